@@ -0,0 +1,518 @@
+/*
+ * acmdecoder.c
+ * Decodes Interplay ACM audio entries
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "acmdecoder.h"
+#include "byteorder.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define ACM_ID 0x032897
+#define ACM_VERSION 1
+
+// Largest block accepted, in samples, to bound memory for corrupt headers
+#define ACM_MAX_BLOCK_LENGTH (1 << 22)
+
+// Samples converted per write when exporting
+#define ACM_OUTPUT_SAMPLES 8192
+
+//
+// Refill the input buffer from the entry stream
+// Returns 0 on success, or -1 at the end of the data
+//
+static int refill(acmdecoder *decoder)
+{
+    decoder->input_start = 0;
+    decoder->input_end = dat2stream_read(decoder->stream, decoder->input, sizeof(decoder->input));
+    return decoder->input_end ? 0 : -1;
+}
+
+//
+// Read count bits (at most 24), least significant bit first.
+// Running out of data marks the decoder as failed and returns 0
+//
+static uint32_t get_bits(acmdecoder *decoder, uint32_t count)
+{
+    while (decoder->bit_count < count)
+    {
+        if (decoder->input_start == decoder->input_end && refill(decoder))
+        {
+            decoder->failed = true;
+            return 0;
+        }
+        decoder->bits |= (uint32_t)decoder->input[decoder->input_start++] << decoder->bit_count;
+        decoder->bit_count += 8;
+    }
+
+    uint32_t value = decoder->bits & ((1U << count) - 1);
+    decoder->bits >>= count;
+    decoder->bit_count -= count;
+    return value;
+}
+
+static inline void set_value(acmdecoder *decoder, uint32_t row, uint32_t column, int32_t index)
+{
+    decoder->block[(row << decoder->level) + column] = decoder->middle[index];
+}
+
+static const int8_t map_1bit[] = { -1, 1 };
+static const int8_t map_2bit_near[] = { -2, -1, 1, 2 };
+static const int8_t map_2bit_far[] = { -3, -2, 2, 3 };
+static const int8_t map_3bit[] = { -4, -3, -2, -1, 1, 2, 3, 4 };
+
+//
+// Column fillers. Each column of a block is coded with one of these,
+// chosen by a 5 bit index. The k fillers are prefix codes over small
+// values, where the "k?5" and "k?3" variants also code runs of two
+// zeros. The t fillers pack several values into one code word
+//
+typedef int (*filler)(acmdecoder *decoder, uint32_t index, uint32_t column);
+
+static int fill_bad(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return -1;
+}
+
+static int fill_zero(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    for (uint32_t i = 0; i < decoder->rows; i++)
+        set_value(decoder, i, column, 0);
+    return 0;
+}
+
+static int fill_linear(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    int32_t middle = 1 << (index - 1);
+    for (uint32_t i = 0; i < decoder->rows; i++)
+        set_value(decoder, i, column, (int32_t)get_bits(decoder, index) - middle);
+    return 0;
+}
+
+//
+// Shared implementation of the k fillers. With zero_pairs a leading 0
+// codes two zeros and 10 a single zero, otherwise 0 codes one zero.
+// With small_escape a following 0 bit codes +/-1 in one more bit.
+// Anything else is an index of large_bits into the large table
+//
+static int fill_k(acmdecoder *decoder, uint32_t column, bool zero_pairs, bool small_escape,
+    const int8_t *large, uint32_t large_bits)
+{
+    for (uint32_t i = 0; i < decoder->rows; i++)
+    {
+        if (!get_bits(decoder, 1))
+        {
+            set_value(decoder, i, column, 0);
+            if (zero_pairs && ++i < decoder->rows)
+                set_value(decoder, i, column, 0);
+            continue;
+        }
+
+        if (zero_pairs && !get_bits(decoder, 1))
+        {
+            set_value(decoder, i, column, 0);
+            continue;
+        }
+
+        if (small_escape && !get_bits(decoder, 1))
+        {
+            set_value(decoder, i, column, map_1bit[get_bits(decoder, 1)]);
+            continue;
+        }
+
+        set_value(decoder, i, column, large[get_bits(decoder, large_bits)]);
+    }
+    return 0;
+}
+
+static int fill_k13(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return fill_k(decoder, column, true, false, map_1bit, 1);
+}
+
+static int fill_k12(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return fill_k(decoder, column, false, false, map_1bit, 1);
+}
+
+static int fill_k24(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return fill_k(decoder, column, true, false, map_2bit_near, 2);
+}
+
+static int fill_k23(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return fill_k(decoder, column, false, false, map_2bit_near, 2);
+}
+
+static int fill_k35(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return fill_k(decoder, column, true, true, map_2bit_far, 2);
+}
+
+static int fill_k34(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return fill_k(decoder, column, false, true, map_2bit_far, 2);
+}
+
+static int fill_k45(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return fill_k(decoder, column, true, false, map_3bit, 3);
+}
+
+static int fill_k44(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return fill_k(decoder, column, false, false, map_3bit, 3);
+}
+
+//
+// Shared implementation of the t fillers: each code word of width bits
+// holds count values in base radix, least significant first, biased
+// so that they are centred on zero
+//
+static int fill_t(acmdecoder *decoder, uint32_t column, uint32_t bits, uint32_t count, uint32_t radix)
+{
+    int32_t bias = radix/2;
+    for (uint32_t i = 0; i < decoder->rows; )
+    {
+        uint32_t word = get_bits(decoder, bits);
+        for (uint32_t n = 0; n < count && i < decoder->rows; n++, i++)
+        {
+            // The final digit takes whatever remains of an out of range word
+            uint32_t digit = n + 1 < count ? word % radix : word;
+            set_value(decoder, i, column, (int32_t)digit - bias);
+            word /= radix;
+        }
+    }
+    return 0;
+}
+
+static int fill_t15(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return fill_t(decoder, column, 5, 3, 3);
+}
+
+static int fill_t27(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return fill_t(decoder, column, 7, 3, 5);
+}
+
+static int fill_t37(acmdecoder *decoder, uint32_t index, uint32_t column)
+{
+    return fill_t(decoder, column, 7, 2, 11);
+}
+
+static const filler fillers[32] = {
+    fill_zero, fill_bad, fill_bad, fill_linear,
+    fill_linear, fill_linear, fill_linear, fill_linear,
+    fill_linear, fill_linear, fill_linear, fill_linear,
+    fill_linear, fill_linear, fill_linear, fill_linear,
+    fill_linear, fill_k13, fill_k12, fill_t15,
+    fill_k24, fill_k23, fill_t27, fill_k35,
+    fill_k34, fill_bad, fill_k45, fill_k44,
+    fill_bad, fill_t37, fill_bad, fill_bad,
+};
+
+//
+// One inverse filter pass over sub_count rows of sub_len values. The
+// reference formulation walks each column down the rows; this walks
+// the rows instead, so that adjacent columns can be filtered together.
+// wrap holds the last two rows of the previous block, as separate
+// arrays so that they can be loaded alongside the block rows
+//
+static void juggle(int32_t *wrap, int32_t *block, uint32_t sub_len, uint32_t sub_count)
+{
+    int32_t *previous0 = wrap;
+    int32_t *previous1 = wrap + sub_len;
+    for (uint32_t j = 0; j < sub_count/2; j++)
+    {
+        int32_t *row0 = &block[2*j*sub_len];
+        int32_t *row1 = row0 + sub_len;
+        uint32_t i = 0;
+#ifdef __SSE2__
+        for (; i + 4 <= sub_len; i += 4)
+        {
+            __m128i r0 = _mm_loadu_si128((const __m128i *)&previous0[i]);
+            __m128i r1 = _mm_loadu_si128((const __m128i *)&previous1[i]);
+            __m128i r2 = _mm_loadu_si128((const __m128i *)&row0[i]);
+            __m128i r3 = _mm_loadu_si128((const __m128i *)&row1[i]);
+            _mm_storeu_si128((__m128i *)&row0[i], _mm_add_epi32(_mm_slli_epi32(r1, 1), _mm_add_epi32(r0, r2)));
+            _mm_storeu_si128((__m128i *)&row1[i], _mm_sub_epi32(_mm_slli_epi32(r2, 1), _mm_add_epi32(r1, r3)));
+            _mm_storeu_si128((__m128i *)&previous0[i], r2);
+            _mm_storeu_si128((__m128i *)&previous1[i], r3);
+        }
+#endif
+        for (; i < sub_len; i++)
+        {
+            // Unsigned arithmetic wraps like the vector path
+            uint32_t r0 = previous0[i], r1 = previous1[i], r2 = row0[i], r3 = row1[i];
+            row0[i] = 2*r1 + r0 + r2;
+            row1[i] = 2*r2 - (r1 + r3);
+            previous0[i] = r2;
+            previous1[i] = r3;
+        }
+    }
+}
+
+//
+// Undo the subband split, halving the row length and doubling the
+// row count each pass until every value is a sample. Rows are processed
+// in groups sized to keep the working set near 2048 values
+//
+static void juggle_block(acmdecoder *decoder)
+{
+    if (decoder->level == 0)
+        return;
+
+    uint32_t step = decoder->level > 9 ? 1 : (2048 >> decoder->level) - 2;
+    uint32_t remaining = decoder->rows;
+    int32_t *block = decoder->block;
+    for (;;)
+    {
+        int32_t *wrap = decoder->wrap;
+        uint32_t sub_count = 2*(step < remaining ? step : remaining);
+        uint32_t sub_len = decoder->columns/2;
+
+        juggle(wrap, block, sub_len, sub_count);
+        wrap += 2*sub_len;
+
+        for (uint32_t i = 0; i < sub_count; i++)
+            block[i*sub_len]++;
+
+        while (sub_len > 1)
+        {
+            sub_len /= 2;
+            sub_count *= 2;
+            juggle(wrap, block, sub_len, sub_count);
+            wrap += 2*sub_len;
+        }
+
+        if (remaining <= step)
+            break;
+        remaining -= step;
+        block += step << decoder->level;
+    }
+}
+
+//
+// Decode the next block: its amplitude table, then every column
+// Returns 0 on success, or -1 if the data is corrupt or truncated
+//
+static int decode_block(acmdecoder *decoder)
+{
+    uint32_t power = get_bits(decoder, 4);
+    uint32_t scale = get_bits(decoder, 16);
+
+    // Unsigned arithmetic wraps like the reference decoder on large tables
+    uint32_t count = 1U << power;
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < count; i++, value += scale)
+        decoder->middle[i] = value;
+
+    value = -scale;
+    for (uint32_t i = 1; i <= count; i++, value -= scale)
+        decoder->middle[-(int32_t)i] = value;
+
+    for (uint32_t column = 0; column < decoder->columns && !decoder->failed; column++)
+    {
+        uint32_t index = get_bits(decoder, 5);
+        if (fillers[index](decoder, index, column))
+            decoder->failed = true;
+    }
+
+    if (decoder->failed)
+        return -1;
+
+    juggle_block(decoder);
+    decoder->block_position = 0;
+    return 0;
+}
+
+//
+// Open an ACM entry for streaming decode
+// Returns NULL if the entry is not a valid ACM stream
+//
+acmdecoder *acmdecoder_open(dat2entry *entry)
+{
+    acmdecoder *decoder = calloc(1, sizeof(acmdecoder));
+    if (!decoder)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    decoder->stream = dat2stream_open(entry);
+    if (!decoder->stream)
+        goto stream_error;
+
+    uint32_t id = get_bits(decoder, 24);
+    uint32_t version = get_bits(decoder, 8);
+    decoder->sample_count = get_bits(decoder, 16);
+    decoder->sample_count |= get_bits(decoder, 16) << 16;
+    decoder->channels = get_bits(decoder, 16);
+    decoder->rate = get_bits(decoder, 16);
+    decoder->level = get_bits(decoder, 4);
+    decoder->rows = get_bits(decoder, 12);
+    decoder->columns = 1U << decoder->level;
+    decoder->block_length = decoder->rows*decoder->columns;
+
+    if (decoder->failed || id != ACM_ID || version != ACM_VERSION || decoder->channels == 0 ||
+        decoder->rows == 0 || decoder->block_length > ACM_MAX_BLOCK_LENGTH)
+    {
+        fprintf(stderr, "%s: not a valid acm stream\n", entry->filename);
+        goto header_error;
+    }
+
+    decoder->block = malloc(decoder->block_length*sizeof(int32_t));
+    decoder->wrap = calloc(2*decoder->columns, sizeof(int32_t));
+    decoder->amplitudes = calloc(0x10000, sizeof(int32_t));
+    if (!decoder->block || !decoder->wrap || !decoder->amplitudes)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto header_error;
+    }
+
+    decoder->middle = decoder->amplitudes + 0x8000;
+    decoder->block_position = decoder->block_length;
+    return decoder;
+
+header_error:
+    acmdecoder_close(decoder);
+    return NULL;
+stream_error:
+    free(decoder);
+    return NULL;
+}
+
+void acmdecoder_close(acmdecoder *decoder)
+{
+    dat2stream_close(decoder->stream);
+    free(decoder->block);
+    free(decoder->wrap);
+    free(decoder->amplitudes);
+    free(decoder);
+}
+
+//
+// Decode up to count interleaved 16 bit samples
+// Returns the number of samples decoded. A short count means the end
+// of the stream, or an error if decoder->failed is set
+//
+size_t acmdecoder_read(acmdecoder *decoder, int16_t *samples, size_t count)
+{
+    size_t total = 0;
+    while (total < count && decoder->position < decoder->sample_count)
+    {
+        if (decoder->block_position == decoder->block_length && decode_block(decoder))
+            break;
+
+        size_t length = decoder->block_length - decoder->block_position;
+        if (length > count - total)
+            length = count - total;
+        if (length > decoder->sample_count - decoder->position)
+            length = decoder->sample_count - decoder->position;
+
+        const int32_t *block = &decoder->block[decoder->block_position];
+        for (size_t i = 0; i < length; i++)
+            samples[total + i] = (int16_t)(block[i] >> decoder->level);
+
+        total += length;
+        decoder->block_position += length;
+        decoder->position += length;
+    }
+    return total;
+}
+
+static void write_wav_header(FILE *file, const acmdecoder *decoder)
+{
+    uint32_t data_length = 2*decoder->sample_count;
+    uint8_t header[44];
+    memcpy(header, "RIFF", 4);
+    put_le32(header + 4, 36 + data_length);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le32(header + 16, 16);
+    put_le16(header + 20, 1); // PCM
+    put_le16(header + 22, decoder->channels);
+    put_le32(header + 24, decoder->rate);
+    put_le32(header + 28, 2*(uint32_t)decoder->rate*decoder->channels);
+    put_le16(header + 32, 2*decoder->channels);
+    put_le16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    put_le32(header + 40, data_length);
+    fwrite(header, sizeof(header), 1, file);
+}
+
+//
+// Decode an ACM entry to a WAV file, or to headerless 16 bit little
+// endian PCM, a fixed size block at a time
+// Returns 0 on success, or -1 on error
+//
+int acmdecoder_write_file(dat2entry *entry, acmdecoder_format format, const char *path)
+{
+    acmdecoder *decoder = acmdecoder_open(entry);
+    if (!decoder)
+        return -1;
+
+    int status = -1;
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        goto open_error;
+    }
+
+    if (format == ACMDECODER_WAV)
+        write_wav_header(file, decoder);
+
+    int16_t samples[ACM_OUTPUT_SAMPLES];
+    uint8_t output[2*ACM_OUTPUT_SAMPLES];
+    size_t count;
+    while ((count = acmdecoder_read(decoder, samples, ACM_OUTPUT_SAMPLES)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+            put_le16(&output[2*i], samples[i]);
+        fwrite(output, 2, count, file);
+    }
+
+    if (decoder->failed)
+        fprintf(stderr, "%s: corrupt or truncated acm data\n", entry->filename);
+    else if (ferror(file))
+        fprintf(stderr, "Write error: %s\n", strerror(errno));
+    else
+        status = 0;
+
+    if (fclose(file))
+        status = -1;
+open_error:
+    acmdecoder_close(decoder);
+    return status;
+}
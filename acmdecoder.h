@@ -0,0 +1,81 @@
+/*
+ * acmdecoder.h
+ * Decodes Interplay ACM audio entries
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _acmdecoder_h
+#define _acmdecoder_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "dat2reader.h"
+#include "dat2stream.h"
+
+#define ACMDECODER_INPUT_SIZE 4096
+
+typedef enum
+{
+    ACMDECODER_WAV,
+    ACMDECODER_RAW,
+} acmdecoder_format;
+
+typedef struct
+{
+    dat2stream *stream;
+    uint8_t input[ACMDECODER_INPUT_SIZE];
+    size_t input_start;
+    size_t input_end;
+    uint32_t bits;
+    uint32_t bit_count;
+    bool failed;
+
+    uint32_t sample_count;
+    uint16_t channels;
+    uint16_t rate;
+    uint8_t level;
+    uint16_t rows;
+    uint32_t columns;
+
+    // Decoded block and the filter state carried between blocks
+    int32_t *block;
+    uint32_t block_length;
+    uint32_t block_position;
+    int32_t *wrap;
+
+    // Amplitude table, indexed from -32768 to 32767 through middle
+    int32_t *amplitudes;
+    int32_t *middle;
+
+    uint32_t position;
+} acmdecoder;
+
+acmdecoder *acmdecoder_open(dat2entry *entry);
+void acmdecoder_close(acmdecoder *decoder);
+size_t acmdecoder_read(acmdecoder *decoder, int16_t *samples, size_t count);
+int acmdecoder_write_file(dat2entry *entry, acmdecoder_format format, const char *path);
+
+#endif
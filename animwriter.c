@@ -0,0 +1,400 @@
+/*
+ * animwriter.c
+ * Encodes frm animations as APNG or GIF
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "animwriter.h"
+#include "byteorder.h"
+
+// Index 0 is the transparent entry in the Fallout palettes
+#define TRANSPARENT_INDEX 0
+#define DEFAULT_FPS 10
+
+#define LZW_MAX_CODE 4096
+#define LZW_HASH_SIZE 8192
+#define LZW_EMPTY 0xFFFFFFFF
+
+typedef struct
+{
+    int32_t left;
+    int32_t top;
+    uint32_t width;
+    uint32_t height;
+} anim_canvas;
+
+// A frame's placement on the canvas. Empty frames are drawn as a single
+// transparent pixel, as neither format allows zero sized frames
+typedef struct
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    const uint8_t *pixels;
+} anim_frame;
+
+static const uint8_t empty_pixel = TRANSPARENT_INDEX;
+
+//
+// Find the bounding box of every frame in a direction, after applying
+// the accumulated frame shifts
+//
+static anim_canvas find_canvas(frmreader *frm, uint8_t facing)
+{
+    int32_t min_x = INT32_MAX, min_y = INT32_MAX;
+    int32_t max_x = INT32_MIN, max_y = INT32_MIN;
+    for (uint16_t i = 0; i < frm->animation_length; i++)
+    {
+        frmframe *frame = frm_get_frame(frm, facing, i);
+        int32_t left, top;
+        frm_get_frame_position(frm, facing, i, &left, &top);
+
+        if (left < min_x)
+            min_x = left;
+        if (top < min_y)
+            min_y = top;
+        if (left + frame->width > max_x)
+            max_x = left + frame->width;
+        if (top + frame->height > max_y)
+            max_y = top + frame->height;
+    }
+
+    anim_canvas canvas = { min_x, min_y, max_x - min_x, max_y - min_y };
+    if (canvas.width == 0)
+        canvas.width = 1;
+    if (canvas.height == 0)
+        canvas.height = 1;
+    return canvas;
+}
+
+static anim_frame place_frame(frmreader *frm, uint8_t facing, uint16_t index, const anim_canvas *canvas)
+{
+    frmframe *frame = frm_get_frame(frm, facing, index);
+    int32_t left, top;
+    frm_get_frame_position(frm, facing, index, &left, &top);
+
+    anim_frame placed = { left - canvas->left, top - canvas->top, frame->width, frame->height, frame->data };
+    if (frame->width == 0 || frame->height == 0)
+    {
+        placed.width = placed.height = 1;
+        placed.pixels = &empty_pixel;
+        if (placed.x >= canvas->width)
+            placed.x = canvas->width - 1;
+        if (placed.y >= canvas->height)
+            placed.y = canvas->height - 1;
+    }
+    return placed;
+}
+
+//
+// Encode as APNG. The palette is written once, and every frame after the
+// first only stores its own rectangle, cleared to transparent before the
+// next frame is drawn
+//
+static int encode_apng(frmreader *frm, uint8_t facing, const uint8_t *rgb,
+    const pngwriter_options *options, pngbuffer *out)
+{
+    anim_canvas canvas = find_canvas(frm, facing);
+
+    pngwriter_image image;
+    image.width = canvas.width;
+    image.height = canvas.height;
+    image.color = PNGWRITER_COLOR_INDEXED;
+    image.pixels = NULL;
+    image.stride = canvas.width;
+    image.palette = rgb;
+    image.palette_size = 256;
+    image.transparent_index = TRANSPARENT_INDEX;
+
+    if (pngwriter_begin(out, &image) || pngwriter_write_animation(out, frm->animation_length, 0))
+        return -1;
+
+    // The first frame doubles as the still image, so must cover the canvas
+    uint8_t *first = calloc(canvas.width*canvas.height, sizeof(uint8_t));
+    if (!first)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    anim_frame placed = place_frame(frm, facing, 0, &canvas);
+    for (uint32_t y = 0; y < placed.height; y++)
+        memcpy(&first[(placed.y + y)*canvas.width + placed.x], &placed.pixels[y*placed.width], placed.width);
+
+    pngwriter_frame frame;
+    frame.delay_numerator = 1;
+    frame.delay_denominator = frm->fps ? frm->fps : DEFAULT_FPS;
+    frame.dispose = PNGWRITER_DISPOSE_BACKGROUND;
+    frame.blend = PNGWRITER_BLEND_SOURCE;
+
+    uint32_t sequence = 0;
+    frame.x = frame.y = 0;
+    image.pixels = first;
+    int status = pngwriter_write_frame(out, &image, &frame, options, &sequence);
+    free(first);
+
+    for (uint16_t i = 1; i < frm->animation_length && status == 0; i++)
+    {
+        placed = place_frame(frm, facing, i, &canvas);
+        image.width = placed.width;
+        image.height = placed.height;
+        image.pixels = placed.pixels;
+        image.stride = placed.width;
+        frame.x = placed.x;
+        frame.y = placed.y;
+        status = pngwriter_write_frame(out, &image, &frame, options, &sequence);
+    }
+
+    if (status == 0)
+        status = pngwriter_end(out);
+    return status;
+}
+
+// LZW encoder state, kept across frames so the string table
+// is only allocated once per animation
+typedef struct
+{
+    pngbuffer *out;
+    uint32_t keys[LZW_HASH_SIZE];
+    uint16_t codes[LZW_HASH_SIZE];
+    uint32_t bits;
+    uint32_t bit_count;
+    uint8_t block[256];
+    uint32_t block_length;
+    int failed;
+} lzw_encoder;
+
+static void lzw_flush_block(lzw_encoder *lzw)
+{
+    if (!lzw->block_length)
+        return;
+
+    lzw->block[0] = lzw->block_length;
+    if (pngbuffer_append(lzw->out, lzw->block, lzw->block_length + 1))
+        lzw->failed = 1;
+    lzw->block_length = 0;
+}
+
+//
+// Append a code to the output, packed least significant bit first
+// into data sub-blocks of up to 255 bytes
+//
+static void lzw_put(lzw_encoder *lzw, uint32_t code, uint32_t width)
+{
+    lzw->bits |= code << lzw->bit_count;
+    lzw->bit_count += width;
+    while (lzw->bit_count >= 8)
+    {
+        lzw->block[++lzw->block_length] = lzw->bits;
+        lzw->bits >>= 8;
+        lzw->bit_count -= 8;
+        if (lzw->block_length == 255)
+            lzw_flush_block(lzw);
+    }
+}
+
+static void lzw_reset(lzw_encoder *lzw)
+{
+    memset(lzw->keys, 0xFF, sizeof(lzw->keys));
+}
+
+//
+// Compress a rectangle of 8 bit indices as GIF image data
+// Returns 0 on success, or -1 on error
+//
+static int lzw_encode(lzw_encoder *lzw, const uint8_t *pixels, uint32_t width, uint32_t height)
+{
+    const uint32_t clear = 256, end = 257;
+    uint32_t next = end + 1, width_bits = 9;
+
+    uint8_t min_code_size = 8;
+    if (pngbuffer_append(lzw->out, &min_code_size, 1))
+        return -1;
+
+    lzw->bits = lzw->bit_count = lzw->block_length = 0;
+    lzw->failed = 0;
+    lzw_reset(lzw);
+    lzw_put(lzw, clear, width_bits);
+
+    uint32_t prefix = pixels[0];
+    for (size_t i = 1; i < (size_t)width*height; i++)
+    {
+        uint8_t c = pixels[i];
+        uint32_t key = prefix << 8 | c;
+        uint32_t slot = (key*2654435761u) >> 19;
+        while (lzw->keys[slot] != LZW_EMPTY && lzw->keys[slot] != key)
+            slot = (slot + 1) & (LZW_HASH_SIZE - 1);
+
+        if (lzw->keys[slot] == key)
+        {
+            prefix = lzw->codes[slot];
+            continue;
+        }
+
+        lzw_put(lzw, prefix, width_bits);
+        if (next < LZW_MAX_CODE)
+        {
+            lzw->keys[slot] = key;
+            lzw->codes[slot] = next++;
+
+            // The decoder adds each code one step behind us, so widen
+            // once the code just added no longer fits
+            if (next - 1 == 1u << width_bits && width_bits < 12)
+                width_bits++;
+        }
+        else
+        {
+            lzw_put(lzw, clear, width_bits);
+            lzw_reset(lzw);
+            next = end + 1;
+            width_bits = 9;
+        }
+        prefix = c;
+    }
+
+    lzw_put(lzw, prefix, width_bits);
+
+    // The decoder adds a final code after reading the last prefix
+    if (next < LZW_MAX_CODE && next == 1u << width_bits && width_bits < 12)
+        width_bits++;
+    lzw_put(lzw, end, width_bits);
+
+    if (lzw->bit_count)
+        lzw_put(lzw, 0, 8 - lzw->bit_count);
+    lzw_flush_block(lzw);
+
+    uint8_t terminator = 0;
+    if (lzw->failed || pngbuffer_append(lzw->out, &terminator, 1))
+        return -1;
+    return 0;
+}
+
+//
+// Encode as a looping GIF89a with a global color table. Each frame
+// stores only its own rectangle and is cleared to the transparent
+// background before the next is drawn
+//
+static int encode_gif(frmreader *frm, uint8_t facing, const uint8_t *rgb, pngbuffer *out)
+{
+    anim_canvas canvas = find_canvas(frm, facing);
+    if (canvas.width > UINT16_MAX || canvas.height > UINT16_MAX)
+        return -1;
+
+    uint8_t header[13] = { 'G', 'I', 'F', '8', '9', 'a' };
+    put_le16(&header[6], canvas.width);
+    put_le16(&header[8], canvas.height);
+    header[10] = 0xF7; // Global color table of 256 entries
+    header[11] = TRANSPARENT_INDEX;
+    header[12] = 0;
+
+    static const uint8_t loop[19] = {
+        0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00
+    };
+
+    if (pngbuffer_append(out, header, sizeof(header)) || pngbuffer_append(out, rgb, 768) ||
+        pngbuffer_append(out, loop, sizeof(loop)))
+        return -1;
+
+    lzw_encoder *lzw = malloc(sizeof(lzw_encoder));
+    if (!lzw)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+    lzw->out = out;
+
+    // GIF delays are in hundredths of a second
+    uint16_t fps = frm->fps ? frm->fps : DEFAULT_FPS;
+    uint16_t delay = (100 + fps/2)/fps;
+    if (delay == 0)
+        delay = 1;
+
+    int status = 0;
+    for (uint16_t i = 0; i < frm->animation_length && status == 0; i++)
+    {
+        anim_frame placed = place_frame(frm, facing, i, &canvas);
+
+        // Graphic control extension: restore to background, transparent index
+        uint8_t control[18] = { 0x21, 0xF9, 0x04, 0x09 };
+        put_le16(&control[4], delay);
+        control[6] = TRANSPARENT_INDEX;
+        control[7] = 0;
+
+        // Image descriptor, using the global color table
+        control[8] = 0x2C;
+        put_le16(&control[9], placed.x);
+        put_le16(&control[11], placed.y);
+        put_le16(&control[13], placed.width);
+        put_le16(&control[15], placed.height);
+        control[17] = 0;
+
+        status = pngbuffer_append(out, control, sizeof(control));
+        if (status == 0)
+            status = lzw_encode(lzw, placed.pixels, placed.width, placed.height);
+    }
+    free(lzw);
+
+    uint8_t trailer = 0x3B;
+    if (status == 0)
+        status = pngbuffer_append(out, &trailer, 1);
+    return status;
+}
+
+//
+// Encode one direction of an frm as an animation, appending it to out.
+// rgb is the 768 byte palette shared by every frame
+// Returns 0 on success, or -1 on error
+//
+int animwriter_encode_direction(frmreader *frm, uint8_t facing, const uint8_t *rgb, animwriter_format format,
+    const pngwriter_options *options, pngbuffer *out)
+{
+    if (facing >= FRM_DIRECTIONS)
+        return -1;
+
+    if (format == ANIMWRITER_GIF)
+        return encode_gif(frm, facing, rgb, out);
+    return encode_apng(frm, facing, rgb, options, out);
+}
+
+//
+// Encode one direction of an frm as an animation and write it to a file
+// Returns 0 on success, or -1 on error
+//
+int animwriter_write_direction(frmreader *frm, uint8_t facing, const uint8_t *rgb, animwriter_format format,
+    const pngwriter_options *options, const char *path)
+{
+    pngbuffer buffer = { NULL, 0, 0 };
+    int status = animwriter_encode_direction(frm, facing, rgb, format, options, &buffer);
+    if (status == 0)
+        status = pngbuffer_write_file(&buffer, path);
+
+    pngbuffer_free(&buffer);
+    return status;
+}
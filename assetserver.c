@@ -0,0 +1,985 @@
+/*
+ * assetserver.c
+ * Serves archive entries and rendered artwork over loopback HTTP
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "assetserver.h"
+#include "dat2pool.h"
+#include "dat2scheduler.h"
+#include "frmreader.h"
+#include "palreader.h"
+
+#define REQUEST_MAX 8192
+#define PATH_MAX_LENGTH 1024
+#define IDLE_TIMEOUT_SECONDS 10
+#define CONNECTION_MAX 1024
+#define EVENT_MAX 64
+
+typedef struct connection
+{
+    int fd;
+    bool busy;
+    size_t slot;
+    time_t deadline;
+    struct connection *next;
+    char buffer[REQUEST_MAX];
+    size_t length;
+} connection;
+
+typedef struct
+{
+    dat2reader **readers;
+    size_t reader_count;
+    uint8_t rgb[768];
+    bool have_palette;
+    const pngwriter_options *options;
+    rendercache *cache;
+    uint64_t *archive_ids;
+    int listen_fd;
+    int epoll_fd;
+
+    // Connections waiting for a request are watched by the dispatcher,
+    // and handed to the workers through the queue once one arrives.
+    // Everything below is guarded by the lock
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    connection *queue_head;
+    connection *queue_tail;
+    connection *connections[CONNECTION_MAX];
+    size_t connection_count;
+    bool stopping;
+} assetserver;
+
+typedef struct
+{
+    bool head;
+    bool keep_alive;
+    char path[PATH_MAX_LENGTH];
+    char *query;
+
+    // The If-None-Match value, which points into the request text
+    const char *if_none_match;
+} request;
+
+//
+// Find an entry in the first archive that contains it, so archives
+// listed earlier take precedence
+//
+static dat2entry *find_entry(assetserver *server, char *name, size_t *archive)
+{
+    for (size_t i = 0; i < server->reader_count; i++)
+    {
+        dat2entry *entry = dat2reader_find_entry(server->readers[i], name);
+        if (entry)
+        {
+            *archive = i;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static int send_all(int fd, const void *data, size_t length, int flags)
+{
+    const uint8_t *p = data;
+    while (length)
+    {
+        ssize_t sent = send(fd, p, length, flags | MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return -1;
+
+        p += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+//
+// Send the status line and headers. Bodies sent separately are hinted
+// with MSG_MORE so the headers share a segment with the first data
+//
+static int send_headers(int fd, const request *req, const char *status, const char *type, const char *etag,
+    size_t length, bool more)
+{
+    char headers[512];
+    int size = snprintf(headers, sizeof(headers),
+        "HTTP/1.1 %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Content-Type: %s\r\n"
+        "%s%s%s"
+        "Connection: %s\r\n\r\n",
+        status, length, type,
+        etag ? "ETag: " : "", etag ? etag : "", etag ? "\r\n" : "",
+        req->keep_alive ? "keep-alive" : "close");
+
+    return send_all(fd, headers, size, more && !req->head ? MSG_MORE : 0);
+}
+
+static int send_response(int fd, const request *req, const char *status, const char *type, const char *etag,
+    const void *body, size_t length)
+{
+    if (send_headers(fd, req, status, type, etag, length, length > 0))
+        return -1;
+    if (req->head || !length)
+        return 0;
+    return send_all(fd, body, length, 0);
+}
+
+static int send_error(int fd, const request *req, const char *status)
+{
+    char body[128];
+    int length = snprintf(body, sizeof(body), "%s\n", status);
+    return send_response(fd, req, status, "text/plain", NULL, body, length);
+}
+
+//
+// Check whether an If-None-Match list names the current version. Tags
+// are compared weakly, ignoring any W/ prefix, and * matches anything
+//
+static bool etag_matches(const char *list, const char *etag)
+{
+    size_t length = strlen(etag);
+    for (const char *p = list; *p; )
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '*')
+            return true;
+        if (strncmp(p, "W/", 2) == 0)
+            p += 2;
+
+        const char *end = *p == '"' ? strchr(p + 1, '"') : NULL;
+        if (!end)
+            return false;
+        end++;
+
+        if ((size_t)(end - p) == length && memcmp(p, etag, length) == 0)
+            return true;
+        p = end;
+    }
+    return false;
+}
+
+//
+// Answer a conditional request that already has the current version
+// Returns true if a 304 response was sent (or failed to send)
+//
+static bool not_modified(int fd, const request *req, const char *etag, int *status)
+{
+    if (!req->if_none_match || !etag_matches(req->if_none_match, etag))
+        return false;
+
+    *status = send_headers(fd, req, "304 Not Modified", "application/octet-stream", etag, 0, false);
+    return true;
+}
+
+//
+// Read a whole entry into a pooled buffer
+// Returns NULL on error
+//
+static uint8_t *load_entry(dat2pool *pool, dat2entry *entry)
+{
+    uint8_t *data = dat2pool_acquire(pool, entry->uncompressed_size);
+    if (data && dat2entry_extract_into(entry, data, entry->uncompressed_size))
+    {
+        dat2pool_release(pool, data);
+        return NULL;
+    }
+    return data;
+}
+
+//
+// Send raw entry bytes. Stored entries go straight from the archive to
+// the socket with sendfile, compressed entries are inflated into a
+// pooled buffer first
+//
+static int serve_file(assetserver *server, int fd, const request *req, char *name)
+{
+    size_t archive;
+    dat2entry *entry = find_entry(server, name, &archive);
+    if (!entry)
+        return send_error(fd, req, "404 Not Found");
+
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%zx-%llx-%x\"", archive, (unsigned long long)entry->offset, entry->uncompressed_size);
+
+    int status;
+    if (not_modified(fd, req, etag, &status))
+        return status;
+
+    if (!entry->compressed)
+    {
+        if (send_headers(fd, req, "200 OK", "application/octet-stream", etag, entry->uncompressed_size, true))
+            return -1;
+        if (req->head)
+            return 0;
+
+        off_t offset = entry->offset;
+        size_t remaining = entry->uncompressed_size;
+        int file = fileno(entry->reader->file);
+        while (remaining)
+        {
+            ssize_t sent = sendfile(fd, file, &offset, remaining);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+                return -1;
+            remaining -= sent;
+        }
+        return 0;
+    }
+
+    dat2pool *pool = dat2pool_thread();
+    uint8_t *data = pool ? load_entry(pool, entry) : NULL;
+    if (!data)
+        return send_error(fd, req, "500 Internal Server Error");
+
+    status = send_response(fd, req, "200 OK", "application/octet-stream", etag, data, entry->uncompressed_size);
+    dat2pool_release(pool, data);
+    return status;
+}
+
+static frmreader *load_frm(dat2entry *entry)
+{
+    dat2pool *pool = dat2pool_thread();
+    uint8_t *data = pool ? load_entry(pool, entry) : NULL;
+    if (!data)
+        return NULL;
+
+    frmreader *frm = frmreader_from_data(data, entry->uncompressed_size);
+    dat2pool_release(pool, data);
+    return frm;
+}
+
+//
+// Describe an frm's animation and frame geometry as JSON
+//
+static int serve_frm(assetserver *server, int fd, const request *req, char *name)
+{
+    size_t archive;
+    dat2entry *entry = find_entry(server, name, &archive);
+    if (!entry)
+        return send_error(fd, req, "404 Not Found");
+
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%zx-%llx-%x-frm\"", archive, (unsigned long long)entry->offset, entry->uncompressed_size);
+
+    int status;
+    if (not_modified(fd, req, etag, &status))
+        return status;
+
+    frmreader *frm = load_frm(entry);
+    if (!frm)
+        return send_error(fd, req, "422 Unprocessable Entity");
+
+    pngbuffer body = { NULL, 0, 0 };
+    char text[128];
+    int length = snprintf(text, sizeof(text), "{\"fps\":%u,\"action_frame\":%u,\"frames\":%u,\"directions\":[",
+        frm->fps, frm->action_frame, frm->animation_length);
+    status = pngbuffer_append(&body, (uint8_t *)text, length);
+
+    for (uint8_t d = 0; d < frm->direction_count && status == 0; d++)
+    {
+        status = pngbuffer_append(&body, (uint8_t *)(d ? ",[" : "["), d ? 2 : 1);
+        for (uint16_t i = 0; i < frm->animation_length && status == 0; i++)
+        {
+            frmframe *frame = frm_get_frame(frm, d, i);
+            int32_t left, top;
+            frm_get_frame_position(frm, d, i, &left, &top);
+            length = snprintf(text, sizeof(text), "%s{\"width\":%u,\"height\":%u,\"left\":%d,\"top\":%d}",
+                i ? "," : "", frame->width, frame->height, left, top);
+            status = pngbuffer_append(&body, (uint8_t *)text, length);
+        }
+        if (status == 0)
+            status = pngbuffer_append(&body, (uint8_t *)"]", 1);
+    }
+
+    if (status == 0)
+        status = pngbuffer_append(&body, (uint8_t *)"]}\n", 3);
+
+    frmreader_free(frm);
+    if (status == 0)
+        status = send_response(fd, req, "200 OK", "application/json", etag, body.data, body.length);
+    else
+        status = send_error(fd, req, "500 Internal Server Error");
+
+    pngbuffer_free(&body);
+    return status;
+}
+
+static unsigned query_value(const char *query, const char *key)
+{
+    size_t key_length = strlen(key);
+    for (const char *p = query; p && *p; p = strchr(p, '&'), p = p ? p + 1 : NULL)
+        if (strncmp(p, key, key_length) == 0 && p[key_length] == '=')
+            return strtoul(p + key_length + 1, NULL, 10);
+    return 0;
+}
+
+//
+// Render a single frame as an indexed PNG. The direction and frame
+// are selected with the direction and frame query parameters
+//
+static int serve_png(assetserver *server, int fd, const request *req, char *name)
+{
+    if (!server->have_palette)
+        return send_error(fd, req, "503 Service Unavailable");
+
+    size_t archive;
+    dat2entry *entry = find_entry(server, name, &archive);
+    if (!entry)
+        return send_error(fd, req, "404 Not Found");
+
+    unsigned direction = query_value(req->query, "direction");
+    unsigned index = query_value(req->query, "frame");
+
+    // Rendered frames are cached under the same fields as the etag, so
+    // a change of palette or png options changes both
+    uint64_t archive_id = server->cache ? server->archive_ids[archive] : 0;
+    rendercache_key key = rendercache_entry_key(entry, archive_id, server->rgb, server->options,
+        RENDERCACHE_FRAME, direction << 16 | (index & UINT16_MAX));
+
+    char etag[128];
+    snprintf(etag, sizeof(etag), "\"%zx-%llx-%x-%u-%u-%llx-%x\"", archive, (unsigned long long)entry->offset,
+        entry->uncompressed_size, direction, index, (unsigned long long)key.palette, key.options);
+
+    int status;
+    if (not_modified(fd, req, etag, &status))
+        return status;
+
+    if (server->cache)
+    {
+        size_t length;
+        uint8_t *cached = index <= UINT16_MAX ? rendercache_lookup(server->cache, &key, &length) : NULL;
+        if (cached)
+        {
+            status = send_response(fd, req, "200 OK", "image/png", etag, cached, length);
+            free(cached);
+            return status;
+        }
+    }
+
+    frmreader *frm = load_frm(entry);
+    if (!frm)
+        return send_error(fd, req, "422 Unprocessable Entity");
+
+    frmframe *frame = direction < frm->direction_count && index <= UINT16_MAX ?
+        frm_get_frame(frm, direction, index) : NULL;
+    if (!frame || !frame->width || !frame->height)
+    {
+        frmreader_free(frm);
+        return send_error(fd, req, "404 Not Found");
+    }
+
+    pngwriter_image image;
+    image.width = frame->width;
+    image.height = frame->height;
+    image.color = PNGWRITER_COLOR_INDEXED;
+    image.pixels = frame->data;
+    image.stride = frame->width;
+    image.palette = server->rgb;
+    image.palette_size = 256;
+    image.transparent_index = 0;
+
+    pngbuffer png = { NULL, 0, 0 };
+    if (pngwriter_encode(&png, &image, server->options) == 0)
+    {
+        if (server->cache)
+            rendercache_store(server->cache, &key, png.data, png.length);
+        status = send_response(fd, req, "200 OK", "image/png", etag, png.data, png.length);
+    }
+    else
+        status = send_error(fd, req, "500 Internal Server Error");
+
+    frmreader_free(frm);
+    pngbuffer_free(&png);
+    return status;
+}
+
+//
+// List every entry as tab separated archive index, size and name
+//
+static int serve_list(assetserver *server, int fd, const request *req)
+{
+    pngbuffer body = { NULL, 0, 0 };
+    int status = 0;
+    for (size_t i = 0; i < server->reader_count && status == 0; i++)
+    {
+        dat2reader *reader = server->readers[i];
+        for (uint32_t j = 0; j < reader->entry_count && status == 0; j++)
+        {
+            char line[PATH_MAX_LENGTH + 32];
+            int length = snprintf(line, sizeof(line), "%zu\t%u\t%s\n", i,
+                reader->entries[j].uncompressed_size, reader->entries[j].filename);
+            status = pngbuffer_append(&body, (uint8_t *)line, length < (int)sizeof(line) ? length : (int)sizeof(line) - 1);
+        }
+    }
+
+    if (status == 0)
+        status = send_response(fd, req, "200 OK", "text/plain", NULL, body.data, body.length);
+    else
+        status = send_error(fd, req, "500 Internal Server Error");
+
+    pngbuffer_free(&body);
+    return status;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+//
+// Decode a request path in place, mapping / to the archive's \ separator
+// Returns 0 on success, or -1 if the encoding is invalid
+//
+static int decode_path(char *path)
+{
+    char *out = path;
+    for (char *in = path; *in; in++)
+    {
+        if (*in == '%')
+        {
+            int hi = hex_value(in[1]);
+            int lo = hi < 0 ? -1 : hex_value(in[2]);
+            if (lo < 0 || (hi == 0 && lo == 0))
+                return -1;
+            *out++ = hi << 4 | lo;
+            in += 2;
+        }
+        else
+            *out++ = *in == '/' ? '\\' : *in;
+    }
+    *out = '\0';
+    return 0;
+}
+
+//
+// Parse the request line and the headers we care about
+// Returns 0 on success, or -1 if the request is malformed
+//
+static int parse_request(char *text, request *req)
+{
+    char *line_end = strstr(text, "\r\n");
+    *line_end = '\0';
+
+    char *method = text;
+    char *target = strchr(method, ' ');
+    if (!target)
+        return -1;
+    *target++ = '\0';
+
+    char *version = strchr(target, ' ');
+    if (!version)
+        return -1;
+    *version++ = '\0';
+
+    if (strcmp(method, "GET") == 0)
+        req->head = false;
+    else if (strcmp(method, "HEAD") == 0)
+        req->head = true;
+    else
+        return -1;
+
+    req->keep_alive = strcmp(version, "HTTP/1.1") == 0;
+    req->if_none_match = NULL;
+
+    for (char *line = line_end + 2; *line; )
+    {
+        char *end = strstr(line, "\r\n");
+        if (!end)
+            break;
+        *end = '\0';
+
+        char *value = strchr(line, ':');
+        if (value)
+        {
+            *value++ = '\0';
+            while (*value == ' ' || *value == '\t')
+                value++;
+
+            if (strcasecmp(line, "Connection") == 0)
+                req->keep_alive = strcasecmp(value, "close") != 0 && (req->keep_alive || strcasecmp(value, "keep-alive") == 0);
+            else if (strcasecmp(line, "If-None-Match") == 0)
+                req->if_none_match = value;
+        }
+        line = end + 2;
+    }
+
+    if (strlen(target) >= sizeof(req->path))
+        return -1;
+    strcpy(req->path, target);
+
+    req->query = strchr(req->path, '?');
+    if (req->query)
+        *req->query++ = '\0';
+
+    return decode_path(req->path);
+}
+
+static int dispatch(assetserver *server, int fd, request *req)
+{
+    // Paths were rewritten to use archive separators by decode_path
+    static const char file_prefix[] = "\\file\\";
+    static const char frm_prefix[] = "\\frm\\";
+    static const char png_prefix[] = "\\png\\";
+
+    if (strcmp(req->path, "\\list") == 0)
+        return serve_list(server, fd, req);
+    if (strncmp(req->path, file_prefix, sizeof(file_prefix) - 1) == 0)
+        return serve_file(server, fd, req, req->path + sizeof(file_prefix) - 1);
+    if (strncmp(req->path, frm_prefix, sizeof(frm_prefix) - 1) == 0)
+        return serve_frm(server, fd, req, req->path + sizeof(frm_prefix) - 1);
+    if (strncmp(req->path, png_prefix, sizeof(png_prefix) - 1) == 0)
+        return serve_png(server, fd, req, req->path + sizeof(png_prefix) - 1);
+
+    return send_error(fd, req, "404 Not Found");
+}
+
+static time_t monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+//
+// Read whatever the client has already sent, without waiting for more
+// Returns false if the client closed the connection or it failed
+//
+static bool receive(connection *conn)
+{
+    while (conn->length < sizeof(conn->buffer) - 1)
+    {
+        ssize_t received = recv(conn->fd, conn->buffer + conn->length, sizeof(conn->buffer) - 1 - conn->length,
+            MSG_DONTWAIT);
+        if (received > 0)
+            conn->length += received;
+        else if (received < 0 && errno == EINTR)
+            continue;
+        else
+            return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+    return true;
+}
+
+//
+// Serve every complete request the client has sent so far. A partial
+// request stays buffered until the dispatcher sees the rest arrive
+// Returns true if the connection should be kept open
+//
+static bool serve_connection(assetserver *server, connection *conn)
+{
+    bool open = receive(conn);
+
+    char *end;
+    while ((end = memmem(conn->buffer, conn->length, "\r\n\r\n", 4)))
+    {
+        // Requests may be pipelined, so keep anything after this one
+        size_t request_length = end + 4 - conn->buffer;
+        char text[REQUEST_MAX];
+        memcpy(text, conn->buffer, request_length);
+        text[request_length] = '\0';
+        memmove(conn->buffer, conn->buffer + request_length, conn->length - request_length);
+        conn->length -= request_length;
+
+        request req;
+        if (parse_request(text, &req))
+        {
+            req.head = false;
+            req.keep_alive = false;
+            send_error(conn->fd, &req, "400 Bad Request");
+            return false;
+        }
+
+        if (dispatch(server, conn->fd, &req) || !req.keep_alive)
+            return false;
+
+        // The idle timeout restarts only once a whole request is served,
+        // so a client trickling in a request is still closed on time
+        conn->deadline = monotonic_seconds() + IDLE_TIMEOUT_SECONDS;
+    }
+
+    if (conn->length == sizeof(conn->buffer) - 1)
+    {
+        request req = { .keep_alive = false };
+        send_error(conn->fd, &req, "431 Request Header Fields Too Large");
+        return false;
+    }
+    return open;
+}
+
+//
+// Close a connection and forget it. The lock must be held
+//
+static void close_connection(assetserver *server, connection *conn)
+{
+    close(conn->fd);
+    connection *last = server->connections[--server->connection_count];
+    server->connections[conn->slot] = last;
+    last->slot = conn->slot;
+    free(conn);
+}
+
+//
+// Hand a connection back to the dispatcher to wait for its next request.
+// The lock must be held
+//
+static void watch_connection(assetserver *server, connection *conn)
+{
+    conn->busy = false;
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn };
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event))
+        close_connection(server, conn);
+}
+
+//
+// Accept every pending connection and start watching it for requests.
+// Connections past the limit are closed straight away
+//
+static void accept_connections(assetserver *server)
+{
+    struct timeval timeout = { IDLE_TIMEOUT_SECONDS, 0 };
+    int one = 1;
+    for (;;)
+    {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE)
+                fprintf(stderr, "Unable to accept connection: %s\n", strerror(errno));
+            return;
+        }
+
+        pthread_mutex_lock(&server->lock);
+        connection *conn = server->connection_count < CONNECTION_MAX ? malloc(sizeof(connection)) : NULL;
+        if (!conn)
+        {
+            pthread_mutex_unlock(&server->lock);
+            close(fd);
+            continue;
+        }
+
+        // Responses are sent with blocking writes, which give up on a
+        // client that stops reading
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn->fd = fd;
+        conn->busy = false;
+        conn->length = 0;
+        conn->deadline = monotonic_seconds() + IDLE_TIMEOUT_SECONDS;
+        conn->slot = server->connection_count;
+        server->connections[server->connection_count++] = conn;
+
+        struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn };
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event))
+            close_connection(server, conn);
+        pthread_mutex_unlock(&server->lock);
+    }
+}
+
+//
+// Queue a connection that has a request waiting for the next free worker.
+// A client that keeps trickling in bytes never goes quiet long enough to
+// be expired, so its deadline is checked here as well
+//
+static void queue_connection(assetserver *server, connection *conn)
+{
+    pthread_mutex_lock(&server->lock);
+    if (conn->deadline <= monotonic_seconds())
+    {
+        close_connection(server, conn);
+        pthread_mutex_unlock(&server->lock);
+        return;
+    }
+
+    conn->busy = true;
+    conn->next = NULL;
+    if (server->queue_tail)
+        server->queue_tail->next = conn;
+    else
+        server->queue_head = conn;
+    server->queue_tail = conn;
+    pthread_cond_signal(&server->ready);
+    pthread_mutex_unlock(&server->lock);
+}
+
+//
+// Close connections that have waited too long for a request
+//
+static void expire_connections(assetserver *server)
+{
+    time_t now = monotonic_seconds();
+    pthread_mutex_lock(&server->lock);
+    for (size_t i = server->connection_count; i--; )
+        if (!server->connections[i]->busy && server->connections[i]->deadline <= now)
+            close_connection(server, server->connections[i]);
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void *worker(void *user)
+{
+    assetserver *server = user;
+    pthread_mutex_lock(&server->lock);
+    for (;;)
+    {
+        while (!server->queue_head && !server->stopping)
+            pthread_cond_wait(&server->ready, &server->lock);
+        if (server->stopping)
+            break;
+
+        connection *conn = server->queue_head;
+        server->queue_head = conn->next;
+        if (!server->queue_head)
+            server->queue_tail = NULL;
+        pthread_mutex_unlock(&server->lock);
+
+        bool keep = serve_connection(server, conn);
+
+        pthread_mutex_lock(&server->lock);
+        if (keep && !server->stopping)
+            watch_connection(server, conn);
+        else
+            close_connection(server, conn);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+//
+// Wait for new connections, requests on idle connections and shutdown
+// signals, handing each request to the workers
+// Returns 0 on a clean shutdown, or -1 on error
+//
+static int dispatch_events(assetserver *server, int signal_fd)
+{
+    struct epoll_event events[EVENT_MAX];
+    for (;;)
+    {
+        int count = epoll_wait(server->epoll_fd, events, EVENT_MAX, 1000);
+        if (count < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "Poll error: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.ptr == &server->listen_fd)
+                accept_connections(server);
+            else if (events[i].data.ptr == server)
+            {
+                // Consume the signal so it is not delivered once unblocked
+                struct signalfd_siginfo info;
+                if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+                    return 0;
+            }
+            else
+                queue_connection(server, events[i].data.ptr);
+        }
+
+        expire_connections(server);
+    }
+}
+
+//
+// Serve the archives on the loopback interface until interrupted.
+// Idle keep-alive connections are watched by this thread, and each
+// request is handed to one of the worker threads, which keep their
+// per-thread decompressors and buffers warm between requests
+// Returns 0 on a clean shutdown, or -1 on error
+//
+int assetserver_run(dat2reader **readers, size_t reader_count, uint16_t port, unsigned threads,
+    const pngwriter_options *options, rendercache *cache)
+{
+    assetserver server;
+    server.readers = readers;
+    server.reader_count = reader_count;
+    server.options = options;
+    server.cache = cache;
+    server.archive_ids = NULL;
+    server.have_palette = false;
+    server.queue_head = server.queue_tail = NULL;
+    server.connection_count = 0;
+    server.stopping = false;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+
+    size_t archive;
+    // palreader_from_data reads a whole palette without a length, so
+    // truncated entries are rejected here
+    dat2entry *pal_entry = find_entry(&server, "color.pal", &archive);
+    if (pal_entry && pal_entry->uncompressed_size < sizeof(server.rgb))
+        pal_entry = NULL;
+    uint8_t *pal_data = pal_entry ? dat2entry_extract_data(pal_entry) : NULL;
+    palreader *pal = pal_data ? palreader_from_data(pal_data) : NULL;
+    if (pal)
+    {
+        palreader_get_rgb(pal, server.rgb);
+        server.have_palette = true;
+        palreader_free(pal);
+    }
+    else
+        fprintf(stderr, "color.pal not found or invalid, png rendering is disabled\n");
+    free(pal_data);
+
+    int status = -1;
+    if (cache)
+    {
+        server.archive_ids = malloc(reader_count*sizeof(uint64_t));
+        if (!server.archive_ids)
+        {
+            fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+            goto socket_error;
+        }
+
+        for (size_t i = 0; i < reader_count; i++)
+            server.archive_ids[i] = rendercache_archive_id(readers[i]);
+    }
+
+    server.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (server.listen_fd < 0)
+    {
+        fprintf(stderr, "Socket error: %s\n", strerror(errno));
+        goto socket_error;
+    }
+
+    int one = 1;
+    setsockopt(server.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(server.listen_fd, (struct sockaddr *)&address, sizeof(address)) || listen(server.listen_fd, SOMAXCONN))
+    {
+        fprintf(stderr, "Unable to listen on port %u: %s\n", port, strerror(errno));
+        goto listen_error;
+    }
+
+    // Workers inherit this mask, so shutdown signals are only
+    // delivered through the signalfd watched by the dispatcher
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_event = { .events = EPOLLIN, .data.ptr = &server.listen_fd };
+    struct epoll_event signal_event = { .events = EPOLLIN, .data.ptr = &server };
+    if (signal_fd < 0 || server.epoll_fd < 0 ||
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &listen_event) ||
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, signal_fd, &signal_event))
+    {
+        fprintf(stderr, "Poll error: %s\n", strerror(errno));
+        goto poll_error;
+    }
+
+    if (!threads)
+        threads = dat2scheduler_default_threads();
+
+    pthread_t *workers = malloc(threads*sizeof(pthread_t));
+    if (!workers)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto poll_error;
+    }
+
+    unsigned started = 0;
+    for (; started < threads; started++)
+        if (pthread_create(&workers[started], NULL, worker, &server))
+            break;
+
+    if (started)
+    {
+        printf("Serving %zu archives on http://127.0.0.1:%u/ with %u threads\n", reader_count, port, started);
+        fflush(stdout);
+        status = dispatch_events(&server, signal_fd);
+    }
+
+    // Wake idle workers, and any blocked sending to a connection
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    pthread_cond_broadcast(&server.ready);
+    for (size_t i = 0; i < server.connection_count; i++)
+        if (server.connections[i]->busy)
+            shutdown(server.connections[i]->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&server.lock);
+
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    while (server.connection_count)
+        close_connection(&server, server.connections[0]);
+
+    free(workers);
+poll_error:
+    if (server.epoll_fd >= 0)
+        close(server.epoll_fd);
+    if (signal_fd >= 0)
+        close(signal_fd);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+listen_error:
+    close(server.listen_fd);
+socket_error:
+    free(server.archive_ids);
+    pthread_cond_destroy(&server.ready);
+    pthread_mutex_destroy(&server.lock);
+    return status;
+}
@@ -0,0 +1,328 @@
+/*
+ * checksum.c
+ * Checksums and hashes used for validating and identifying data
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "checksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define CHECKSUM_HAVE_SSSE3 1
+#endif
+
+// Largest prime smaller than 65536
+#define ADLER32_BASE 65521
+
+// Largest n such that 255n(n+1)/2 + (n+1)(BASE-1) fits in 32 bits,
+// i.e. the number of bytes that can be summed before reducing
+#define ADLER32_NMAX 5552
+
+static uint32_t adler32_scalar(uint32_t adler, const uint8_t *data, size_t length)
+{
+    uint32_t s1 = adler & 0xFFFF;
+    uint32_t s2 = adler >> 16;
+    while (length)
+    {
+        size_t block = length < ADLER32_NMAX ? length : ADLER32_NMAX;
+        length -= block;
+
+        for (; block >= 8; block -= 8, data += 8)
+        {
+            s1 += data[0]; s2 += s1;
+            s1 += data[1]; s2 += s1;
+            s1 += data[2]; s2 += s1;
+            s1 += data[3]; s2 += s1;
+            s1 += data[4]; s2 += s1;
+            s1 += data[5]; s2 += s1;
+            s1 += data[6]; s2 += s1;
+            s1 += data[7]; s2 += s1;
+        }
+
+        for (; block; block--)
+        {
+            s1 += *data++;
+            s2 += s1;
+        }
+
+        s1 %= ADLER32_BASE;
+        s2 %= ADLER32_BASE;
+    }
+    return (s2 << 16) | s1;
+}
+
+#ifdef CHECKSUM_HAVE_SSSE3
+//
+// Sum 32 byte blocks with SSSE3: s1 is a horizontal byte sum (psadbw),
+// and s2 is a dot product of the bytes with descending weights (pmaddubsw)
+// plus 32 times the value s1 had at the start of each block
+//
+__attribute__((target("ssse3")))
+static uint32_t adler32_ssse3(uint32_t adler, const uint8_t *data, size_t length)
+{
+    uint32_t s1 = adler & 0xFFFF;
+    uint32_t s2 = adler >> 16;
+
+    size_t blocks = length / 32;
+    length -= blocks*32;
+
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    while (blocks)
+    {
+        size_t n = ADLER32_NMAX / 32;
+        if (n > blocks)
+            n = blocks;
+        blocks -= n;
+
+        __m128i v_ps = _mm_set_epi32(0, 0, 0, s1*n);
+        __m128i v_s2 = _mm_set_epi32(0, 0, 0, s2);
+        __m128i v_s1 = zero;
+        do
+        {
+            const __m128i bytes1 = _mm_loadu_si128((const __m128i *)data);
+            const __m128i bytes2 = _mm_loadu_si128((const __m128i *)(data + 16));
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+            data += 32;
+        } while (--n);
+
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        // Horizontal sums of the four 32 bit lanes
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += _mm_cvtsi128_si32(v_s1);
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = _mm_cvtsi128_si32(v_s2);
+
+        s1 %= ADLER32_BASE;
+        s2 %= ADLER32_BASE;
+    }
+
+    return adler32_scalar((s2 << 16) | s1, data, length);
+}
+
+static bool have_ssse3;
+static pthread_once_t have_ssse3_once = PTHREAD_ONCE_INIT;
+
+static void detect_ssse3(void)
+{
+    have_ssse3 = __builtin_cpu_supports("ssse3");
+}
+#endif
+
+//
+// Update a running Adler-32 checksum (start from ADLER32_INIT) with
+// additional data. Uses SSSE3 when the CPU supports it
+//
+uint32_t adler32_update(uint32_t adler, const uint8_t *data, size_t length)
+{
+#ifdef CHECKSUM_HAVE_SSSE3
+    pthread_once(&have_ssse3_once, detect_ssse3);
+    if (have_ssse3 && length >= 64)
+        return adler32_ssse3(adler, data, length);
+#endif
+    return adler32_scalar(adler, data, length);
+}
+
+//
+// Combine the checksums of two adjacent blocks of data into the checksum
+// of their concatenation, given the length of the second block.
+// s1 simply adds (less the second block's initial 1), and every byte of
+// the first block contributes to s2 once more for each byte in the second
+//
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, uint64_t length2)
+{
+    uint32_t remainder = length2 % ADLER32_BASE;
+    uint32_t s1 = adler1 & 0xFFFF;
+    uint32_t s2 = (uint32_t)(((uint64_t)remainder*s1) % ADLER32_BASE);
+    s1 += (adler2 & 0xFFFF) + ADLER32_BASE - 1;
+    s2 += (adler1 >> 16) + (adler2 >> 16) + ADLER32_BASE - remainder;
+    if (s1 >= ADLER32_BASE)
+        s1 -= ADLER32_BASE;
+    if (s1 >= ADLER32_BASE)
+        s1 -= ADLER32_BASE;
+    if (s2 >= 2*ADLER32_BASE)
+        s2 -= 2*ADLER32_BASE;
+    if (s2 >= ADLER32_BASE)
+        s2 -= ADLER32_BASE;
+    return (s2 << 16) | s1;
+}
+
+// CRC-32 (IEEE 802.3, as used by PNG and gzip) in the reflected form
+#define CRC32_POLYNOMIAL 0xEDB88320
+
+static uint32_t crc32_table[4][256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? CRC32_POLYNOMIAL ^ (c >> 1) : c >> 1;
+        crc32_table[0][i] = c;
+    }
+
+    // Tables for processing four bytes per step (slicing-by-4)
+    for (uint32_t i = 0; i < 256; i++)
+        for (int t = 1; t < 4; t++)
+            crc32_table[t][i] = (crc32_table[t - 1][i] >> 8) ^ crc32_table[0][crc32_table[t - 1][i] & 0xFF];
+}
+
+//
+// Update a running CRC-32 (start from CRC32_INIT) with additional data
+//
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length)
+{
+    pthread_once(&crc32_table_once, crc32_init_table);
+
+    uint32_t c = ~crc;
+    for (; length >= 4; length -= 4, data += 4)
+    {
+        c ^= (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+        c = crc32_table[3][c & 0xFF] ^ crc32_table[2][(c >> 8) & 0xFF] ^
+            crc32_table[1][(c >> 16) & 0xFF] ^ crc32_table[0][c >> 24];
+    }
+
+    for (; length; length--)
+        c = crc32_table[0][(c ^ *data++) & 0xFF] ^ (c >> 8);
+
+    return ~c;
+}
+
+// 64 bit hash constants, from xxHash
+#define HASH64_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH64_PRIME3 0x165667B19E3779F9ULL
+#define HASH64_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH64_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read_u64(const uint8_t *data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read_u32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint64_t hash64_round(uint64_t acc, uint64_t input)
+{
+    acc += input*HASH64_PRIME2;
+    acc = rotl64(acc, 31);
+    return acc*HASH64_PRIME1;
+}
+
+static inline uint64_t hash64_merge(uint64_t acc, uint64_t value)
+{
+    acc ^= hash64_round(0, value);
+    return acc*HASH64_PRIME1 + HASH64_PRIME4;
+}
+
+//
+// Fast non-cryptographic 64 bit hash (the XXH64 algorithm).
+// Four independent accumulators consume 32 bytes per iteration
+// Suitable for identifying content, not for resisting attackers
+//
+uint64_t hash64(const uint8_t *data, size_t length, uint64_t seed)
+{
+    const uint8_t *end = data + length;
+    uint64_t h;
+
+    if (length >= 32)
+    {
+        uint64_t v1 = seed + HASH64_PRIME1 + HASH64_PRIME2;
+        uint64_t v2 = seed + HASH64_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - HASH64_PRIME1;
+        const uint8_t *limit = end - 32;
+        do
+        {
+            v1 = hash64_round(v1, read_u64(data));
+            v2 = hash64_round(v2, read_u64(data + 8));
+            v3 = hash64_round(v3, read_u64(data + 16));
+            v4 = hash64_round(v4, read_u64(data + 24));
+            data += 32;
+        } while (data <= limit);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = hash64_merge(h, v1);
+        h = hash64_merge(h, v2);
+        h = hash64_merge(h, v3);
+        h = hash64_merge(h, v4);
+    }
+    else
+        h = seed + HASH64_PRIME5;
+
+    h += length;
+    for (; data + 8 <= end; data += 8)
+    {
+        h ^= hash64_round(0, read_u64(data));
+        h = rotl64(h, 27)*HASH64_PRIME1 + HASH64_PRIME4;
+    }
+
+    if (data + 4 <= end)
+    {
+        h ^= read_u32(data)*HASH64_PRIME1;
+        h = rotl64(h, 23)*HASH64_PRIME2 + HASH64_PRIME3;
+        data += 4;
+    }
+
+    for (; data < end; data++)
+    {
+        h ^= *data*HASH64_PRIME5;
+        h = rotl64(h, 11)*HASH64_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH64_PRIME2;
+    h ^= h >> 29;
+    h *= HASH64_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
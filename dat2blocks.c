@@ -0,0 +1,579 @@
+/*
+ * dat2blocks.c
+ * Block-compressed archive container with random access
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "dat2blocks.h"
+#include "byteorder.h"
+#include "dat2pool.h"
+#include "dat2scheduler.h"
+#include "checksum.h"
+#include "lzblock.h"
+
+static uint32_t entry_block_count(uint32_t block_size, uint32_t length)
+{
+    return length/block_size + (length % block_size != 0);
+}
+
+static uint32_t block_length(uint32_t block_size, uint32_t length, uint32_t block)
+{
+    uint64_t start = (uint64_t)block*block_size;
+    return length - start < block_size ? length - start : block_size;
+}
+
+//
+// Check whether a reader's file starts with the block archive magic
+//
+bool dat2blocks_detect(dat2reader *reader)
+{
+    uint8_t magic[DAT2BLOCKS_MAGIC_SIZE];
+    return dat2reader_read_at(reader, magic, sizeof(magic), 0) == sizeof(magic) &&
+        memcmp(magic, DAT2BLOCKS_MAGIC, DAT2BLOCKS_MAGIC_SIZE) == 0;
+}
+
+//
+// Release a block table
+//
+void dat2blocks_free(dat2blocks *blocks)
+{
+    if (!blocks)
+        return;
+    free(blocks->blocks);
+    free(blocks->first_block);
+    free(blocks->adler32);
+    free(blocks);
+}
+
+//
+// Check that the blocks of an entry lie end to end from its offset,
+// and mark the entry compressed unless every block is stored raw
+// Returns 0 if the entry is consistent, or -1 if not
+//
+static int load_entry_blocks(dat2blocks *blocks, dat2entry *entry, uint32_t first_block, uint64_t data_end)
+{
+    uint32_t count = entry_block_count(blocks->block_size, entry->uncompressed_size);
+    if (first_block > blocks->block_count || blocks->block_count - first_block < count)
+        return -1;
+
+    entry->compressed = false;
+    uint64_t offset = entry->offset;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const dat2blocks_block *block = &blocks->blocks[first_block + i];
+        uint32_t length = block_length(blocks->block_size, entry->uncompressed_size, i);
+        bool raw = block->flags & DAT2BLOCKS_BLOCK_RAW;
+        if (block->offset != offset || block->size == 0 || block->size > length || (raw && block->size != length))
+            return -1;
+
+        if (!raw)
+            entry->compressed = true;
+        offset += block->size;
+    }
+
+    if (offset - entry->offset != entry->compressed_size || offset > data_end)
+        return -1;
+    return 0;
+}
+
+//
+// Load the entries, block index and filename hash table of a block
+// archive into a reader that has just opened the file
+// Returns 0 on success, or -1 on error
+//
+int dat2blocks_load(dat2reader *reader)
+{
+    uint8_t header[DAT2BLOCKS_HEADER_SIZE];
+    struct stat st;
+    if (fstat(fileno(reader->file), &st) ||
+        dat2reader_read_at(reader, header, sizeof(header), 0) != sizeof(header))
+        goto format_error;
+
+    uint32_t block_size = get_le32(header + 12);
+    uint32_t entry_count = get_le32(header + 16);
+    uint32_t block_count = get_le32(header + 20);
+    uint64_t block_offset = get_le64(header + 24);
+    uint64_t entry_offset = get_le64(header + 32);
+    uint64_t names_offset = get_le64(header + 40);
+    uint64_t hash_offset = get_le64(header + 48);
+    uint32_t hash_slots = get_le32(header + 56);
+    uint32_t names_size = get_le32(header + 60);
+
+    // The tables follow the data back to back, up to the end of the file
+    if (get_le32(header + 8) != DAT2BLOCKS_VERSION || block_size < 4096 || block_size > (1U << 24) ||
+        block_offset < DAT2BLOCKS_HEADER_SIZE || block_offset > (uint64_t)st.st_size ||
+        entry_offset != block_offset + (uint64_t)block_count*DAT2BLOCKS_BLOCK_RECORD_SIZE ||
+        names_offset != entry_offset + (uint64_t)entry_count*DAT2BLOCKS_ENTRY_RECORD_SIZE ||
+        hash_offset != names_offset + names_size || hash_offset + (uint64_t)hash_slots*sizeof(uint32_t) != (uint64_t)st.st_size ||
+        hash_slots < 16 || (hash_slots & (hash_slots - 1)) || hash_slots/2 < entry_count)
+        goto format_error;
+
+    size_t metadata_size = st.st_size - block_offset;
+    uint8_t *metadata = malloc(metadata_size);
+    dat2blocks *blocks = calloc(1, sizeof(dat2blocks));
+    if (!metadata || !blocks)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(metadata);
+        free(blocks);
+        return -1;
+    }
+
+    reader->blocks = blocks;
+    reader->extended = false;
+    reader->filesize = st.st_size;
+    reader->directory_offset = block_offset;
+    reader->entry_count = 0;
+    reader->entries = calloc(entry_count ? entry_count : 1, sizeof(dat2entry));
+    reader->index = malloc(hash_slots*sizeof(uint32_t));
+    reader->index_mask = hash_slots - 1;
+    blocks->block_size = block_size;
+    blocks->block_count = block_count;
+    blocks->blocks = malloc((block_count ? block_count : 1)*sizeof(dat2blocks_block));
+    blocks->first_block = malloc((entry_count ? entry_count : 1)*sizeof(uint32_t));
+    blocks->adler32 = malloc((entry_count ? entry_count : 1)*sizeof(uint32_t));
+    if (!reader->entries || !reader->index || !blocks->blocks || !blocks->first_block || !blocks->adler32)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto load_error;
+    }
+
+    if (dat2reader_read_at(reader, metadata, metadata_size, block_offset) != metadata_size)
+        goto load_format_error;
+
+    const uint8_t *p = metadata;
+    for (uint32_t i = 0; i < block_count; i++, p += DAT2BLOCKS_BLOCK_RECORD_SIZE)
+    {
+        blocks->blocks[i].offset = get_le64(p);
+        blocks->blocks[i].size = get_le32(p + 8);
+        blocks->blocks[i].flags = get_le32(p + 12);
+    }
+
+    const char *names = (const char *)metadata + (names_offset - block_offset);
+    if (names_size && names[names_size - 1] != '\0')
+        goto load_format_error;
+
+    for (uint32_t i = 0; i < entry_count; i++, p += DAT2BLOCKS_ENTRY_RECORD_SIZE)
+    {
+        dat2entry *entry = &reader->entries[i];
+        uint32_t name = get_le32(p);
+        entry->reader = reader;
+        entry->uncompressed_size = get_le32(p + 4);
+        entry->compressed_size = get_le32(p + 8);
+        blocks->first_block[i] = get_le32(p + 12);
+        entry->offset = get_le64(p + 16);
+        blocks->adler32[i] = get_le32(p + 24);
+
+        if (name >= names_size || load_entry_blocks(blocks, entry, blocks->first_block[i], block_offset))
+            goto load_format_error;
+
+        entry->filename = strdup(&names[name]);
+        if (!entry->filename)
+        {
+            fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+            goto load_error;
+        }
+        reader->entry_count++;
+    }
+
+    // Lookups stop at an empty slot, so a full table would never end
+    const uint8_t *hash = metadata + (hash_offset - block_offset);
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < hash_slots; i++)
+    {
+        reader->index[i] = get_le32(hash + 4*i);
+        if (reader->index[i] > entry_count)
+            goto load_format_error;
+        used += reader->index[i] != 0;
+    }
+
+    if (used == hash_slots)
+        goto load_format_error;
+
+    free(metadata);
+    return 0;
+
+load_format_error:
+    fprintf(stderr, "Error: %s is not a valid block archive\n", reader->path);
+load_error:
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+        free(reader->entries[i].filename);
+    free(reader->entries);
+    free(reader->index);
+    dat2blocks_free(blocks);
+    reader->blocks = NULL;
+    free(metadata);
+    return -1;
+
+format_error:
+    fprintf(stderr, "Error: %s is not a valid block archive\n", reader->path);
+    return -1;
+}
+
+//
+// Decode one block of an entry into data, which must hold the block
+// size. Scratch receives the compressed block and must be as large
+// Returns the length of the block, or 0 on error
+//
+size_t dat2blocks_read_block(dat2entry *entry, uint32_t block, uint8_t *data, uint8_t *scratch)
+{
+    dat2blocks *blocks = entry->reader->blocks;
+    const dat2blocks_block *record = &blocks->blocks[blocks->first_block[entry - entry->reader->entries] + block];
+    uint32_t length = block_length(blocks->block_size, entry->uncompressed_size, block);
+    if (record->flags & DAT2BLOCKS_BLOCK_RAW)
+        return dat2reader_read_at(entry->reader, data, length, record->offset) == length ? length : 0;
+
+    if (dat2reader_read_at(entry->reader, scratch, record->size, record->offset) != record->size ||
+        lzblock_decompress(data, length, scratch, record->size))
+    {
+        fprintf(stderr, "%s: corrupt block %u\n", entry->filename, block);
+        return 0;
+    }
+    return length;
+}
+
+//
+// Extract a compressed entry of a block archive. Its blocks are read
+// with a single positional read, then decoded in place one by one
+// Returns 0 on success, or -1 on error
+//
+int dat2blocks_extract(dat2entry *entry, uint8_t *data)
+{
+    dat2blocks *blocks = entry->reader->blocks;
+    dat2pool *pool = dat2pool_thread();
+    uint8_t *stored = pool ? dat2pool_acquire(pool, entry->compressed_size) : NULL;
+    if (!stored)
+        return -1;
+
+    int status = -1;
+    if (dat2reader_read_at(entry->reader, stored, entry->compressed_size, entry->offset) != entry->compressed_size)
+    {
+        fprintf(stderr, "Extracted file length mismatch\n");
+        goto read_error;
+    }
+
+    const dat2blocks_block *record = &blocks->blocks[blocks->first_block[entry - entry->reader->entries]];
+    uint32_t count = entry_block_count(blocks->block_size, entry->uncompressed_size);
+    for (uint32_t i = 0; i < count; i++, record++)
+    {
+        const uint8_t *input = stored + (record->offset - entry->offset);
+        uint8_t *output = data + (size_t)i*blocks->block_size;
+        uint32_t length = block_length(blocks->block_size, entry->uncompressed_size, i);
+        if (record->flags & DAT2BLOCKS_BLOCK_RAW)
+            memcpy(output, input, length);
+        else if (lzblock_decompress(output, length, input, record->size))
+        {
+            fprintf(stderr, "%s: corrupt block %u\n", entry->filename, i);
+            goto read_error;
+        }
+    }
+    status = 0;
+
+read_error:
+    dat2pool_release(pool, stored);
+    return status;
+}
+
+//
+// Decode every block of an entry and compare the Adler-32 of the result
+// with the one recorded when the archive was written
+// Returns DAT2VERIFY_OK if the entry is intact
+//
+dat2verify_status dat2blocks_verify(dat2entry *entry, uint32_t *adler32)
+{
+    dat2blocks *blocks = entry->reader->blocks;
+    dat2pool *pool = dat2pool_thread();
+    if (!pool)
+        return DAT2VERIFY_NO_MEMORY;
+
+    uint8_t *data = dat2pool_acquire(pool, blocks->block_size);
+    uint8_t *scratch = dat2pool_acquire(pool, blocks->block_size);
+    dat2verify_status status = DAT2VERIFY_OK;
+    if (!data || !scratch)
+    {
+        status = DAT2VERIFY_NO_MEMORY;
+        goto done;
+    }
+
+    uint32_t adler = ADLER32_INIT;
+    uint32_t count = entry_block_count(blocks->block_size, entry->uncompressed_size);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        size_t length = dat2blocks_read_block(entry, i, data, scratch);
+        if (!length)
+        {
+            status = DAT2VERIFY_CORRUPT;
+            goto done;
+        }
+        adler = adler32_update(adler, data, length);
+    }
+
+    if (adler != blocks->adler32[entry - entry->reader->entries])
+        status = DAT2VERIFY_CHECKSUM_MISMATCH;
+    else if (adler32)
+        *adler32 = adler;
+
+done:
+    dat2pool_release(pool, scratch);
+    dat2pool_release(pool, data);
+    return status;
+}
+
+typedef struct
+{
+    dat2entry *entry;
+    uint8_t *data;
+    uint32_t size;
+    uint32_t *block_sizes;
+    uint32_t adler32;
+    bool failed;
+} pack_item;
+
+//
+// Extract an entry and compress each of its blocks, keeping a block
+// raw when compression does not make it smaller
+//
+static int pack_entry(size_t index, void *user)
+{
+    pack_item *item = &((pack_item *)user)[index];
+    dat2entry *entry = item->entry;
+    uint32_t count = entry_block_count(DAT2BLOCKS_BLOCK_SIZE, entry->uncompressed_size);
+
+    dat2pool *pool = dat2pool_thread();
+    uint8_t *data = pool ? dat2pool_acquire(pool, entry->uncompressed_size) : NULL;
+    uint8_t *scratch = pool ? dat2pool_acquire(pool, lzblock_bound(DAT2BLOCKS_BLOCK_SIZE)) : NULL;
+    item->data = malloc(entry->uncompressed_size ? entry->uncompressed_size : 1);
+    item->block_sizes = malloc((count ? count : 1)*sizeof(uint32_t));
+    item->failed = true;
+    if (!data || !scratch || !item->data || !item->block_sizes)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto done;
+    }
+
+    if (dat2entry_extract_into(entry, data, entry->uncompressed_size))
+        goto done;
+
+    item->adler32 = adler32_update(ADLER32_INIT, data, entry->uncompressed_size);
+    item->size = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const uint8_t *block = data + (size_t)i*DAT2BLOCKS_BLOCK_SIZE;
+        uint32_t length = block_length(DAT2BLOCKS_BLOCK_SIZE, entry->uncompressed_size, i);
+        size_t size = lzblock_compress(scratch, lzblock_bound(DAT2BLOCKS_BLOCK_SIZE), block, length);
+        if (size && size < length)
+            memcpy(item->data + item->size, scratch, size);
+        else
+        {
+            memcpy(item->data + item->size, block, length);
+            size = length;
+        }
+        item->block_sizes[i] = size;
+        item->size += size;
+    }
+    item->failed = false;
+
+done:
+    if (pool)
+    {
+        dat2pool_release(pool, scratch);
+        dat2pool_release(pool, data);
+    }
+    return item->failed;
+}
+
+//
+// Write the tables that follow the block data, then the header
+// Returns 0 on success, or -1 on error
+//
+static int write_tables(FILE *file, dat2reader *reader, uint64_t block_offset, const uint8_t *block_records,
+    uint32_t block_count, const uint8_t *entry_records, uint32_t names_size)
+{
+    uint64_t entry_offset = block_offset + (uint64_t)block_count*DAT2BLOCKS_BLOCK_RECORD_SIZE;
+    uint64_t names_offset = entry_offset + (uint64_t)reader->entry_count*DAT2BLOCKS_ENTRY_RECORD_SIZE;
+    uint64_t hash_offset = names_offset + names_size;
+    uint32_t hash_slots = reader->index_mask + 1;
+
+    fwrite(block_records, DAT2BLOCKS_BLOCK_RECORD_SIZE, block_count, file);
+    fwrite(entry_records, DAT2BLOCKS_ENTRY_RECORD_SIZE, reader->entry_count, file);
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+        fwrite(reader->entries[i].filename, 1, strlen(reader->entries[i].filename) + 1, file);
+
+    // Entries keep the order of the source reader, so its hash table
+    // already maps every name to the right index
+    uint8_t slot[4];
+    for (uint32_t i = 0; i < hash_slots; i++)
+    {
+        put_le32(slot, reader->index[i]);
+        fwrite(slot, sizeof(slot), 1, file);
+    }
+
+    uint8_t header[DAT2BLOCKS_HEADER_SIZE];
+    memcpy(header, DAT2BLOCKS_MAGIC, DAT2BLOCKS_MAGIC_SIZE);
+    put_le32(header + 8, DAT2BLOCKS_VERSION);
+    put_le32(header + 12, DAT2BLOCKS_BLOCK_SIZE);
+    put_le32(header + 16, reader->entry_count);
+    put_le32(header + 20, block_count);
+    put_le64(header + 24, block_offset);
+    put_le64(header + 32, entry_offset);
+    put_le64(header + 40, names_offset);
+    put_le64(header + 48, hash_offset);
+    put_le32(header + 56, hash_slots);
+    put_le32(header + 60, names_size);
+    if (fseeko(file, 0, SEEK_SET) || fwrite(header, sizeof(header), 1, file) != 1)
+        return -1;
+    return 0;
+}
+
+//
+// Write a block archive holding every entry of a reader, in the same
+// order. Entries are compressed in parallel batches and appended in order
+// Returns 0 on success, or -1 on error
+//
+int dat2blocks_write(dat2reader *reader, const char *path, unsigned threads)
+{
+    uint32_t count = reader->entry_count;
+    uint64_t block_count = 0;
+    uint64_t names_size = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        block_count += entry_block_count(DAT2BLOCKS_BLOCK_SIZE, reader->entries[i].uncompressed_size);
+        names_size += strlen(reader->entries[i].filename) + 1;
+    }
+
+    if (block_count > UINT32_MAX || names_size > UINT32_MAX)
+    {
+        fprintf(stderr, "Error: %s has too many files for a block archive\n", reader->path);
+        return -1;
+    }
+
+    pack_item *items = calloc(count ? count : 1, sizeof(pack_item));
+    uint64_t *costs = malloc((count ? count : 1)*sizeof(uint64_t));
+    uint8_t *block_records = malloc((block_count ? block_count : 1)*DAT2BLOCKS_BLOCK_RECORD_SIZE);
+    uint8_t *entry_records = malloc((count ? count : 1)*DAT2BLOCKS_ENTRY_RECORD_SIZE);
+    if (!items || !costs || !block_records || !entry_records)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(items);
+        free(costs);
+        free(block_records);
+        free(entry_records);
+        return -1;
+    }
+
+    int status = -1;
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        goto open_error;
+    }
+
+    // The header is written last, once the table offsets are known
+    uint8_t header[DAT2BLOCKS_HEADER_SIZE] = { 0 };
+    fwrite(header, sizeof(header), 1, file);
+
+    uint64_t offset = DAT2BLOCKS_HEADER_SIZE;
+    uint32_t block = 0;
+    uint32_t name = 0;
+    for (uint32_t start = 0; start < count;)
+    {
+        // Compress a batch in parallel, then append it in order
+        uint32_t end = start;
+        uint64_t batch_size = 0;
+        while (end < count && (end == start || batch_size + reader->entries[end].uncompressed_size <= DAT2BLOCKS_BATCH_SIZE))
+        {
+            items[end].entry = &reader->entries[end];
+            costs[end] = dat2scheduler_entry_cost(&reader->entries[end]) + reader->entries[end].uncompressed_size;
+            batch_size += reader->entries[end].uncompressed_size;
+            end++;
+        }
+
+        size_t failed = dat2scheduler_run_tasks(end - start, &costs[start], pack_entry, &items[start], threads);
+        for (uint32_t i = start; i < end; i++)
+        {
+            pack_item *item = &items[i];
+            if (!failed)
+            {
+                uint8_t *record = &entry_records[(size_t)i*DAT2BLOCKS_ENTRY_RECORD_SIZE];
+                put_le32(record, name);
+                put_le32(record + 4, item->entry->uncompressed_size);
+                put_le32(record + 8, item->size);
+                put_le32(record + 12, block);
+                put_le64(record + 16, offset);
+                put_le32(record + 24, item->adler32);
+                put_le32(record + 28, 0);
+
+                uint32_t blocks = entry_block_count(DAT2BLOCKS_BLOCK_SIZE, item->entry->uncompressed_size);
+                for (uint32_t j = 0; j < blocks; j++, block++)
+                {
+                    uint32_t length = block_length(DAT2BLOCKS_BLOCK_SIZE, item->entry->uncompressed_size, j);
+                    uint8_t *block_record = &block_records[(size_t)block*DAT2BLOCKS_BLOCK_RECORD_SIZE];
+                    put_le64(block_record, offset);
+                    put_le32(block_record + 8, item->block_sizes[j]);
+                    put_le32(block_record + 12, item->block_sizes[j] == length ? DAT2BLOCKS_BLOCK_RAW : 0);
+                    offset += item->block_sizes[j];
+                }
+
+                if (fwrite(item->data, 1, item->size, file) != item->size)
+                    failed = 1;
+                name += strlen(item->entry->filename) + 1;
+            }
+            free(item->data);
+            free(item->block_sizes);
+        }
+
+        if (failed)
+        {
+            fprintf(stderr, "Error writing %s\n", path);
+            goto write_error;
+        }
+        start = end;
+    }
+
+    if (write_tables(file, reader, offset, block_records, block, entry_records, name) == 0 &&
+        !ferror(file))
+        status = 0;
+    else
+        fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+
+write_error:
+    if (fclose(file) && status == 0)
+    {
+        fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+        status = -1;
+    }
+open_error:
+    free(entry_records);
+    free(block_records);
+    free(costs);
+    free(items);
+    return status;
+}
@@ -0,0 +1,84 @@
+/*
+ * dat2blocks.h
+ * Block-compressed archive container with random access
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _dat2blocks_h
+#define _dat2blocks_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "dat2reader.h"
+
+// A block archive holds the same files as a dat2 archive, but each file is
+// split into fixed-size blocks compressed independently with lzblock, so
+// any block decodes on its own. The file starts with a header, followed by
+// the block data of each entry in turn, then the block index, the entry
+// table, the nul-terminated names and the filename hash table used by
+// dat2reader_find_entry, all little-endian. Blocks that do not shrink are
+// stored raw, and entries made only of raw blocks read like stored entries
+#define DAT2BLOCKS_MAGIC "DAT2BLK\x1A"
+#define DAT2BLOCKS_MAGIC_SIZE 8
+#define DAT2BLOCKS_VERSION 1
+#define DAT2BLOCKS_HEADER_SIZE 64
+#define DAT2BLOCKS_BLOCK_RECORD_SIZE 16
+#define DAT2BLOCKS_ENTRY_RECORD_SIZE 32
+#define DAT2BLOCKS_BLOCK_SIZE 65536
+#define DAT2BLOCKS_BLOCK_RAW 1
+
+// Entries are compressed in batches of about this many uncompressed
+// bytes, bounding memory while keeping every thread busy
+#define DAT2BLOCKS_BATCH_SIZE (64*1024*1024)
+
+typedef struct
+{
+    uint64_t offset;
+    uint32_t size;
+    uint32_t flags;
+} dat2blocks_block;
+
+typedef struct dat2blocks
+{
+    uint32_t block_size;
+    uint32_t block_count;
+    dat2blocks_block *blocks;
+
+    // First block and Adler-32 of each entry, indexed like reader->entries
+    uint32_t *first_block;
+    uint32_t *adler32;
+} dat2blocks;
+
+bool dat2blocks_detect(dat2reader *reader);
+int dat2blocks_load(dat2reader *reader);
+void dat2blocks_free(dat2blocks *blocks);
+
+size_t dat2blocks_read_block(dat2entry *entry, uint32_t block, uint8_t *data, uint8_t *scratch);
+int dat2blocks_extract(dat2entry *entry, uint8_t *data);
+dat2verify_status dat2blocks_verify(dat2entry *entry, uint32_t *adler32);
+
+int dat2blocks_write(dat2reader *reader, const char *path, unsigned threads);
+
+#endif
@@ -0,0 +1,599 @@
+/*
+ * dat2checkpoint.c
+ * Inflate checkpoints for random access into compressed entries
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "dat2checkpoint.h"
+#include "byteorder.h"
+#include "dat2scheduler.h"
+#include "dat2stream.h"
+#include "deflate.h"
+
+// Serialised inflate state: the scalar fields, bit buffer and output
+// distance, then the code sizes of the literal/length and distance tables
+#define STATE_SCALARS 9
+#define STATE_SIZE (STATE_SCALARS*4 + 2*8 + TINFL_MAX_HUFF_SYMBOLS_0 + TINFL_MAX_HUFF_SYMBOLS_1)
+#define RECORD_SIZE (STATE_SIZE + TINFL_LZ_DICT_SIZE)
+
+// Longest deflate match, which bounds the copy count of a huffman block
+#define MAX_MATCH 258
+
+typedef enum
+{
+    RESUME_NONE,
+    RESUME_STORED,
+    RESUME_HUFFMAN,
+} resume_kind;
+
+//
+// Classify the tinfl coroutine point an inflate state resumes at. Only
+// points within the data of a block are checkpointed: the stored block
+// copy (9, 38, 51, 52) and huffman literal, length and distance decoding
+// (23 to 27, 53). These read nothing but the fields that put_state saves,
+// while the header and table parsing points in between are skipped
+//
+static resume_kind resume_point(mz_uint32 state)
+{
+    switch (state)
+    {
+        case 9: case 38: case 51: case 52:
+            return RESUME_STORED;
+        case 23: case 24: case 25: case 26: case 27: case 53:
+            return RESUME_HUFFMAN;
+        default:
+            return RESUME_NONE;
+    }
+}
+
+static bool eligible(dat2entry *entry, uint32_t span)
+{
+    return entry->compressed && !entry->reader->blocks && entry->uncompressed_size > span;
+}
+
+//
+// Keep checkpoints for the compressed entries of a reader that are
+// larger than span bytes, building them as streams pass through.
+// Any checkpoints the reader already had are discarded
+// Returns 0 on success, or -1 on error
+//
+int dat2reader_enable_checkpoints(dat2reader *reader, uint32_t span)
+{
+    if (span < DAT2CHECKPOINT_MIN_SPAN)
+    {
+        fprintf(stderr, "Checkpoint span must be at least %u bytes\n", DAT2CHECKPOINT_MIN_SPAN);
+        return -1;
+    }
+
+    dat2checkpoints *checkpoints = malloc(sizeof(dat2checkpoints));
+    dat2checkpoint_list *lists = calloc(reader->entry_count ? reader->entry_count : 1, sizeof(dat2checkpoint_list));
+    if (!checkpoints || !lists)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(checkpoints);
+        free(lists);
+        return -1;
+    }
+
+    checkpoints->span = span;
+    checkpoints->entry_count = reader->entry_count;
+    checkpoints->lists = lists;
+    pthread_mutex_init(&checkpoints->lock, NULL);
+
+    dat2checkpoints_free(reader->checkpoints);
+    reader->checkpoints = checkpoints;
+    return 0;
+}
+
+//
+// Release a set of checkpoints
+//
+void dat2checkpoints_free(dat2checkpoints *checkpoints)
+{
+    if (!checkpoints)
+        return;
+
+    for (uint32_t i = 0; i < checkpoints->entry_count; i++)
+    {
+        dat2checkpoint_list *list = &checkpoints->lists[i];
+        for (uint32_t j = 0; j < list->count; j++)
+            free(list->checkpoints[j]);
+        free(list->checkpoints);
+    }
+    free(checkpoints->lists);
+    pthread_mutex_destroy(&checkpoints->lock);
+    free(checkpoints);
+}
+
+//
+// Check whether a stream that has inflated output bytes of an entry has
+// reached the point where the entry's next checkpoint belongs
+//
+static bool due_locked(dat2checkpoints *checkpoints, dat2checkpoint_list *list, uint64_t output)
+{
+    return output >= (uint64_t)(list->count + 1)*checkpoints->span &&
+        (list->count == 0 || output > list->checkpoints[list->count - 1]->output);
+}
+
+//
+// Check whether a stream should save a checkpoint after inflating
+// output bytes of an entry
+//
+bool dat2checkpoints_due(dat2entry *entry, uint64_t output)
+{
+    dat2checkpoints *checkpoints = entry->reader->checkpoints;
+    if (!eligible(entry, checkpoints->span))
+        return false;
+
+    pthread_mutex_lock(&checkpoints->lock);
+    bool due = due_locked(checkpoints, &checkpoints->lists[entry - entry->reader->entries], output);
+    pthread_mutex_unlock(&checkpoints->lock);
+    return due;
+}
+
+//
+// Append a checkpoint to an entry, taking ownership of it. Checkpoints
+// that another stream has already saved in the meantime are discarded
+//
+void dat2checkpoints_add(dat2entry *entry, dat2checkpoint *checkpoint)
+{
+    dat2checkpoints *checkpoints = entry->reader->checkpoints;
+    dat2checkpoint_list *list = &checkpoints->lists[entry - entry->reader->entries];
+
+    pthread_mutex_lock(&checkpoints->lock);
+    if (due_locked(checkpoints, list, checkpoint->output))
+    {
+        if (list->count == list->capacity)
+        {
+            uint32_t capacity = list->capacity ? 2*list->capacity : 4;
+            dat2checkpoint **grown = realloc(list->checkpoints, capacity*sizeof(dat2checkpoint *));
+            if (grown)
+            {
+                list->checkpoints = grown;
+                list->capacity = capacity;
+            }
+        }
+
+        if (list->count < list->capacity)
+        {
+            list->checkpoints[list->count++] = checkpoint;
+            checkpoint = NULL;
+        }
+    }
+    pthread_mutex_unlock(&checkpoints->lock);
+    free(checkpoint);
+}
+
+//
+// Find the last checkpoint of an entry at or before a position
+// Returns the checkpoint, or NULL if there is none
+//
+const dat2checkpoint *dat2checkpoints_find(dat2entry *entry, uint64_t position)
+{
+    dat2checkpoints *checkpoints = entry->reader->checkpoints;
+    dat2checkpoint_list *list = &checkpoints->lists[entry - entry->reader->entries];
+
+    pthread_mutex_lock(&checkpoints->lock);
+    uint32_t low = 0;
+    uint32_t high = list->count;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low)/2;
+        if (list->checkpoints[middle]->output <= position)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    const dat2checkpoint *checkpoint = low ? list->checkpoints[low - 1] : NULL;
+    pthread_mutex_unlock(&checkpoints->lock);
+    return checkpoint;
+}
+
+//
+// Check whether an inflate state can be saved as a checkpoint.
+// Streams skip states that cannot and save at their next run of output
+//
+bool dat2checkpoints_resumable(const tinfl_decompressor *decompressor)
+{
+    return resume_point(decompressor->m_state) != RESUME_NONE;
+}
+
+static bool eligible_filter(dat2entry *entry, void *user)
+{
+    return eligible(entry, *(uint32_t *)user);
+}
+
+static int build_entry(dat2entry *entry, void *user)
+{
+    (void)user;
+    dat2stream *stream = dat2stream_open(entry);
+    if (!stream)
+        return 1;
+
+    int status = dat2stream_seek(stream, entry->uncompressed_size) != 0;
+    dat2stream_close(stream);
+    return status;
+}
+
+//
+// Inflate every eligible entry once, saving all of its checkpoints
+// Returns the number of entries that failed
+//
+size_t dat2checkpoints_build(dat2reader *reader, unsigned threads)
+{
+    if (!reader->checkpoints)
+        return 0;
+
+    uint32_t span = reader->checkpoints->span;
+    return dat2scheduler_run_reader(reader, eligible_filter, build_entry, &span, threads);
+}
+
+static uint8_t *put_state(uint8_t *p, const tinfl_decompressor *r)
+{
+    const mz_uint32 scalars[STATE_SCALARS] =
+    {
+        r->m_state, r->m_num_bits, r->m_final, r->m_check_adler32, r->m_dist, r->m_counter, r->m_num_extra,
+        r->m_table_sizes[0], r->m_table_sizes[1]
+    };
+
+    for (int i = 0; i < STATE_SCALARS; i++, p += 4)
+        put_le32(p, scalars[i]);
+    put_le64(p, r->m_bit_buf);
+    put_le64(p + 8, r->m_dist_from_out_buf_start);
+    p += 16;
+
+    memcpy(p, r->m_tables[0].m_code_size, TINFL_MAX_HUFF_SYMBOLS_0);
+    memcpy(p + TINFL_MAX_HUFF_SYMBOLS_0, r->m_tables[1].m_code_size, TINFL_MAX_HUFF_SYMBOLS_1);
+    return p + TINFL_MAX_HUFF_SYMBOLS_0 + TINFL_MAX_HUFF_SYMBOLS_1;
+}
+
+//
+// Restore an inflate state written by put_state. Every field is checked
+// against the range tinfl can produce at the state's resume point, and
+// the huffman tables are rebuilt from their code sizes by tinfl itself,
+// so a damaged index cannot send the inflater outside its buffers
+// Returns 0 on success, or -1 if the state is invalid
+//
+static int get_state(const uint8_t *p, tinfl_decompressor *r)
+{
+    memset(r, 0, sizeof(tinfl_decompressor));
+    mz_uint32 *scalars[STATE_SCALARS] =
+    {
+        &r->m_state, &r->m_num_bits, &r->m_final, &r->m_check_adler32, &r->m_dist, &r->m_counter, &r->m_num_extra,
+        &r->m_table_sizes[0], &r->m_table_sizes[1]
+    };
+
+    for (int i = 0; i < STATE_SCALARS; i++, p += 4)
+        *scalars[i] = get_le32(p);
+    r->m_bit_buf = get_le64(p);
+    r->m_dist_from_out_buf_start = get_le64(p + 8);
+    p += 16;
+
+    // Bits above the count held are always clear
+    resume_kind kind = resume_point(r->m_state);
+    if (kind == RESUME_NONE || r->m_num_bits >= TINFL_BITBUF_SIZE || r->m_bit_buf >> r->m_num_bits)
+        return -1;
+
+    // Check the fields each resume point reads, clearing those that it
+    // overwrites first. Points that wait for input hold fewer bits than
+    // the code or extra bits they are reading
+    mz_uint32 dist = r->m_dist;
+    mz_uint32 num_extra = r->m_num_extra;
+    size_t dist_from_out_buf_start = r->m_dist_from_out_buf_start;
+    r->m_dist = r->m_num_extra = 0;
+    r->m_dist_from_out_buf_start = 0;
+
+    bool valid = false;
+    switch (r->m_state)
+    {
+        case 9: case 38: case 51:
+            // Copying the rest of a stored block
+            valid = r->m_counter <= 0xFFFF && (r->m_state == 9 || r->m_num_bits < 8);
+            break;
+        case 52:
+            // Writing one byte of a stored block held in dist
+            r->m_dist = dist;
+            valid = r->m_counter <= 0xFFFF && dist <= 0xFF;
+            break;
+        case 23:
+            // Decoding a literal or length
+            r->m_counter = 0;
+            valid = r->m_num_bits < 15;
+            break;
+        case 24:
+            // Writing a literal held in counter
+            valid = r->m_counter < 256;
+            break;
+        case 25:
+            // Reading the extra bits of a length
+            r->m_num_extra = num_extra;
+            valid = r->m_counter <= MAX_MATCH && r->m_num_bits < num_extra && num_extra <= 5;
+            break;
+        case 26:
+            // Decoding a distance
+            valid = r->m_counter <= MAX_MATCH && r->m_num_bits < 15;
+            break;
+        case 27:
+            // Reading the extra bits of a distance
+            r->m_dist = dist;
+            r->m_num_extra = num_extra;
+            valid = r->m_counter <= MAX_MATCH && dist <= TINFL_LZ_DICT_SIZE && r->m_num_bits < num_extra && num_extra <= 13;
+            break;
+        case 53:
+            // Copying the rest of a match
+            r->m_dist = dist;
+            r->m_dist_from_out_buf_start = dist_from_out_buf_start;
+            valid = r->m_counter < MAX_MATCH && dist <= TINFL_LZ_DICT_SIZE &&
+                dist_from_out_buf_start <= TINFL_LZ_DICT_SIZE + MAX_MATCH;
+            break;
+    }
+
+    r->m_z_adler32 = 1;
+    if (!valid)
+        return -1;
+
+    if (kind == RESUME_STORED)
+    {
+        r->m_type = 0;
+        return 0;
+    }
+
+    if (r->m_table_sizes[0] < 257 || r->m_table_sizes[0] > TINFL_MAX_HUFF_SYMBOLS_0 ||
+        r->m_table_sizes[1] < 1 || r->m_table_sizes[1] > TINFL_MAX_HUFF_SYMBOLS_1)
+        return -1;
+
+    // Decoding a huffman block leaves the table counter past the first table
+    r->m_type = (mz_uint32)-1;
+    memcpy(r->m_tables[0].m_code_size, p, TINFL_MAX_HUFF_SYMBOLS_0);
+    memcpy(r->m_tables[1].m_code_size, p + TINFL_MAX_HUFF_SYMBOLS_0, TINFL_MAX_HUFF_SYMBOLS_1);
+    for (int t = 0; t < 2; t++)
+    {
+        tinfl_huff_table *table = &r->m_tables[t];
+        for (mz_uint32 i = 0; i < r->m_table_sizes[t]; i++)
+            if (table->m_code_size[i] > 15)
+                return -1;
+
+        if (!tinfl_build_huff_table(table, r->m_table_sizes[t]))
+            return -1;
+    }
+    return 0;
+}
+
+//
+// Write the checkpoints saved so far to a sidecar index, with the state
+// and window of each checkpoint compressed
+// Returns 0 on success, or -1 on error
+//
+int dat2checkpoints_save(dat2reader *reader, const char *path)
+{
+    dat2checkpoints *checkpoints = reader->checkpoints;
+    if (!checkpoints)
+        return -1;
+
+    uint8_t *record = malloc(RECORD_SIZE);
+    uint8_t *packed = malloc(zlib_bound(RECORD_SIZE));
+    if (!record || !packed)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(record);
+        free(packed);
+        return -1;
+    }
+
+    int status = -1;
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        goto open_error;
+    }
+
+    pthread_mutex_lock(&checkpoints->lock);
+    uint32_t entry_count = 0;
+    for (uint32_t i = 0; i < checkpoints->entry_count; i++)
+        entry_count += checkpoints->lists[i].count != 0;
+
+    uint8_t header[DAT2CHECKPOINT_HEADER_SIZE];
+    memcpy(header, DAT2CHECKPOINT_MAGIC, DAT2CHECKPOINT_MAGIC_SIZE);
+    put_le32(header + 8, DAT2CHECKPOINT_VERSION);
+    put_le32(header + 12, checkpoints->span);
+    put_le32(header + 16, entry_count);
+    put_le32(header + 20, TINFL_BITBUF_SIZE);
+    fwrite(header, sizeof(header), 1, file);
+
+    for (uint32_t i = 0; i < checkpoints->entry_count; i++)
+    {
+        dat2checkpoint_list *list = &checkpoints->lists[i];
+        if (!list->count)
+            continue;
+
+        dat2entry *entry = &reader->entries[i];
+        uint32_t name_length = strlen(entry->filename);
+        uint8_t fields[24];
+        put_le32(fields, name_length);
+        fwrite(fields, 4, 1, file);
+        fwrite(entry->filename, 1, name_length, file);
+        put_le64(fields, entry->offset);
+        put_le32(fields + 8, entry->compressed_size);
+        put_le32(fields + 12, entry->uncompressed_size);
+        put_le32(fields + 16, list->count);
+        fwrite(fields, 20, 1, file);
+
+        for (uint32_t j = 0; j < list->count; j++)
+        {
+            const dat2checkpoint *checkpoint = list->checkpoints[j];
+            put_state(record, &checkpoint->decompressor);
+            memcpy(record + STATE_SIZE, checkpoint->window, TINFL_LZ_DICT_SIZE);
+            size_t packed_size = zlib_compress(packed, zlib_bound(RECORD_SIZE), record, RECORD_SIZE, DEFLATE_LEVEL_FAST);
+
+            put_le32(fields, checkpoint->output);
+            put_le32(fields + 4, checkpoint->input);
+            put_le32(fields + 8, checkpoint->window_offset);
+            put_le32(fields + 12, checkpoint->status);
+            put_le32(fields + 16, packed_size);
+            fwrite(fields, 20, 1, file);
+            fwrite(packed, 1, packed_size, file);
+        }
+    }
+    pthread_mutex_unlock(&checkpoints->lock);
+
+    status = ferror(file) ? -1 : 0;
+    if (fclose(file))
+        status = -1;
+    if (status)
+        fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+
+open_error:
+    free(packed);
+    free(record);
+    return status;
+}
+
+//
+// Read one checkpoint of an entry from a sidecar index
+// Returns the checkpoint, or NULL if it is invalid
+//
+static dat2checkpoint *load_checkpoint(dat2entry *entry, const uint8_t **p, const uint8_t *end, uint8_t *record)
+{
+    if (end - *p < 20)
+        return NULL;
+
+    uint32_t packed_size = get_le32(*p + 16);
+    const uint8_t *packed = *p + 20;
+    if ((size_t)(end - packed) < packed_size)
+        return NULL;
+
+    dat2checkpoint *checkpoint = malloc(sizeof(dat2checkpoint));
+    if (!checkpoint)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    checkpoint->output = get_le32(*p);
+    checkpoint->input = get_le32(*p + 4);
+    checkpoint->window_offset = get_le32(*p + 8);
+    checkpoint->status = (tinfl_status)get_le32(*p + 12);
+    *p = packed + packed_size;
+
+    if (checkpoint->output > entry->uncompressed_size || checkpoint->input > entry->compressed_size ||
+        checkpoint->window_offset >= TINFL_LZ_DICT_SIZE || checkpoint->status < TINFL_STATUS_DONE ||
+        checkpoint->status > TINFL_STATUS_HAS_MORE_OUTPUT ||
+        tinfl_decompress_mem_to_mem(record, RECORD_SIZE, packed, packed_size, TINFL_FLAG_PARSE_ZLIB_HEADER) != RECORD_SIZE ||
+        get_state(record, &checkpoint->decompressor))
+    {
+        free(checkpoint);
+        return NULL;
+    }
+
+    memcpy(checkpoint->window, record + STATE_SIZE, TINFL_LZ_DICT_SIZE);
+    return checkpoint;
+}
+
+//
+// Replace the checkpoints of a reader with those in a sidecar index.
+// Entries whose name, position or sizes no longer match the archive
+// are skipped, and their checkpoints are rebuilt on first access
+// Returns 0 on success, or -1 on error
+//
+int dat2checkpoints_load(dat2reader *reader, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    uint8_t *data = NULL;
+    uint8_t *record = malloc(RECORD_SIZE);
+    long size;
+    if (!record || fseek(file, 0, SEEK_END) || (size = ftell(file)) < DAT2CHECKPOINT_HEADER_SIZE || fseek(file, 0, SEEK_SET))
+        goto format_error;
+
+    data = malloc(size);
+    if (!data || fread(data, 1, size, file) != (size_t)size ||
+        memcmp(data, DAT2CHECKPOINT_MAGIC, DAT2CHECKPOINT_MAGIC_SIZE) || get_le32(data + 8) != DAT2CHECKPOINT_VERSION ||
+        get_le32(data + 20) != TINFL_BITBUF_SIZE || dat2reader_enable_checkpoints(reader, get_le32(data + 12)))
+        goto format_error;
+
+    dat2checkpoints *checkpoints = reader->checkpoints;
+    uint32_t entry_count = get_le32(data + 16);
+    const uint8_t *p = data + DAT2CHECKPOINT_HEADER_SIZE;
+    const uint8_t *end = data + size;
+    for (uint32_t i = 0; i < entry_count; i++)
+    {
+        if (end - p < 4 || (size_t)(end - p - 4) < get_le32(p) || (size_t)(end - p - 4) - get_le32(p) < 20)
+            goto format_error;
+
+        uint32_t name_length = get_le32(p);
+        dat2entry *entry = dat2reader_find_entry_length(reader, (const char *)p + 4, name_length);
+        p += 4 + name_length;
+        uint32_t count = get_le32(p + 16);
+        bool matches = entry && eligible(entry, checkpoints->span) && get_le64(p) == entry->offset &&
+            get_le32(p + 8) == entry->compressed_size && get_le32(p + 12) == entry->uncompressed_size;
+        p += 20;
+
+        for (uint32_t j = 0; j < count; j++)
+        {
+            if (!matches)
+            {
+                // Skip over the checkpoints of a stale entry
+                if (end - p < 20 || (size_t)(end - p - 20) < get_le32(p + 16))
+                    goto format_error;
+                p += 20 + get_le32(p + 16);
+                continue;
+            }
+
+            dat2checkpoint *checkpoint = load_checkpoint(entry, &p, end, record);
+            if (!checkpoint)
+                goto format_error;
+            if (!dat2checkpoints_due(entry, checkpoint->output))
+            {
+                free(checkpoint);
+                goto format_error;
+            }
+            dat2checkpoints_add(entry, checkpoint);
+        }
+    }
+
+    free(record);
+    free(data);
+    fclose(file);
+    return 0;
+
+format_error:
+    fprintf(stderr, "Error: %s is not a valid checkpoint index\n", path);
+    dat2checkpoints_free(reader->checkpoints);
+    reader->checkpoints = NULL;
+    free(record);
+    free(data);
+    fclose(file);
+    return -1;
+}
@@ -0,0 +1,97 @@
+/*
+ * dat2checkpoint.h
+ * Inflate checkpoints for random access into compressed entries
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _dat2checkpoint_h
+#define _dat2checkpoint_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "dat2reader.h"
+#include "tinfl.h"
+
+// A checkpoint holds the inflate state and the 32KB window of a
+// compressed entry, so a stream can resume from it instead of inflating
+// from the start. Streams save one every span bytes of output the first
+// time they pass that point within the data of a block, so a seek
+// inflates at most about one span. Indexes store only the fields of the
+// state that such points read, and the code sizes its tables are built from.
+//
+// A sidecar index starts with the magic, version, span, the number of
+// entries and the size of the inflate bit buffer. Each entry then has its
+// name length and name, offset, compressed and uncompressed sizes and
+// checkpoint count, and each checkpoint its output and input positions,
+// window offset, inflate status and the zlib-compressed length of its
+// state and window, followed by that data. All values are little-endian
+#define DAT2CHECKPOINT_MAGIC "DAT2CKP\x1A"
+#define DAT2CHECKPOINT_MAGIC_SIZE 8
+#define DAT2CHECKPOINT_VERSION 2
+#define DAT2CHECKPOINT_HEADER_SIZE 24
+#define DAT2CHECKPOINT_DEFAULT_SPAN (1024*1024)
+#define DAT2CHECKPOINT_MIN_SPAN (64*1024)
+
+typedef struct
+{
+    uint32_t output;
+    uint32_t input;
+    uint32_t window_offset;
+    tinfl_status status;
+    tinfl_decompressor decompressor;
+    uint8_t window[TINFL_LZ_DICT_SIZE];
+} dat2checkpoint;
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t capacity;
+    dat2checkpoint **checkpoints;
+} dat2checkpoint_list;
+
+typedef struct dat2checkpoints
+{
+    uint32_t span;
+    pthread_mutex_t lock;
+    uint32_t entry_count;
+
+    // Checkpoints of each entry in output order, indexed like reader->entries
+    dat2checkpoint_list *lists;
+} dat2checkpoints;
+
+int dat2reader_enable_checkpoints(dat2reader *reader, uint32_t span);
+void dat2checkpoints_free(dat2checkpoints *checkpoints);
+
+bool dat2checkpoints_due(dat2entry *entry, uint64_t output);
+void dat2checkpoints_add(dat2entry *entry, dat2checkpoint *checkpoint);
+const dat2checkpoint *dat2checkpoints_find(dat2entry *entry, uint64_t position);
+bool dat2checkpoints_resumable(const tinfl_decompressor *decompressor);
+
+size_t dat2checkpoints_build(dat2reader *reader, unsigned threads);
+int dat2checkpoints_load(dat2reader *reader, const char *path);
+int dat2checkpoints_save(dat2reader *reader, const char *path);
+
+#endif
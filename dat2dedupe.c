@@ -0,0 +1,287 @@
+/*
+ * dat2dedupe.c
+ * Finds byte-identical entries across .dat files
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "dat2dedupe.h"
+#include "dat2pool.h"
+#include "dat2scheduler.h"
+#include "checksum.h"
+
+typedef struct
+{
+    dat2reader **readers;
+    size_t reader_count;
+    size_t *reader_base;
+    dat2dedupe_item *items;
+} hash_context;
+
+static int hash_entry(dat2entry *entry, void *user)
+{
+    hash_context *context = user;
+    size_t r = 0;
+    while (context->readers[r] != entry->reader)
+        r++;
+
+    dat2dedupe_item *item = &context->items[context->reader_base[r] + (entry - entry->reader->entries)];
+
+    dat2pool *pool = dat2pool_thread();
+    uint8_t *data = pool ? dat2pool_acquire(pool, entry->uncompressed_size) : NULL;
+    if (!data)
+        return 1;
+
+    if (dat2entry_extract_into(entry, data, entry->uncompressed_size) == 0)
+    {
+        item->hash = hash64(data, entry->uncompressed_size, 0);
+        item->valid = true;
+    }
+
+    dat2pool_release(pool, data);
+    return !item->valid;
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    const dat2dedupe_item *ia = a;
+    const dat2dedupe_item *ib = b;
+    if (ia->valid != ib->valid)
+        return ia->valid ? -1 : 1;
+    if (ia->entry->uncompressed_size != ib->entry->uncompressed_size)
+        return ia->entry->uncompressed_size < ib->entry->uncompressed_size ? -1 : 1;
+    if (ia->hash != ib->hash)
+        return ia->hash < ib->hash ? -1 : 1;
+
+    // Keep the original archive order within a group
+    // so that the first item is the earliest copy
+    return ia->position < ib->position ? -1 : ia->position > ib->position;
+}
+
+//
+// Hash the uncompressed content of every entry in a set of archives
+// in parallel, and group entries with identical content
+// Entries that fail to extract are reported and left out of the groups
+// Returns NULL on error
+//
+dat2dedupe *dat2dedupe_build(dat2reader **readers, size_t reader_count, unsigned threads)
+{
+    dat2dedupe *dedupe = calloc(1, sizeof(dat2dedupe));
+    if (!dedupe)
+        return NULL;
+
+    hash_context context = { readers, reader_count, NULL, NULL };
+    context.reader_base = malloc(reader_count*sizeof(size_t));
+    if (!context.reader_base)
+        goto error;
+
+    for (size_t r = 0; r < reader_count; r++)
+    {
+        context.reader_base[r] = dedupe->item_count;
+        dedupe->item_count += readers[r]->entry_count;
+    }
+
+    dat2entry **entries = malloc(dedupe->item_count*sizeof(dat2entry *));
+    dedupe->items = calloc(dedupe->item_count, sizeof(dat2dedupe_item));
+    if (!entries || !dedupe->items)
+    {
+        free(entries);
+        goto error;
+    }
+
+    for (size_t r = 0; r < reader_count; r++)
+        for (uint32_t i = 0; i < readers[r]->entry_count; i++)
+        {
+            size_t position = context.reader_base[r] + i;
+            entries[position] = &readers[r]->entries[i];
+            dedupe->items[position].entry = entries[position];
+            dedupe->items[position].position = position;
+        }
+
+    context.items = dedupe->items;
+    size_t failed = dat2scheduler_run(entries, dedupe->item_count, hash_entry, &context, threads);
+    free(entries);
+    if (failed)
+        fprintf(stderr, "Failed to hash %zu files\n", failed);
+
+    qsort(dedupe->items, dedupe->item_count, sizeof(dat2dedupe_item), compare_items);
+
+    // Each run of equal size and hash starts a group
+    dedupe->group_start = malloc((dedupe->item_count + 1)*sizeof(size_t));
+    if (!dedupe->group_start)
+        goto error;
+
+    for (size_t i = 0; i < dedupe->item_count && dedupe->items[i].valid; i++)
+    {
+        dat2dedupe_item *item = &dedupe->items[i];
+        if (i == 0 || item->hash != item[-1].hash ||
+            item->entry->uncompressed_size != item[-1].entry->uncompressed_size)
+            dedupe->group_start[dedupe->group_count++] = i;
+    }
+    dedupe->group_start[dedupe->group_count] = dedupe->item_count - failed;
+
+    free(context.reader_base);
+    return dedupe;
+
+error:
+    fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+    free(context.reader_base);
+    dat2dedupe_free(dedupe);
+    return NULL;
+}
+
+void dat2dedupe_free(dat2dedupe *dedupe)
+{
+    free(dedupe->items);
+    free(dedupe->group_start);
+    free(dedupe);
+}
+
+//
+// Number of entries sharing the content of a group
+//
+size_t dat2dedupe_group_size(dat2dedupe *dedupe, size_t group)
+{
+    return dedupe->group_start[group + 1] - dedupe->group_start[group];
+}
+
+//
+// Build the content-addressed name of an object from its hash and size
+//
+static void object_name(char *name, size_t length, uint64_t hash, uint32_t size)
+{
+    snprintf(name, length, "%02x/%016llx-%u", (unsigned)(hash >> 56), (unsigned long long)hash, size);
+}
+
+static int export_entry(dat2entry *entry, void *user)
+{
+    const char *root = user;
+
+    dat2pool *pool = dat2pool_thread();
+    uint8_t *data = pool ? dat2pool_acquire(pool, entry->uncompressed_size) : NULL;
+    if (!data)
+        return 1;
+
+    int status = 1;
+    if (dat2entry_extract_into(entry, data, entry->uncompressed_size))
+        goto extract_error;
+
+    // Hashing again is cheap next to the inflate, and avoids
+    // having to map entries back to their group
+    char name[64];
+    object_name(name, sizeof(name), hash64(data, entry->uncompressed_size, 0), entry->uncompressed_size);
+
+    size_t length = strlen(root) + strlen(name) + 2;
+    char *path = malloc(length);
+    if (!path)
+        goto extract_error;
+    snprintf(path, length, "%s/%s", root, name);
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        goto fopen_error;
+    }
+
+    if (fwrite(data, sizeof(uint8_t), entry->uncompressed_size, file) == entry->uncompressed_size)
+        status = 0;
+    if (fclose(file))
+        status = 1;
+
+fopen_error:
+    free(path);
+extract_error:
+    dat2pool_release(pool, data);
+    return status;
+}
+
+//
+// Write one copy of every unique entry into a content-addressed layout
+// (path/<first byte of hash>/<hash>-<size>) in parallel, followed by
+// a manifest mapping each archive entry to its object
+// Returns 0 on success, or -1 on error
+//
+int dat2dedupe_export(dat2dedupe *dedupe, const char *path, unsigned threads)
+{
+    size_t length = strlen(path) + 32;
+    char *dir = malloc(length);
+    dat2entry **entries = malloc(dedupe->group_count*sizeof(dat2entry *));
+    if (!dir || !entries)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(dir);
+        free(entries);
+        return -1;
+    }
+
+    int status = -1;
+    mkdir(path, 0755);
+    for (unsigned i = 0; i < 256; i++)
+    {
+        snprintf(dir, length, "%s/%02x", path, i);
+        if (mkdir(dir, 0755) && errno != EEXIST)
+        {
+            fprintf(stderr, "Error creating %s: %s\n", dir, strerror(errno));
+            goto error;
+        }
+    }
+
+    for (size_t g = 0; g < dedupe->group_count; g++)
+        entries[g] = dedupe->items[dedupe->group_start[g]].entry;
+
+    size_t failed = dat2scheduler_run(entries, dedupe->group_count, export_entry, (void *)path, threads);
+    if (failed)
+    {
+        fprintf(stderr, "Failed to export %zu objects\n", failed);
+        goto error;
+    }
+
+    snprintf(dir, length, "%s/manifest.txt", path);
+    FILE *manifest = fopen(dir, "w");
+    if (!manifest)
+    {
+        fprintf(stderr, "Error creating %s: %s\n", dir, strerror(errno));
+        goto error;
+    }
+
+    for (size_t i = 0; i < dedupe->group_start[dedupe->group_count]; i++)
+    {
+        dat2dedupe_item *item = &dedupe->items[i];
+        char name[64];
+        object_name(name, sizeof(name), item->hash, item->entry->uncompressed_size);
+        fprintf(manifest, "%s\t%s\t%s\n", name, item->entry->reader->path, item->entry->filename);
+    }
+
+    status = fclose(manifest) ? -1 : 0;
+
+error:
+    free(entries);
+    free(dir);
+    return status;
+}
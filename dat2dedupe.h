@@ -0,0 +1,61 @@
+/*
+ * dat2dedupe.h
+ * Finds byte-identical entries across .dat files
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _dat2dedupe_h
+#define _dat2dedupe_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dat2reader.h"
+
+typedef struct
+{
+    dat2entry *entry;
+    uint64_t hash;
+    bool valid;
+
+    // Index of the entry across all archives, in the order they were given
+    size_t position;
+} dat2dedupe_item;
+
+// Items are sorted so that entries with identical content are adjacent.
+// Each group is a run of items with matching size and hash
+typedef struct
+{
+    size_t item_count;
+    dat2dedupe_item *items;
+    size_t group_count;
+    size_t *group_start;
+} dat2dedupe;
+
+dat2dedupe *dat2dedupe_build(dat2reader **readers, size_t reader_count, unsigned threads);
+void dat2dedupe_free(dat2dedupe *dedupe);
+size_t dat2dedupe_group_size(dat2dedupe *dedupe, size_t group);
+int dat2dedupe_export(dat2dedupe *dedupe, const char *path, unsigned threads);
+
+#endif
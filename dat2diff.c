@@ -0,0 +1,254 @@
+/*
+ * dat2diff.c
+ * Compares the entries of two .dat archives
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "dat2diff.h"
+#include "dat2pool.h"
+#include "dat2scheduler.h"
+#include "dat2writer.h"
+
+// Raw entry data is compared in blocks of this size
+#define DAT2DIFF_BLOCK_SIZE 65536
+
+//
+// Compare the stored bytes of two entries with the same encoding
+// Returns 1 if they are identical, 0 if not, or -1 on error
+//
+static int compare_raw(dat2entry *a, dat2entry *b, uint8_t *buffer)
+{
+    uint8_t *a_block = buffer;
+    uint8_t *b_block = buffer + DAT2DIFF_BLOCK_SIZE;
+    for (uint32_t done = 0; done < a->compressed_size;)
+    {
+        size_t length = a->compressed_size - done < DAT2DIFF_BLOCK_SIZE ? a->compressed_size - done : DAT2DIFF_BLOCK_SIZE;
+        if (dat2reader_read_at(a->reader, a_block, length, a->offset + done) != length ||
+            dat2reader_read_at(b->reader, b_block, length, b->offset + done) != length)
+            return -1;
+
+        if (memcmp(a_block, b_block, length))
+            return 0;
+        done += length;
+    }
+    return 1;
+}
+
+//
+// Compare the uncompressed content of two entries of equal size
+// Returns 1 if they are identical, 0 if not, or -1 on error
+//
+static int compare_content(dat2entry *a, dat2entry *b)
+{
+    dat2pool *pool = dat2pool_thread();
+    if (!pool)
+        return -1;
+
+    int status = -1;
+    uint8_t *a_data = dat2pool_acquire(pool, a->uncompressed_size);
+    uint8_t *b_data = dat2pool_acquire(pool, b->uncompressed_size);
+    if (a_data && b_data && dat2entry_extract_into(a, a_data, a->uncompressed_size) == 0 &&
+        dat2entry_extract_into(b, b_data, b->uncompressed_size) == 0)
+        status = memcmp(a_data, b_data, a->uncompressed_size) == 0;
+
+    dat2pool_release(pool, a_data);
+    dat2pool_release(pool, b_data);
+    return status;
+}
+
+typedef struct
+{
+    dat2diff_item *items;
+    size_t *pending;
+} compare_job;
+
+//
+// Decide whether an entry present in both archives with the same
+// uncompressed size has changed. Identically encoded entries are
+// compared byte for byte without inflating, which settles stored
+// entries and unchanged compressed ones. Anything else is inflated
+//
+static int compare_item(size_t index, void *user)
+{
+    compare_job *job = user;
+    dat2diff_item *item = &job->items[job->pending[index]];
+    dat2entry *a = item->old_entry;
+    dat2entry *b = item->new_entry;
+
+    int same = -1;
+    bool inflate = true;
+    item->method = DAT2DIFF_BY_RAW;
+    if (a->compressed == b->compressed && a->compressed_size == b->compressed_size &&
+        (!a->compressed || (a->reader->blocks == NULL) == (b->reader->blocks == NULL)))
+    {
+        uint8_t *buffer = malloc(2*DAT2DIFF_BLOCK_SIZE);
+        if (!buffer)
+        {
+            fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+            item->status = DAT2DIFF_FAILED;
+            return 1;
+        }
+
+        same = compare_raw(a, b, buffer);
+        free(buffer);
+
+        // Different deflate streams can still hold the same content
+        inflate = same == 0 && a->compressed;
+    }
+
+    if (inflate)
+    {
+        item->method = DAT2DIFF_BY_CONTENT;
+        same = compare_content(a, b);
+    }
+
+    if (same < 0)
+    {
+        fprintf(stderr, "%s: unable to compare\n", b->filename);
+        item->status = DAT2DIFF_FAILED;
+        return 1;
+    }
+
+    item->status = same ? DAT2DIFF_UNCHANGED : DAT2DIFF_CHANGED;
+    return 0;
+}
+
+//
+// Match the entries of two archives by name. Entries whose sizes
+// differ are changed without reading them; only entries of equal size
+// are read, in parallel, to decide whether their content changed
+// Returns NULL on error
+//
+dat2diff *dat2diff_build(dat2reader *old_reader, dat2reader *new_reader, unsigned threads)
+{
+    dat2diff *diff = calloc(1, sizeof(dat2diff));
+    if (!diff)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    size_t capacity = (size_t)old_reader->entry_count + new_reader->entry_count;
+    diff->items = calloc(capacity ? capacity : 1, sizeof(dat2diff_item));
+    bool *matched = calloc(old_reader->entry_count ? old_reader->entry_count : 1, sizeof(bool));
+    size_t *pending = malloc((new_reader->entry_count ? new_reader->entry_count : 1)*sizeof(size_t));
+    uint64_t *costs = malloc((new_reader->entry_count ? new_reader->entry_count : 1)*sizeof(uint64_t));
+    if (!diff->items || !matched || !pending || !costs)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto error;
+    }
+
+    size_t pending_count = 0;
+    for (uint32_t i = 0; i < new_reader->entry_count; i++)
+    {
+        dat2diff_item *item = &diff->items[diff->item_count++];
+        item->new_entry = &new_reader->entries[i];
+        item->old_entry = dat2reader_find_entry(old_reader, item->new_entry->filename);
+        if (!item->old_entry)
+        {
+            item->status = DAT2DIFF_ADDED;
+            continue;
+        }
+
+        matched[item->old_entry - old_reader->entries] = true;
+        if (item->old_entry->uncompressed_size != item->new_entry->uncompressed_size)
+        {
+            item->status = DAT2DIFF_CHANGED;
+            item->method = DAT2DIFF_BY_SIZE;
+            continue;
+        }
+
+        costs[pending_count] = dat2scheduler_entry_cost(item->old_entry) + dat2scheduler_entry_cost(item->new_entry);
+        pending[pending_count++] = diff->item_count - 1;
+    }
+
+    for (uint32_t i = 0; i < old_reader->entry_count; i++)
+    {
+        if (matched[i])
+            continue;
+
+        dat2diff_item *item = &diff->items[diff->item_count++];
+        item->old_entry = &old_reader->entries[i];
+        item->status = DAT2DIFF_REMOVED;
+    }
+
+    compare_job job = { diff->items, pending };
+    dat2scheduler_run_tasks(pending_count, costs, compare_item, &job, threads);
+
+    for (size_t i = 0; i < diff->item_count; i++)
+    {
+        dat2diff_item *item = &diff->items[i];
+        diff->counts[item->status]++;
+        if (item->old_entry && item->new_entry && item->status != DAT2DIFF_FAILED)
+            diff->methods[item->method]++;
+    }
+
+    free(costs);
+    free(pending);
+    free(matched);
+    return diff;
+
+error:
+    free(costs);
+    free(pending);
+    free(matched);
+    dat2diff_free(diff);
+    return NULL;
+}
+
+void dat2diff_free(dat2diff *diff)
+{
+    free(diff->items);
+    free(diff);
+}
+
+//
+// Write an archive holding only the added and changed entries, copied
+// from the new archive without recompressing. DAT2 has no way to
+// delete entries, so removals are left to the caller to report
+// Returns 0 on success, or -1 on error
+//
+int dat2diff_write_patch(dat2diff *diff, const char *path)
+{
+    dat2writer *writer = dat2writer_create(path, false);
+    if (!writer)
+        return -1;
+
+    for (size_t i = 0; i < diff->item_count; i++)
+    {
+        dat2diff_item *item = &diff->items[i];
+        if (item->status != DAT2DIFF_ADDED && item->status != DAT2DIFF_CHANGED)
+            continue;
+
+        if (dat2writer_copy_entry(writer, item->new_entry, NULL))
+            break;
+    }
+
+    return dat2writer_close(writer);
+}
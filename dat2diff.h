@@ -0,0 +1,77 @@
+/*
+ * dat2diff.h
+ * Compares the entries of two .dat archives
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _dat2diff_h
+#define _dat2diff_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dat2reader.h"
+
+typedef enum
+{
+    DAT2DIFF_UNCHANGED,
+    DAT2DIFF_ADDED,
+    DAT2DIFF_REMOVED,
+    DAT2DIFF_CHANGED,
+    DAT2DIFF_FAILED,
+} dat2diff_status;
+
+// How an entry present in both archives was classified
+typedef enum
+{
+    DAT2DIFF_BY_SIZE,       // Uncompressed sizes differ
+    DAT2DIFF_BY_RAW,        // Identical encodings, compared without inflating
+    DAT2DIFF_BY_CONTENT,    // Different encodings, compared after inflating
+} dat2diff_method;
+
+typedef struct
+{
+    dat2diff_status status;
+    dat2diff_method method;
+    dat2entry *old_entry;
+    dat2entry *new_entry;
+} dat2diff_item;
+
+// Items for the new archive's entries in its directory order,
+// followed by the entries only present in the old archive
+typedef struct
+{
+    size_t item_count;
+    dat2diff_item *items;
+    size_t counts[DAT2DIFF_FAILED + 1];
+
+    // Entries in both archives, by how they were classified
+    size_t methods[DAT2DIFF_BY_CONTENT + 1];
+} dat2diff;
+
+dat2diff *dat2diff_build(dat2reader *old_reader, dat2reader *new_reader, unsigned threads);
+void dat2diff_free(dat2diff *diff);
+int dat2diff_write_patch(dat2diff *diff, const char *path);
+
+#endif
@@ -0,0 +1,434 @@
+/*
+ * dat2mount.c
+ * Mounts a .dat archive as a read-only FUSE filesystem
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse.h>
+#include "dat2reader.h"
+#include "dat2stream.h"
+#include "dat2checkpoint.h"
+#include "checksum.h"
+
+typedef struct
+{
+    // Archive path of the directory using '\' separators, "" for the root
+    char *path;
+    uint32_t subdirectory_count;
+    uint32_t subdirectory_capacity;
+    uint32_t *subdirectories;
+    uint32_t entry_count;
+    uint32_t entry_capacity;
+    dat2entry **entries;
+} mount_directory;
+
+typedef struct
+{
+    dat2reader *reader;
+    struct stat archive_stat;
+
+    // Directories are found through a hash table of their paths, in the
+    // same way as dat2reader_find_entry finds files
+    uint32_t directory_count;
+    uint32_t directory_capacity;
+    mount_directory *directories;
+    uint32_t *index;
+    uint32_t index_mask;
+} mount_tree;
+
+// Compressed entries keep an inflate stream between reads, so that
+// sequential reads continue where the previous one stopped
+typedef struct
+{
+    dat2entry *entry;
+    pthread_mutex_t lock;
+    dat2stream *stream;
+} mount_handle;
+
+static mount_tree *get_tree(void)
+{
+    return fuse_get_context()->private_data;
+}
+
+static uint32_t find_directory(mount_tree *tree, const char *path, size_t length)
+{
+    uint32_t slot = hash64((const uint8_t *)path, length, 0) & tree->index_mask;
+    for (; tree->index[slot]; slot = (slot + 1) & tree->index_mask)
+    {
+        mount_directory *directory = &tree->directories[tree->index[slot] - 1];
+        if (strlen(directory->path) == length && memcmp(directory->path, path, length) == 0)
+            return tree->index[slot];
+    }
+    return 0;
+}
+
+//
+// Make room for one more item in an array
+// Returns the (possibly moved) array, or NULL on error
+//
+static void *reserve_item(void *items, uint32_t count, uint32_t *capacity, size_t size)
+{
+    if (count < *capacity)
+        return items;
+
+    uint32_t grown = *capacity ? 2*(*capacity) : 8;
+    void *resized = realloc(items, grown*size);
+    if (!resized)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    *capacity = grown;
+    return resized;
+}
+
+//
+// Find a directory by path, adding it and any missing parents
+// Returns the directory number (index + 1), or 0 on error
+//
+static uint32_t add_directory(mount_tree *tree, const char *path, size_t length)
+{
+    uint32_t found = find_directory(tree, path, length);
+    if (found)
+        return found;
+
+    const char *separator = length ? memrchr(path, '\\', length) : NULL;
+    uint32_t parent = length ? add_directory(tree, path, separator ? (size_t)(separator - path) : 0) : 0;
+    if (length && !parent)
+        return 0;
+
+    mount_directory *directories = reserve_item(tree->directories, tree->directory_count, &tree->directory_capacity,
+        sizeof(mount_directory));
+    if (!directories)
+        return 0;
+    tree->directories = directories;
+
+    mount_directory *directory = &tree->directories[tree->directory_count];
+    memset(directory, 0, sizeof(mount_directory));
+    directory->path = strndup(path, length);
+    if (!directory->path)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return 0;
+    }
+    uint32_t number = ++tree->directory_count;
+
+    uint32_t slot = hash64((const uint8_t *)path, length, 0) & tree->index_mask;
+    while (tree->index[slot])
+        slot = (slot + 1) & tree->index_mask;
+    tree->index[slot] = number;
+
+    if (parent)
+    {
+        mount_directory *p = &tree->directories[parent - 1];
+        uint32_t *subdirectories = reserve_item(p->subdirectories, p->subdirectory_count, &p->subdirectory_capacity,
+            sizeof(uint32_t));
+        if (!subdirectories)
+            return 0;
+        p->subdirectories = subdirectories;
+        p->subdirectories[p->subdirectory_count++] = number;
+    }
+    return number;
+}
+
+static void free_tree(mount_tree *tree)
+{
+    for (uint32_t i = 0; i < tree->directory_count; i++)
+    {
+        free(tree->directories[i].path);
+        free(tree->directories[i].subdirectories);
+        free(tree->directories[i].entries);
+    }
+    free(tree->directories);
+    free(tree->index);
+    free(tree);
+}
+
+//
+// Build the directory tree implied by the archive's file names
+// Returns NULL on error
+//
+static mount_tree *build_tree(dat2reader *reader)
+{
+    mount_tree *tree = calloc(1, sizeof(mount_tree));
+    if (!tree)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    // Every directory holds at least one file, so there can be no more
+    // directories than path components in the archive
+    uint64_t components = 1;
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+        for (const char *c = reader->entries[i].filename; *c; c++)
+            components += *c == '\\';
+
+    uint32_t slots = 16;
+    while (slots < 2*components)
+        slots *= 2;
+
+    tree->reader = reader;
+    tree->index_mask = slots - 1;
+    tree->index = calloc(slots, sizeof(uint32_t));
+    if (!tree->index || fstat(fileno(reader->file), &tree->archive_stat) || !add_directory(tree, "", 0))
+        goto error;
+
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+    {
+        dat2entry *entry = &reader->entries[i];
+        const char *separator = strrchr(entry->filename, '\\');
+        uint32_t number = add_directory(tree, entry->filename, separator ? (size_t)(separator - entry->filename) : 0);
+        if (!number)
+            goto error;
+
+        mount_directory *directory = &tree->directories[number - 1];
+        dat2entry **entries = reserve_item(directory->entries, directory->entry_count, &directory->entry_capacity,
+            sizeof(dat2entry *));
+        if (!entries)
+            goto error;
+        directory->entries = entries;
+        directory->entries[directory->entry_count++] = entry;
+    }
+
+    return tree;
+
+error:
+    free_tree(tree);
+    return NULL;
+}
+
+//
+// Convert a mount path to an archive path: drop the leading '/' and
+// replace the remaining separators with '\'
+// Returns 0 on success, or -ENAMETOOLONG
+//
+static int archive_path(const char *path, char *out, size_t size)
+{
+    while (*path == '/')
+        path++;
+
+    size_t length = strlen(path);
+    if (length >= size)
+        return -ENAMETOOLONG;
+
+    for (size_t i = 0; i <= length; i++)
+        out[i] = path[i] == '/' ? '\\' : path[i];
+    return 0;
+}
+
+static const char *base_name(const char *path)
+{
+    const char *separator = strrchr(path, '\\');
+    return separator ? separator + 1 : path;
+}
+
+static int mount_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    mount_tree *tree = get_tree();
+    char name[PATH_MAX];
+    int status = archive_path(path, name, sizeof(name));
+    if (status)
+        return status;
+
+    memset(st, 0, sizeof(struct stat));
+    st->st_uid = tree->archive_stat.st_uid;
+    st->st_gid = tree->archive_stat.st_gid;
+    st->st_atim = tree->archive_stat.st_atim;
+    st->st_mtim = tree->archive_stat.st_mtim;
+    st->st_ctim = tree->archive_stat.st_ctim;
+
+    dat2entry *entry = dat2reader_find_entry(tree->reader, name);
+    if (entry)
+    {
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        st->st_size = entry->uncompressed_size;
+        st->st_blocks = (entry->compressed_size + 511)/512;
+        return 0;
+    }
+
+    uint32_t number = find_directory(tree, name, strlen(name));
+    if (!number)
+        return -ENOENT;
+
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2 + tree->directories[number - 1].subdirectory_count;
+    return 0;
+}
+
+static int mount_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+    struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    mount_tree *tree = get_tree();
+    char name[PATH_MAX];
+    int status = archive_path(path, name, sizeof(name));
+    if (status)
+        return status;
+
+    uint32_t number = find_directory(tree, name, strlen(name));
+    if (!number)
+        return dat2reader_find_entry(tree->reader, name) ? -ENOTDIR : -ENOENT;
+
+    mount_directory *directory = &tree->directories[number - 1];
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    for (uint32_t i = 0; i < directory->subdirectory_count; i++)
+        filler(buf, base_name(tree->directories[directory->subdirectories[i] - 1].path), NULL, 0, 0);
+    for (uint32_t i = 0; i < directory->entry_count; i++)
+        filler(buf, base_name(directory->entries[i]->filename), NULL, 0, 0);
+    return 0;
+}
+
+static int mount_open(const char *path, struct fuse_file_info *fi)
+{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+
+    char name[PATH_MAX];
+    int status = archive_path(path, name, sizeof(name));
+    if (status)
+        return status;
+
+    dat2entry *entry = dat2reader_find_entry(get_tree()->reader, name);
+    if (!entry)
+        return -ENOENT;
+
+    mount_handle *handle = malloc(sizeof(mount_handle));
+    if (!handle)
+        return -ENOMEM;
+
+    handle->entry = entry;
+    handle->stream = NULL;
+    pthread_mutex_init(&handle->lock, NULL);
+
+    // Archive contents never change while mounted
+    fi->fh = (uintptr_t)handle;
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int mount_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    mount_handle *handle = (mount_handle *)(uintptr_t)fi->fh;
+    dat2entry *entry = handle->entry;
+    if (offset < 0)
+        return -EINVAL;
+    if ((uint64_t)offset >= entry->uncompressed_size)
+        return 0;
+    if (size > entry->uncompressed_size - (uint64_t)offset)
+        size = entry->uncompressed_size - offset;
+
+    // Stored entries are read in place without any shared state
+    if (!entry->compressed)
+    {
+        size_t read = dat2reader_read_at(entry->reader, (uint8_t *)buf, size, (off_t)entry->offset + offset);
+        return read == size ? (int)read : -EIO;
+    }
+
+    int status = -EIO;
+    pthread_mutex_lock(&handle->lock);
+    if (!handle->stream)
+        handle->stream = dat2stream_open(entry);
+    if (handle->stream && dat2stream_seek(handle->stream, offset) == 0)
+    {
+        size_t read = dat2stream_read(handle->stream, (uint8_t *)buf, size);
+        if (read == size)
+            status = read;
+    }
+    pthread_mutex_unlock(&handle->lock);
+    return status;
+}
+
+static int mount_release(const char *path, struct fuse_file_info *fi)
+{
+    mount_handle *handle = (mount_handle *)(uintptr_t)fi->fh;
+    if (handle->stream)
+        dat2stream_close(handle->stream);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+    return 0;
+}
+
+static void *mount_init(struct fuse_conn_info *conn, struct fuse_config *config)
+{
+    config->kernel_cache = 1;
+    return get_tree();
+}
+
+static const struct fuse_operations mount_operations =
+{
+    .init = mount_init,
+    .getattr = mount_getattr,
+    .readdir = mount_readdir,
+    .open = mount_open,
+    .read = mount_read,
+    .release = mount_release,
+};
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <archive.dat> <mountpoint> [fuse options]\n", argv[0]);
+        return 1;
+    }
+
+    dat2reader *reader = dat2reader_open(argv[1]);
+    if (!reader)
+        return 1;
+
+    // Reads arrive at any offset, so large compressed files keep inflate
+    // checkpoints the first time they are read through
+    if (dat2reader_enable_checkpoints(reader, DAT2CHECKPOINT_DEFAULT_SPAN))
+    {
+        dat2reader_close(reader);
+        return 1;
+    }
+
+    int status = 1;
+    mount_tree *tree = build_tree(reader);
+    if (tree)
+    {
+        // Pass everything but the archive on to fuse
+        argv[1] = argv[0];
+        status = fuse_main(argc - 1, argv + 1, &mount_operations, tree);
+        free_tree(tree);
+    }
+
+    dat2reader_close(reader);
+    return status;
+}
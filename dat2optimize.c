@@ -0,0 +1,251 @@
+/*
+ * dat2optimize.c
+ * Rewrites .dat archives with recompressed and regrouped entries
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include "dat2optimize.h"
+#include "dat2scheduler.h"
+#include "dat2writer.h"
+#include "deflate.h"
+
+typedef enum
+{
+    ENCODING_STORED,
+    ENCODING_RECOMPRESSED,
+    ENCODING_ORIGINAL,
+} encoding;
+
+typedef struct
+{
+    dat2entry *entry;
+    encoding choice;
+
+    // Uncompressed data when stored, new zlib stream when recompressed
+    uint8_t *data;
+    uint32_t size;
+    bool failed;
+} optimize_item;
+
+typedef struct
+{
+    optimize_item *items;
+    unsigned budget;
+} optimize_job;
+
+//
+// Compress an entry at the best level and pick its encoding. Stored data
+// decodes fastest, so it is used whenever it is no more than budget
+// percent larger than the smallest compressed form, which is either
+// the new stream or the original one
+//
+static int optimize_entry(size_t index, void *user)
+{
+    optimize_job *job = user;
+    optimize_item *item = &job->items[index];
+    dat2entry *entry = item->entry;
+
+    uint8_t *data = malloc(entry->uncompressed_size ? entry->uncompressed_size : 1);
+    if (!data || dat2entry_extract_into(entry, data, entry->uncompressed_size))
+    {
+        if (!data)
+            fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(data);
+        item->failed = true;
+        return 1;
+    }
+
+    // Block archive data can only be kept by recompressing it
+    uint64_t smallest = entry->compressed && !entry->reader->blocks ? entry->compressed_size : UINT64_MAX;
+    uint8_t *compressed = NULL;
+    size_t compressed_size = 0;
+    if (entry->uncompressed_size)
+    {
+        size_t bound = zlib_bound(entry->uncompressed_size);
+        compressed = malloc(bound);
+        if (compressed)
+            compressed_size = zlib_compress(compressed, bound, data, entry->uncompressed_size, DEFLATE_LEVEL_BEST);
+    }
+
+    item->choice = ENCODING_ORIGINAL;
+    if (compressed_size && compressed_size < smallest)
+    {
+        smallest = compressed_size;
+        item->choice = ENCODING_RECOMPRESSED;
+    }
+
+    if (smallest == UINT64_MAX || (uint64_t)entry->uncompressed_size*100 <= smallest*(100 + job->budget))
+        item->choice = ENCODING_STORED;
+
+    if (item->choice == ENCODING_STORED)
+    {
+        item->data = data;
+        item->size = entry->uncompressed_size;
+        free(compressed);
+    }
+    else if (item->choice == ENCODING_RECOMPRESSED)
+    {
+        item->data = compressed;
+        item->size = compressed_size;
+        free(data);
+    }
+    else
+    {
+        free(compressed);
+        free(data);
+    }
+    return 0;
+}
+
+static int compare_layout(const void *a, const void *b)
+{
+    const char *name_a = (*(dat2entry * const *)a)->filename;
+    const char *name_b = (*(dat2entry * const *)b)->filename;
+    const char *slash_a = strrchr(name_a, '\\');
+    const char *slash_b = strrchr(name_b, '\\');
+    size_t dir_a = slash_a ? (size_t)(slash_a - name_a) : 0;
+    size_t dir_b = slash_b ? (size_t)(slash_b - name_b) : 0;
+
+    // Whole directories first, then files within a directory
+    size_t common = dir_a < dir_b ? dir_a : dir_b;
+    int order = strncasecmp(name_a, name_b, common);
+    if (order == 0 && dir_a != dir_b)
+        return dir_a < dir_b ? -1 : 1;
+    if (order == 0)
+        order = strcasecmp(name_a + dir_a, name_b + dir_b);
+    return order;
+}
+
+//
+// Write a copy of an archive with each entry in the encoding chosen by
+// optimize_entry, and with entries regrouped by directory so that files
+// loaded together are adjacent on disk. The directory lists entries in
+// the same order as their data
+// Returns 0 on success, or -1 on error
+//
+int dat2optimize_write(dat2reader *reader, const char *path, unsigned budget, unsigned threads, dat2optimize_report *report)
+{
+    memset(report, 0, sizeof(dat2optimize_report));
+    report->entry_count = reader->entry_count;
+    report->original_size = reader->filesize;
+
+    uint32_t count = reader->entry_count;
+    dat2entry **order = malloc((count ? count : 1)*sizeof(dat2entry *));
+    optimize_item *items = calloc(count ? count : 1, sizeof(optimize_item));
+    uint64_t *costs = malloc((count ? count : 1)*sizeof(uint64_t));
+    if (!order || !items || !costs)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(order);
+        free(items);
+        free(costs);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        order[i] = &reader->entries[i];
+    qsort(order, count, sizeof(dat2entry *), compare_layout);
+
+    int status = -1;
+    dat2writer *writer = dat2writer_create(path, reader->extended);
+    if (!writer)
+        goto create_error;
+
+    optimize_job job = { items, budget };
+    for (uint32_t start = 0; start < count;)
+    {
+        // Compress a batch in parallel, then append it in order
+        uint32_t end = start;
+        uint64_t batch_size = 0;
+        while (end < count && (end == start || batch_size + order[end]->uncompressed_size <= DAT2OPTIMIZE_BATCH_SIZE))
+        {
+            items[end].entry = order[end];
+            costs[end] = dat2scheduler_entry_cost(order[end]) + 8*(uint64_t)order[end]->uncompressed_size;
+            batch_size += order[end]->uncompressed_size;
+            end++;
+        }
+
+        job.items = &items[start];
+        dat2scheduler_run_tasks(end - start, &costs[start], optimize_entry, &job, threads);
+
+        for (uint32_t i = start; i < end; i++)
+        {
+            optimize_item *item = &items[i];
+            dat2entry *entry = item->entry;
+            int result;
+            if (item->failed)
+            {
+                // Keep entries that could not be read exactly as they were
+                report->failed++;
+                result = dat2writer_copy_entry(writer, entry, NULL);
+            }
+            else if (item->choice == ENCODING_ORIGINAL)
+            {
+                report->kept++;
+                result = dat2writer_copy_entry(writer, entry, NULL);
+            }
+            else
+            {
+                bool compressed = item->choice == ENCODING_RECOMPRESSED;
+                if (compressed)
+                    report->recompressed++;
+                else
+                    report->stored++;
+                result = dat2writer_add_raw(writer, entry->filename, compressed, entry->uncompressed_size,
+                    item->data, item->size);
+            }
+
+            free(item->data);
+            item->data = NULL;
+            if (result)
+            {
+                for (uint32_t j = i + 1; j < end; j++)
+                    free(items[j].data);
+                dat2writer_close(writer);
+                goto create_error;
+            }
+        }
+        start = end;
+    }
+
+    if (dat2writer_close(writer) == 0)
+    {
+        struct stat st;
+        if (stat(path, &st) == 0)
+            report->optimized_size = st.st_size;
+        status = 0;
+    }
+
+create_error:
+    free(costs);
+    free(items);
+    free(order);
+    return status;
+}
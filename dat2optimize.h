@@ -0,0 +1,53 @@
+/*
+ * dat2optimize.h
+ * Rewrites .dat archives with recompressed and regrouped entries
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _dat2optimize_h
+#define _dat2optimize_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dat2reader.h"
+
+// Entries are recompressed in batches of about this many uncompressed
+// bytes, bounding memory while keeping every thread busy
+#define DAT2OPTIMIZE_BATCH_SIZE (64*1024*1024)
+
+typedef struct
+{
+    uint32_t entry_count;
+    uint32_t stored;        // Stored because it was within the budget
+    uint32_t recompressed;  // Compressed with the new deflate output
+    uint32_t kept;          // Original compressed data was smallest
+    uint32_t failed;
+    uint64_t original_size;
+    uint64_t optimized_size;
+} dat2optimize_report;
+
+int dat2optimize_write(dat2reader *reader, const char *path, unsigned budget, unsigned threads, dat2optimize_report *report);
+
+#endif
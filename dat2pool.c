@@ -0,0 +1,173 @@
+/*
+ * dat2pool.c
+ * Per-thread pools of decompressors and scratch buffers
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include "dat2pool.h"
+
+// Every pooled buffer is prefixed with a header recording its class,
+// padded to keep the returned pointer suitably aligned
+#define DAT2POOL_HEADER_SIZE 16
+#define DAT2POOL_UNPOOLED 0xFF
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static void pool_destroy(void *arg)
+{
+    dat2pool *pool = arg;
+    for (size_t i = 0; i < DAT2POOL_CLASS_COUNT; i++)
+        for (size_t j = 0; j < pool->classes[i].count; j++)
+            free(pool->classes[i].buffers[j] - DAT2POOL_HEADER_SIZE);
+    free(pool);
+}
+
+//
+// Thread-specific destructors only run for threads that exit through
+// pthread_exit, so the thread calling exit releases its own pool here
+//
+static void pool_exit(void)
+{
+    dat2pool *pool = pthread_getspecific(pool_key);
+    if (!pool)
+        return;
+
+    pthread_setspecific(pool_key, NULL);
+    pool_destroy(pool);
+}
+
+static void pool_key_create(void)
+{
+    if (pthread_key_create(&pool_key, pool_destroy) == 0)
+        atexit(pool_exit);
+}
+
+//
+// Return the pool owned by the calling thread, creating it on first use.
+// The pool is released automatically when the thread (or process) exits
+// Returns NULL if the pool could not be allocated
+//
+dat2pool *dat2pool_thread(void)
+{
+    pthread_once(&pool_key_once, pool_key_create);
+    dat2pool *pool = pthread_getspecific(pool_key);
+    if (pool)
+        return pool;
+
+    pool = calloc(1, sizeof(dat2pool));
+    if (!pool)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    if (pthread_setspecific(pool_key, pool))
+    {
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+static uint8_t size_class(size_t size)
+{
+    uint8_t bits = DAT2POOL_MIN_CLASS_BITS;
+    while (bits <= DAT2POOL_MAX_CLASS_BITS && ((size_t)1 << bits) < size)
+        bits++;
+
+    return bits > DAT2POOL_MAX_CLASS_BITS ? DAT2POOL_UNPOOLED : bits - DAT2POOL_MIN_CLASS_BITS;
+}
+
+//
+// Acquire a buffer of at least size bytes, reusing a previously
+// released buffer of the same size class where possible
+// Returns NULL on error
+//
+uint8_t *dat2pool_acquire(dat2pool *pool, size_t size)
+{
+    uint8_t index = size_class(size);
+    if (index != DAT2POOL_UNPOOLED)
+    {
+        dat2pool_class *class = &pool->classes[index];
+        size = (size_t)1 << (index + DAT2POOL_MIN_CLASS_BITS);
+        if (class->count)
+        {
+            pool->retained -= size;
+            return class->buffers[--class->count];
+        }
+    }
+
+    uint8_t *buffer = malloc(size + DAT2POOL_HEADER_SIZE);
+    if (!buffer)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    buffer[0] = index;
+    return buffer + DAT2POOL_HEADER_SIZE;
+}
+
+//
+// Return a buffer to the pool for reuse, or free it if its class is
+// full or the pool already holds DAT2POOL_MAX_RETAINED bytes.
+// Buffers acquired from one thread's pool may be released to another
+//
+void dat2pool_release(dat2pool *pool, uint8_t *buffer)
+{
+    if (!buffer)
+        return;
+
+    uint8_t index = buffer[-DAT2POOL_HEADER_SIZE];
+    if (index != DAT2POOL_UNPOOLED)
+    {
+        dat2pool_class *class = &pool->classes[index];
+        size_t size = (size_t)1 << (index + DAT2POOL_MIN_CLASS_BITS);
+        if (class->count < DAT2POOL_CLASS_DEPTH && pool->retained + size <= DAT2POOL_MAX_RETAINED)
+        {
+            pool->retained += size;
+            class->buffers[class->count++] = buffer;
+            return;
+        }
+    }
+
+    free(buffer - DAT2POOL_HEADER_SIZE);
+}
+
+//
+// Free a buffer without returning it to a pool
+//
+void dat2pool_free(uint8_t *buffer)
+{
+    if (buffer)
+        free(buffer - DAT2POOL_HEADER_SIZE);
+}
@@ -0,0 +1,66 @@
+/*
+ * dat2pool.h
+ * Per-thread pools of decompressors and scratch buffers
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _dat2pool_h
+#define _dat2pool_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "tinfl.h"
+
+// Buffers are grouped into power-of-two size classes between
+// 1 << DAT2POOL_MIN_CLASS_BITS and 1 << DAT2POOL_MAX_CLASS_BITS bytes.
+// Larger requests bypass the pool
+#define DAT2POOL_MIN_CLASS_BITS 12
+#define DAT2POOL_MAX_CLASS_BITS 26
+#define DAT2POOL_CLASS_COUNT (DAT2POOL_MAX_CLASS_BITS - DAT2POOL_MIN_CLASS_BITS + 1)
+
+// Number of released buffers kept for reuse in each class, and
+// total bytes of released buffers kept by each pool
+#define DAT2POOL_CLASS_DEPTH 4
+#define DAT2POOL_MAX_RETAINED ((size_t)32 << 20)
+
+typedef struct
+{
+    uint8_t *buffers[DAT2POOL_CLASS_DEPTH];
+    uint8_t count;
+} dat2pool_class;
+
+typedef struct
+{
+    tinfl_decompressor decompressor;
+    dat2pool_class classes[DAT2POOL_CLASS_COUNT];
+    size_t retained;
+} dat2pool;
+
+dat2pool *dat2pool_thread(void);
+uint8_t *dat2pool_acquire(dat2pool *pool, size_t size);
+void dat2pool_release(dat2pool *pool, uint8_t *buffer);
+void dat2pool_free(uint8_t *buffer);
+
+#endif
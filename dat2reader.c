@@ -29,11 +29,105 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 #include "dat2reader.h"
+#include "dat2pool.h"
+#include "dat2trace.h"
+#include "dat2blocks.h"
+#include "dat2checkpoint.h"
+#include "checksum.h"
 #include "tinfl.h"
 
 //
-// Open a Fallout 2 dat file and cache the file entries
+// Build an open-addressed hash table mapping filenames to entries.
+// Slots hold the entry index plus one, so zero marks an empty slot.
+// Duplicate names keep the first entry, matching a linear search
+// Returns 0 on success, or -1 on error
+//
+static int build_index(dat2reader *reader)
+{
+    if (reader->entry_count > (1U << 30))
+        return -1;
+
+    uint32_t size = 16;
+    while (size < 2*reader->entry_count)
+        size <<= 1;
+
+    reader->index = calloc(size, sizeof(uint32_t));
+    if (!reader->index)
+        return -1;
+    reader->index_mask = size - 1;
+
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+    {
+        const char *filename = reader->entries[i].filename;
+        uint32_t slot = hash64((const uint8_t *)filename, strlen(filename), 0) & reader->index_mask;
+        while (reader->index[slot] && strcmp(reader->entries[reader->index[slot] - 1].filename, filename))
+            slot = (slot + 1) & reader->index_mask;
+
+        if (!reader->index[slot])
+            reader->index[slot] = i + 1;
+    }
+    return 0;
+}
+
+static uint64_t trailer_size(dat2reader *reader)
+{
+    return reader->extended ? DAT2_EXTENDED_TRAILER_SIZE : DAT2_TRAILER_SIZE;
+}
+
+//
+// Read the directory size and archive size from the end of the file.
+// Extended archives are recognised by their magic, and are only
+// accepted if the recorded size matches the file
+// Returns 0 on success, or -1 on error
+//
+static int read_trailer(dat2reader *reader, uint64_t *tree_size)
+{
+    reader->extended = false;
+    if (fseeko(reader->file, 0, SEEK_END))
+    {
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    off_t size = ftello(reader->file);
+    if (size >= DAT2_EXTENDED_TRAILER_SIZE && fseeko(reader->file, -DAT2_EXTENDED_TRAILER_SIZE, SEEK_END) == 0)
+    {
+        char magic[DAT2_EXTENDED_MAGIC_SIZE];
+        fread(tree_size, sizeof(uint64_t), 1, reader->file);
+        fread(&reader->filesize, sizeof(uint64_t), 1, reader->file);
+        if (fread(magic, 1, sizeof(magic), reader->file) == sizeof(magic) &&
+            memcmp(magic, DAT2_EXTENDED_MAGIC, sizeof(magic)) == 0 && reader->filesize == (uint64_t)size)
+            reader->extended = true;
+    }
+
+    if (!reader->extended)
+    {
+        if (fseeko(reader->file, -DAT2_TRAILER_SIZE, SEEK_END))
+        {
+            fprintf(stderr, "Error: %s\n", strerror(errno));
+            return -1;
+        }
+
+        uint32_t tree_size32, filesize32;
+        fread(&tree_size32, sizeof(uint32_t), 1, reader->file);
+        fread(&filesize32, sizeof(uint32_t), 1, reader->file);
+        *tree_size = tree_size32;
+        reader->filesize = filesize32;
+    }
+
+    if (reader->filesize < trailer_size(reader) || *tree_size > reader->filesize - trailer_size(reader))
+    {
+        fprintf(stderr, "Error: %s is not a valid dat2 archive\n", reader->path);
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Open a Fallout 2 dat file, or a block archive written by
+// dat2blocks_write, and cache the file entries
 // Returns NULL if there is an error
 //
 dat2reader *dat2reader_open(char *path)
@@ -42,26 +136,34 @@ dat2reader *dat2reader_open(char *path)
     if (!reader)
         return NULL;
     
+    reader->trace = NULL;
+    reader->blocks = NULL;
+    reader->checkpoints = NULL;
+    reader->path = strdup(path);
+    if (!reader->path)
+        goto malloc_error;
+
     reader->file = fopen(path, "r");
     if (!reader->file)
     {
-        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
-        goto malloc_error;
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        goto fopen_error;
     }
 
-    // Find and seek to the filename block
-    if (fseeko(reader->file, -8, SEEK_END))
+    if (dat2blocks_detect(reader))
     {
-        fprintf(stderr, "Error: %s\n", strerror(errno));
-        goto seek_error;
+        if (dat2blocks_load(reader))
+            goto seek_error;
+        return reader;
     }
 
-    uint32_t entry_offset;
-    fread(&entry_offset, sizeof(uint32_t), 1, reader->file);
-    fread(&reader->filesize, sizeof(uint32_t), 1, reader->file);
-    
+    uint64_t tree_size;
+    if (read_trailer(reader, &tree_size))
+        goto seek_error;
+
     // Jump to entry count, 4 bytes before the file data offset
-    if (fseek(reader->file, reader->filesize - entry_offset - 8, SEEK_SET))
+    reader->directory_offset = reader->filesize - tree_size - trailer_size(reader);
+    if (fseeko(reader->file, reader->directory_offset, SEEK_SET))
     {
         fprintf(stderr, "Error: %s\n", strerror(errno));
         goto seek_error;
@@ -85,9 +187,7 @@ dat2reader *dat2reader_open(char *path)
         entry->filename = malloc((name_length + 1)*sizeof(char));
         if (!entry->filename)
         {
-            for (uint32_t j = 0; j < i; j++)
-                free(reader->entries[j].filename);
-            free(reader->entries);
+            reader->entry_count = i;
             goto entry_error;
         }
 
@@ -96,16 +196,30 @@ dat2reader *dat2reader_open(char *path)
         fread(&entry->compressed, sizeof(uint8_t), 1, reader->file);
         fread(&entry->uncompressed_size, sizeof(uint32_t), 1, reader->file);
         fread(&entry->compressed_size, sizeof(uint32_t), 1, reader->file);
-        fread(&entry->offset, sizeof(uint32_t), 1, reader->file);
+        if (reader->extended)
+            fread(&entry->offset, sizeof(uint64_t), 1, reader->file);
+        else
+        {
+            uint32_t offset;
+            fread(&offset, sizeof(uint32_t), 1, reader->file);
+            entry->offset = offset;
+        }
     }
 
+    if (build_index(reader))
+        goto entry_error;
+
     return reader;
 
 entry_error:
+    for (uint32_t j = 0; j < reader->entry_count; j++)
+        free(reader->entries[j].filename);
     free(reader->entries);
 entry_malloc_error:
 seek_error:
     fclose(reader->file);
+fopen_error:
+    free(reader->path);
 malloc_error:
     free(reader);
     return NULL;
@@ -116,6 +230,7 @@ malloc_error:
 //
 void dat2reader_close(dat2reader *reader)
 {
+    dat2reader_stop_trace(reader);
     fclose(reader->file);
     for (uint32_t i = 0; i < reader->entry_count; i++)
     {
@@ -123,6 +238,10 @@ void dat2reader_close(dat2reader *reader)
         reader->entries[i].reader = NULL;
     }
     free(reader->entries);
+    free(reader->index);
+    dat2blocks_free(reader->blocks);
+    dat2checkpoints_free(reader->checkpoints);
+    free(reader->path);
     free(reader);
 }
 
@@ -132,18 +251,129 @@ void dat2reader_close(dat2reader *reader)
 //
 dat2entry *dat2reader_find_entry(dat2reader *reader, char *filename)
 {
-    // TODO: This could be smarter
-    for (uint32_t i = 0; i < reader->entry_count; i++)
+    return dat2reader_find_entry_length(reader, filename, strlen(filename));
+}
+
+//
+// Find an entry from a filename that need not be nul terminated
+// Returns a pointer to the entry, or NULL if not found
+//
+dat2entry *dat2reader_find_entry_length(dat2reader *reader, const char *filename, size_t length)
+{
+    uint32_t slot = hash64((const uint8_t *)filename, length, 0) & reader->index_mask;
+    for (; reader->index[slot]; slot = (slot + 1) & reader->index_mask)
     {
-        dat2entry *entry = &reader->entries[i];
-        if (strcmp(filename, entry->filename) == 0)
+        dat2entry *entry = &reader->entries[reader->index[slot] - 1];
+        if (strncmp(entry->filename, filename, length) == 0 && entry->filename[length] == '\0')
+        {
+            if (reader->trace)
+                dat2trace_record(entry, DAT2TRACE_FIND);
             return entry;
+        }
     }
     return NULL;
 }
 
+//
+// Read length bytes from an absolute position in the archive.
+// Uses positional reads so that several threads can extract
+// entries from the same reader concurrently
+// Returns the number of bytes read
+//
+size_t dat2reader_read_at(dat2reader *reader, uint8_t *buf, size_t length, off_t offset)
+{
+    int fd = fileno(reader->file);
+    size_t total = 0;
+    while (total < length)
+    {
+        ssize_t read = pread(fd, buf + total, length - total, offset + total);
+        if (read < 0 && errno == EINTR)
+            continue;
+        if (read <= 0)
+        {
+            if (read < 0)
+                fprintf(stderr, "Error: %s\n", strerror(errno));
+            break;
+        }
+        total += read;
+    }
+    return total;
+}
+
+//
+// Extract (and if necessary, decompress) the data for a given entry into
+// a caller-provided buffer of at least size bytes. Scratch space and the
+// decompressor state come from the calling thread's pool, so repeated
+// calls perform no heap allocation once the pool is warm
+// Returns 0 on success, or -1 on error
+//
+int dat2entry_extract_into(dat2entry *entry, uint8_t *data, size_t size)
+{
+    if (!entry->reader)
+        return -1;
+
+    if (size < entry->uncompressed_size)
+    {
+        fprintf(stderr, "Output buffer too small for %s\n", entry->filename);
+        return -1;
+    }
+
+    if (entry->reader->trace)
+        dat2trace_record(entry, DAT2TRACE_EXTRACT_ENTRY);
+
+    if (!entry->compressed)
+    {
+        // Uncompressed data - read directly into output buffer
+        size_t read = dat2reader_read_at(entry->reader, data, entry->uncompressed_size, entry->offset);
+        if (read != entry->uncompressed_size)
+        {
+            fprintf(stderr, "Extracted file length mismatch\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (entry->reader->blocks)
+        return dat2blocks_extract(entry, data);
+
+    // Compressed data - read into a pooled scratch buffer, then decompress into output buffer
+    dat2pool *pool = dat2pool_thread();
+    if (!pool)
+        return -1;
+
+    uint8_t *compressed_data = dat2pool_acquire(pool, entry->compressed_size);
+    if (!compressed_data)
+        return -1;
+
+    int status = -1;
+    size_t read = dat2reader_read_at(entry->reader, compressed_data, entry->compressed_size, entry->offset);
+    if (read != entry->compressed_size)
+    {
+        fprintf(stderr, "Extracted file length mismatch\n");
+        goto read_error;
+    }
+
+    tinfl_decompressor *decompressor = &pool->decompressor;
+    tinfl_init(decompressor);
+    size_t in_size = entry->compressed_size;
+    size_t out_size = entry->uncompressed_size;
+    tinfl_status result = tinfl_decompress(decompressor, compressed_data, &in_size, data, data, &out_size,
+        TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    if (result != TINFL_STATUS_DONE || out_size != entry->uncompressed_size)
+    {
+        fprintf(stderr, "%s: decompression failed\n", entry->filename);
+        goto read_error;
+    }
+
+    status = 0;
+read_error:
+    dat2pool_release(pool, compressed_data);
+    return status;
+}
+
 //
 // Extract (and if necessary, decompress) the data for a given entry
+// Safe to call from several threads for entries of the same reader
 // Returns an allocated byte array, or NULL on error
 //
 uint8_t *dat2entry_extract_data(dat2entry *entry)
@@ -151,62 +381,142 @@ uint8_t *dat2entry_extract_data(dat2entry *entry)
     if (!entry->reader)
         return NULL;
 
-    if (fseek(entry->reader->file, entry->offset, SEEK_SET))
+    uint8_t *data = malloc(entry->uncompressed_size*sizeof(uint8_t));
+    if (!data)
     {
-        fprintf(stderr, "Error: %s\n", strerror(errno));
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
         return NULL;
     }
 
-    uint8_t *data = malloc(entry->uncompressed_size*sizeof(uint8_t));
-    if (!data)
+    if (dat2entry_extract_into(entry, data, entry->uncompressed_size))
     {
-        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(data);
         return NULL;
     }
 
+    return data;
+}
+
+
+//
+// Check that an entry's directory record is consistent with the archive,
+// and that its data can be read and (if necessary) inflated with a valid
+// zlib Adler-32. Compressed entries are inflated through a pooled 32KB
+// window, so memory use does not depend on the entry size.
+// If adler32 is non-NULL it receives the checksum of the uncompressed data
+// Returns DAT2VERIFY_OK if the entry is intact
+//
+dat2verify_status dat2entry_verify(dat2entry *entry, uint32_t *adler32)
+{
+    dat2reader *reader = entry->reader;
+    if (!reader)
+        return DAT2VERIFY_READ_ERROR;
+
+    if (entry->offset > reader->directory_offset ||
+        entry->compressed_size > reader->directory_offset - entry->offset)
+        return DAT2VERIFY_BAD_RANGE;
+
+    if (!entry->compressed && entry->compressed_size != entry->uncompressed_size)
+        return DAT2VERIFY_BAD_SIZE;
+
+    // Block archives record a checksum for stored entries too
+    if (reader->blocks)
+        return dat2blocks_verify(entry, adler32);
+
+    dat2pool *pool = dat2pool_thread();
+    if (!pool)
+        return DAT2VERIFY_NO_MEMORY;
+
+    uint8_t *input = dat2pool_acquire(pool, entry->compressed_size);
+    if (!input)
+        return DAT2VERIFY_NO_MEMORY;
+
+    dat2verify_status status = DAT2VERIFY_OK;
+    uint8_t *window = NULL;
+    if (dat2reader_read_at(reader, input, entry->compressed_size, entry->offset) != entry->compressed_size)
+    {
+        status = DAT2VERIFY_READ_ERROR;
+        goto done;
+    }
+
     if (!entry->compressed)
     {
-        // Uncompressed data - read directly into output buffer
-        size_t read = fread(data, sizeof(uint8_t), entry->uncompressed_size, entry->reader->file);
-        if (read != entry->uncompressed_size)
-        {
-            fprintf(stderr, "Extracted file length mismatch\n");
-            free(data);
-            return NULL;
-        }
+        // Stored entries carry no checksum of their own
+        if (adler32)
+            *adler32 = adler32_update(ADLER32_INIT, input, entry->compressed_size);
+        goto done;
     }
-    else
+
+    window = dat2pool_acquire(pool, TINFL_LZ_DICT_SIZE);
+    if (!window)
     {
-        // Compressed data - read into a temporary buffer, then decompress into output buffer
-        uint8_t *compressed_data = malloc(entry->uncompressed_size*sizeof(uint8_t));
-        if (!compressed_data)
-        {
-            fprintf(stderr, "Malloc error: %s\n", strerror(errno));
-            free(data);
-            return NULL;
-        }
+        status = DAT2VERIFY_NO_MEMORY;
+        goto done;
+    }
 
-        size_t read = fread(compressed_data, sizeof(uint8_t), entry->compressed_size, entry->reader->file);
-        if (read != entry->compressed_size)
+    tinfl_decompressor *decompressor = &pool->decompressor;
+    tinfl_init(decompressor);
+    size_t in_offset = 0;
+    size_t window_offset = 0;
+    uint64_t total = 0;
+    tinfl_status result;
+    do
+    {
+        size_t in_size = entry->compressed_size - in_offset;
+        size_t out_size = TINFL_LZ_DICT_SIZE - window_offset;
+        result = tinfl_decompress(decompressor, input + in_offset, &in_size, window, window + window_offset, &out_size,
+            TINFL_FLAG_PARSE_ZLIB_HEADER);
+        in_offset += in_size;
+        total += out_size;
+        window_offset = (window_offset + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+
+        // Exhausted input reads as zeros, so a corrupt stream may never end
+        if (total > entry->uncompressed_size)
         {
-            fprintf(stderr, "Extracted file length mismatch\n");
-            free(data);
-            free(compressed_data);
-            return NULL;
+            status = DAT2VERIFY_LENGTH_MISMATCH;
+            goto done;
         }
 
-        // Decompress
-        if (tinfl_decompress_mem_to_mem(data, entry->uncompressed_size, compressed_data, entry->compressed_size,
-            TINFL_FLAG_PARSE_ZLIB_HEADER) == TINFL_DECOMPRESS_MEM_TO_MEM_FAILED)
+        if (result == TINFL_STATUS_HAS_MORE_OUTPUT && in_size == 0 && out_size == 0)
         {
-            printf("decompression failed\n");
-            free(data);
-            free(compressed_data);
-            return NULL;
+            status = DAT2VERIFY_CORRUPT;
+            goto done;
         }
+    } while (result == TINFL_STATUS_HAS_MORE_OUTPUT);
 
-        free(compressed_data);
-    }
+    if (result == TINFL_STATUS_ADLER32_MISMATCH)
+        status = DAT2VERIFY_CHECKSUM_MISMATCH;
+    else if (result == TINFL_STATUS_NEEDS_MORE_INPUT)
+        status = DAT2VERIFY_TRUNCATED;
+    else if (result != TINFL_STATUS_DONE)
+        status = DAT2VERIFY_CORRUPT;
+    else if (total != entry->uncompressed_size)
+        status = DAT2VERIFY_LENGTH_MISMATCH;
+    else if (adler32)
+        *adler32 = tinfl_get_adler32(decompressor);
 
-    return data;
-}
\ No newline at end of file
+done:
+    dat2pool_release(pool, window);
+    dat2pool_release(pool, input);
+    return status;
+}
+
+//
+// Describe the result of dat2entry_verify
+//
+const char *dat2verify_status_string(dat2verify_status status)
+{
+    switch (status)
+    {
+        case DAT2VERIFY_OK: return "ok";
+        case DAT2VERIFY_BAD_RANGE: return "data lies outside the archive";
+        case DAT2VERIFY_BAD_SIZE: return "stored entry sizes disagree";
+        case DAT2VERIFY_READ_ERROR: return "read error";
+        case DAT2VERIFY_CORRUPT: return "corrupt compressed data";
+        case DAT2VERIFY_TRUNCATED: return "truncated compressed data";
+        case DAT2VERIFY_CHECKSUM_MISMATCH: return "adler-32 mismatch";
+        case DAT2VERIFY_LENGTH_MISMATCH: return "uncompressed length mismatch";
+        case DAT2VERIFY_NO_MEMORY: return "out of memory";
+    }
+    return "unknown error";
+}
@@ -32,8 +32,32 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
+
+// Extended archives replace the 32-bit trailer with 64-bit directory and
+// archive sizes followed by this magic, and store 64-bit entry offsets
+#define DAT2_TRAILER_SIZE 8
+#define DAT2_EXTENDED_TRAILER_SIZE 24
+#define DAT2_EXTENDED_MAGIC "DAT2EXT\x1A"
+#define DAT2_EXTENDED_MAGIC_SIZE 8
 
 struct dat2reader;
+struct dat2trace;
+struct dat2blocks;
+struct dat2checkpoints;
+
+typedef enum
+{
+    DAT2VERIFY_OK = 0,
+    DAT2VERIFY_BAD_RANGE,
+    DAT2VERIFY_BAD_SIZE,
+    DAT2VERIFY_READ_ERROR,
+    DAT2VERIFY_CORRUPT,
+    DAT2VERIFY_TRUNCATED,
+    DAT2VERIFY_CHECKSUM_MISMATCH,
+    DAT2VERIFY_LENGTH_MISMATCH,
+    DAT2VERIFY_NO_MEMORY,
+} dat2verify_status;
 
 typedef struct
 {
@@ -42,22 +66,43 @@ typedef struct
     bool compressed;
     uint32_t uncompressed_size;
     uint32_t compressed_size;
-    uint32_t offset;
+    uint64_t offset;
 } dat2entry;
 
 typedef struct dat2reader
 {
+    char *path;
     FILE *file;
-    uint32_t filesize;
+    bool extended;
+    uint64_t filesize;
+    uint64_t directory_offset;
 
     uint32_t entry_count;
     dat2entry *entries;
+
+    // Filename hash table used by dat2reader_find_entry
+    uint32_t *index;
+    uint32_t index_mask;
+
+    // Access trace, if recording (see dat2trace.h)
+    struct dat2trace *trace;
+
+    // Block table of a block archive, or NULL for a dat2 archive (see dat2blocks.h)
+    struct dat2blocks *blocks;
+
+    // Inflate checkpoints of large compressed entries, if enabled (see dat2checkpoint.h)
+    struct dat2checkpoints *checkpoints;
 } dat2reader;
 
 dat2reader *dat2reader_open(char *path);
 void dat2reader_close(dat2reader *reader);
 dat2entry *dat2reader_find_entry(dat2reader *reader, char *filename);
+dat2entry *dat2reader_find_entry_length(dat2reader *reader, const char *filename, size_t length);
+size_t dat2reader_read_at(dat2reader *reader, uint8_t *buf, size_t length, off_t offset);
 
 
 uint8_t *dat2entry_extract_data(dat2entry *entry);
+int dat2entry_extract_into(dat2entry *entry, uint8_t *data, size_t size);
+dat2verify_status dat2entry_verify(dat2entry *entry, uint32_t *adler32);
+const char *dat2verify_status_string(dat2verify_status status);
 #endif
@@ -0,0 +1,365 @@
+/*
+ * dat2scheduler.c
+ * Distributes bulk operations over .dat entries between worker threads
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "dat2scheduler.h"
+
+// Fixed per-entry overhead (lookup, syscalls, output file creation)
+// expressed in bytes so that tiny entries are not treated as free
+#define DAT2SCHEDULER_ENTRY_OVERHEAD 4096
+
+typedef struct
+{
+    size_t index;
+    uint64_t cost;
+} dat2task;
+
+// Each worker owns a deque of tasks sorted largest-first.
+// The owner takes from the head, idle workers steal from the tail
+typedef struct
+{
+    pthread_mutex_t lock;
+    dat2task *tasks;
+    size_t head;
+    size_t tail;
+    uint64_t remaining;
+    size_t pending;
+} dat2queue;
+
+typedef struct
+{
+    dat2queue *queues;
+    unsigned queue_count;
+    dat2scheduler_task job;
+    void *user;
+} dat2workers;
+
+typedef struct
+{
+    dat2workers *shared;
+    unsigned index;
+    size_t failures;
+} dat2worker;
+
+//
+// Number of worker threads to use when the caller does not specify one
+//
+unsigned dat2scheduler_default_threads(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (unsigned)count : 1;
+}
+
+//
+// Estimate the relative time needed to process an entry.
+// Stored entries only cost their read, compressed entries
+// pay for the read plus inflating every output byte
+//
+uint64_t dat2scheduler_entry_cost(dat2entry *entry)
+{
+    uint64_t cost = DAT2SCHEDULER_ENTRY_OVERHEAD;
+    if (entry->compressed)
+        cost += entry->compressed_size + 2*(uint64_t)entry->uncompressed_size;
+    else
+        cost += entry->uncompressed_size;
+    return cost;
+}
+
+static int compare_task_cost(const void *a, const void *b)
+{
+    uint64_t ca = ((const dat2task *)a)->cost;
+    uint64_t cb = ((const dat2task *)b)->cost;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static bool queue_pop_head(dat2queue *queue, dat2task *task)
+{
+    bool found = false;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail)
+    {
+        *task = queue->tasks[queue->head++];
+        __atomic_sub_fetch(&queue->remaining, task->cost, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&queue->pending, 1, __ATOMIC_RELAXED);
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static bool queue_pop_tail(dat2queue *queue, dat2task *task)
+{
+    bool found = false;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail)
+    {
+        *task = queue->tasks[--queue->tail];
+        __atomic_sub_fetch(&queue->remaining, task->cost, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&queue->pending, 1, __ATOMIC_RELAXED);
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+//
+// Steal the smallest pending task from the worker with the most remaining
+// work. Every pending task counts, so queues of zero-cost tasks are
+// still stolen from, busiest first
+//
+static bool steal_task(dat2workers *shared, unsigned thief, dat2task *task)
+{
+    for (;;)
+    {
+        dat2queue *victim = NULL;
+        uint64_t victim_remaining = 0;
+        size_t victim_pending = 0;
+        for (unsigned i = 0; i < shared->queue_count; i++)
+        {
+            if (i == thief)
+                continue;
+
+            // Unlocked reads: only used as a hint for picking a victim
+            size_t pending = __atomic_load_n(&shared->queues[i].pending, __ATOMIC_RELAXED);
+            uint64_t remaining = __atomic_load_n(&shared->queues[i].remaining, __ATOMIC_RELAXED);
+            if (pending && (remaining > victim_remaining ||
+                (remaining == victim_remaining && pending > victim_pending)))
+            {
+                victim = &shared->queues[i];
+                victim_remaining = remaining;
+                victim_pending = pending;
+            }
+        }
+
+        if (!victim)
+            return false;
+
+        if (queue_pop_tail(victim, task))
+            return true;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    dat2worker *worker = arg;
+    dat2workers *shared = worker->shared;
+    dat2queue *own = &shared->queues[worker->index];
+
+    dat2task task;
+    while (queue_pop_head(own, &task) || steal_task(shared, worker->index, &task))
+        if (shared->job(task.index, shared->user))
+            worker->failures++;
+
+    return NULL;
+}
+
+//
+// Run a job over task indices [0, count) using up to the given number of
+// threads (0 selects one per CPU). Tasks are ordered by estimated cost
+// (equal if costs is NULL) and distributed largest-first to the least
+// loaded worker, and workers that run dry steal pending work from the
+// busiest remaining queue.
+// Returns the number of tasks whose job failed
+//
+size_t dat2scheduler_run_tasks(size_t count, const uint64_t *costs, dat2scheduler_task job, void *user, unsigned threads)
+{
+    if (threads == 0)
+        threads = dat2scheduler_default_threads();
+    if (threads > count)
+        threads = count;
+
+    size_t failures = 0;
+    if (threads <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+            if (job(i, user))
+                failures++;
+        return failures;
+    }
+
+    dat2task *tasks = malloc(count*sizeof(dat2task));
+    dat2queue *queues = calloc(threads, sizeof(dat2queue));
+    dat2worker *workers = calloc(threads, sizeof(dat2worker));
+    pthread_t *handles = calloc(threads, sizeof(pthread_t));
+    if (!tasks || !queues || !workers || !handles)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        failures = count;
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        tasks[i].index = i;
+        tasks[i].cost = costs ? costs[i] : 1;
+    }
+    qsort(tasks, count, sizeof(dat2task), compare_task_cost);
+
+    // Count the tasks each worker receives so that every queue can be
+    // a contiguous slice of one array sorted in largest-first order
+    unsigned *owner = malloc(count*sizeof(unsigned));
+    if (!owner)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        failures = count;
+        goto cleanup;
+    }
+
+    // Ties in cost go to the queue with the fewest tasks, which spreads
+    // zero-cost tasks evenly
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned best = 0;
+        for (unsigned w = 1; w < threads; w++)
+            if (queues[w].remaining < queues[best].remaining ||
+                (queues[w].remaining == queues[best].remaining && queues[w].tail < queues[best].tail))
+                best = w;
+        owner[i] = best;
+        queues[best].remaining += tasks[i].cost;
+        queues[best].tail++;
+    }
+
+    dat2task *sorted = malloc(count*sizeof(dat2task));
+    if (!sorted)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(owner);
+        failures = count;
+        goto cleanup;
+    }
+
+    size_t start = 0;
+    for (unsigned w = 0; w < threads; w++)
+    {
+        queues[w].tasks = &sorted[start];
+        start += queues[w].tail;
+        queues[w].pending = queues[w].tail;
+        queues[w].tail = 0;
+        pthread_mutex_init(&queues[w].lock, NULL);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        dat2queue *queue = &queues[owner[i]];
+        queue->tasks[queue->tail++] = tasks[i];
+    }
+    free(owner);
+
+    dat2workers shared = { queues, threads, job, user };
+    unsigned started = 0;
+    for (unsigned w = 0; w < threads; w++)
+    {
+        workers[w].shared = &shared;
+        workers[w].index = w;
+        if (w > 0 && pthread_create(&handles[w], NULL, worker_main, &workers[w]))
+            break;
+        started++;
+    }
+
+    // The calling thread acts as worker 0; queues of workers that could
+    // not be started are drained through work stealing
+    worker_main(&workers[0]);
+    for (unsigned w = 1; w < started; w++)
+        pthread_join(handles[w], NULL);
+
+    for (unsigned w = 0; w < threads; w++)
+    {
+        failures += workers[w].failures;
+        pthread_mutex_destroy(&queues[w].lock);
+    }
+    free(sorted);
+
+cleanup:
+    free(handles);
+    free(workers);
+    free(queues);
+    free(tasks);
+    return failures;
+}
+
+typedef struct
+{
+    dat2entry **entries;
+    dat2scheduler_job job;
+    void *user;
+} entry_tasks;
+
+static int run_entry_task(size_t index, void *user)
+{
+    entry_tasks *tasks = user;
+    return tasks->job(tasks->entries[index], tasks->user);
+}
+
+//
+// Run a job over a set of entries, weighting each by its estimated cost
+// Returns the number of entries whose job failed
+//
+size_t dat2scheduler_run(dat2entry **entries, size_t count, dat2scheduler_job job, void *user, unsigned threads)
+{
+    uint64_t *costs = malloc(count*sizeof(uint64_t));
+    if (!costs)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return count;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        costs[i] = dat2scheduler_entry_cost(entries[i]);
+
+    entry_tasks tasks = { entries, job, user };
+    size_t failures = dat2scheduler_run_tasks(count, costs, run_entry_task, &tasks, threads);
+    free(costs);
+    return failures;
+}
+
+//
+// Run a job over every entry in a reader that matches a filter
+// (NULL selects all entries). Returns the number of failed entries
+//
+size_t dat2scheduler_run_reader(dat2reader *reader, dat2scheduler_filter filter, dat2scheduler_job job, void *user, unsigned threads)
+{
+    dat2entry **entries = malloc(reader->entry_count*sizeof(dat2entry *));
+    if (!entries)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return reader->entry_count;
+    }
+
+    size_t count = 0;
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+        if (!filter || filter(&reader->entries[i], user))
+            entries[count++] = &reader->entries[i];
+
+    size_t failures = dat2scheduler_run(entries, count, job, user, threads);
+    free(entries);
+    return failures;
+}
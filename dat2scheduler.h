@@ -0,0 +1,52 @@
+/*
+ * dat2scheduler.h
+ * Distributes bulk operations over .dat entries between worker threads
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _dat2scheduler_h
+#define _dat2scheduler_h
+
+#include <stddef.h>
+#include "dat2reader.h"
+
+// Called once for every scheduled entry, possibly from several threads at once
+// Returns 0 on success, or nonzero if the entry failed
+typedef int (*dat2scheduler_job)(dat2entry *entry, void *user);
+
+// Called once for every task index, possibly from several threads at once
+// Returns 0 on success, or nonzero if the task failed
+typedef int (*dat2scheduler_task)(size_t index, void *user);
+
+// Selects the entries of a reader that should be scheduled
+typedef bool (*dat2scheduler_filter)(dat2entry *entry, void *user);
+
+unsigned dat2scheduler_default_threads(void);
+uint64_t dat2scheduler_entry_cost(dat2entry *entry);
+size_t dat2scheduler_run_tasks(size_t count, const uint64_t *costs, dat2scheduler_task job, void *user, unsigned threads);
+size_t dat2scheduler_run(dat2entry **entries, size_t count, dat2scheduler_job job, void *user, unsigned threads);
+size_t dat2scheduler_run_reader(dat2reader *reader, dat2scheduler_filter filter, dat2scheduler_job job, void *user, unsigned threads);
+
+#endif
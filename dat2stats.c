@@ -0,0 +1,678 @@
+/*
+ * dat2stats.c
+ * Columnar entry metadata and archive statistics
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "dat2stats.h"
+#include "dat2scheduler.h"
+#include "checksum.h"
+
+// Entries aggregated by each task before the partial results are merged
+#define DAT2STATS_CHUNK 16384
+
+//
+// Return the id of a name, adding a lower case copy if it is new
+// Returns UINT32_MAX on error
+//
+static uint32_t intern_name(dat2names *names, const char *name, size_t length)
+{
+    // Keep the table at most half full
+    if (2*(names->count + 1) > names->index_mask + 1 || !names->index)
+    {
+        uint32_t size = names->index ? 2*(names->index_mask + 1) : 64;
+        uint32_t *index = calloc(size, sizeof(uint32_t));
+        if (!index)
+            return UINT32_MAX;
+
+        for (uint32_t i = 0; i < names->count; i++)
+        {
+            uint32_t slot = hash64((const uint8_t *)names->names[i], strlen(names->names[i]), 0) & (size - 1);
+            while (index[slot])
+                slot = (slot + 1) & (size - 1);
+            index[slot] = i + 1;
+        }
+
+        free(names->index);
+        names->index = index;
+        names->index_mask = size - 1;
+    }
+
+    char lower[256];
+    if (length >= sizeof(lower))
+        length = sizeof(lower) - 1;
+    for (size_t i = 0; i < length; i++)
+        lower[i] = tolower((unsigned char)name[i]);
+    lower[length] = '\0';
+
+    uint32_t slot = hash64((const uint8_t *)lower, length, 0) & names->index_mask;
+    while (names->index[slot])
+    {
+        if (strcmp(names->names[names->index[slot] - 1], lower) == 0)
+            return names->index[slot] - 1;
+        slot = (slot + 1) & names->index_mask;
+    }
+
+    if (names->count == names->capacity)
+    {
+        uint32_t capacity = names->capacity ? 2*names->capacity : 64;
+        char **grown = realloc(names->names, capacity*sizeof(char *));
+        if (!grown)
+            return UINT32_MAX;
+        names->names = grown;
+        names->capacity = capacity;
+    }
+
+    names->names[names->count] = strdup(lower);
+    if (!names->names[names->count])
+        return UINT32_MAX;
+
+    names->index[slot] = names->count + 1;
+    return names->count++;
+}
+
+static void free_names(dat2names *names)
+{
+    for (uint32_t i = 0; i < names->count; i++)
+        free(names->names[i]);
+    free(names->names);
+    free(names->index);
+}
+
+//
+// Copy the directory of a reader into columns, splitting each filename
+// into its directory and extension
+// Returns NULL on error
+//
+dat2columns *dat2columns_from_reader(dat2reader *reader)
+{
+    dat2columns *columns = calloc(1, sizeof(dat2columns));
+    if (!columns)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    uint32_t count = reader->entry_count;
+    columns->count = count;
+    columns->filename = malloc(count*sizeof(char *));
+    columns->compressed = malloc(count*sizeof(uint8_t));
+    columns->uncompressed_size = malloc(count*sizeof(uint32_t));
+    columns->compressed_size = malloc(count*sizeof(uint32_t));
+    columns->offset = malloc(count*sizeof(uint64_t));
+    columns->extension = malloc(count*sizeof(uint32_t));
+    columns->directory = malloc(count*sizeof(uint32_t));
+    if (count && (!columns->filename || !columns->compressed || !columns->uncompressed_size ||
+        !columns->compressed_size || !columns->offset || !columns->extension || !columns->directory))
+        goto error;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        dat2entry *entry = &reader->entries[i];
+        columns->filename[i] = entry->filename;
+        columns->compressed[i] = entry->compressed;
+        columns->uncompressed_size[i] = entry->uncompressed_size;
+        columns->compressed_size[i] = entry->compressed_size;
+        columns->offset[i] = entry->offset;
+
+        const char *slash = strrchr(entry->filename, '\\');
+        const char *base = slash ? slash + 1 : entry->filename;
+        const char *dot = strrchr(base, '.');
+        columns->directory[i] = intern_name(&columns->directories, entry->filename, slash ? slash - entry->filename : 0);
+        columns->extension[i] = intern_name(&columns->extensions, dot ? dot + 1 : "", dot ? strlen(dot + 1) : 0);
+        if (columns->directory[i] == UINT32_MAX || columns->extension[i] == UINT32_MAX)
+            goto error;
+    }
+
+    return columns;
+
+error:
+    fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+    dat2columns_free(columns);
+    return NULL;
+}
+
+void dat2columns_free(dat2columns *columns)
+{
+    free(columns->filename);
+    free(columns->compressed);
+    free(columns->uncompressed_size);
+    free(columns->compressed_size);
+    free(columns->offset);
+    free(columns->extension);
+    free(columns->directory);
+    free_names(&columns->extensions);
+    free_names(&columns->directories);
+    free(columns);
+}
+
+static void add_total(dat2stats_total *total, uint64_t count, uint64_t uncompressed_size, uint64_t compressed_size)
+{
+    total->count += count;
+    total->uncompressed_size += uncompressed_size;
+    total->compressed_size += compressed_size;
+}
+
+static uint32_t size_bucket(uint32_t size)
+{
+    return size ? 32 - __builtin_clz(size) : 0;
+}
+
+static uint32_t ratio_bucket(uint32_t uncompressed_size, uint32_t compressed_size)
+{
+    if (compressed_size >= uncompressed_size)
+        return DAT2STATS_RATIO_BUCKETS - 1;
+    return (uint64_t)compressed_size*(DAT2STATS_RATIO_BUCKETS - 1)/uncompressed_size;
+}
+
+//
+// Insert an entry into a largest-first list if it is big enough.
+// Ties keep the earlier entry first
+//
+static void add_largest(dat2stats *stats, dat2columns *columns, uint32_t entry)
+{
+    uint32_t size = columns->uncompressed_size[entry];
+    uint32_t position = stats->largest_count;
+    while (position > 0 && columns->uncompressed_size[stats->largest[position - 1]] < size)
+        position--;
+
+    if (position >= DAT2STATS_LARGEST)
+        return;
+
+    uint32_t last = stats->largest_count < DAT2STATS_LARGEST ? stats->largest_count++ : DAT2STATS_LARGEST - 1;
+    memmove(&stats->largest[position + 1], &stats->largest[position], (last - position)*sizeof(uint32_t));
+    stats->largest[position] = entry;
+}
+
+typedef struct
+{
+    dat2columns *columns;
+    dat2stats *partials;
+} stats_job;
+
+//
+// Aggregate one chunk of entries into its own partial result
+//
+static int aggregate_chunk(size_t index, void *user)
+{
+    stats_job *job = user;
+    dat2columns *columns = job->columns;
+    dat2stats *stats = &job->partials[index];
+    uint32_t start = index*DAT2STATS_CHUNK;
+    uint32_t end = columns->count - start < DAT2STATS_CHUNK ? columns->count : start + DAT2STATS_CHUNK;
+
+    stats->extensions = calloc(columns->extensions.count, sizeof(dat2stats_total));
+    stats->directories = calloc(columns->directories.count, sizeof(dat2stats_total));
+    if (!stats->extensions || !stats->directories)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // Whole-column sums are plain loops over contiguous arrays, with the
+    // compressed flag applied as a mask, so the compiler can vectorize them
+    const uint32_t *uncompressed = columns->uncompressed_size;
+    const uint32_t *compressed = columns->compressed_size;
+    const uint8_t *flag = columns->compressed;
+    const uint64_t *offset = columns->offset;
+    uint64_t uncompressed_sum = 0, compressed_sum = 0;
+    uint64_t flag_count = 0, flag_uncompressed_sum = 0, flag_compressed_sum = 0;
+    uint64_t out_of_order = 0;
+    for (uint32_t i = start; i < end; i++)
+    {
+        uint64_t mask = -(uint64_t)(flag[i] != 0);
+        uncompressed_sum += uncompressed[i];
+        compressed_sum += compressed[i];
+        flag_count += flag[i] != 0;
+        flag_uncompressed_sum += uncompressed[i] & mask;
+        flag_compressed_sum += compressed[i] & mask;
+    }
+
+    for (uint32_t i = start ? start : 1; i < end; i++)
+        out_of_order += offset[i] < offset[i - 1];
+
+    add_total(&stats->all, end - start, uncompressed_sum, compressed_sum);
+    add_total(&stats->compressed, flag_count, flag_uncompressed_sum, flag_compressed_sum);
+    stats->out_of_order = out_of_order;
+
+    // Grouped sums scatter into small tables that stay in cache
+    for (uint32_t i = start; i < end; i++)
+    {
+        add_total(&stats->extensions[columns->extension[i]], 1, uncompressed[i], compressed[i]);
+        add_total(&stats->directories[columns->directory[i]], 1, uncompressed[i], compressed[i]);
+        add_total(&stats->sizes[size_bucket(uncompressed[i])], 1, uncompressed[i], compressed[i]);
+        if (flag[i])
+            add_total(&stats->ratios[ratio_bucket(uncompressed[i], compressed[i])], 1, uncompressed[i], compressed[i]);
+        add_largest(stats, columns, i);
+    }
+    return 0;
+}
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+} extent;
+
+static int compare_extent(const void *a, const void *b)
+{
+    const extent *ea = a;
+    const extent *eb = b;
+    if (ea->start != eb->start)
+        return ea->start < eb->start ? -1 : 1;
+    return ea->end < eb->end ? -1 : ea->end > eb->end ? 1 : 0;
+}
+
+//
+// Measure unused space between entry data, and data shared by more than
+// one entry, within the data region that ends at the directory
+// Returns 0 on success, or -1 on error
+//
+static int measure_layout(dat2stats *stats, dat2columns *columns, uint64_t directory_offset)
+{
+    stats->data_size = directory_offset;
+    extent *extents = malloc(columns->count*sizeof(extent));
+    if (columns->count && !extents)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < columns->count; i++)
+    {
+        extents[i].start = columns->offset[i];
+        extents[i].end = columns->offset[i] + columns->compressed_size[i];
+    }
+    qsort(extents, columns->count, sizeof(extent), compare_extent);
+
+    uint64_t covered = 0;
+    for (uint32_t i = 0; i < columns->count; i++)
+    {
+        if (extents[i].start > covered)
+        {
+            stats->gap_count++;
+            stats->gap_size += extents[i].start - covered;
+        }
+        else if (extents[i].start < covered && extents[i].end > extents[i].start)
+        {
+            stats->overlap_count++;
+            stats->overlap_size += (extents[i].end < covered ? extents[i].end : covered) - extents[i].start;
+        }
+
+        if (extents[i].end > covered)
+            covered = extents[i].end;
+    }
+
+    if (directory_offset > covered)
+    {
+        stats->gap_count++;
+        stats->gap_size += directory_offset - covered;
+    }
+
+    free(extents);
+    return 0;
+}
+
+//
+// Aggregate sizes by extension, directory, size and compression ratio,
+// find the largest entries and measure the data layout. Chunks of
+// entries are aggregated in parallel and then merged
+// Returns NULL on error
+//
+dat2stats *dat2stats_build(dat2columns *columns, uint64_t directory_offset, unsigned threads)
+{
+    dat2stats *stats = calloc(1, sizeof(dat2stats));
+    if (!stats)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    size_t chunk_count = (columns->count + DAT2STATS_CHUNK - 1)/DAT2STATS_CHUNK;
+    stats_job job;
+    job.columns = columns;
+    job.partials = calloc(chunk_count, sizeof(dat2stats));
+    stats->extensions = calloc(columns->extensions.count, sizeof(dat2stats_total));
+    stats->directories = calloc(columns->directories.count, sizeof(dat2stats_total));
+    if ((chunk_count && !job.partials) || (columns->extensions.count && !stats->extensions) ||
+        (columns->directories.count && !stats->directories))
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto error;
+    }
+
+    if (dat2scheduler_run_tasks(chunk_count, NULL, aggregate_chunk, &job, threads))
+        goto error;
+
+    for (size_t c = 0; c < chunk_count; c++)
+    {
+        dat2stats *partial = &job.partials[c];
+        add_total(&stats->all, partial->all.count, partial->all.uncompressed_size, partial->all.compressed_size);
+        add_total(&stats->compressed, partial->compressed.count, partial->compressed.uncompressed_size,
+            partial->compressed.compressed_size);
+        stats->out_of_order += partial->out_of_order;
+
+        for (uint32_t i = 0; i < columns->extensions.count; i++)
+            add_total(&stats->extensions[i], partial->extensions[i].count, partial->extensions[i].uncompressed_size,
+                partial->extensions[i].compressed_size);
+        for (uint32_t i = 0; i < columns->directories.count; i++)
+            add_total(&stats->directories[i], partial->directories[i].count, partial->directories[i].uncompressed_size,
+                partial->directories[i].compressed_size);
+        for (uint32_t i = 0; i < DAT2STATS_SIZE_BUCKETS; i++)
+            add_total(&stats->sizes[i], partial->sizes[i].count, partial->sizes[i].uncompressed_size,
+                partial->sizes[i].compressed_size);
+        for (uint32_t i = 0; i < DAT2STATS_RATIO_BUCKETS; i++)
+            add_total(&stats->ratios[i], partial->ratios[i].count, partial->ratios[i].uncompressed_size,
+                partial->ratios[i].compressed_size);
+
+        // Chunks are merged in entry order, so ties still favour earlier entries
+        for (uint32_t i = 0; i < partial->largest_count; i++)
+            add_largest(stats, columns, partial->largest[i]);
+    }
+
+    if (measure_layout(stats, columns, directory_offset))
+        goto error;
+
+    for (size_t c = 0; c < chunk_count; c++)
+    {
+        free(job.partials[c].extensions);
+        free(job.partials[c].directories);
+    }
+    free(job.partials);
+    return stats;
+
+error:
+    if (job.partials)
+    {
+        for (size_t c = 0; c < chunk_count; c++)
+        {
+            free(job.partials[c].extensions);
+            free(job.partials[c].directories);
+        }
+    }
+    free(job.partials);
+    dat2stats_free(stats);
+    return NULL;
+}
+
+void dat2stats_free(dat2stats *stats)
+{
+    free(stats->extensions);
+    free(stats->directories);
+    free(stats);
+}
+
+typedef struct
+{
+    uint32_t id;
+    const dat2stats_total *total;
+} ranked_group;
+
+static int compare_group(const void *a, const void *b)
+{
+    const ranked_group *ga = a;
+    const ranked_group *gb = b;
+    if (ga->total->compressed_size != gb->total->compressed_size)
+        return ga->total->compressed_size > gb->total->compressed_size ? -1 : 1;
+    return ga->id < gb->id ? -1 : ga->id > gb->id;
+}
+
+//
+// Order the groups of a name table by the archive space they use
+// Returns NULL on error
+//
+static ranked_group *rank_groups(const dat2stats_total *totals, uint32_t count)
+{
+    ranked_group *groups = malloc((count ? count : 1)*sizeof(ranked_group));
+    if (!groups)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        groups[i].id = i;
+        groups[i].total = &totals[i];
+    }
+    qsort(groups, count, sizeof(ranked_group), compare_group);
+    return groups;
+}
+
+static double ratio(const dat2stats_total *total)
+{
+    return total->uncompressed_size ? (double)total->compressed_size/total->uncompressed_size : 1.0;
+}
+
+static void write_json_string(FILE *out, const char *value)
+{
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)value; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static void write_json_total(FILE *out, const dat2stats_total *total)
+{
+    fprintf(out, "\"count\":%llu,\"uncompressed_size\":%llu,\"compressed_size\":%llu,\"ratio\":%.4f",
+        (unsigned long long)total->count, (unsigned long long)total->uncompressed_size,
+        (unsigned long long)total->compressed_size, ratio(total));
+}
+
+static int write_json_groups(FILE *out, const char *key, const dat2names *names, const dat2stats_total *totals)
+{
+    ranked_group *groups = rank_groups(totals, names->count);
+    if (!groups)
+        return -1;
+
+    fprintf(out, ",\n  \"%s\": [", key);
+    for (uint32_t i = 0; i < names->count; i++)
+    {
+        fprintf(out, "%s\n    {\"name\":", i ? "," : "");
+        write_json_string(out, names->names[groups[i].id]);
+        fputc(',', out);
+        write_json_total(out, groups[i].total);
+        fputc('}', out);
+    }
+    fprintf(out, "\n  ]");
+    free(groups);
+    return 0;
+}
+
+//
+// Write statistics as a JSON document. Groups are ordered by the
+// archive space they use and histograms list only non-empty buckets
+// Returns 0 on success, or -1 on error
+//
+int dat2stats_write_json(dat2stats *stats, dat2columns *columns, FILE *out)
+{
+    fprintf(out, "{\n  \"total\": {");
+    write_json_total(out, &stats->all);
+    fprintf(out, "},\n  \"compressed\": {");
+    write_json_total(out, &stats->compressed);
+    fputc('}', out);
+
+    if (write_json_groups(out, "extensions", &columns->extensions, stats->extensions) ||
+        write_json_groups(out, "directories", &columns->directories, stats->directories))
+        return -1;
+
+    fprintf(out, ",\n  \"sizes\": [");
+    bool first = true;
+    for (uint32_t i = 0; i < DAT2STATS_SIZE_BUCKETS; i++)
+    {
+        if (!stats->sizes[i].count)
+            continue;
+
+        uint64_t min = i ? 1ULL << (i - 1) : 0;
+        uint64_t max = i ? (1ULL << i) - 1 : 0;
+        fprintf(out, "%s\n    {\"min\":%llu,\"max\":%llu,", first ? "" : ",", (unsigned long long)min, (unsigned long long)max);
+        write_json_total(out, &stats->sizes[i]);
+        fputc('}', out);
+        first = false;
+    }
+
+    fprintf(out, "\n  ],\n  \"ratios\": [");
+    first = true;
+    for (uint32_t i = 0; i < DAT2STATS_RATIO_BUCKETS; i++)
+    {
+        if (!stats->ratios[i].count)
+            continue;
+
+        // The last bucket holds entries that did not shrink
+        fprintf(out, "%s\n    {\"min\":%.1f,", first ? "" : ",", i/10.0);
+        if (i + 1 < DAT2STATS_RATIO_BUCKETS)
+            fprintf(out, "\"max\":%.1f,", (i + 1)/10.0);
+        write_json_total(out, &stats->ratios[i]);
+        fputc('}', out);
+        first = false;
+    }
+
+    fprintf(out, "\n  ],\n  \"largest\": [");
+    for (uint32_t i = 0; i < stats->largest_count; i++)
+    {
+        uint32_t entry = stats->largest[i];
+        fprintf(out, "%s\n    {\"name\":", i ? "," : "");
+        write_json_string(out, columns->filename[entry]);
+        fprintf(out, ",\"compressed\":%s,\"uncompressed_size\":%u,\"compressed_size\":%u,\"offset\":%llu}",
+            columns->compressed[entry] ? "true" : "false", columns->uncompressed_size[entry],
+            columns->compressed_size[entry], (unsigned long long)columns->offset[entry]);
+    }
+
+    fprintf(out, "\n  ],\n  \"layout\": {\"data_size\":%llu,\"gaps\":%llu,\"gap_size\":%llu,"
+        "\"overlaps\":%llu,\"overlap_size\":%llu,\"out_of_order\":%llu}\n}\n",
+        (unsigned long long)stats->data_size, (unsigned long long)stats->gap_count,
+        (unsigned long long)stats->gap_size, (unsigned long long)stats->overlap_count,
+        (unsigned long long)stats->overlap_size, (unsigned long long)stats->out_of_order);
+    return ferror(out) ? -1 : 0;
+}
+
+static void write_csv_string(FILE *out, const char *value)
+{
+    if (!strpbrk(value, ",\"\r\n"))
+    {
+        fputs(value, out);
+        return;
+    }
+
+    fputc('"', out);
+    for (const char *c = value; *c; c++)
+    {
+        if (*c == '"')
+            fputc('"', out);
+        fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static void write_csv_row(FILE *out, const char *section, const char *name, uint64_t count,
+    uint64_t uncompressed_size, uint64_t compressed_size)
+{
+    fprintf(out, "%s,", section);
+    write_csv_string(out, name);
+    fprintf(out, ",%llu,%llu,%llu\n", (unsigned long long)count, (unsigned long long)uncompressed_size,
+        (unsigned long long)compressed_size);
+}
+
+static int write_csv_groups(FILE *out, const char *section, const dat2names *names, const dat2stats_total *totals)
+{
+    ranked_group *groups = rank_groups(totals, names->count);
+    if (!groups)
+        return -1;
+
+    for (uint32_t i = 0; i < names->count; i++)
+    {
+        const dat2stats_total *total = groups[i].total;
+        write_csv_row(out, section, names->names[groups[i].id], total->count, total->uncompressed_size,
+            total->compressed_size);
+    }
+    free(groups);
+    return 0;
+}
+
+//
+// Write statistics as one CSV table of section,name,count,
+// uncompressed_size,compressed_size rows. Layout rows use the size
+// columns for the bytes involved
+// Returns 0 on success, or -1 on error
+//
+int dat2stats_write_csv(dat2stats *stats, dat2columns *columns, FILE *out)
+{
+    fprintf(out, "section,name,count,uncompressed_size,compressed_size\n");
+    write_csv_row(out, "total", "all", stats->all.count, stats->all.uncompressed_size, stats->all.compressed_size);
+    write_csv_row(out, "total", "compressed", stats->compressed.count, stats->compressed.uncompressed_size,
+        stats->compressed.compressed_size);
+
+    if (write_csv_groups(out, "extension", &columns->extensions, stats->extensions) ||
+        write_csv_groups(out, "directory", &columns->directories, stats->directories))
+        return -1;
+
+    char name[64];
+    for (uint32_t i = 0; i < DAT2STATS_SIZE_BUCKETS; i++)
+    {
+        if (!stats->sizes[i].count)
+            continue;
+
+        snprintf(name, sizeof(name), "%llu-%llu", i ? 1ULL << (i - 1) : 0ULL, i ? (1ULL << i) - 1 : 0ULL);
+        write_csv_row(out, "size", name, stats->sizes[i].count, stats->sizes[i].uncompressed_size,
+            stats->sizes[i].compressed_size);
+    }
+
+    for (uint32_t i = 0; i < DAT2STATS_RATIO_BUCKETS; i++)
+    {
+        if (!stats->ratios[i].count)
+            continue;
+
+        if (i + 1 < DAT2STATS_RATIO_BUCKETS)
+            snprintf(name, sizeof(name), "%.1f-%.1f", i/10.0, (i + 1)/10.0);
+        else
+            snprintf(name, sizeof(name), "%.1f+", i/10.0);
+        write_csv_row(out, "ratio", name, stats->ratios[i].count, stats->ratios[i].uncompressed_size,
+            stats->ratios[i].compressed_size);
+    }
+
+    for (uint32_t i = 0; i < stats->largest_count; i++)
+    {
+        uint32_t entry = stats->largest[i];
+        write_csv_row(out, "largest", columns->filename[entry], 1, columns->uncompressed_size[entry],
+            columns->compressed_size[entry]);
+    }
+
+    write_csv_row(out, "layout", "data", columns->count, stats->data_size, stats->data_size);
+    write_csv_row(out, "layout", "gaps", stats->gap_count, stats->gap_size, stats->gap_size);
+    write_csv_row(out, "layout", "overlaps", stats->overlap_count, stats->overlap_size, stats->overlap_size);
+    write_csv_row(out, "layout", "out_of_order", stats->out_of_order, 0, 0);
+    return ferror(out) ? -1 : 0;
+}
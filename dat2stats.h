@@ -0,0 +1,108 @@
+/*
+ * dat2stats.h
+ * Columnar entry metadata and archive statistics
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _dat2stats_h
+#define _dat2stats_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include "dat2reader.h"
+
+// Entry sizes are bucketed by bit length (0, 1, 2-3, 4-7, ...) and
+// compressed entries by compressed/uncompressed ratio in tenths, with
+// a final bucket for entries that grew
+#define DAT2STATS_SIZE_BUCKETS 33
+#define DAT2STATS_RATIO_BUCKETS 11
+#define DAT2STATS_LARGEST 10
+
+// Interned names, numbered in order of first appearance
+typedef struct
+{
+    uint32_t count;
+    uint32_t capacity;
+    char **names;
+    uint32_t *index;
+    uint32_t index_mask;
+} dat2names;
+
+// Entry metadata stored column-wise: each field is a contiguous array
+// indexed like reader->entries, so a scan over one field touches no others
+typedef struct
+{
+    uint32_t count;
+    char **filename;
+    uint8_t *compressed;
+    uint32_t *uncompressed_size;
+    uint32_t *compressed_size;
+    uint64_t *offset;
+    uint32_t *extension;
+    uint32_t *directory;
+
+    // Lower case extensions (without the dot) and directories
+    dat2names extensions;
+    dat2names directories;
+} dat2columns;
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t uncompressed_size;
+    uint64_t compressed_size;
+} dat2stats_total;
+
+typedef struct
+{
+    dat2stats_total all;
+    dat2stats_total compressed;
+    dat2stats_total *extensions;
+    dat2stats_total *directories;
+    dat2stats_total sizes[DAT2STATS_SIZE_BUCKETS];
+    dat2stats_total ratios[DAT2STATS_RATIO_BUCKETS];
+
+    // Entries with the largest uncompressed size, largest first
+    uint32_t largest_count;
+    uint32_t largest[DAT2STATS_LARGEST];
+
+    // Placement of entry data before the directory
+    uint64_t data_size;
+    uint64_t gap_count;
+    uint64_t gap_size;
+    uint64_t overlap_count;
+    uint64_t overlap_size;
+    uint64_t out_of_order;
+} dat2stats;
+
+dat2columns *dat2columns_from_reader(dat2reader *reader);
+void dat2columns_free(dat2columns *columns);
+
+dat2stats *dat2stats_build(dat2columns *columns, uint64_t directory_offset, unsigned threads);
+void dat2stats_free(dat2stats *stats);
+int dat2stats_write_json(dat2stats *stats, dat2columns *columns, FILE *out);
+int dat2stats_write_csv(dat2stats *stats, dat2columns *columns, FILE *out);
+
+#endif
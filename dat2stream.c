@@ -0,0 +1,361 @@
+/*
+ * dat2stream.c
+ * Incremental reads of .dat entries
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "dat2stream.h"
+#include "dat2pool.h"
+#include "dat2trace.h"
+#include "dat2blocks.h"
+#include "dat2checkpoint.h"
+
+//
+// Open a stream over the uncompressed data of an entry.
+// Compressed entries are inflated incrementally through a 32KB window,
+// so only the data up to the furthest position read is ever decoded.
+// Compressed entries of block archives decode just the blocks read
+// Returns NULL on error
+//
+dat2stream *dat2stream_open(dat2entry *entry)
+{
+    if (!entry->reader)
+        return NULL;
+
+    if (entry->reader->trace)
+        dat2trace_record(entry, DAT2TRACE_EXTRACT_ENTRY);
+
+    dat2stream *stream = malloc(sizeof(dat2stream));
+    if (!stream)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    stream->entry = entry;
+    stream->position = 0;
+    stream->failed = false;
+    stream->input = NULL;
+    stream->window = NULL;
+    if (!entry->compressed)
+        return stream;
+
+    dat2pool *pool = dat2pool_thread();
+    if (!pool)
+        goto pool_error;
+
+    if (entry->reader->blocks)
+    {
+        stream->input = dat2pool_acquire(pool, entry->reader->blocks->block_size);
+        stream->window = dat2pool_acquire(pool, entry->reader->blocks->block_size);
+        stream->block = UINT32_MAX;
+        if (!stream->input || !stream->window)
+            goto pool_error;
+        return stream;
+    }
+
+    stream->input = dat2pool_acquire(pool, DAT2STREAM_INPUT_SIZE);
+    stream->window = dat2pool_acquire(pool, TINFL_LZ_DICT_SIZE);
+    if (!stream->input || !stream->window)
+        goto pool_error;
+
+    dat2stream_seek(stream, 0);
+    return stream;
+
+pool_error:
+    dat2stream_close(stream);
+    return NULL;
+}
+
+//
+// Release resources associated with a stream
+//
+void dat2stream_close(dat2stream *stream)
+{
+    dat2pool *pool = dat2pool_thread();
+    if (pool)
+    {
+        dat2pool_release(pool, stream->input);
+        dat2pool_release(pool, stream->window);
+    }
+    free(stream);
+}
+
+//
+// Save the inflate state after output bytes as a checkpoint of the entry
+//
+static void save_checkpoint(dat2stream *stream, uint64_t output)
+{
+    dat2checkpoint *checkpoint = malloc(sizeof(dat2checkpoint));
+    if (!checkpoint)
+        return;
+
+    checkpoint->output = output;
+    checkpoint->input = stream->input_offset - (stream->input_end - stream->input_start);
+    checkpoint->window_offset = stream->window_offset;
+    checkpoint->status = stream->status;
+    checkpoint->decompressor = stream->decompressor;
+    memcpy(checkpoint->window, stream->window, TINFL_LZ_DICT_SIZE);
+    dat2checkpoints_add(stream->entry, checkpoint);
+}
+
+//
+// Resume inflating from a checkpoint. The input buffer starts empty,
+// and is refilled from the checkpoint's input position when needed
+//
+static void restore_checkpoint(dat2stream *stream, const dat2checkpoint *checkpoint)
+{
+    stream->decompressor = checkpoint->decompressor;
+    memcpy(stream->window, checkpoint->window, TINFL_LZ_DICT_SIZE);
+    stream->window_offset = checkpoint->window_offset;
+    stream->status = checkpoint->status;
+    stream->failed = false;
+    stream->position = checkpoint->output;
+    stream->input_start = stream->input_end = 0;
+    stream->input_offset = checkpoint->input;
+    stream->pending_start = stream->pending_length = 0;
+}
+
+//
+// Inflate the next run of data into the window
+// Returns false once the stream has ended or failed
+//
+static bool inflate_more(dat2stream *stream)
+{
+    dat2entry *entry = stream->entry;
+    while (stream->status != TINFL_STATUS_DONE)
+    {
+        // Refill the input buffer once the inflater has consumed it
+        if (stream->status == TINFL_STATUS_NEEDS_MORE_INPUT && stream->input_start == stream->input_end)
+        {
+            size_t length = entry->compressed_size - stream->input_offset;
+            if (length > DAT2STREAM_INPUT_SIZE)
+                length = DAT2STREAM_INPUT_SIZE;
+
+            if (length == 0 || dat2reader_read_at(entry->reader, stream->input, length,
+                (off_t)entry->offset + stream->input_offset) != length)
+            {
+                fprintf(stderr, "%s: compressed data truncated\n", entry->filename);
+                stream->failed = true;
+                return false;
+            }
+
+            stream->input_offset += length;
+            stream->input_start = 0;
+            stream->input_end = length;
+        }
+
+        mz_uint32 flags = TINFL_FLAG_PARSE_ZLIB_HEADER;
+        if (stream->input_offset < entry->compressed_size)
+            flags |= TINFL_FLAG_HAS_MORE_INPUT;
+
+        size_t in_size = stream->input_end - stream->input_start;
+        size_t out_size = TINFL_LZ_DICT_SIZE - stream->window_offset;
+        stream->status = tinfl_decompress(&stream->decompressor, stream->input + stream->input_start, &in_size,
+            stream->window, stream->window + stream->window_offset, &out_size, flags);
+        stream->input_start += in_size;
+
+        if (stream->status < 0)
+        {
+            fprintf(stderr, "%s: decompression failed\n", entry->filename);
+            stream->failed = true;
+            return false;
+        }
+
+        if (out_size)
+        {
+            stream->pending_start = stream->window_offset;
+            stream->pending_length = out_size;
+            stream->window_offset = (stream->window_offset + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+
+            // Nothing is pending before this run, so position is where it starts
+            uint64_t output = stream->position + out_size;
+            if (entry->reader->checkpoints && dat2checkpoints_resumable(&stream->decompressor) &&
+                dat2checkpoints_due(entry, output))
+                save_checkpoint(stream, output);
+            return true;
+        }
+    }
+    return false;
+}
+
+//
+// Copy (or with a NULL destination, discard) up to length bytes
+// from the current position of a compressed stream
+//
+static size_t read_compressed(dat2stream *stream, uint8_t *data, size_t length)
+{
+    size_t total = 0;
+    while (total < length)
+    {
+        if (!stream->pending_length && !inflate_more(stream))
+            break;
+
+        size_t count = length - total;
+        if (count > stream->pending_length)
+            count = stream->pending_length;
+
+        if (data)
+            memcpy(data + total, stream->window + stream->pending_start, count);
+
+        stream->pending_start += count;
+        stream->pending_length -= count;
+        stream->position += count;
+        total += count;
+    }
+    return total;
+}
+
+//
+// Copy up to length bytes from the current position of a block archive
+// entry, decoding each block the first time it is needed
+//
+static size_t read_blocks(dat2stream *stream, uint8_t *data, size_t length)
+{
+    dat2entry *entry = stream->entry;
+    uint32_t block_size = entry->reader->blocks->block_size;
+    size_t total = 0;
+    while (total < length)
+    {
+        uint32_t block = stream->position/block_size;
+        if (block != stream->block)
+        {
+            stream->block = UINT32_MAX;
+            if (!dat2blocks_read_block(entry, block, stream->window, stream->input))
+            {
+                stream->failed = true;
+                break;
+            }
+            stream->block = block;
+        }
+
+        uint32_t start = stream->position % block_size;
+        size_t count = length - total;
+        if (count > block_size - start)
+            count = block_size - start;
+
+        memcpy(data + total, stream->window + start, count);
+        stream->position += count;
+        total += count;
+    }
+    return total;
+}
+
+//
+// Read up to length bytes from the current position of a stream
+// Returns the number of bytes read, which is less than length
+// at the end of the entry or on error
+//
+size_t dat2stream_read(dat2stream *stream, uint8_t *data, size_t length)
+{
+    dat2entry *entry = stream->entry;
+    if (stream->failed || stream->position >= entry->uncompressed_size)
+        return 0;
+
+    if (length > entry->uncompressed_size - stream->position)
+        length = entry->uncompressed_size - stream->position;
+
+    if (entry->compressed && entry->reader->blocks)
+        return read_blocks(stream, data, length);
+    if (entry->compressed)
+        return read_compressed(stream, data, length);
+
+    size_t read = dat2reader_read_at(entry->reader, data, length, (off_t)entry->offset + stream->position);
+    if (read != length)
+        stream->failed = true;
+
+    stream->position += read;
+    return read;
+}
+
+//
+// Move a stream to an absolute position in the uncompressed data.
+// Seeking a compressed stream forwards inflates and discards the data
+// in between; seeking backwards restarts the inflate from the beginning,
+// or from the nearest checkpoint before the position if the reader keeps
+// them. Block archive entries seek directly to any position
+// Returns 0 on success, or -1 on error
+//
+int dat2stream_seek(dat2stream *stream, uint64_t position)
+{
+    dat2entry *entry = stream->entry;
+    if (position > entry->uncompressed_size)
+        return -1;
+
+    if (!entry->compressed || entry->reader->blocks)
+    {
+        stream->position = position;
+        return 0;
+    }
+
+    const dat2checkpoint *checkpoint = entry->reader->checkpoints ? dat2checkpoints_find(entry, position) : NULL;
+    if (checkpoint && (position < stream->position || checkpoint->output > stream->position))
+        restore_checkpoint(stream, checkpoint);
+    else if (position < stream->position || stream->position == 0)
+    {
+        tinfl_init(&stream->decompressor);
+        stream->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+        stream->failed = false;
+        stream->position = 0;
+        stream->input_start = stream->input_end = 0;
+        stream->input_offset = 0;
+        stream->window_offset = 0;
+        stream->pending_start = stream->pending_length = 0;
+    }
+
+    uint64_t skip = position - stream->position;
+    return read_compressed(stream, NULL, skip) == skip ? 0 : -1;
+}
+
+//
+// Read bytes [start, end) of an entry's uncompressed data without
+// extracting the whole entry. Stored entries are read directly and
+// compressed entries are only inflated as far as end
+// Returns the number of bytes read
+//
+size_t dat2entry_read_range(dat2entry *entry, uint8_t *data, uint32_t start, uint32_t end)
+{
+    if (end > entry->uncompressed_size)
+        end = entry->uncompressed_size;
+    if (start >= end)
+        return 0;
+
+    if (!entry->compressed)
+        return dat2reader_read_at(entry->reader, data, end - start, (off_t)entry->offset + start);
+
+    dat2stream *stream = dat2stream_open(entry);
+    if (!stream)
+        return 0;
+
+    size_t read = 0;
+    if (dat2stream_seek(stream, start) == 0)
+        read = dat2stream_read(stream, data, end - start);
+
+    dat2stream_close(stream);
+    return read;
+}
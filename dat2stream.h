@@ -0,0 +1,72 @@
+/*
+ * dat2stream.h
+ * Incremental reads of .dat entries
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _dat2stream_h
+#define _dat2stream_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dat2reader.h"
+#include "tinfl.h"
+
+// Size of the compressed input buffer refilled from the archive
+#define DAT2STREAM_INPUT_SIZE 16384
+
+typedef struct
+{
+    dat2entry *entry;
+    uint64_t position;
+    bool failed;
+
+    // Compressed entries only: input buffer, output window and inflate state
+    uint8_t *input;
+    size_t input_start;
+    size_t input_end;
+    uint32_t input_offset;
+
+    uint8_t *window;
+    size_t window_offset;
+    size_t pending_start;
+    size_t pending_length;
+
+    tinfl_status status;
+    tinfl_decompressor decompressor;
+
+    // Compressed entries of block archives decode whole blocks into
+    // window, using input as scratch, and keep the index of that block
+    uint32_t block;
+} dat2stream;
+
+dat2stream *dat2stream_open(dat2entry *entry);
+void dat2stream_close(dat2stream *stream);
+size_t dat2stream_read(dat2stream *stream, uint8_t *data, size_t length);
+int dat2stream_seek(dat2stream *stream, uint64_t position);
+
+size_t dat2entry_read_range(dat2entry *entry, uint8_t *data, uint32_t start, uint32_t end);
+
+#endif
@@ -0,0 +1,306 @@
+/*
+ * dat2trace.c
+ * Records entry accesses and lays out or warms archives from them
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "dat2trace.h"
+#include "byteorder.h"
+#include "dat2writer.h"
+#include "checksum.h"
+
+static uint64_t now_microseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+//
+// Hash the names and offsets of every entry, which identifies the
+// directory order that trace entry indices refer to
+//
+static uint64_t directory_hash(dat2reader *reader)
+{
+    uint64_t hash = 0;
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+    {
+        uint8_t offset[8];
+        put_le64(offset, reader->entries[i].offset);
+        hash = hash64((const uint8_t *)reader->entries[i].filename, strlen(reader->entries[i].filename), hash);
+        hash = hash64(offset, sizeof(offset), hash);
+    }
+    return hash;
+}
+
+//
+// Start recording the entries found and extracted through a reader
+// Returns 0 on success, or -1 on error
+//
+int dat2reader_start_trace(dat2reader *reader, const char *path)
+{
+    dat2trace *trace = calloc(1, sizeof(dat2trace));
+    if (!trace)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    trace->file = fopen(path, "wb");
+    if (!trace->file)
+    {
+        fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+        free(trace);
+        return -1;
+    }
+
+    uint8_t header[DAT2TRACE_HEADER_SIZE];
+    memcpy(header, DAT2TRACE_MAGIC, DAT2TRACE_MAGIC_SIZE);
+    put_le32(header + 8, reader->entry_count);
+    put_le32(header + 12, 0);
+    put_le64(header + 16, reader->filesize);
+    put_le64(header + 24, directory_hash(reader));
+    fwrite(header, 1, sizeof(header), trace->file);
+
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->start = now_microseconds();
+    reader->trace = trace;
+    return 0;
+}
+
+//
+// Stop recording and close the trace file
+// Returns 0 if every access was written, or -1 on error
+//
+int dat2reader_stop_trace(dat2reader *reader)
+{
+    dat2trace *trace = reader->trace;
+    if (!trace)
+        return 0;
+
+    reader->trace = NULL;
+    int status = trace->failed || ferror(trace->file) ? -1 : 0;
+    if (fclose(trace->file))
+        status = -1;
+    if (status)
+        fprintf(stderr, "Error writing access trace\n");
+
+    pthread_mutex_destroy(&trace->lock);
+    free(trace);
+    return status;
+}
+
+//
+// Append an access to the reader's trace. Records are buffered by stdio,
+// so the lock is only held for a copy into the buffer
+//
+void dat2trace_record(dat2entry *entry, dat2trace_kind kind)
+{
+    dat2trace *trace = entry->reader->trace;
+    uint8_t record[DAT2TRACE_RECORD_SIZE];
+    uint32_t index = entry - entry->reader->entries;
+    put_le32(record, index | (kind == DAT2TRACE_EXTRACT_ENTRY ? DAT2TRACE_EXTRACT : 0));
+
+    pthread_mutex_lock(&trace->lock);
+    put_le64(record + 4, now_microseconds() - trace->start);
+    if (fwrite(record, 1, sizeof(record), trace->file) != sizeof(record))
+        trace->failed = true;
+    pthread_mutex_unlock(&trace->lock);
+}
+
+//
+// Read a trace recorded against this archive and list the entries it
+// touched, in order of their first access
+// Returns an array of count entry indices, or NULL on error
+//
+uint32_t *dat2trace_load_order(dat2reader *reader, const char *path, uint32_t *count)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    uint32_t *order = NULL;
+    bool *seen = NULL;
+    uint8_t header[DAT2TRACE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        memcmp(header, DAT2TRACE_MAGIC, DAT2TRACE_MAGIC_SIZE))
+    {
+        fprintf(stderr, "%s is not an access trace\n", path);
+        goto error;
+    }
+
+    if (get_le32(header + 8) != reader->entry_count || get_le64(header + 16) != reader->filesize ||
+        get_le64(header + 24) != directory_hash(reader))
+    {
+        fprintf(stderr, "%s was recorded against a different archive\n", path);
+        goto error;
+    }
+
+    order = malloc((reader->entry_count ? reader->entry_count : 1)*sizeof(uint32_t));
+    seen = calloc(reader->entry_count ? reader->entry_count : 1, sizeof(bool));
+    if (!order || !seen)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto error;
+    }
+
+    *count = 0;
+    uint8_t record[DAT2TRACE_RECORD_SIZE];
+    while (fread(record, 1, sizeof(record), file) == sizeof(record))
+    {
+        uint32_t index = get_le32(record) & ~DAT2TRACE_EXTRACT;
+        if (index >= reader->entry_count)
+        {
+            fprintf(stderr, "%s: invalid entry index %u\n", path, index);
+            goto error;
+        }
+
+        if (!seen[index])
+        {
+            seen[index] = true;
+            order[(*count)++] = index;
+        }
+    }
+
+    free(seen);
+    fclose(file);
+    return order;
+
+error:
+    free(seen);
+    free(order);
+    fclose(file);
+    return NULL;
+}
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+} range;
+
+static int compare_range(const void *a, const void *b)
+{
+    const range *ra = a;
+    const range *rb = b;
+    return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+//
+// Read the data of the given entries into the page cache. Their ranges
+// are sorted by offset and nearby ranges merged, so the archive is read
+// in one forward sweep rather than in access order
+// Returns 0 on success, or -1 on error
+//
+int dat2trace_prefetch(dat2reader *reader, const uint32_t *order, uint32_t count, uint64_t *bytes)
+{
+    *bytes = 0;
+    range *ranges = malloc((count ? count : 1)*sizeof(range));
+    uint8_t *buffer = malloc(DAT2TRACE_PREFETCH_GAP);
+    if (!ranges || !buffer)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(ranges);
+        free(buffer);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        dat2entry *entry = &reader->entries[order[i]];
+        ranges[i].start = entry->offset;
+        ranges[i].end = entry->offset + entry->compressed_size;
+    }
+    qsort(ranges, count, sizeof(range), compare_range);
+
+    int status = 0;
+    for (uint32_t i = 0; i < count && status == 0;)
+    {
+        uint64_t start = ranges[i].start;
+        uint64_t end = ranges[i].end;
+        for (i++; i < count && ranges[i].start <= end + DAT2TRACE_PREFETCH_GAP; i++)
+            if (ranges[i].end > end)
+                end = ranges[i].end;
+
+        for (uint64_t position = start; position < end;)
+        {
+            size_t length = end - position < DAT2TRACE_PREFETCH_GAP ? end - position : DAT2TRACE_PREFETCH_GAP;
+            if (dat2reader_read_at(reader, buffer, length, position) != length)
+            {
+                status = -1;
+                break;
+            }
+            position += length;
+            *bytes += length;
+        }
+    }
+
+    free(buffer);
+    free(ranges);
+    return status;
+}
+
+//
+// Copy an archive with the data and directory of the given entries
+// first, in trace order, followed by the untouched entries in their
+// original order. Entries are copied without recompressing
+// Returns 0 on success, or -1 on error
+//
+int dat2trace_repack(dat2reader *reader, const uint32_t *order, uint32_t count, const char *path)
+{
+    bool *placed = calloc(reader->entry_count ? reader->entry_count : 1, sizeof(bool));
+    if (!placed)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    dat2writer *writer = dat2writer_create(path, reader->extended);
+    if (!writer)
+    {
+        free(placed);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count && !writer->failed; i++)
+    {
+        placed[order[i]] = true;
+        dat2writer_copy_entry(writer, &reader->entries[order[i]], NULL);
+    }
+
+    for (uint32_t i = 0; i < reader->entry_count && !writer->failed; i++)
+        if (!placed[i])
+            dat2writer_copy_entry(writer, &reader->entries[i], NULL);
+
+    free(placed);
+    return dat2writer_close(writer);
+}
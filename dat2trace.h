@@ -0,0 +1,74 @@
+/*
+ * dat2trace.h
+ * Records entry accesses and lays out or warms archives from them
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _dat2trace_h
+#define _dat2trace_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "dat2reader.h"
+
+// A trace starts with the magic, the archive's entry count, 4 reserved
+// bytes, the archive size and a hash of its directory, all little-endian,
+// so that traces are only applied to the archive they index. Each access is then
+// recorded as a 32-bit entry index, with DAT2TRACE_EXTRACT set for
+// extractions, and a 64-bit time in microseconds since tracing started
+#define DAT2TRACE_MAGIC "DAT2TRC\x1A"
+#define DAT2TRACE_MAGIC_SIZE 8
+#define DAT2TRACE_HEADER_SIZE 32
+#define DAT2TRACE_RECORD_SIZE 12
+#define DAT2TRACE_EXTRACT 0x80000000U
+
+// Touched ranges closer than this are read as one during prefetch
+#define DAT2TRACE_PREFETCH_GAP (256*1024)
+
+typedef enum
+{
+    DAT2TRACE_FIND,
+    DAT2TRACE_EXTRACT_ENTRY,
+} dat2trace_kind;
+
+typedef struct dat2trace
+{
+    FILE *file;
+    pthread_mutex_t lock;
+    uint64_t start;
+    bool failed;
+} dat2trace;
+
+int dat2reader_start_trace(dat2reader *reader, const char *path);
+int dat2reader_stop_trace(dat2reader *reader);
+void dat2trace_record(dat2entry *entry, dat2trace_kind kind);
+
+uint32_t *dat2trace_load_order(dat2reader *reader, const char *path, uint32_t *count);
+int dat2trace_prefetch(dat2reader *reader, const uint32_t *order, uint32_t count, uint64_t *bytes);
+int dat2trace_repack(dat2reader *reader, const uint32_t *order, uint32_t count, const char *path);
+
+#endif
@@ -0,0 +1,289 @@
+/*
+ * dat2writer.c
+ * Writes Fallout 2 .dat files
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "dat2writer.h"
+#include "deflate.h"
+
+//
+// Create a new archive at path. Entry data is written as it is added,
+// and the directory is written by dat2writer_close. Archives are written
+// in the standard format unless extended is set or they outgrow 4GB
+// Returns NULL if there is an error
+//
+dat2writer *dat2writer_create(const char *path, bool extended)
+{
+    dat2writer *writer = malloc(sizeof(dat2writer));
+    if (!writer)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    writer->file = fopen(path, "wb");
+    if (!writer->file)
+    {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        free(writer);
+        return NULL;
+    }
+
+    writer->extended = extended;
+    writer->failed = false;
+    writer->offset = 0;
+    writer->entry_count = 0;
+    writer->entry_capacity = 0;
+    writer->entries = NULL;
+    return writer;
+}
+
+static dat2writer_entry *append_entry(dat2writer *writer, const char *filename)
+{
+    if (writer->entry_count == writer->entry_capacity)
+    {
+        uint32_t capacity = writer->entry_capacity ? 2*writer->entry_capacity : 256;
+        dat2writer_entry *entries = realloc(writer->entries, capacity*sizeof(dat2writer_entry));
+        if (!entries)
+        {
+            fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+            return NULL;
+        }
+        writer->entries = entries;
+        writer->entry_capacity = capacity;
+    }
+
+    dat2writer_entry *entry = &writer->entries[writer->entry_count];
+    entry->filename = strdup(filename);
+    if (!entry->filename)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    writer->entry_count++;
+    return entry;
+}
+
+//
+// Add an entry whose data is already in its stored form: a zlib stream
+// if compressed is set, otherwise the raw file contents
+// Returns 0 on success, or -1 on error
+//
+int dat2writer_add_raw(dat2writer *writer, const char *filename, bool compressed, uint32_t uncompressed_size,
+    const uint8_t *data, uint32_t compressed_size)
+{
+    if (writer->failed)
+        return -1;
+
+    dat2writer_entry *entry = append_entry(writer, filename);
+    if (!entry)
+        goto error;
+
+    entry->compressed = compressed;
+    entry->uncompressed_size = uncompressed_size;
+    entry->compressed_size = compressed_size;
+    entry->offset = writer->offset;
+
+    if (fwrite(data, sizeof(uint8_t), compressed_size, writer->file) != compressed_size)
+    {
+        fprintf(stderr, "Write error: %s\n", strerror(errno));
+        goto error;
+    }
+
+    writer->offset += compressed_size;
+    return 0;
+
+error:
+    writer->failed = true;
+    return -1;
+}
+
+//
+// Add an entry, compressing it at the given deflate level. Entries that
+// do not shrink, or any entry at DEFLATE_LEVEL_STORE, are stored
+// Returns 0 on success, or -1 on error
+//
+int dat2writer_add_data(dat2writer *writer, const char *filename, const uint8_t *data, size_t length, int level)
+{
+    if (length > UINT32_MAX)
+    {
+        fprintf(stderr, "%s: entries are limited to 4GB\n", filename);
+        writer->failed = true;
+        return -1;
+    }
+
+    if (level == DEFLATE_LEVEL_STORE || length == 0)
+        return dat2writer_add_raw(writer, filename, false, length, data, length);
+
+    size_t bound = zlib_bound(length);
+    uint8_t *compressed = malloc(bound);
+    if (!compressed)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        writer->failed = true;
+        return -1;
+    }
+
+    int status;
+    size_t compressed_length = zlib_compress(compressed, bound, data, length, level);
+    if (compressed_length && compressed_length < length)
+        status = dat2writer_add_raw(writer, filename, true, length, compressed, compressed_length);
+    else
+        status = dat2writer_add_raw(writer, filename, false, length, data, length);
+
+    free(compressed);
+    return status;
+}
+
+//
+// Copy an entry from another archive without recompressing it,
+// optionally under a new name. Compressed entries of block archives
+// have no deflate stream to copy, so they are recompressed
+// Returns 0 on success, or -1 on error
+//
+int dat2writer_copy_entry(dat2writer *writer, dat2entry *entry, const char *filename)
+{
+    if (entry->compressed && entry->reader->blocks)
+    {
+        uint8_t *data = dat2entry_extract_data(entry);
+        if (!data)
+        {
+            writer->failed = true;
+            return -1;
+        }
+
+        int status = dat2writer_add_data(writer, filename ? filename : entry->filename, data,
+            entry->uncompressed_size, DEFLATE_LEVEL_DEFAULT);
+        free(data);
+        return status;
+    }
+
+    uint8_t *data = malloc(entry->compressed_size ? entry->compressed_size : 1);
+    if (!data)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        writer->failed = true;
+        return -1;
+    }
+
+    int status = -1;
+    if (dat2reader_read_at(entry->reader, data, entry->compressed_size, entry->offset) == entry->compressed_size)
+        status = dat2writer_add_raw(writer, filename ? filename : entry->filename, entry->compressed,
+            entry->uncompressed_size, data, entry->compressed_size);
+    else
+    {
+        fprintf(stderr, "%s: read error\n", entry->filename);
+        writer->failed = true;
+    }
+
+    free(data);
+    return status;
+}
+
+static uint64_t directory_size(dat2writer *writer)
+{
+    uint64_t size = sizeof(uint32_t);
+    size_t offset_size = writer->extended ? sizeof(uint64_t) : sizeof(uint32_t);
+    for (uint32_t i = 0; i < writer->entry_count; i++)
+        size += sizeof(uint32_t) + strlen(writer->entries[i].filename) + 1 + 2*sizeof(uint32_t) + offset_size;
+    return size;
+}
+
+static int write_directory(dat2writer *writer)
+{
+    // Switch to the extended format if any offset or the total size
+    // does not fit in 32 bits
+    uint64_t tree_size = directory_size(writer);
+    if (!writer->extended && writer->offset + tree_size + DAT2_TRAILER_SIZE > UINT32_MAX)
+    {
+        writer->extended = true;
+        tree_size = directory_size(writer);
+    }
+
+    FILE *f = writer->file;
+    fwrite(&writer->entry_count, sizeof(uint32_t), 1, f);
+    for (uint32_t i = 0; i < writer->entry_count; i++)
+    {
+        dat2writer_entry *entry = &writer->entries[i];
+        uint32_t name_length = strlen(entry->filename);
+        uint8_t compressed = entry->compressed;
+        fwrite(&name_length, sizeof(uint32_t), 1, f);
+        fwrite(entry->filename, sizeof(char), name_length, f);
+        fwrite(&compressed, sizeof(uint8_t), 1, f);
+        fwrite(&entry->uncompressed_size, sizeof(uint32_t), 1, f);
+        fwrite(&entry->compressed_size, sizeof(uint32_t), 1, f);
+        if (writer->extended)
+            fwrite(&entry->offset, sizeof(uint64_t), 1, f);
+        else
+        {
+            uint32_t offset = entry->offset;
+            fwrite(&offset, sizeof(uint32_t), 1, f);
+        }
+    }
+
+    if (writer->extended)
+    {
+        uint64_t filesize = writer->offset + tree_size + DAT2_EXTENDED_TRAILER_SIZE;
+        fwrite(&tree_size, sizeof(uint64_t), 1, f);
+        fwrite(&filesize, sizeof(uint64_t), 1, f);
+        fwrite(DAT2_EXTENDED_MAGIC, 1, DAT2_EXTENDED_MAGIC_SIZE, f);
+    }
+    else
+    {
+        uint32_t tree_size32 = tree_size;
+        uint32_t filesize = writer->offset + tree_size + DAT2_TRAILER_SIZE;
+        fwrite(&tree_size32, sizeof(uint32_t), 1, f);
+        fwrite(&filesize, sizeof(uint32_t), 1, f);
+    }
+
+    if (fflush(f) || ferror(f))
+    {
+        fprintf(stderr, "Write error: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//
+// Write the directory and trailer, and release the writer
+// Returns 0 if the archive was written completely, or -1 on error
+//
+int dat2writer_close(dat2writer *writer)
+{
+    int status = writer->failed ? -1 : write_directory(writer);
+    if (fclose(writer->file))
+        status = -1;
+
+    for (uint32_t i = 0; i < writer->entry_count; i++)
+        free(writer->entries[i].filename);
+    free(writer->entries);
+    free(writer);
+    return status;
+}
@@ -0,0 +1,65 @@
+/*
+ * dat2writer.h
+ * Writes Fallout 2 .dat files
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _dat2writer_h
+#define _dat2writer_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "dat2reader.h"
+
+typedef struct
+{
+    char *filename;
+    bool compressed;
+    uint32_t uncompressed_size;
+    uint32_t compressed_size;
+    uint64_t offset;
+} dat2writer_entry;
+
+typedef struct
+{
+    FILE *file;
+    bool extended;
+    bool failed;
+    uint64_t offset;
+
+    uint32_t entry_count;
+    uint32_t entry_capacity;
+    dat2writer_entry *entries;
+} dat2writer;
+
+dat2writer *dat2writer_create(const char *path, bool extended);
+int dat2writer_add_data(dat2writer *writer, const char *filename, const uint8_t *data, size_t length, int level);
+int dat2writer_add_raw(dat2writer *writer, const char *filename, bool compressed, uint32_t uncompressed_size,
+    const uint8_t *data, uint32_t compressed_size);
+int dat2writer_copy_entry(dat2writer *writer, dat2entry *entry, const char *filename);
+int dat2writer_close(dat2writer *writer);
+
+#endif
@@ -0,0 +1,904 @@
+/*
+ * deflate.c
+ * Deflate (RFC 1951) and zlib (RFC 1950) compression
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include "deflate.h"
+#include "checksum.h"
+
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MAX_STORED 65535
+
+// Number of literal/match symbols collected before a block is emitted
+#define DEFLATE_BLOCK_SYMBOLS 16384
+
+#define DEFLATE_LITLEN_CODES 286
+#define DEFLATE_DIST_CODES 30
+#define DEFLATE_CODELEN_CODES 19
+#define DEFLATE_END_OF_BLOCK 256
+
+typedef struct
+{
+    uint16_t max_chain;     // Hash chain entries searched per position
+    uint16_t nice_length;   // Stop searching once a match is this long
+    uint16_t max_insert;    // Longer greedy matches skip hashing their interior
+    bool lazy;              // Defer a match if the next position has a longer one
+} deflate_params;
+
+static const deflate_params level_params[10] =
+{
+    {    0,   0,   0, false },
+    {    4,  16,  16, false },
+    {    8,  32,  32, false },
+    {   16,  64,  64, false },
+    {   16,  32,   0, true },
+    {   32,  64,   0, true },
+    {  128, 128,   0, true },
+    {  256, 258,   0, true },
+    { 1024, 258,   0, true },
+    { 4096, 258,   0, true },
+};
+
+static const uint16_t length_base[29] =
+{
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const uint8_t length_extra[29] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const uint16_t dist_base[30] =
+{
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const uint8_t dist_extra[30] =
+{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static const uint8_t codelen_order[DEFLATE_CODELEN_CODES] =
+{
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+// Lookup tables from match length / distance to deflate code
+static uint8_t length_code[DEFLATE_MAX_MATCH + 1];
+static uint8_t dist_code_low[512];
+static uint8_t dist_code_high[256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void init_tables(void)
+{
+    for (int code = 0; code < 29; code++)
+        for (int len = length_base[code]; len < length_base[code] + (1 << length_extra[code]) && len <= DEFLATE_MAX_MATCH; len++)
+            length_code[len] = code;
+    length_code[DEFLATE_MAX_MATCH] = 28;
+
+    for (int code = 0; code < 30; code++)
+    {
+        for (int dist = dist_base[code]; dist < dist_base[code] + (1 << dist_extra[code]); dist++)
+        {
+            if (dist <= 512)
+                dist_code_low[dist - 1] = code;
+            else
+                dist_code_high[(dist - 1) >> 7] = code;
+        }
+    }
+}
+
+static inline int get_dist_code(unsigned dist)
+{
+    return dist <= 512 ? dist_code_low[dist - 1] : dist_code_high[(dist - 1) >> 7];
+}
+
+typedef struct
+{
+    uint16_t length;        // Match length, or the literal byte if dist == 0
+    uint16_t dist;
+} deflate_symbol;
+
+typedef struct
+{
+    uint8_t *out;
+    uint8_t *end;
+    uint64_t bits;
+    unsigned count;
+    bool overflow;
+} bitwriter;
+
+static inline void put_bits(bitwriter *bw, uint32_t value, unsigned count)
+{
+    bw->bits |= (uint64_t)value << bw->count;
+    bw->count += count;
+    while (bw->count >= 8)
+    {
+        if (bw->out < bw->end)
+            *bw->out++ = bw->bits & 0xFF;
+        else
+            bw->overflow = true;
+        bw->bits >>= 8;
+        bw->count -= 8;
+    }
+}
+
+static void align_bits(bitwriter *bw)
+{
+    if (bw->count)
+        put_bits(bw, 0, 8 - bw->count);
+}
+
+static void put_bytes(bitwriter *bw, const uint8_t *data, size_t length)
+{
+    if ((size_t)(bw->end - bw->out) < length)
+    {
+        bw->overflow = true;
+        return;
+    }
+    memcpy(bw->out, data, length);
+    bw->out += length;
+}
+
+typedef struct
+{
+    uint32_t key;
+    uint16_t symbol;
+} symbol_frequency;
+
+static int compare_frequency(const void *a, const void *b)
+{
+    const symbol_frequency *fa = a;
+    const symbol_frequency *fb = b;
+    if (fa->key != fb->key)
+        return fa->key < fb->key ? -1 : 1;
+    return fa->symbol - fb->symbol;
+}
+
+//
+// Compute Huffman code lengths in place for symbols sorted by ascending
+// frequency (Moffat and Katajainen's minimum-redundancy algorithm).
+// On return each key holds the code length of its symbol
+//
+static void minimum_redundancy(symbol_frequency *a, int n)
+{
+    a[0].key += a[1].key;
+    int root = 0;
+    int leaf = 2;
+    for (int next = 1; next < n - 1; next++)
+    {
+        if (leaf >= n || a[root].key < a[leaf].key)
+        {
+            a[next].key = a[root].key;
+            a[root++].key = next;
+        }
+        else
+            a[next].key = a[leaf++].key;
+
+        if (leaf >= n || (root < next && a[root].key < a[leaf].key))
+        {
+            a[next].key += a[root].key;
+            a[root++].key = next;
+        }
+        else
+            a[next].key += a[leaf++].key;
+    }
+
+    a[n - 2].key = 0;
+    for (int next = n - 3; next >= 0; next--)
+        a[next].key = a[a[next].key].key + 1;
+
+    int available = 1;
+    int used = 0;
+    int depth = 0;
+    root = n - 2;
+    int next = n - 1;
+    while (available > 0)
+    {
+        while (root >= 0 && (int)a[root].key == depth)
+        {
+            used++;
+            root--;
+        }
+        while (available > used)
+        {
+            a[next--].key = depth;
+            available--;
+        }
+        available = 2*used;
+        depth++;
+        used = 0;
+    }
+}
+
+//
+// Build length-limited Huffman code lengths for a symbol alphabet
+//
+static void build_lengths(const uint32_t *frequency, int n, int max_length, uint8_t *lengths)
+{
+    symbol_frequency sorted[DEFLATE_LITLEN_CODES];
+    int used = 0;
+    for (int i = 0; i < n; i++)
+    {
+        lengths[i] = 0;
+        if (frequency[i])
+        {
+            sorted[used].key = frequency[i];
+            sorted[used].symbol = i;
+            used++;
+        }
+    }
+
+    if (used == 0)
+        return;
+
+    if (used == 1)
+    {
+        lengths[sorted[0].symbol] = 1;
+        return;
+    }
+
+    qsort(sorted, used, sizeof(symbol_frequency), compare_frequency);
+    minimum_redundancy(sorted, used);
+
+    // Count codes per length, folding overlong codes into the limit and then
+    // lengthening shorter codes until the Kraft inequality holds again
+    int count[16] = { 0 };
+    for (int i = 0; i < used; i++)
+        count[sorted[i].key > (uint32_t)max_length ? max_length : sorted[i].key]++;
+
+    uint32_t total = 0;
+    for (int i = max_length; i > 0; i--)
+        total += (uint32_t)count[i] << (max_length - i);
+
+    while (total > (1U << max_length))
+    {
+        count[max_length]--;
+        for (int i = max_length - 1; i > 0; i--)
+        {
+            if (count[i])
+            {
+                count[i]--;
+                count[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // The most frequent symbols receive the shortest codes
+    int j = used;
+    for (int length = 1; length <= max_length; length++)
+        for (int k = count[length]; k > 0; k--)
+            lengths[sorted[--j].symbol] = length;
+}
+
+//
+// Assign canonical Huffman codes, bit-reversed for LSB-first output
+//
+static void build_codes(const uint8_t *lengths, int n, uint16_t *codes)
+{
+    uint16_t count[16] = { 0 };
+    uint16_t next[16];
+    for (int i = 0; i < n; i++)
+        count[lengths[i]]++;
+    count[0] = 0;
+
+    uint16_t code = 0;
+    for (int bits = 1; bits < 16; bits++)
+    {
+        code = (code + count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (!lengths[i])
+            continue;
+
+        uint16_t value = next[lengths[i]]++;
+        uint16_t reversed = 0;
+        for (int b = 0; b < lengths[i]; b++)
+        {
+            reversed = (reversed << 1) | (value & 1);
+            value >>= 1;
+        }
+        codes[i] = reversed;
+    }
+}
+
+typedef struct
+{
+    uint8_t symbol;
+    uint8_t extra;
+} codelen_item;
+
+//
+// Run-length encode the code lengths of a dynamic block header
+// Returns the number of items written
+//
+static int encode_codelens(const uint8_t *lengths, int n, codelen_item *items)
+{
+    int count = 0;
+    int i = 0;
+    while (i < n)
+    {
+        uint8_t current = lengths[i];
+        int run = 1;
+        while (i + run < n && lengths[i + run] == current)
+            run++;
+        i += run;
+
+        if (current == 0)
+        {
+            while (run >= 11)
+            {
+                int r = run > 138 ? 138 : run;
+                items[count++] = (codelen_item){ 18, r - 11 };
+                run -= r;
+            }
+            if (run >= 3)
+            {
+                items[count++] = (codelen_item){ 17, run - 3 };
+                run = 0;
+            }
+        }
+        else
+        {
+            items[count++] = (codelen_item){ current, 0 };
+            run--;
+            while (run >= 3)
+            {
+                int r = run > 6 ? 6 : run;
+                items[count++] = (codelen_item){ 16, r - 3 };
+                run -= r;
+            }
+        }
+
+        while (run-- > 0)
+            items[count++] = (codelen_item){ current, 0 };
+    }
+    return count;
+}
+
+static const uint8_t codelen_extra_bits[3] = { 2, 3, 7 };
+
+static void write_stored(bitwriter *bw, const uint8_t *raw, size_t length, bool final)
+{
+    do
+    {
+        size_t chunk = length > DEFLATE_MAX_STORED ? DEFLATE_MAX_STORED : length;
+        length -= chunk;
+
+        put_bits(bw, final && length == 0, 1);
+        put_bits(bw, 0, 2);
+        align_bits(bw);
+
+        uint8_t header[4] = { chunk & 0xFF, chunk >> 8, ~chunk & 0xFF, (~chunk >> 8) & 0xFF };
+        put_bytes(bw, header, 4);
+        put_bytes(bw, raw, chunk);
+        raw += chunk;
+    } while (length);
+}
+
+static void write_symbols(bitwriter *bw, const deflate_symbol *symbols, size_t count,
+    const uint16_t *lit_codes, const uint8_t *lit_lengths, const uint16_t *dist_codes, const uint8_t *dist_lengths)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const deflate_symbol *s = &symbols[i];
+        if (!s->dist)
+        {
+            put_bits(bw, lit_codes[s->length], lit_lengths[s->length]);
+            continue;
+        }
+
+        int lc = length_code[s->length];
+        put_bits(bw, lit_codes[257 + lc], lit_lengths[257 + lc]);
+        put_bits(bw, s->length - length_base[lc], length_extra[lc]);
+
+        int dc = get_dist_code(s->dist);
+        put_bits(bw, dist_codes[dc], dist_lengths[dc]);
+        put_bits(bw, s->dist - dist_base[dc], dist_extra[dc]);
+    }
+    put_bits(bw, lit_codes[DEFLATE_END_OF_BLOCK], lit_lengths[DEFLATE_END_OF_BLOCK]);
+}
+
+//
+// Emit one block using whichever of the stored, fixed and dynamic
+// encodings produces the fewest bits
+//
+static void write_block(bitwriter *bw, const deflate_symbol *symbols, size_t count,
+    const uint8_t *raw, size_t raw_length, bool final)
+{
+    uint32_t lit_freq[DEFLATE_LITLEN_CODES] = { 0 };
+    uint32_t dist_freq[DEFLATE_DIST_CODES] = { 0 };
+    uint64_t extra_bits = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!symbols[i].dist)
+        {
+            lit_freq[symbols[i].length]++;
+            continue;
+        }
+        int lc = length_code[symbols[i].length];
+        int dc = get_dist_code(symbols[i].dist);
+        lit_freq[257 + lc]++;
+        dist_freq[dc]++;
+        extra_bits += length_extra[lc] + dist_extra[dc];
+    }
+    lit_freq[DEFLATE_END_OF_BLOCK] = 1;
+
+    // Fixed Huffman code lengths (RFC 1951 3.2.6)
+    uint8_t fixed_lit[288];
+    uint8_t fixed_dist[DEFLATE_DIST_CODES];
+    memset(fixed_lit, 8, 144);
+    memset(fixed_lit + 144, 9, 112);
+    memset(fixed_lit + 256, 7, 24);
+    memset(fixed_lit + 280, 8, 8);
+    memset(fixed_dist, 5, DEFLATE_DIST_CODES);
+
+    // Dynamic code lengths; a block needs at least one distance code
+    uint8_t lit_lengths[DEFLATE_LITLEN_CODES];
+    uint8_t dist_lengths[DEFLATE_DIST_CODES];
+    build_lengths(lit_freq, DEFLATE_LITLEN_CODES, 15, lit_lengths);
+    build_lengths(dist_freq, DEFLATE_DIST_CODES, 15, dist_lengths);
+
+    int hlit = DEFLATE_LITLEN_CODES;
+    while (hlit > 257 && !lit_lengths[hlit - 1])
+        hlit--;
+    int hdist = DEFLATE_DIST_CODES;
+    while (hdist > 1 && !dist_lengths[hdist - 1])
+        hdist--;
+    if (!dist_lengths[0] && hdist == 1)
+        dist_lengths[0] = 1;
+
+    uint8_t combined[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    memcpy(combined, lit_lengths, hlit);
+    memcpy(combined + hlit, dist_lengths, hdist);
+
+    codelen_item items[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    int item_count = encode_codelens(combined, hlit + hdist, items);
+
+    uint32_t codelen_freq[DEFLATE_CODELEN_CODES] = { 0 };
+    for (int i = 0; i < item_count; i++)
+        codelen_freq[items[i].symbol]++;
+
+    uint8_t codelen_lengths[DEFLATE_CODELEN_CODES];
+    build_lengths(codelen_freq, DEFLATE_CODELEN_CODES, 7, codelen_lengths);
+
+    int hclen = DEFLATE_CODELEN_CODES;
+    while (hclen > 4 && !codelen_lengths[codelen_order[hclen - 1]])
+        hclen--;
+
+    uint64_t dynamic_bits = 3 + 5 + 5 + 4 + 3*hclen + extra_bits;
+    for (int i = 0; i < item_count; i++)
+        dynamic_bits += codelen_lengths[items[i].symbol] + (items[i].symbol >= 16 ? codelen_extra_bits[items[i].symbol - 16] : 0);
+
+    uint64_t fixed_bits = 3 + extra_bits;
+    for (int i = 0; i < DEFLATE_LITLEN_CODES; i++)
+    {
+        dynamic_bits += (uint64_t)lit_freq[i]*lit_lengths[i];
+        fixed_bits += (uint64_t)lit_freq[i]*fixed_lit[i];
+    }
+    for (int i = 0; i < DEFLATE_DIST_CODES; i++)
+    {
+        dynamic_bits += (uint64_t)dist_freq[i]*dist_lengths[i];
+        fixed_bits += (uint64_t)dist_freq[i]*fixed_dist[i];
+    }
+
+    uint64_t stored_bits = (raw_length + 5*((raw_length + DEFLATE_MAX_STORED - 1)/DEFLATE_MAX_STORED))*8 + 7;
+    if (raw && stored_bits <= fixed_bits && stored_bits <= dynamic_bits)
+    {
+        write_stored(bw, raw, raw_length, final);
+        return;
+    }
+
+    uint16_t lit_codes[288];
+    uint16_t dist_codes[DEFLATE_DIST_CODES];
+    if (fixed_bits <= dynamic_bits)
+    {
+        put_bits(bw, final, 1);
+        put_bits(bw, 1, 2);
+        build_codes(fixed_lit, 288, lit_codes);
+        build_codes(fixed_dist, DEFLATE_DIST_CODES, dist_codes);
+        write_symbols(bw, symbols, count, lit_codes, fixed_lit, dist_codes, fixed_dist);
+        return;
+    }
+
+    put_bits(bw, final, 1);
+    put_bits(bw, 2, 2);
+    put_bits(bw, hlit - 257, 5);
+    put_bits(bw, hdist - 1, 5);
+    put_bits(bw, hclen - 4, 4);
+    for (int i = 0; i < hclen; i++)
+        put_bits(bw, codelen_lengths[codelen_order[i]], 3);
+
+    uint16_t codelen_codes[DEFLATE_CODELEN_CODES];
+    build_codes(codelen_lengths, DEFLATE_CODELEN_CODES, codelen_codes);
+    for (int i = 0; i < item_count; i++)
+    {
+        uint8_t symbol = items[i].symbol;
+        put_bits(bw, codelen_codes[symbol], codelen_lengths[symbol]);
+        if (symbol >= 16)
+            put_bits(bw, items[i].extra, codelen_extra_bits[symbol - 16]);
+    }
+
+    build_codes(lit_lengths, DEFLATE_LITLEN_CODES, lit_codes);
+    build_codes(dist_lengths, DEFLATE_DIST_CODES, dist_codes);
+    write_symbols(bw, symbols, count, lit_codes, lit_lengths, dist_codes, dist_lengths);
+}
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t start;
+    size_t length;
+    const deflate_params *params;
+
+    int32_t *head;
+    int32_t *prev;
+    unsigned hash_shift;
+    size_t prev_mask;
+
+    deflate_symbol *symbols;
+    size_t symbol_count;
+    size_t block_start;
+    size_t block_end;
+    bitwriter bw;
+} deflate_state;
+
+static inline uint32_t hash3(deflate_state *s, size_t pos)
+{
+    const uint8_t *p = s->data + pos;
+    uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    return (v*2654435761U) >> s->hash_shift;
+}
+
+static inline void insert_hash(deflate_state *s, size_t pos)
+{
+    if (pos + DEFLATE_MIN_MATCH > s->length)
+        return;
+
+    uint32_t h = hash3(s, pos);
+    s->prev[pos & s->prev_mask] = s->head[h];
+    s->head[h] = pos;
+}
+
+static inline unsigned match_length(const uint8_t *a, const uint8_t *b, unsigned max_length)
+{
+    unsigned length = 0;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (length + 8 <= max_length)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + length, 8);
+        memcpy(&y, b + length, 8);
+        if (x != y)
+            return length + (__builtin_ctzll(x ^ y) >> 3);
+        length += 8;
+    }
+#endif
+    while (length < max_length && a[length] == b[length])
+        length++;
+    return length;
+}
+
+//
+// Search the hash chain for the longest match at pos that is
+// longer than min_length. Must be called before pos is inserted
+//
+static unsigned find_match(deflate_state *s, size_t pos, unsigned min_length, unsigned *dist)
+{
+    size_t available = s->length - pos;
+    if (available < DEFLATE_MIN_MATCH)
+        return 0;
+
+    unsigned max_length = available > DEFLATE_MAX_MATCH ? DEFLATE_MAX_MATCH : available;
+    unsigned best = min_length < DEFLATE_MIN_MATCH - 1 ? DEFLATE_MIN_MATCH - 1 : min_length;
+    if (best >= max_length)
+        return 0;
+
+    const uint8_t *current = s->data + pos;
+    int32_t candidate = s->head[hash3(s, pos)];
+    unsigned chain = s->params->max_chain;
+    unsigned found = 0;
+
+    while (candidate >= 0 && pos - candidate <= DEFLATE_WINDOW_SIZE && chain--)
+    {
+        const uint8_t *match = s->data + candidate;
+        if (match[best] == current[best] && match[0] == current[0] && match[1] == current[1])
+        {
+            unsigned length = match_length(match, current, max_length);
+            if (length > best)
+            {
+                best = length;
+                found = length;
+                *dist = pos - candidate;
+                if (length >= s->params->nice_length || length == max_length)
+                    break;
+            }
+        }
+        candidate = s->prev[candidate & s->prev_mask];
+    }
+    return found;
+}
+
+static void flush_block(deflate_state *s, bool final)
+{
+    write_block(&s->bw, s->symbols, s->symbol_count, s->data + s->block_start,
+        s->block_end - s->block_start, final);
+    s->symbol_count = 0;
+    s->block_start = s->block_end;
+}
+
+static inline void emit_literal(deflate_state *s, size_t pos)
+{
+    s->symbols[s->symbol_count++] = (deflate_symbol){ s->data[pos], 0 };
+    s->block_end = pos + 1;
+    if (s->symbol_count == DEFLATE_BLOCK_SYMBOLS)
+        flush_block(s, false);
+}
+
+static inline void emit_match(deflate_state *s, size_t pos, unsigned length, unsigned dist)
+{
+    s->symbols[s->symbol_count++] = (deflate_symbol){ length, dist };
+    s->block_end = pos + length;
+    if (s->symbol_count == DEFLATE_BLOCK_SYMBOLS)
+        flush_block(s, false);
+}
+
+static void compress_greedy(deflate_state *s)
+{
+    size_t pos = s->start;
+    while (pos < s->length)
+    {
+        unsigned dist = 0;
+        unsigned length = find_match(s, pos, 0, &dist);
+        insert_hash(s, pos);
+
+        if (!length)
+        {
+            emit_literal(s, pos++);
+            continue;
+        }
+
+        emit_match(s, pos, length, dist);
+
+        // Long matches (typically runs of a single palette index)
+        // are not worth hashing position by position
+        if (length <= s->params->max_insert)
+            for (size_t i = pos + 1; i < pos + length; i++)
+                insert_hash(s, i);
+        pos += length;
+    }
+}
+
+static void compress_lazy(deflate_state *s)
+{
+    size_t pos = s->start;
+    unsigned prev_length = 0;
+    unsigned prev_dist = 0;
+    bool pending = false;
+
+    while (pos < s->length)
+    {
+        unsigned dist = 0;
+        unsigned length = 0;
+        if (prev_length < s->params->nice_length)
+            length = find_match(s, pos, prev_length, &dist);
+        insert_hash(s, pos);
+
+        if (pending && prev_length >= DEFLATE_MIN_MATCH && length <= prev_length)
+        {
+            // The match found at the previous position is at least as good
+            size_t start = pos - 1;
+            emit_match(s, start, prev_length, prev_dist);
+            for (size_t i = pos + 1; i < start + prev_length; i++)
+                insert_hash(s, i);
+
+            pos = start + prev_length;
+            prev_length = 0;
+            pending = false;
+            continue;
+        }
+
+        if (pending)
+            emit_literal(s, pos - 1);
+
+        prev_length = length;
+        prev_dist = dist;
+        pending = true;
+        pos++;
+    }
+
+    if (pending)
+        emit_literal(s, pos - 1);
+}
+
+//
+// Upper bound on the output size of deflate_raw for length input bytes
+//
+size_t deflate_bound(size_t length)
+{
+    size_t blocks = length/DEFLATE_BLOCK_SYMBOLS + length/DEFLATE_MAX_STORED + 2;
+    return length + 5*blocks + 16;
+}
+
+//
+// Compress data[dictionary, dictionary + length) into raw deflate blocks at
+// the given level (0-9). The dictionary bytes before it (at most
+// DEFLATE_WINDOW_SIZE) only seed the match finder, so that independently
+// compressed stripes of one stream lose little ratio. Unless final, the
+// blocks end with a sync flush (an empty stored block) on a byte boundary
+// so that the next stripe's output can be appended directly.
+// Returns the compressed length, or 0 if the output did not fit
+// (capacity >= deflate_bound(length) is always sufficient) or on error
+//
+size_t deflate_raw_stripe(uint8_t *out, size_t capacity, const uint8_t *data, size_t dictionary, size_t length,
+    int level, bool final)
+{
+    pthread_once(&tables_once, init_tables);
+    if (level < 0)
+        level = DEFLATE_LEVEL_DEFAULT;
+    if (level > DEFLATE_LEVEL_BEST)
+        level = DEFLATE_LEVEL_BEST;
+    if (dictionary > DEFLATE_WINDOW_SIZE)
+    {
+        data += dictionary - DEFLATE_WINDOW_SIZE;
+        dictionary = DEFLATE_WINDOW_SIZE;
+    }
+
+    deflate_state s;
+    memset(&s, 0, sizeof(s));
+    s.data = data;
+    s.start = dictionary;
+    s.length = dictionary + length;
+    s.block_start = dictionary;
+    s.block_end = dictionary;
+    s.params = &level_params[level];
+    s.bw.out = out;
+    s.bw.end = out + capacity;
+
+    if (level == DEFLATE_LEVEL_STORE || length == 0)
+    {
+        write_stored(&s.bw, data + dictionary, length, final);
+        align_bits(&s.bw);
+        return s.bw.overflow ? 0 : s.bw.out - out;
+    }
+
+    // Size the match finder to the input so that small sprites
+    // do not pay for clearing full-size tables
+    unsigned hash_bits = 8;
+    while (hash_bits < 15 && ((size_t)1 << hash_bits) < s.length)
+        hash_bits++;
+
+    size_t prev_size = 1;
+    while (prev_size < DEFLATE_WINDOW_SIZE && prev_size < s.length)
+        prev_size <<= 1;
+
+    s.hash_shift = 32 - hash_bits;
+    s.prev_mask = prev_size - 1;
+    s.head = malloc(((size_t)1 << hash_bits)*sizeof(int32_t));
+    s.prev = malloc(prev_size*sizeof(int32_t));
+    s.symbols = malloc(DEFLATE_BLOCK_SYMBOLS*sizeof(deflate_symbol));
+    size_t written = 0;
+    if (!s.head || !s.prev || !s.symbols)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto error;
+    }
+    memset(s.head, 0xFF, ((size_t)1 << hash_bits)*sizeof(int32_t));
+
+    for (size_t i = 0; i < dictionary; i++)
+        insert_hash(&s, i);
+
+    if (s.params->lazy)
+        compress_lazy(&s);
+    else
+        compress_greedy(&s);
+
+    flush_block(&s, final);
+    if (!final)
+        write_stored(&s.bw, data + s.length, 0, false);
+    align_bits(&s.bw);
+    if (!s.bw.overflow)
+        written = s.bw.out - out;
+
+error:
+    free(s.head);
+    free(s.prev);
+    free(s.symbols);
+    return written;
+}
+
+//
+// Compress data into a raw deflate stream at the given level (0-9)
+// Returns the compressed length, or 0 if the output did not fit
+// (capacity >= deflate_bound(length) is always sufficient) or on error
+//
+size_t deflate_raw(uint8_t *out, size_t capacity, const uint8_t *data, size_t length, int level)
+{
+    return deflate_raw_stripe(out, capacity, data, 0, length, level, true);
+}
+
+//
+// Upper bound on the output size of zlib_compress for length input bytes
+//
+size_t zlib_bound(size_t length)
+{
+    return deflate_bound(length) + 6;
+}
+
+//
+// Write the two byte zlib header: 32K window, deflate, with the
+// level hint in FLEVEL and a valid FCHECK
+//
+void zlib_header(uint8_t *out, int level)
+{
+    uint8_t flevel = level <= 1 ? 0 : level <= 5 ? 1 : level == 6 ? 2 : 3;
+    out[0] = 0x78;
+    out[1] = flevel << 6;
+    uint8_t check = ((out[0] << 8) | out[1]) % 31;
+    if (check)
+        out[1] += 31 - check;
+}
+
+//
+// Compress data into a zlib stream (header, deflate data, Adler-32)
+// Returns the compressed length, or 0 on error
+//
+size_t zlib_compress(uint8_t *out, size_t capacity, const uint8_t *data, size_t length, int level)
+{
+    if (capacity < 6)
+        return 0;
+
+    zlib_header(out, level);
+
+    size_t written = deflate_raw(out + 2, capacity - 6, data, length, level);
+    if (!written)
+        return 0;
+
+    uint32_t adler = adler32_update(ADLER32_INIT, data, length);
+    uint8_t *trailer = out + 2 + written;
+    trailer[0] = adler >> 24;
+    trailer[1] = adler >> 16;
+    trailer[2] = adler >> 8;
+    trailer[3] = adler;
+    return written + 6;
+}
@@ -0,0 +1,53 @@
+/*
+ * deflate.h
+ * Deflate (RFC 1951) and zlib (RFC 1950) compression
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _deflate_h
+#define _deflate_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Compression levels: 0 stores the data, 1 is fastest, 9 is smallest
+#define DEFLATE_LEVEL_STORE 0
+#define DEFLATE_LEVEL_FAST 1
+#define DEFLATE_LEVEL_DEFAULT 6
+#define DEFLATE_LEVEL_BEST 9
+
+// Matches never reach further back than this
+#define DEFLATE_WINDOW_SIZE 32768
+
+size_t deflate_bound(size_t length);
+size_t deflate_raw(uint8_t *out, size_t capacity, const uint8_t *data, size_t length, int level);
+size_t deflate_raw_stripe(uint8_t *out, size_t capacity, const uint8_t *data, size_t dictionary, size_t length,
+    int level, bool final);
+size_t zlib_bound(size_t length);
+void zlib_header(uint8_t *out, int level);
+size_t zlib_compress(uint8_t *out, size_t capacity, const uint8_t *data, size_t length, int level);
+
+#endif
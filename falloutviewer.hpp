@@ -0,0 +1,317 @@
+/*
+ * falloutviewer.hpp
+ * Header-only C++20 interface to the archive, frm and palette readers
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _falloutviewer_hpp
+#define _falloutviewer_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <utility>
+
+extern "C"
+{
+#include "dat2reader.h"
+#include "dat2pool.h"
+#include "dat2stream.h"
+#include "frmreader.h"
+#include "palreader.h"
+}
+
+// Move-only owners for the C objects. Failures are reported the same way
+// as by the C functions: handles and buffers are empty (false) on error.
+// Entries found through an archive are plain pointers owned by it
+namespace falloutviewer
+{
+    using entry = dat2entry;
+
+    class archive
+    {
+    public:
+        archive() noexcept = default;
+        explicit archive(dat2reader *reader) noexcept : reader_(reader) {}
+        archive(archive &&other) noexcept : reader_(std::exchange(other.reader_, nullptr)) {}
+        archive &operator=(archive &&other) noexcept
+        {
+            std::swap(reader_, other.reader_);
+            return *this;
+        }
+        archive(const archive &) = delete;
+        archive &operator=(const archive &) = delete;
+        ~archive()
+        {
+            if (reader_)
+                dat2reader_close(reader_);
+        }
+
+        // The path is only used while opening, so a temporary is fine
+        static archive open(const char *path) noexcept
+        {
+            return archive(dat2reader_open(const_cast<char *>(path)));
+        }
+
+        explicit operator bool() const noexcept { return reader_ != nullptr; }
+        dat2reader *get() const noexcept { return reader_; }
+
+        // Hashes the name in place, without copying it to a terminated string
+        entry *find(std::string_view name) const noexcept
+        {
+            return dat2reader_find_entry_length(reader_, name.data(), name.size());
+        }
+
+        std::span<entry> entries() const noexcept
+        {
+            return reader_ ? std::span<entry>(reader_->entries, reader_->entry_count) : std::span<entry>();
+        }
+
+    private:
+        dat2reader *reader_ = nullptr;
+    };
+
+    // Uncompressed data in storage obtained from an allocator
+    template <typename Allocator = std::allocator<std::uint8_t>>
+    class buffer
+    {
+        using traits = std::allocator_traits<Allocator>;
+
+    public:
+        explicit buffer(const Allocator &allocator = Allocator()) noexcept : allocator_(allocator) {}
+        buffer(buffer &&other) noexcept : allocator_(std::move(other.allocator_)),
+            data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+        buffer &operator=(buffer &&other) noexcept
+        {
+            std::swap(allocator_, other.allocator_);
+            std::swap(data_, other.data_);
+            std::swap(size_, other.size_);
+            return *this;
+        }
+        buffer(const buffer &) = delete;
+        buffer &operator=(const buffer &) = delete;
+        ~buffer()
+        {
+            if (data_)
+                traits::deallocate(allocator_, data_, size_ ? size_ : 1);
+        }
+
+        explicit operator bool() const noexcept { return data_ != nullptr; }
+        std::span<std::uint8_t> span() const noexcept { return { data_, size_ }; }
+        std::uint8_t *data() const noexcept { return data_; }
+        std::size_t size() const noexcept { return size_; }
+
+        static buffer extract(const entry *e, const Allocator &allocator = Allocator())
+        {
+            buffer out(allocator);
+            std::size_t size = e->uncompressed_size;
+            std::uint8_t *data = traits::allocate(out.allocator_, size ? size : 1);
+            if (dat2entry_extract_into(const_cast<entry *>(e), data, size) == 0)
+            {
+                out.data_ = data;
+                out.size_ = size;
+            }
+            else
+                traits::deallocate(out.allocator_, data, size ? size : 1);
+            return out;
+        }
+
+    private:
+        Allocator allocator_;
+        std::uint8_t *data_ = nullptr;
+        std::size_t size_ = 0;
+    };
+
+    // Uncompressed data in a buffer borrowed from the calling thread's pool.
+    // It may be returned to the pool from any thread
+    class pooled_buffer
+    {
+    public:
+        pooled_buffer() noexcept = default;
+        pooled_buffer(pooled_buffer &&other) noexcept : data_(std::exchange(other.data_, nullptr)),
+            size_(std::exchange(other.size_, 0)) {}
+        pooled_buffer &operator=(pooled_buffer &&other) noexcept
+        {
+            std::swap(data_, other.data_);
+            std::swap(size_, other.size_);
+            return *this;
+        }
+        pooled_buffer(const pooled_buffer &) = delete;
+        pooled_buffer &operator=(const pooled_buffer &) = delete;
+        ~pooled_buffer()
+        {
+            dat2pool *pool = data_ ? dat2pool_thread() : nullptr;
+            if (pool)
+                dat2pool_release(pool, data_);
+            else
+                dat2pool_free(data_);
+        }
+
+        explicit operator bool() const noexcept { return data_ != nullptr; }
+        std::span<std::uint8_t> span() const noexcept { return { data_, size_ }; }
+        std::uint8_t *data() const noexcept { return data_; }
+        std::size_t size() const noexcept { return size_; }
+
+        static pooled_buffer extract(const entry *e) noexcept
+        {
+            pooled_buffer out;
+            dat2pool *pool = dat2pool_thread();
+            std::size_t size = e->uncompressed_size;
+            std::uint8_t *data = pool ? dat2pool_acquire(pool, size) : nullptr;
+            if (data && dat2entry_extract_into(const_cast<entry *>(e), data, size) == 0)
+            {
+                out.data_ = data;
+                out.size_ = size;
+            }
+            else if (data)
+                dat2pool_release(pool, data);
+            return out;
+        }
+
+    private:
+        std::uint8_t *data_ = nullptr;
+        std::size_t size_ = 0;
+    };
+
+    // Extract an entry into caller-owned storage, which must hold at
+    // least the entry's uncompressed size
+    inline bool extract_into(const entry *e, std::span<std::uint8_t> out) noexcept
+    {
+        return dat2entry_extract_into(const_cast<entry *>(e), out.data(), out.size()) == 0;
+    }
+
+    // Read part of an entry, starting at an uncompressed offset, without
+    // inflating beyond the end of the range
+    // Returns the bytes read, a prefix of out
+    inline std::span<std::uint8_t> read_range(const entry *e, std::span<std::uint8_t> out, std::uint32_t start) noexcept
+    {
+        std::uint64_t end = std::uint64_t(start) + out.size();
+        std::size_t read = dat2entry_read_range(const_cast<entry *>(e), out.data(), start,
+            end > e->uncompressed_size ? e->uncompressed_size : std::uint32_t(end));
+        return out.first(read);
+    }
+
+    template <typename Allocator = std::allocator<std::uint8_t>>
+    buffer<Allocator> extract(const entry *e, const Allocator &allocator = Allocator())
+    {
+        return buffer<Allocator>::extract(e, allocator);
+    }
+
+    inline pooled_buffer extract_pooled(const entry *e) noexcept
+    {
+        return pooled_buffer::extract(e);
+    }
+
+    // A frame's pixels are palette indices, one byte each, row by row
+    struct frame_view
+    {
+        std::uint16_t width;
+        std::uint16_t height;
+        std::int16_t x;
+        std::int16_t y;
+        std::span<const std::uint8_t> pixels;
+    };
+
+    class frm
+    {
+    public:
+        frm() noexcept = default;
+        explicit frm(frmreader *reader) noexcept : reader_(reader) {}
+        frm(frm &&other) noexcept : reader_(std::exchange(other.reader_, nullptr)) {}
+        frm &operator=(frm &&other) noexcept
+        {
+            std::swap(reader_, other.reader_);
+            return *this;
+        }
+        frm(const frm &) = delete;
+        frm &operator=(const frm &) = delete;
+        ~frm()
+        {
+            if (reader_)
+                frmreader_free(reader_);
+        }
+
+        // The frame data is copied, so the source may be released afterwards
+        static frm parse(std::span<const std::uint8_t> data) noexcept
+        {
+            return frm(frmreader_from_data(const_cast<std::uint8_t *>(data.data()), data.size()));
+        }
+
+        explicit operator bool() const noexcept { return reader_ != nullptr; }
+        frmreader *get() const noexcept { return reader_; }
+        std::uint8_t direction_count() const noexcept { return reader_->direction_count; }
+        std::uint16_t frame_count() const noexcept { return reader_->animation_length; }
+
+        // Returns an empty view if the frame does not exist
+        frame_view frame(std::uint8_t direction, std::uint16_t index) const noexcept
+        {
+            frmframe *f = direction < reader_->direction_count ? frm_get_frame(reader_, direction, index) : nullptr;
+            if (!f)
+                return {};
+            return { f->width, f->height, f->x, f->y, { f->data, std::size_t(f->width)*f->height } };
+        }
+
+    private:
+        frmreader *reader_ = nullptr;
+    };
+
+    class palette
+    {
+    public:
+        palette() noexcept = default;
+        explicit palette(palreader *reader) noexcept : reader_(reader) {}
+        palette(palette &&other) noexcept : reader_(std::exchange(other.reader_, nullptr)) {}
+        palette &operator=(palette &&other) noexcept
+        {
+            std::swap(reader_, other.reader_);
+            return *this;
+        }
+        palette(const palette &) = delete;
+        palette &operator=(const palette &) = delete;
+        ~palette()
+        {
+            if (reader_)
+                palreader_free(reader_);
+        }
+
+        static palette parse(std::span<const std::uint8_t> data) noexcept
+        {
+            return palette(data.size() >= 768 ? palreader_from_data(const_cast<std::uint8_t *>(data.data())) : nullptr);
+        }
+
+        explicit operator bool() const noexcept { return reader_ != nullptr; }
+        palreader *get() const noexcept { return reader_; }
+
+        // Fills 256 rgb triplets scaled to 8 bits per channel
+        void rgb(std::span<std::uint8_t, 768> out) const noexcept { palreader_get_rgb(reader_, out.data()); }
+
+    private:
+        palreader *reader_ = nullptr;
+    };
+}
+
+#endif
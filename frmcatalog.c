@@ -0,0 +1,500 @@
+/*
+ * frmcatalog.c
+ * Catalog of frm dimensions, timing and offsets read from frame headers
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include "frmcatalog.h"
+#include "byteorder.h"
+#include "dat2scheduler.h"
+#include "dat2stream.h"
+
+// Sprites and frames read for each entry, by index in the archive
+typedef struct
+{
+    frmcatalog_sprite *sprites;
+    frmcatalog_frame **frames;
+} catalog_tasks;
+
+// frm data is big-endian
+static uint16_t read_be16(const uint8_t *data)
+{
+    return data[0] << 8 | data[1];
+}
+
+static uint32_t read_be32(const uint8_t *data)
+{
+    return (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+//
+// Read the frame headers of one direction, skipping over the pixels
+// between them. Skipped pixels are inflated but never copied, and
+// nothing after the last frame header is read
+// Returns 0 on success, or -1 if the frm is truncated or inconsistent
+//
+static int read_direction(dat2stream *stream, uint32_t start, uint32_t data_length, frmcatalog_frame *frames,
+    uint16_t frame_count)
+{
+    uint32_t offset = start;
+    for (uint16_t i = 0; i < frame_count; i++)
+    {
+        uint8_t header[FRM_FRAME_HEADER_SIZE];
+        if (offset > data_length || data_length - offset < FRM_FRAME_HEADER_SIZE ||
+            dat2stream_seek(stream, FRM_HEADER_SIZE + offset) ||
+            dat2stream_read(stream, header, FRM_FRAME_HEADER_SIZE) != FRM_FRAME_HEADER_SIZE)
+            return -1;
+
+        frames[i].width = read_be16(&header[0]);
+        frames[i].height = read_be16(&header[2]);
+        frames[i].x = read_be16(&header[8]);
+        frames[i].y = read_be16(&header[10]);
+
+        // Like frmreader, trust the dimensions over the size field
+        offset += FRM_FRAME_HEADER_SIZE;
+        uint32_t size = (uint32_t)frames[i].width*frames[i].height;
+        if (size > data_length - offset)
+            return -1;
+        offset += size;
+    }
+    return 0;
+}
+
+//
+// Read an frm's header and frame headers without extracting it
+// Returns 0 on success, or -1 on error
+//
+static int read_sprite(dat2entry *entry, frmcatalog_sprite *sprite, frmcatalog_frame **frames)
+{
+    *frames = NULL;
+    if (entry->uncompressed_size < FRM_HEADER_SIZE + FRM_FRAME_HEADER_SIZE)
+        return -1;
+
+    dat2stream *stream = dat2stream_open(entry);
+    if (!stream)
+        return -1;
+
+    uint8_t header[FRM_HEADER_SIZE];
+    uint32_t start[FRM_DIRECTIONS];
+    uint32_t data_length = 0;
+    if (dat2stream_read(stream, header, FRM_HEADER_SIZE) != FRM_HEADER_SIZE)
+        goto error;
+
+    sprite->name = entry->filename;
+    sprite->fps = read_be16(&header[4]);
+    sprite->action_frame = read_be16(&header[6]);
+    sprite->frame_count = read_be16(&header[8]);
+    for (uint8_t d = 0; d < FRM_DIRECTIONS; d++)
+    {
+        sprite->x_origin[d] = read_be16(&header[10 + 2*d]);
+        sprite->y_origin[d] = read_be16(&header[22 + 2*d]);
+        start[d] = read_be32(&header[34 + 4*d]);
+    }
+    data_length = read_be32(&header[58]);
+    if (data_length > entry->uncompressed_size - FRM_HEADER_SIZE || sprite->frame_count == 0)
+        goto error;
+
+    // Single-direction frms leave the other offsets zeroed
+    sprite->direction_count = 1;
+    for (uint8_t d = 1; d < FRM_DIRECTIONS; d++)
+        if (start[d])
+            sprite->direction_count = FRM_DIRECTIONS;
+
+    *frames = malloc(sprite->direction_count*sprite->frame_count*sizeof(frmcatalog_frame));
+    if (!*frames)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto error;
+    }
+
+    // Visit directions in file order so the stream only moves forwards,
+    // and copy directions that share frames instead of reading them again
+    uint8_t order[FRM_DIRECTIONS];
+    for (uint8_t d = 0; d < sprite->direction_count; d++)
+    {
+        uint8_t i = d;
+        for (; i > 0 && start[order[i - 1]] > start[d]; i--)
+            order[i] = order[i - 1];
+        order[i] = d;
+    }
+
+    for (uint8_t i = 0; i < sprite->direction_count; i++)
+    {
+        uint8_t d = order[i];
+        frmcatalog_frame *direction = &(*frames)[d*sprite->frame_count];
+        if (i > 0 && start[order[i - 1]] == start[d])
+            memcpy(direction, &(*frames)[order[i - 1]*sprite->frame_count], sprite->frame_count*sizeof(frmcatalog_frame));
+        else if (read_direction(stream, start[d], data_length, direction, sprite->frame_count))
+            goto error;
+    }
+
+    dat2stream_close(stream);
+    return 0;
+
+error:
+    free(*frames);
+    *frames = NULL;
+    dat2stream_close(stream);
+    return -1;
+}
+
+static bool is_frm_entry(dat2entry *entry, void *user)
+{
+    return strcasestr(entry->filename, ".frm") != NULL;
+}
+
+static int catalog_entry(dat2entry *entry, void *user)
+{
+    catalog_tasks *tasks = user;
+    size_t index = entry - entry->reader->entries;
+    return read_sprite(entry, &tasks->sprites[index], &tasks->frames[index]);
+}
+
+static int compare_sprite_name(const void *a, const void *b)
+{
+    return strcmp(((const frmcatalog_sprite *)a)->name, ((const frmcatalog_sprite *)b)->name);
+}
+
+//
+// Build a catalog of every frm in an archive, reading the entries in
+// parallel. Entries that cannot be read are left out and counted in
+// failed_count
+// Returns NULL on error
+//
+frmcatalog *frmcatalog_build(dat2reader *reader, unsigned threads)
+{
+    frmcatalog *catalog = calloc(1, sizeof(frmcatalog));
+    catalog_tasks tasks;
+    tasks.sprites = calloc(reader->entry_count, sizeof(frmcatalog_sprite));
+    tasks.frames = calloc(reader->entry_count, sizeof(frmcatalog_frame *));
+    if (!catalog || !tasks.sprites || !tasks.frames)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto error;
+    }
+
+    catalog->failed_count = dat2scheduler_run_reader(reader, is_frm_entry, catalog_entry, &tasks, threads);
+
+    // Gather the sprites that were read, then lay out their frames and
+    // names in name order
+    uint64_t frame_count = 0;
+    uint64_t names_size = 0;
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+    {
+        if (!tasks.frames[i])
+            continue;
+
+        uint32_t n = catalog->sprite_count++;
+        tasks.sprites[n] = tasks.sprites[i];
+        tasks.frames[n] = tasks.frames[i];
+        if (n != i)
+            tasks.frames[i] = NULL;
+
+        // Remember where the frames are until they are copied in name order
+        tasks.sprites[n].first_frame = n;
+        frame_count += tasks.sprites[n].direction_count*tasks.sprites[n].frame_count;
+        names_size += strlen(tasks.sprites[n].name) + 1;
+    }
+
+    if (frame_count > UINT32_MAX || names_size > UINT32_MAX)
+    {
+        fprintf(stderr, "Too many frames to catalog\n");
+        goto error;
+    }
+
+    qsort(tasks.sprites, catalog->sprite_count, sizeof(frmcatalog_sprite), compare_sprite_name);
+    catalog->frames = malloc((frame_count ? frame_count : 1)*sizeof(frmcatalog_frame));
+    catalog->names = malloc(names_size ? names_size : 1);
+    if (!catalog->frames || !catalog->names)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto error;
+    }
+
+    for (uint32_t i = 0; i < catalog->sprite_count; i++)
+    {
+        frmcatalog_sprite *sprite = &tasks.sprites[i];
+        size_t frames = sprite->direction_count*sprite->frame_count;
+        memcpy(&catalog->frames[catalog->frame_count], tasks.frames[sprite->first_frame], frames*sizeof(frmcatalog_frame));
+        sprite->first_frame = catalog->frame_count;
+        catalog->frame_count += frames;
+
+        size_t length = strlen(sprite->name) + 1;
+        memcpy(&catalog->names[catalog->names_size], sprite->name, length);
+        sprite->name = &catalog->names[catalog->names_size];
+        catalog->names_size += length;
+    }
+
+    catalog->sprites = tasks.sprites;
+    tasks.sprites = NULL;
+    for (uint32_t i = 0; i < catalog->sprite_count; i++)
+        free(tasks.frames[i]);
+    free(tasks.frames);
+    return catalog;
+
+error:
+    if (tasks.frames)
+        for (uint32_t i = 0; i < reader->entry_count; i++)
+            free(tasks.frames[i]);
+    free(tasks.frames);
+    free(tasks.sprites);
+    if (catalog)
+        frmcatalog_free(catalog);
+    return NULL;
+}
+
+void frmcatalog_free(frmcatalog *catalog)
+{
+    free(catalog->sprites);
+    free(catalog->frames);
+    free(catalog->names);
+    free(catalog);
+}
+
+//
+// Find a sprite by its full archive name
+// Returns NULL if the sprite is not in the catalog
+//
+frmcatalog_sprite *frmcatalog_find(frmcatalog *catalog, const char *name)
+{
+    frmcatalog_sprite key;
+    key.name = name;
+    return bsearch(&key, catalog->sprites, catalog->sprite_count, sizeof(frmcatalog_sprite), compare_sprite_name);
+}
+
+//
+// Returns a frame of a sprite, or NULL if it does not exist
+//
+frmcatalog_frame *frmcatalog_get_frame(frmcatalog *catalog, frmcatalog_sprite *sprite, uint8_t direction, uint16_t index)
+{
+    if (direction >= sprite->direction_count || index >= sprite->frame_count)
+        return NULL;
+
+    return &catalog->frames[sprite->first_frame + direction*sprite->frame_count + index];
+}
+
+//
+// Write a catalog in the binary format described in frmcatalog.h
+// Returns 0 on success, or -1 on error
+//
+int frmcatalog_write(frmcatalog *catalog, const char *path)
+{
+    size_t size = FRMCATALOG_HEADER_SIZE + (size_t)catalog->sprite_count*FRMCATALOG_SPRITE_SIZE +
+        (size_t)catalog->frame_count*FRMCATALOG_FRAME_SIZE + catalog->names_size;
+    uint8_t *data = malloc(size);
+    if (!data)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    uint8_t *p = data;
+    memcpy(p, FRMCATALOG_MAGIC, FRMCATALOG_MAGIC_SIZE);
+    put_le32(p + 8, FRMCATALOG_VERSION);
+    put_le32(p + 12, catalog->sprite_count);
+    put_le32(p + 16, catalog->frame_count);
+    put_le32(p + 20, catalog->names_size);
+    p += FRMCATALOG_HEADER_SIZE;
+
+    for (uint32_t i = 0; i < catalog->sprite_count; i++, p += FRMCATALOG_SPRITE_SIZE)
+    {
+        frmcatalog_sprite *sprite = &catalog->sprites[i];
+        put_le32(p, sprite->name - catalog->names);
+        put_le32(p + 4, sprite->first_frame);
+        put_le16(p + 8, sprite->fps);
+        put_le16(p + 10, sprite->action_frame);
+        put_le16(p + 12, sprite->frame_count);
+        p[14] = sprite->direction_count;
+        p[15] = 0;
+        for (uint8_t d = 0; d < FRM_DIRECTIONS; d++)
+        {
+            put_le16(p + 16 + 2*d, sprite->x_origin[d]);
+            put_le16(p + 28 + 2*d, sprite->y_origin[d]);
+        }
+    }
+
+    for (uint32_t i = 0; i < catalog->frame_count; i++, p += FRMCATALOG_FRAME_SIZE)
+    {
+        frmcatalog_frame *frame = &catalog->frames[i];
+        put_le16(p, frame->width);
+        put_le16(p + 2, frame->height);
+        put_le16(p + 4, frame->x);
+        put_le16(p + 6, frame->y);
+    }
+    memcpy(p, catalog->names, catalog->names_size);
+
+    int status = -1;
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+    else
+    {
+        if (fwrite(data, 1, size, f) == size)
+            status = 0;
+        if (fclose(f))
+            status = -1;
+        if (status)
+            fprintf(stderr, "Write error: %s\n", strerror(errno));
+    }
+
+    free(data);
+    return status;
+}
+
+//
+// Load a catalog written by frmcatalog_write with a single read
+// Returns NULL if the file cannot be read or is not a valid catalog
+//
+frmcatalog *frmcatalog_load(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    frmcatalog *catalog = calloc(1, sizeof(frmcatalog));
+    uint8_t *data = NULL;
+    long size;
+    if (!catalog || fseek(f, 0, SEEK_END) || (size = ftell(f)) < FRMCATALOG_HEADER_SIZE || fseek(f, 0, SEEK_SET))
+        goto format_error;
+
+    data = malloc(size);
+    if (!data || fread(data, 1, size, f) != (size_t)size)
+        goto format_error;
+
+    catalog->sprite_count = get_le32(data + 12);
+    catalog->frame_count = get_le32(data + 16);
+    catalog->names_size = get_le32(data + 20);
+    uint64_t expected = FRMCATALOG_HEADER_SIZE + (uint64_t)catalog->sprite_count*FRMCATALOG_SPRITE_SIZE +
+        (uint64_t)catalog->frame_count*FRMCATALOG_FRAME_SIZE + catalog->names_size;
+    if (memcmp(data, FRMCATALOG_MAGIC, FRMCATALOG_MAGIC_SIZE) || get_le32(data + 8) != FRMCATALOG_VERSION ||
+        expected != (uint64_t)size || (catalog->names_size && data[size - 1] != '\0'))
+        goto format_error;
+
+    catalog->sprites = malloc((catalog->sprite_count ? catalog->sprite_count : 1)*sizeof(frmcatalog_sprite));
+    catalog->frames = malloc((catalog->frame_count ? catalog->frame_count : 1)*sizeof(frmcatalog_frame));
+    catalog->names = malloc(catalog->names_size ? catalog->names_size : 1);
+    if (!catalog->sprites || !catalog->frames || !catalog->names)
+        goto format_error;
+
+    const uint8_t *p = data + FRMCATALOG_HEADER_SIZE;
+    memcpy(catalog->names, data + size - catalog->names_size, catalog->names_size);
+    for (uint32_t i = 0; i < catalog->sprite_count; i++, p += FRMCATALOG_SPRITE_SIZE)
+    {
+        frmcatalog_sprite *sprite = &catalog->sprites[i];
+        uint32_t name = get_le32(p);
+        sprite->first_frame = get_le32(p + 4);
+        sprite->fps = get_le16(p + 8);
+        sprite->action_frame = get_le16(p + 10);
+        sprite->frame_count = get_le16(p + 12);
+        sprite->direction_count = p[14];
+        for (uint8_t d = 0; d < FRM_DIRECTIONS; d++)
+        {
+            sprite->x_origin[d] = get_le16(p + 16 + 2*d);
+            sprite->y_origin[d] = get_le16(p + 28 + 2*d);
+        }
+
+        if (name >= catalog->names_size || sprite->direction_count > FRM_DIRECTIONS ||
+            sprite->first_frame > catalog->frame_count ||
+            catalog->frame_count - sprite->first_frame < (uint32_t)sprite->direction_count*sprite->frame_count)
+            goto format_error;
+        sprite->name = &catalog->names[name];
+    }
+
+    for (uint32_t i = 0; i < catalog->frame_count; i++, p += FRMCATALOG_FRAME_SIZE)
+    {
+        frmcatalog_frame *frame = &catalog->frames[i];
+        frame->width = get_le16(p);
+        frame->height = get_le16(p + 2);
+        frame->x = get_le16(p + 4);
+        frame->y = get_le16(p + 6);
+    }
+
+    free(data);
+    fclose(f);
+    return catalog;
+
+format_error:
+    fprintf(stderr, "%s is not a valid frm catalog\n", path);
+    if (catalog)
+        frmcatalog_free(catalog);
+    free(data);
+    fclose(f);
+    return NULL;
+}
+
+static void write_json_string(FILE *out, const char *value)
+{
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)value; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+//
+// Write a catalog as a JSON document with one line per sprite, listing
+// each frame as [width, height, x, y]
+// Returns 0 on success, or -1 on error
+//
+int frmcatalog_write_json(frmcatalog *catalog, FILE *out)
+{
+    fprintf(out, "{\n  \"sprites\": [");
+    for (uint32_t i = 0; i < catalog->sprite_count; i++)
+    {
+        frmcatalog_sprite *sprite = &catalog->sprites[i];
+        fprintf(out, "%s\n    {\"name\":", i ? "," : "");
+        write_json_string(out, sprite->name);
+        fprintf(out, ",\"fps\":%u,\"action_frame\":%u,\"frame_count\":%u,\"directions\":[",
+            sprite->fps, sprite->action_frame, sprite->frame_count);
+
+        for (uint8_t d = 0; d < sprite->direction_count; d++)
+        {
+            fprintf(out, "%s{\"x\":%d,\"y\":%d,\"frames\":[", d ? "," : "", sprite->x_origin[d], sprite->y_origin[d]);
+            for (uint16_t f = 0; f < sprite->frame_count; f++)
+            {
+                frmcatalog_frame *frame = frmcatalog_get_frame(catalog, sprite, d, f);
+                fprintf(out, "%s[%u,%u,%d,%d]", f ? "," : "", frame->width, frame->height, frame->x, frame->y);
+            }
+            fprintf(out, "]}");
+        }
+        fprintf(out, "]}");
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    return ferror(out) ? -1 : 0;
+}
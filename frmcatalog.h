@@ -0,0 +1,91 @@
+/*
+ * frmcatalog.h
+ * Catalog of frm dimensions, timing and offsets read from frame headers
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _frmcatalog_h
+#define _frmcatalog_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include "dat2reader.h"
+#include "frmreader.h"
+
+// A catalog file holds a header, the sprite records sorted by name, the
+// frame records and then the nul-terminated names, all little-endian.
+// Sprite records reference their name by offset into the names and their
+// frames by index, with direction d frame i at first_frame + d*frame_count + i
+#define FRMCATALOG_MAGIC "FRMCATLG"
+#define FRMCATALOG_MAGIC_SIZE 8
+#define FRMCATALOG_VERSION 1
+#define FRMCATALOG_HEADER_SIZE 24
+#define FRMCATALOG_SPRITE_SIZE 40
+#define FRMCATALOG_FRAME_SIZE 8
+
+typedef struct
+{
+    uint16_t width;
+    uint16_t height;
+    int16_t x;
+    int16_t y;
+} frmcatalog_frame;
+
+typedef struct
+{
+    const char *name;
+    uint32_t first_frame;
+    uint16_t fps;
+    uint16_t action_frame;
+    uint16_t frame_count;
+    uint8_t direction_count;
+    int16_t x_origin[FRM_DIRECTIONS];
+    int16_t y_origin[FRM_DIRECTIONS];
+} frmcatalog_sprite;
+
+typedef struct
+{
+    uint32_t sprite_count;
+    frmcatalog_sprite *sprites;
+    uint32_t frame_count;
+    frmcatalog_frame *frames;
+    uint32_t names_size;
+    char *names;
+
+    // Entries that could not be read while building
+    uint32_t failed_count;
+} frmcatalog;
+
+frmcatalog *frmcatalog_build(dat2reader *reader, unsigned threads);
+frmcatalog *frmcatalog_load(const char *path);
+void frmcatalog_free(frmcatalog *catalog);
+
+frmcatalog_sprite *frmcatalog_find(frmcatalog *catalog, const char *name);
+frmcatalog_frame *frmcatalog_get_frame(frmcatalog *catalog, frmcatalog_sprite *sprite, uint8_t direction, uint16_t index);
+
+int frmcatalog_write(frmcatalog *catalog, const char *path);
+int frmcatalog_write_json(frmcatalog *catalog, FILE *out);
+
+#endif
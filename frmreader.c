@@ -45,10 +45,7 @@ static uint16_t read_u16(uint8_t **data)
 
 static int16_t read_s16(uint8_t **data)
 {
-    int8_t **sdata = (int8_t **)data;
-    int8_t hi = *(*sdata)++;
-    int8_t lo = *(*sdata)++;
-    return (hi << 8) | lo;
+    return (int16_t)read_u16(data);
 }
 
 static uint32_t read_u32(uint8_t **data)
@@ -59,8 +56,16 @@ static uint32_t read_u32(uint8_t **data)
     return ret;
 }
 
-frmreader *frmreader_from_data(uint8_t *data)
+//
+// Parse an frm from memory. The frame data is copied, so the input
+// may be released once this returns
+// Returns NULL if the data is truncated or inconsistent
+//
+frmreader *frmreader_from_data(uint8_t *data, size_t length)
 {
+    if (length < FRM_HEADER_SIZE + FRM_FRAME_HEADER_SIZE)
+        return NULL;
+
     frmreader *reader = malloc(sizeof(frmreader));
     if (!reader)
         return NULL;
@@ -77,30 +82,101 @@ frmreader *frmreader_from_data(uint8_t *data)
     for (uint8_t i = 0; i < 6; i++)
         reader->animation_start[i] = read_u32(&dp);
     reader->data_length = read_u32(&dp);
-    reader->width = read_u16(&dp);
-    reader->height = read_u16(&dp);
-    read_u32(&dp); // Skip size field
-    reader->x = read_u16(&dp);
-    reader->y = read_u16(&dp);
 
-    // Take a local copy of the image data
+    if (reader->data_length > length - FRM_HEADER_SIZE || reader->animation_length == 0)
+        goto format_error;
+
+    // Take a local copy of the frame data, including the frame headers
     reader->data = malloc(reader->data_length*sizeof(uint8_t));
+    reader->frames = malloc(FRM_DIRECTIONS*reader->animation_length*sizeof(frmframe));
+    if (!reader->data || !reader->frames)
+        goto frame_error;
     memcpy(reader->data, dp, reader->data_length);
 
+    // Single-direction frms leave the other offsets zeroed
+    reader->direction_count = 1;
+    for (uint8_t i = 1; i < FRM_DIRECTIONS; i++)
+        if (reader->animation_start[i])
+            reader->direction_count = FRM_DIRECTIONS;
+
+    for (uint8_t d = 0; d < FRM_DIRECTIONS; d++)
+    {
+        uint32_t offset = reader->animation_start[d];
+        for (uint16_t i = 0; i < reader->animation_length; i++)
+        {
+            if (offset > reader->data_length || reader->data_length - offset < FRM_FRAME_HEADER_SIZE)
+                goto frame_error;
+
+            frmframe *frame = &reader->frames[d*reader->animation_length + i];
+            uint8_t *fp = &reader->data[offset];
+            frame->width = read_u16(&fp);
+            frame->height = read_u16(&fp);
+            read_u32(&fp); // Skip size field
+            frame->x = read_s16(&fp);
+            frame->y = read_s16(&fp);
+            frame->data = fp;
+
+            offset += FRM_FRAME_HEADER_SIZE;
+            uint32_t size = (uint32_t)frame->width*frame->height;
+            if (size > reader->data_length - offset)
+                goto frame_error;
+            offset += size;
+        }
+    }
+
+    // The first frame describes the image for callers that only need a still
+    reader->width = reader->frames[0].width;
+    reader->height = reader->frames[0].height;
+    reader->x = reader->frames[0].x;
+    reader->y = reader->frames[0].y;
     return reader;
+
+frame_error:
+    free(reader->frames);
+    free(reader->data);
+format_error:
+    free(reader);
+    return NULL;
 }
 
-uint8_t *frm_get_framedata(frmreader *reader, uint8_t facing, uint8_t index)
+frmframe *frm_get_frame(frmreader *reader, uint8_t facing, uint16_t index)
 {
-    if (facing >= 6 || index >= reader->animation_length)
+    if (facing >= FRM_DIRECTIONS || index >= reader->animation_length)
         return NULL;
 
-    uint8_t offset = reader->animation_start[facing] + index*reader->width*reader->height;
-    return &reader->data[offset];
+    return &reader->frames[facing*reader->animation_length + index];
+}
+
+uint8_t *frm_get_framedata(frmreader *reader, uint8_t facing, uint8_t index)
+{
+    frmframe *frame = frm_get_frame(reader, facing, index);
+    return frame ? frame->data : NULL;
+}
+
+//
+// Position of a frame's top-left corner relative to the sprite's anchor
+// point (the bottom center of the object's hex). The per-frame x/y shifts
+// accumulate over the animation, on top of the direction's origin shift
+//
+void frm_get_frame_position(frmreader *reader, uint8_t facing, uint16_t index, int32_t *left, int32_t *top)
+{
+    int32_t x = reader->x_origin[facing];
+    int32_t y = reader->y_origin[facing];
+    for (uint16_t i = 0; i <= index; i++)
+    {
+        frmframe *frame = frm_get_frame(reader, facing, i);
+        x += frame->x;
+        y += frame->y;
+    }
+
+    frmframe *frame = frm_get_frame(reader, facing, index);
+    *left = x - frame->width/2;
+    *top = y - frame->height + 1;
 }
 
 void frmreader_free(frmreader *reader)
 {
+    free(reader->frames);
     free(reader->data);
     free(reader);
-}
\ No newline at end of file
+}
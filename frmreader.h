@@ -28,6 +28,23 @@
 
 #ifndef _frmreader_h
 #define _frmreader_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRM_HEADER_SIZE 62
+#define FRM_FRAME_HEADER_SIZE 12
+#define FRM_DIRECTIONS 6
+
+typedef struct
+{
+    uint16_t width;
+    uint16_t height;
+    int16_t x;
+    int16_t y;
+    uint8_t *data;
+} frmframe;
+
 typedef struct
 {
     uint32_t version;
@@ -43,11 +60,18 @@ typedef struct
     uint16_t x;
     uint16_t y;
     uint8_t *data;
+
+    // Frames for each direction, animation_length per direction.
+    // Directions that share frame data point at the same frames
+    uint8_t direction_count;
+    frmframe *frames;
 } frmreader;
 
-frmreader *frmreader_from_data(uint8_t *data);
+frmreader *frmreader_from_data(uint8_t *data, size_t length);
 void frmreader_free(frmreader *reader);
+frmframe *frm_get_frame(frmreader *reader, uint8_t facing, uint16_t index);
 uint8_t *frm_get_framedata(frmreader *reader, uint8_t facing, uint8_t index);
+void frm_get_frame_position(frmreader *reader, uint8_t facing, uint16_t index, int32_t *left, int32_t *top);
 
 
 #endif
@@ -0,0 +1,215 @@
+/*
+ * lzblock.c
+ * Fast LZ77 block codec used by block archives
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "lzblock.h"
+
+// The final bytes of a block are always literals, and no match starts
+// in the last LZBLOCK_MATCH_LIMIT bytes
+#define LZBLOCK_LAST_LITERALS 5
+#define LZBLOCK_MATCH_LIMIT 12
+
+// Unmatched input is scanned with a growing stride, so incompressible
+// data is passed over quickly
+#define LZBLOCK_SKIP_SHIFT 6
+
+static uint32_t read_u32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint32_t hash_u32(uint32_t value)
+{
+    return (value*2654435761U) >> (32 - LZBLOCK_HASH_BITS);
+}
+
+static uint8_t *write_length(uint8_t *out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = length;
+    return out;
+}
+
+static uint8_t *write_sequence(uint8_t *out, const uint8_t *literals, size_t literal_length, size_t offset, size_t match_length)
+{
+    uint8_t *token = out++;
+    *token = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15)
+        out = write_length(out, literal_length - 15);
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+
+    // The final sequence has no match
+    if (!offset)
+        return out;
+
+    *out++ = offset;
+    *out++ = offset >> 8;
+    match_length -= LZBLOCK_MIN_MATCH;
+    *token |= match_length < 15 ? match_length : 15;
+    if (match_length >= 15)
+        out = write_length(out, match_length - 15);
+    return out;
+}
+
+//
+// Largest possible compressed size of length bytes
+//
+size_t lzblock_bound(size_t length)
+{
+    return length + length/255 + 16;
+}
+
+//
+// Compress a block with greedy hash-chain-free matching
+// Returns the compressed size, or 0 if capacity is below lzblock_bound
+//
+size_t lzblock_compress(uint8_t *out, size_t capacity, const uint8_t *data, size_t length)
+{
+    if (capacity < lzblock_bound(length))
+        return 0;
+
+    uint32_t table[1 << LZBLOCK_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *end = data + length;
+    const uint8_t *anchor = data;
+    uint8_t *op = out;
+    if (length > LZBLOCK_MATCH_LIMIT)
+    {
+        const uint8_t *match_limit = end - LZBLOCK_MATCH_LIMIT;
+        const uint8_t *extend_limit = end - LZBLOCK_LAST_LITERALS;
+        const uint8_t *ip = data + 1;
+        while (ip < match_limit)
+        {
+            uint32_t sequence = read_u32(ip);
+            uint32_t hash = hash_u32(sequence);
+            const uint8_t *ref = data + table[hash];
+            table[hash] = ip - data;
+            if (ref >= ip || ip - ref > LZBLOCK_MAX_OFFSET || read_u32(ref) != sequence)
+            {
+                ip += 1 + ((ip - anchor) >> LZBLOCK_SKIP_SHIFT);
+                continue;
+            }
+
+            // Grow the match backwards into pending literals, then forwards
+            while (ip > anchor && ref > data && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+
+            size_t match_length = LZBLOCK_MIN_MATCH;
+            while (ip + match_length < extend_limit && ip[match_length] == ref[match_length])
+                match_length++;
+
+            op = write_sequence(op, anchor, ip - anchor, ip - ref, match_length);
+            ip += match_length;
+            anchor = ip;
+
+            // Index a position inside the match so repeats are found sooner
+            if (ip < match_limit)
+                table[hash_u32(read_u32(ip - 2))] = ip - 2 - data;
+        }
+    }
+
+    op = write_sequence(op, anchor, end - anchor, 0, 0);
+    return op - out;
+}
+
+static int read_length(const uint8_t **in, const uint8_t *end, size_t *length)
+{
+    uint8_t byte;
+    do
+    {
+        if (*in >= end)
+            return -1;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+//
+// Decompress a block that must expand to exactly length bytes
+// Returns 0 on success, or -1 if the block is corrupt
+//
+int lzblock_decompress(uint8_t *out, size_t length, const uint8_t *data, size_t size)
+{
+    const uint8_t *in = data;
+    const uint8_t *in_end = data + size;
+    uint8_t *op = out;
+    uint8_t *out_end = out + length;
+    for (;;)
+    {
+        if (in >= in_end)
+            return -1;
+
+        uint8_t token = *in++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && read_length(&in, in_end, &literal_length))
+            return -1;
+        if (literal_length > (size_t)(in_end - in) || literal_length > (size_t)(out_end - op))
+            return -1;
+
+        memcpy(op, in, literal_length);
+        op += literal_length;
+        in += literal_length;
+        if (in == in_end)
+            break;
+
+        if (in_end - in < 2)
+            return -1;
+        size_t offset = in[0] | in[1] << 8;
+        in += 2;
+
+        size_t match_length = token & 15;
+        if (match_length == 15 && read_length(&in, in_end, &match_length))
+            return -1;
+        match_length += LZBLOCK_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || match_length > (size_t)(out_end - op))
+            return -1;
+
+        // Overlapping matches repeat the last offset bytes. Each copy
+        // starts a whole number of periods in, so the pattern written so
+        // far can be copied again, doubling the length every time
+        const uint8_t *ref = op - offset;
+        for (size_t i = 0; i < match_length;)
+        {
+            size_t count = i + offset < match_length - i ? i + offset : match_length - i;
+            memcpy(op + i, ref, count);
+            i += count;
+        }
+        op += match_length;
+    }
+
+    return op == out_end ? 0 : -1;
+}
@@ -0,0 +1,46 @@
+/*
+ * lzblock.h
+ * Fast LZ77 block codec used by block archives
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _lzblock_h
+#define _lzblock_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Blocks use the LZ4 block layout: sequences of a token (literal and
+// match length nibbles), extra length bytes, literals and a 16-bit
+// little-endian match offset, ending with a sequence of literals only
+#define LZBLOCK_MIN_MATCH 4
+#define LZBLOCK_MAX_OFFSET 65535
+#define LZBLOCK_HASH_BITS 14
+
+size_t lzblock_bound(size_t length);
+size_t lzblock_compress(uint8_t *out, size_t capacity, const uint8_t *data, size_t length);
+int lzblock_decompress(uint8_t *out, size_t length, const uint8_t *data, size_t size);
+
+#endif
@@ -28,10 +28,36 @@
  */
 
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "dat2reader.h"
+#include "dat2pool.h"
+#include "dat2stream.h"
+#include "dat2scheduler.h"
+#include "dat2dedupe.h"
+#include "dat2diff.h"
+#include "dat2optimize.h"
+#include "dat2blocks.h"
+#include "dat2checkpoint.h"
+#include "dat2trace.h"
+#include "dat2stats.h"
 #include "frmreader.h"
+#include "frmcatalog.h"
+#include "mapreader.h"
+#include "maprenderer.h"
 #include "palreader.h"
+#include "palcycle.h"
+#include "deflate.h"
+#include "animwriter.h"
+#include "thumbnail.h"
+#include "spritemask.h"
+#include "assetserver.h"
+#include "rendercache.h"
+#include "dat2writer.h"
+#include "acmdecoder.h"
 
 void print_entry_table(dat2reader *reader)
 {
@@ -40,7 +66,8 @@ void print_entry_table(dat2reader *reader)
     for (uint32_t i = 0; i < reader->entry_count; i++)
     {
         dat2entry *entry = &reader->entries[i];
-        printf("%-40s %d %8d %8d %8d\n", entry->filename, entry->compressed, entry->compressed_size, entry->uncompressed_size, entry->offset);
+        printf("%-40s %d %8d %8d %8llu\n", entry->filename, entry->compressed, entry->compressed_size, entry->uncompressed_size,
+            (unsigned long long)entry->offset);
     }
 }
 
@@ -70,81 +97,1295 @@ void extract_file(dat2reader *reader, char *entry_name, char *filename)
     free(data);
 }
 
-void dump_frm(dat2reader *reader, char *frm_name, char *pal_name, char *filename)
+//
+// Extract bytes [start, end) of an entry, inflating only as much as needed
+//
+void extract_range(dat2reader *reader, char *entry_name, char *filename, uint32_t start, uint32_t end)
 {
-    dat2entry *frm_entry = dat2reader_find_entry(reader, frm_name);
-    if (!frm_entry)
+    dat2entry *e = dat2reader_find_entry(reader, entry_name);
+    if (!e)
     {
         fprintf(stderr, "Unable to find file\n");
         return;
     }
 
-    uint8_t *frm_data = dat2entry_extract_data(frm_entry);
-    frmreader *frm = frmreader_from_data(frm_data);
-    free(frm_data);
+    if (end > e->uncompressed_size)
+        end = e->uncompressed_size;
+    if (start >= end)
+        return;
+
+    uint8_t *data = malloc(end - start);
+    if (!data)
+        return;
+
+    size_t length = dat2entry_read_range(e, data, start, end);
+    FILE *outfile = fopen(filename, "w+");
+    if (outfile)
+    {
+        fwrite(data, sizeof(uint8_t), length, outfile);
+        fclose(outfile);
+    }
+
+    free(data);
+}
 
+//
+// Load a palette entry from the archive
+// Returns NULL if the palette could not be loaded
+//
+static palreader *load_palette(dat2reader *reader, char *pal_name)
+{
     dat2entry *pal_entry = dat2reader_find_entry(reader, pal_name);
     if (!pal_entry)
     {
         fprintf(stderr, "Unable to find file\n");
-        return;
+        return NULL;
     }
+
     uint8_t *pal_data = dat2entry_extract_data(pal_entry);
+    if (!pal_data)
+        return NULL;
+
     palreader *pal = palreader_from_data(pal_data);
     free(pal_data);
+    return pal;
+}
 
-    palreader_export_png(pal, frm_get_framedata(frm, 0, 0), frm->width, frm->height, filename);
-    palreader_free(pal);
-    frmreader_free(frm);
+//
+// Extract and parse an frm entry
+// Returns NULL if the frm could not be loaded
+//
+static frmreader *load_frm(dat2entry *frm_entry)
+{
+    uint8_t *frm_data = dat2entry_extract_data(frm_entry);
+    if (!frm_data)
+        return NULL;
+
+    frmreader *frm = frmreader_from_data(frm_data, frm_entry->uncompressed_size);
+    if (!frm)
+        fprintf(stderr, "%s: invalid frm data\n", frm_entry->filename);
+
+    free(frm_data);
+    return frm;
 }
 
-void dump_artwork(dat2reader *reader)
+void dump_frm(dat2reader *reader, char *frm_name, char *pal_name, char *filename, const pngwriter_options *options)
 {
-    dat2entry *pal_entry = dat2reader_find_entry(reader, "color.pal");
-    if (!pal_entry)
+    dat2entry *frm_entry = dat2reader_find_entry(reader, frm_name);
+    if (!frm_entry)
     {
         fprintf(stderr, "Unable to find file\n");
         return;
     }
-    uint8_t *pal_data = dat2entry_extract_data(pal_entry);
-    palreader *pal = palreader_from_data(pal_data);
-    free(pal_data);
 
-    for (size_t i = 0; i < reader->entry_count; i++)
+    frmreader *frm = load_frm(frm_entry);
+    if (!frm)
+        return;
+
+    palreader *pal = load_palette(reader, pal_name);
+    if (pal)
     {
-        if (strcasestr(reader->entries[i].filename, ".frm") ||
-            strcasestr(reader->entries[i].filename, ".FRM"))
+        palreader_write_png(pal, frm_get_framedata(frm, 0, 0), frm->width, frm->height, options, filename);
+        palreader_free(pal);
+    }
+    frmreader_free(frm);
+}
+
+static bool is_frm_entry(dat2entry *entry, void *user)
+{
+    return strcasestr(entry->filename, ".frm") != NULL;
+}
+
+typedef struct
+{
+    palreader *pal;
+    const pngwriter_options *options;
+    rendercache *cache;
+    uint64_t archive;
+    uint8_t rgb[768];
+
+    // Mask file options, or NULL to export the png alone
+    const spritemask_options *masks;
+} artwork_context;
+
+//
+// Write a cached image to a file
+// Returns 0 on success, 1 if the image is not cached, or -1 on error
+//
+static int write_cached(rendercache *cache, const rendercache_key *key, const char *path)
+{
+    size_t length;
+    uint8_t *data = rendercache_lookup(cache, key, &length);
+    if (!data)
+        return 1;
+
+    pngbuffer buffer = { data, length, length };
+    int status = pngbuffer_write_file(&buffer, path);
+    pngbuffer_free(&buffer);
+    return status;
+}
+
+static int dump_artwork_entry(dat2entry *entry, void *user)
+{
+    artwork_context *context = user;
+
+    // Take the file component and replace frm -> png
+    char *c = strrchr(entry->filename, '\\');
+    char *png = strdup(c ? c + 1 : entry->filename);
+    if (!png)
+        return 1;
+
+    size_t end = strlen(png);
+    strcpy(&png[end-3], "png");
+    printf("%s\n", png);
+
+    // Unchanged entries are copied from the cache without being decoded,
+    // unless their masks are also needed
+    int status = 1;
+    rendercache_key key;
+    if (context->cache)
+    {
+        key = rendercache_entry_key(entry, context->archive, context->rgb, context->options, RENDERCACHE_ARTWORK,
+            context->masks != NULL);
+        status = write_cached(context->cache, &key, png);
+        if (status < 0 || (status == 0 && !context->masks))
         {
-            // Take the file component and replace frm -> png
-            char *c = strrchr(reader->entries[i].filename, '\\');
-            char *png = strdup(++c);
-            size_t end = strlen(png);
-            strcpy(&png[end-3], "png");
-            printf("%s\n", png);
-
-            uint8_t *frm_data = dat2entry_extract_data(&reader->entries[i]);
-            frmreader *frm = frmreader_from_data(frm_data);
-            palreader_export_png(pal, frm_get_framedata(frm, 0, 0), frm->width, frm->height, png);
+            free(png);
+            return status != 0;
+        }
+    }
+
+    dat2pool *pool = dat2pool_thread();
+    uint8_t *frm_data = pool ? dat2pool_acquire(pool, entry->uncompressed_size) : NULL;
+    if (frm_data && dat2entry_extract_into(entry, frm_data, entry->uncompressed_size) == 0)
+    {
+        frmreader *frm = frmreader_from_data(frm_data, entry->uncompressed_size);
+        if (frm && status != 0)
+        {
+            // With masks, the png's alpha channel is the mask as well
+            pngbuffer buffer = { NULL, 0, 0 };
+            if (context->masks)
+                status = palreader_encode_transparent_png(context->pal, frm_get_framedata(frm, 0, 0), frm->width,
+                    frm->height, context->options, &buffer);
+            else
+                status = palreader_encode_png(context->pal, frm_get_framedata(frm, 0, 0), frm->width, frm->height,
+                    context->options, &buffer);
+            if (status == 0 && context->cache)
+                rendercache_store(context->cache, &key, buffer.data, buffer.length);
+            if (status == 0)
+                status = pngbuffer_write_file(&buffer, png);
+            pngbuffer_free(&buffer);
+        }
+
+        if (frm && status == 0 && context->masks)
+        {
+            strcpy(&png[end - 3], "msk");
+            status = spritemask_write_frm(frm, context->masks, png);
+        }
+        if (frm)
             frmreader_free(frm);
-            free(frm_data);
+    }
+    if (pool)
+        dat2pool_release(pool, frm_data);
 
-            free(png);
+    free(png);
+    return status;
+}
+
+void dump_artwork(dat2reader *reader, const spritemask_options *masks, unsigned threads, const pngwriter_options *options,
+    rendercache *cache)
+{
+    palreader *pal = load_palette(reader, "color.pal");
+    if (!pal)
+        return;
+
+    artwork_context context = { pal, options, cache, cache ? rendercache_archive_id(reader) : 0 };
+    context.masks = masks;
+    palreader_get_rgb(pal, context.rgb);
+    size_t failed = dat2scheduler_run_reader(reader, is_frm_entry, dump_artwork_entry, &context, threads);
+    if (failed)
+        fprintf(stderr, "Failed to export %zu files\n", failed);
+
+    palreader_free(pal);
+}
+
+//
+// Read the arguments of artwork masks: an optional outline radius, then
+// an optional shadow offset
+// Returns 0 on success, or -1 if an argument is invalid
+//
+int parse_mask_options(char **args, int argn, spritemask_options *options)
+{
+    *options = spritemask_defaults();
+    if (argn != 1 && argn != 2 && argn != 4)
+        return -1;
+
+    long values[3];
+    for (int i = 1; i < argn; i++)
+    {
+        char *end;
+        values[i - 1] = strtol(args[i], &end, 10);
+        if (end == args[i] || *end || values[i - 1] < (i == 1 ? 0 : INT8_MIN) ||
+            values[i - 1] > (i == 1 ? SPRITEMASK_MAX_OUTLINE : INT8_MAX))
+        {
+            fprintf(stderr, "Invalid mask argument %s\n", args[i]);
+            return -1;
+        }
+    }
+
+    if (argn >= 2)
+        options->outline_radius = values[0];
+    if (argn == 4)
+    {
+        options->shadow_x = values[1];
+        options->shadow_y = values[2];
+    }
+    return 0;
+}
+
+#define MAX_THUMBNAIL_SIZES 8
+
+typedef struct
+{
+    uint8_t rgb[768];
+    uint32_t sizes[MAX_THUMBNAIL_SIZES];
+    size_t size_count;
+    uint32_t min_size;
+    const pngwriter_options *options;
+} thumbnail_context;
+
+static int thumbnail_entry(dat2entry *entry, void *user)
+{
+    thumbnail_context *context = user;
+
+    int status = 1;
+    dat2pool *pool = dat2pool_thread();
+    uint8_t *frm_data = pool ? dat2pool_acquire(pool, entry->uncompressed_size) : NULL;
+    if (!frm_data || dat2entry_extract_into(entry, frm_data, entry->uncompressed_size))
+        goto extract_error;
+
+    frmreader *frm = frmreader_from_data(frm_data, entry->uncompressed_size);
+    if (!frm)
+        goto extract_error;
+
+    // Every size is produced from a single expansion of the first frame
+    thumbnail_chain *chain = thumbnail_chain_build(frm_get_framedata(frm, 0, 0), frm->width, frm->height,
+        context->rgb, context->min_size);
+    if (!chain)
+        goto chain_error;
+
+    char *c = strrchr(entry->filename, '\\');
+    const char *name = c ? c + 1 : entry->filename;
+    int length = strlen(name) - 4;
+
+    status = 0;
+    for (size_t i = 0; i < context->size_count; i++)
+    {
+        thumbnail_image image;
+        if (thumbnail_chain_resize(chain, context->sizes[i], &image))
+        {
+            status = 1;
+            continue;
+        }
+
+        char path[FILENAME_MAX];
+        snprintf(path, sizeof(path), "%.*s_%u.png", length, name, context->sizes[i]);
+        printf("%s\n", path);
+
+        pngbuffer buffer = { NULL, 0, 0 };
+        if (thumbnail_encode_png(&image, context->options, &buffer) || pngbuffer_write_file(&buffer, path))
+            status = 1;
+
+        pngbuffer_free(&buffer);
+        free(image.pixels);
+    }
+
+    thumbnail_chain_free(chain);
+chain_error:
+    frmreader_free(frm);
+extract_error:
+    if (pool)
+        dat2pool_release(pool, frm_data);
+    return status;
+}
+
+//
+// Export thumbnails of every frm at each of the given sizes in parallel
+//
+void dump_thumbnails(dat2reader *reader, char **sizes, int size_count, unsigned threads, const pngwriter_options *options)
+{
+    thumbnail_context context;
+    context.options = options;
+    context.size_count = 0;
+    context.min_size = UINT32_MAX;
+    for (int i = 0; i < size_count && context.size_count < MAX_THUMBNAIL_SIZES; i++)
+    {
+        uint32_t size = strtoul(sizes[i], NULL, 0);
+        if (size == 0)
+        {
+            fprintf(stderr, "Invalid thumbnail size %s\n", sizes[i]);
+            return;
+        }
+
+        context.sizes[context.size_count++] = size;
+        if (size < context.min_size)
+            context.min_size = size;
+    }
+
+    if (context.size_count == 0)
+    {
+        static const uint32_t default_sizes[] = { 128, 64, 32 };
+        memcpy(context.sizes, default_sizes, sizeof(default_sizes));
+        context.size_count = 3;
+        context.min_size = 32;
+    }
+
+    palreader *pal = load_palette(reader, "color.pal");
+    if (!pal)
+        return;
+
+    palreader_get_rgb(pal, context.rgb);
+    palreader_free(pal);
+
+    size_t failed = dat2scheduler_run_reader(reader, is_frm_entry, thumbnail_entry, &context, threads);
+    if (failed)
+        fprintf(stderr, "Failed to export %zu files\n", failed);
+}
+
+typedef struct
+{
+    const char *pattern;
+    uint8_t rgb[768];
+    animwriter_format format;
+    const pngwriter_options *options;
+    rendercache *cache;
+    uint64_t archive;
+} animate_context;
+
+static bool is_animation_entry(dat2entry *entry, void *user)
+{
+    animate_context *context = user;
+    return is_frm_entry(entry, NULL) && (!context->pattern || strcasestr(entry->filename, context->pattern));
+}
+
+static int animate_entry(dat2entry *entry, void *user)
+{
+    animate_context *context = user;
+    frmreader *frm = load_frm(entry);
+    if (!frm)
+        return 1;
+
+    // Take the file component and replace .frm -> _<direction>.png/gif
+    char *c = strrchr(entry->filename, '\\');
+    const char *name = c ? c + 1 : entry->filename;
+    size_t length = strlen(name) - 4;
+    const char *extension = context->format == ANIMWRITER_GIF ? "gif" : "png";
+
+    int status = 0;
+    for (uint8_t d = 0; d < frm->direction_count; d++)
+    {
+        char path[FILENAME_MAX];
+        snprintf(path, sizeof(path), "%.*s_%u.%s", (int)length, name, d, extension);
+        printf("%s\n", path);
+
+        if (!context->cache)
+        {
+            if (animwriter_write_direction(frm, d, context->rgb, context->format, context->options, path))
+                status = 1;
+            continue;
+        }
+
+        rendercache_key key = rendercache_entry_key(entry, context->archive, context->rgb, context->options,
+            context->format == ANIMWRITER_GIF ? RENDERCACHE_GIF : RENDERCACHE_APNG, d);
+        int cached = write_cached(context->cache, &key, path);
+        if (cached < 0)
+            status = 1;
+        if (cached <= 0)
+            continue;
+
+        pngbuffer buffer = { NULL, 0, 0 };
+        if (animwriter_encode_direction(frm, d, context->rgb, context->format, context->options, &buffer) == 0)
+        {
+            rendercache_store(context->cache, &key, buffer.data, buffer.length);
+            if (pngbuffer_write_file(&buffer, path))
+                status = 1;
+        }
+        else
+            status = 1;
+        pngbuffer_free(&buffer);
+    }
+
+    frmreader_free(frm);
+    return status;
+}
+
+//
+// Export every direction of each frm matching pattern (or all frms)
+// as an animation, encoding the frms in parallel
+//
+void animate_artwork(dat2reader *reader, const char *pattern, animwriter_format format, unsigned threads,
+    const pngwriter_options *options, rendercache *cache)
+{
+    palreader *pal = load_palette(reader, "color.pal");
+    if (!pal)
+        return;
+
+    animate_context context;
+    context.pattern = pattern;
+    context.format = format;
+    context.options = options;
+    context.cache = cache;
+    context.archive = cache ? rendercache_archive_id(reader) : 0;
+    palreader_get_rgb(pal, context.rgb);
+    palreader_free(pal);
+
+    size_t failed = dat2scheduler_run_reader(reader, is_animation_entry, animate_entry, &context, threads);
+    if (failed)
+        fprintf(stderr, "Failed to export %zu files\n", failed);
+}
+
+typedef struct
+{
+    const char *pattern;
+    uint8_t rgb[768];
+    const pngwriter_options *options;
+    size_t exported;
+} cycle_context;
+
+static bool is_cycle_entry(dat2entry *entry, void *user)
+{
+    cycle_context *context = user;
+    return is_frm_entry(entry, NULL) && (!context->pattern || strcasestr(entry->filename, context->pattern));
+}
+
+static int cycle_entry(dat2entry *entry, void *user)
+{
+    cycle_context *context = user;
+    frmreader *frm = load_frm(entry);
+    if (!frm)
+        return 1;
+
+    // Take the file component and replace .frm -> _cycle.png
+    char *c = strrchr(entry->filename, '\\');
+    const char *name = c ? c + 1 : entry->filename;
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%.*s_cycle.png", (int)strlen(name) - 4, name);
+
+    pngbuffer buffer = { NULL, 0, 0 };
+    int status = palcycle_encode_apng(frm_get_framedata(frm, 0, 0), frm->width, frm->height, context->rgb,
+        context->options, &buffer);
+    if (status == 0)
+    {
+        printf("%s\n", path);
+        status = pngbuffer_write_file(&buffer, path);
+        __atomic_add_fetch(&context->exported, 1, __ATOMIC_RELAXED);
+    }
+
+    pngbuffer_free(&buffer);
+    frmreader_free(frm);
+    return status < 0;
+}
+
+//
+// Export the palette cycle of every frm matching pattern (or all frms)
+// whose first frame uses a cycling colour, as a looping APNG
+//
+void cycle_artwork(dat2reader *reader, const char *pattern, unsigned threads, const pngwriter_options *options)
+{
+    palreader *pal = load_palette(reader, "color.pal");
+    if (!pal)
+        return;
+
+    cycle_context context;
+    context.pattern = pattern;
+    context.options = options;
+    context.exported = 0;
+    palreader_get_rgb(pal, context.rgb);
+    palreader_free(pal);
+
+    size_t failed = dat2scheduler_run_reader(reader, is_cycle_entry, cycle_entry, &context, threads);
+    printf("Exported %zu palette cycles\n", context.exported);
+    if (failed)
+        fprintf(stderr, "Failed to export %zu files\n", failed);
+}
+
+typedef struct
+{
+    dat2verify_status *status;
+    uint32_t *adler32;
+} verify_results;
+
+static int verify_entry(dat2entry *entry, void *user)
+{
+    verify_results *results = user;
+    size_t index = entry - entry->reader->entries;
+    results->status[index] = dat2entry_verify(entry, &results->adler32[index]);
+    return results->status[index] != DAT2VERIFY_OK;
+}
+
+//
+// Check the archive directory and inflate every entry in parallel,
+// reporting any entry that fails validation
+// Returns 0 if the archive is intact
+//
+int verify_archive(dat2reader *reader, unsigned threads, bool verbose)
+{
+    int status = 0;
+    struct stat st;
+    if (fstat(fileno(reader->file), &st) == 0 && (uint64_t)st.st_size != reader->filesize)
+    {
+        fprintf(stderr, "Archive size %lld does not match recorded size %llu\n", (long long)st.st_size,
+            (unsigned long long)reader->filesize);
+        status = 1;
+    }
+
+    verify_results results;
+    results.status = calloc(reader->entry_count, sizeof(dat2verify_status));
+    results.adler32 = calloc(reader->entry_count, sizeof(uint32_t));
+    if (!results.status || !results.adler32)
+    {
+        fprintf(stderr, "Malloc error\n");
+        free(results.status);
+        free(results.adler32);
+        return 1;
+    }
+
+    size_t failed = dat2scheduler_run_reader(reader, NULL, verify_entry, &results, threads);
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+    {
+        if (results.status[i] != DAT2VERIFY_OK)
+            fprintf(stderr, "%s: %s\n", reader->entries[i].filename, dat2verify_status_string(results.status[i]));
+        else if (verbose)
+            printf("%08x %s\n", results.adler32[i], reader->entries[i].filename);
+    }
+
+    printf("Verified %u files, %zu failed\n", reader->entry_count, failed);
+    free(results.status);
+    free(results.adler32);
+    return status || failed;
+}
+
+//
+// Group identical entries across the archive and any additional archives,
+// printing each group with more than one member, and optionally export
+// the unique entries into a content-addressed store
+// Returns 0 on success
+//
+int dedupe_archives(dat2reader *reader, char **paths, int path_count, const char *export_path, unsigned threads)
+{
+    int status = 1;
+    dat2reader **readers = calloc(path_count + 1, sizeof(dat2reader *));
+    if (!readers)
+        return 1;
+
+    readers[0] = reader;
+    int reader_count = 1;
+    for (; reader_count <= path_count; reader_count++)
+    {
+        readers[reader_count] = dat2reader_open(paths[reader_count - 1]);
+        if (!readers[reader_count])
+            goto open_error;
+    }
+
+    dat2dedupe *dedupe = dat2dedupe_build(readers, reader_count, threads);
+    if (!dedupe)
+        goto open_error;
+
+    uint64_t duplicate_bytes = 0;
+    size_t duplicate_groups = 0;
+    for (size_t g = 0; g < dedupe->group_count; g++)
+    {
+        size_t count = dat2dedupe_group_size(dedupe, g);
+        if (count < 2)
+            continue;
+
+        dat2dedupe_item *first = &dedupe->items[dedupe->group_start[g]];
+        printf("%016llx %u bytes, %zu copies\n", (unsigned long long)first->hash, first->entry->uncompressed_size, count);
+        for (size_t i = 0; i < count; i++)
+            printf("    %s: %s\n", first[i].entry->reader->path, first[i].entry->filename);
+
+        duplicate_groups++;
+        duplicate_bytes += (uint64_t)(count - 1)*first->entry->uncompressed_size;
+    }
+
+    printf("%zu files, %zu unique, %zu duplicated groups, %llu redundant bytes\n",
+        dedupe->item_count, dedupe->group_count, duplicate_groups, (unsigned long long)duplicate_bytes);
+
+    status = 0;
+    if (export_path && dat2dedupe_export(dedupe, export_path, threads))
+        status = 1;
+
+    dat2dedupe_free(dedupe);
+
+open_error:
+    for (int i = 1; i < reader_count; i++)
+        dat2reader_close(readers[i]);
+    free(readers);
+    return status;
+}
+
+//
+// List the entries added, removed and changed in a newer version of the
+// archive, optionally writing the added and changed entries to a patch
+// Returns 0 on success
+//
+int diff_archives(dat2reader *reader, const char *new_path, const char *patch_path, unsigned threads)
+{
+    dat2reader *new_reader = dat2reader_open((char *)new_path);
+    if (!new_reader)
+        return 1;
+
+    int status = 1;
+    dat2diff *diff = dat2diff_build(reader, new_reader, threads);
+    if (!diff)
+        goto diff_error;
+
+    static const char tags[] = { ' ', 'A', 'R', 'M', '!' };
+    for (size_t i = 0; i < diff->item_count; i++)
+    {
+        dat2diff_item *item = &diff->items[i];
+        if (item->status != DAT2DIFF_UNCHANGED)
+            printf("%c %s\n", tags[item->status], item->new_entry ? item->new_entry->filename : item->old_entry->filename);
+    }
+
+    printf("%zu added, %zu removed, %zu changed, %zu unchanged\n", diff->counts[DAT2DIFF_ADDED],
+        diff->counts[DAT2DIFF_REMOVED], diff->counts[DAT2DIFF_CHANGED], diff->counts[DAT2DIFF_UNCHANGED]);
+    printf("Matched files decided by size: %zu, by stored bytes: %zu, by inflated content: %zu\n",
+        diff->methods[DAT2DIFF_BY_SIZE], diff->methods[DAT2DIFF_BY_RAW], diff->methods[DAT2DIFF_BY_CONTENT]);
+
+    status = diff->counts[DAT2DIFF_FAILED] != 0;
+    if (patch_path)
+    {
+        if (dat2diff_write_patch(diff, patch_path))
+        {
+            unlink(patch_path);
+            status = 1;
         }
+        else if (diff->counts[DAT2DIFF_REMOVED])
+            fprintf(stderr, "Warning: %s cannot express the %zu removed files\n", patch_path, diff->counts[DAT2DIFF_REMOVED]);
     }
+
+    dat2diff_free(diff);
+diff_error:
+    dat2reader_close(new_reader);
+    return status;
+}
+
+//
+// Decode a single acm entry, writing raw PCM if the output ends in .raw
+// and a WAV file otherwise
+// Returns 0 on success
+//
+int decode_sound(dat2reader *reader, char *entry_name, const char *filename)
+{
+    dat2entry *entry = dat2reader_find_entry(reader, entry_name);
+    if (!entry)
+    {
+        fprintf(stderr, "Unable to find file\n");
+        return 1;
+    }
+
+    size_t length = strlen(filename);
+    acmdecoder_format format = length > 4 && strcasecmp(&filename[length - 4], ".raw") == 0 ?
+        ACMDECODER_RAW : ACMDECODER_WAV;
+
+    if (acmdecoder_write_file(entry, format, filename))
+    {
+        unlink(filename);
+        return 1;
+    }
+    return 0;
+}
+
+static bool is_sound_entry(dat2entry *entry, void *user)
+{
+    const char *pattern = user;
+    return strcasestr(entry->filename, ".acm") != NULL && (!pattern || strcasestr(entry->filename, pattern));
+}
+
+static int decode_sound_entry(dat2entry *entry, void *user)
+{
+    // Take the file component and replace acm -> wav
+    char *c = strrchr(entry->filename, '\\');
+    char *wav = strdup(c ? c + 1 : entry->filename);
+    if (!wav)
+        return 1;
+
+    size_t end = strlen(wav);
+    strcpy(&wav[end-3], "wav");
+    printf("%s\n", wav);
+
+    int status = acmdecoder_write_file(entry, ACMDECODER_WAV, wav);
+    if (status)
+        unlink(wav);
+
+    free(wav);
+    return status != 0;
+}
+
+//
+// Decode every acm entry matching pattern (or all of them) to WAV
+// files in parallel
+//
+void dump_sounds(dat2reader *reader, char *pattern, unsigned threads)
+{
+    size_t failed = dat2scheduler_run_reader(reader, is_sound_entry, decode_sound_entry, pattern, threads);
+    if (failed)
+        fprintf(stderr, "Failed to decode %zu files\n", failed);
+}
+
+//
+// Summarise the archive directory by extension, directory, size and
+// compression ratio as JSON or CSV, to stdout or the output file
+// Returns 0 on success
+//
+int print_statistics(dat2reader *reader, const char *format, const char *output, unsigned threads)
+{
+    bool csv = false;
+    if (format && strcmp(format, "csv") == 0)
+        csv = true;
+    else if (format && strcmp(format, "json") != 0)
+    {
+        fprintf(stderr, "Unknown statistics format %s\n", format);
+        return 1;
+    }
+
+    dat2columns *columns = dat2columns_from_reader(reader);
+    if (!columns)
+        return 1;
+
+    int status = 1;
+    dat2stats *stats = dat2stats_build(columns, reader->directory_offset, threads);
+    if (!stats)
+        goto stats_error;
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out)
+    {
+        fprintf(stderr, "Unable to create %s: %s\n", output, strerror(errno));
+        goto open_error;
+    }
+
+    if ((csv ? dat2stats_write_csv(stats, columns, out) : dat2stats_write_json(stats, columns, out)) == 0)
+        status = 0;
+
+    if (output && fclose(out))
+        status = 1;
+
+open_error:
+    dat2stats_free(stats);
+stats_error:
+    dat2columns_free(columns);
+    return status;
+}
+
+//
+// Catalog the dimensions, timing and offsets of every frm, writing
+// either the binary catalog or JSON
+// Returns 0 on success
+//
+int catalog_artwork(dat2reader *reader, const char *path, const char *format, unsigned threads)
+{
+    bool json = false;
+    if (format && strcmp(format, "json") == 0)
+        json = true;
+    else if (format && strcmp(format, "binary") != 0)
+    {
+        fprintf(stderr, "Unknown catalog format %s\n", format);
+        return 1;
+    }
+
+    frmcatalog *catalog = frmcatalog_build(reader, threads);
+    if (!catalog)
+        return 1;
+
+    int status = 1;
+    if (json)
+    {
+        FILE *out = fopen(path, "w");
+        if (!out)
+            fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+        else
+        {
+            if (frmcatalog_write_json(catalog, out) == 0)
+                status = 0;
+            if (fclose(out))
+                status = 1;
+        }
+    }
+    else if (frmcatalog_write(catalog, path) == 0)
+        status = 0;
+
+    printf("Catalogued %u frms with %u frames\n", catalog->sprite_count, catalog->frame_count);
+    if (catalog->failed_count)
+        fprintf(stderr, "Failed to read %u frms\n", catalog->failed_count);
+
+    frmcatalog_free(catalog);
+    return status;
+}
+
+//
+// Render the floors and roofs of every map matching pattern (or all
+// maps) as png tiles. Maps are rendered one at a time, with the tiles
+// of each map composited in parallel
+// Returns 0 on success
+//
+int render_maps(dat2reader *reader, const char *pattern, unsigned threads, const pngwriter_options *options)
+{
+    palreader *pal = load_palette(reader, "color.pal");
+    if (!pal)
+        return 1;
+
+    uint8_t rgb[768];
+    palreader_get_rgb(pal, rgb);
     palreader_free(pal);
+
+    maprenderer *renderer = maprenderer_create(reader, rgb, options);
+    if (!renderer)
+        return 1;
+
+    size_t failed = 0;
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+    {
+        dat2entry *entry = &reader->entries[i];
+        if (!strcasestr(entry->filename, ".map") || (pattern && !strcasestr(entry->filename, pattern)))
+            continue;
+
+        uint8_t *data = dat2entry_extract_data(entry);
+        mapreader *map = data ? mapreader_from_data(data, entry->uncompressed_size) : NULL;
+        free(data);
+        if (!map)
+        {
+            fprintf(stderr, "%s: invalid map data\n", entry->filename);
+            failed++;
+            continue;
+        }
+
+        // Take the file component without the .map extension
+        char *c = strrchr(entry->filename, '\\');
+        char *name = strdup(c ? c + 1 : entry->filename);
+        if (name)
+        {
+            name[strlen(name) - 4] = '\0';
+            if (maprenderer_render(renderer, map, name, threads))
+                failed++;
+        }
+        else
+            failed++;
+
+        free(name);
+        mapreader_free(map);
+    }
+
+    maprenderer_free(renderer);
+    if (failed)
+        fprintf(stderr, "Failed to render %zu maps\n", failed);
+    return failed != 0;
+}
+
+//
+// Copy every entry into a new archive, converting between the standard
+// and extended directory formats without recompressing. Block archives
+// are converted back to dat2 by recompressing their compressed entries
+// Returns 0 on success
+//
+int convert_archive(dat2reader *reader, const char *path, const char *format)
+{
+    bool extended = false;
+    if (format && strcmp(format, "extended") == 0)
+        extended = true;
+    else if (format && strcmp(format, "standard") != 0)
+    {
+        fprintf(stderr, "Unknown archive format %s\n", format);
+        return 1;
+    }
+
+    dat2writer *writer = dat2writer_create(path, extended);
+    if (!writer)
+        return 1;
+
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+        if (dat2writer_copy_entry(writer, &reader->entries[i], NULL))
+            break;
+
+    if (dat2writer_close(writer))
+    {
+        unlink(path);
+        return 1;
+    }
+
+    printf("Wrote %u files to %s\n", reader->entry_count, path);
+    return 0;
+}
+
+//
+// Write a block archive for fast extraction and random access
+// Returns 0 on success
+//
+int pack_archive(dat2reader *reader, const char *path, unsigned threads)
+{
+    if (dat2blocks_write(reader, path, threads))
+    {
+        unlink(path);
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(path, &st))
+        return 1;
+
+    printf("Wrote %u files to %s\n%llu -> %llu bytes\n", reader->entry_count, path,
+        (unsigned long long)reader->filesize, (unsigned long long)st.st_size);
+    return 0;
+}
+
+//
+// Rewrite the archive with every entry recompressed at the best level,
+// or stored when that costs at most budget percent more space, grouped
+// by directory
+// Returns 0 on success
+//
+int optimize_archive(dat2reader *reader, const char *path, const char *budget, unsigned threads)
+{
+    char *end = NULL;
+    unsigned long budget_percent = budget ? strtoul(budget, &end, 10) : 0;
+    if (budget && (end == budget || (*end && strcmp(end, "%"))))
+    {
+        fprintf(stderr, "Invalid size budget %s\n", budget);
+        return 1;
+    }
+
+    dat2optimize_report report;
+    if (dat2optimize_write(reader, path, budget_percent, threads, &report))
+    {
+        unlink(path);
+        return 1;
+    }
+
+    printf("%u files: %u stored, %u recompressed, %u unchanged", report.entry_count, report.stored,
+        report.recompressed, report.kept);
+    if (report.failed)
+        printf(", %u copied after read errors", report.failed);
+    printf("\n%llu -> %llu bytes\n", (unsigned long long)report.original_size, (unsigned long long)report.optimized_size);
+    return report.failed != 0;
+}
+
+//
+// Build inflate checkpoints every span KB through each large compressed
+// entry, and write them to a sidecar index for use with -i
+// Returns 0 on success
+//
+int index_checkpoints(dat2reader *reader, const char *path, const char *span, unsigned threads)
+{
+    char *end = NULL;
+    unsigned long span_kb = span ? strtoul(span, &end, 10) : DAT2CHECKPOINT_DEFAULT_SPAN/1024;
+    if ((span && (end == span || *end)) || span_kb > UINT32_MAX/1024 ||
+        dat2reader_enable_checkpoints(reader, span_kb*1024))
+    {
+        fprintf(stderr, "Invalid checkpoint span %s\n", span);
+        return 1;
+    }
+
+    size_t failed = dat2checkpoints_build(reader, threads);
+    if (dat2checkpoints_save(reader, path))
+        return 1;
+
+    uint32_t entries = 0;
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < reader->entry_count; i++)
+    {
+        entries += reader->checkpoints->lists[i].count != 0;
+        count += reader->checkpoints->lists[i].count;
+    }
+
+    printf("Wrote %llu checkpoints for %u files to %s\n", (unsigned long long)count, entries, path);
+    if (failed)
+        fprintf(stderr, "Failed to index %zu files\n", failed);
+    return failed != 0;
+}
+
+//
+// Read the entries touched by a recorded trace into the page cache,
+// in one pass over the archive
+// Returns 0 on success
+//
+int prefetch_archive(dat2reader *reader, const char *trace_path)
+{
+    uint32_t count;
+    uint32_t *order = dat2trace_load_order(reader, trace_path, &count);
+    if (!order)
+        return 1;
+
+    uint64_t bytes;
+    int status = dat2trace_prefetch(reader, order, count, &bytes);
+    if (status == 0)
+        printf("Prefetched %u files, %llu bytes\n", count, (unsigned long long)bytes);
+
+    free(order);
+    return status != 0;
+}
+
+//
+// Copy the archive with the entries touched by a recorded trace laid
+// out first, in the order they were first accessed
+// Returns 0 on success
+//
+int repack_archive(dat2reader *reader, const char *trace_path, const char *path)
+{
+    uint32_t count;
+    uint32_t *order = dat2trace_load_order(reader, trace_path, &count);
+    if (!order)
+        return 1;
+
+    int status = dat2trace_repack(reader, order, count, path);
+    if (status)
+        unlink(path);
+    else
+        printf("Wrote %u files to %s, %u in trace order\n", reader->entry_count, path, count);
+
+    free(order);
+    return status != 0;
+}
+
+//
+// Keep the archive and any additional archives open and serve them
+// over loopback HTTP until interrupted
+// Returns 0 on a clean shutdown
+//
+int serve_archives(dat2reader *reader, const char *port, char **paths, int path_count, unsigned threads,
+    const pngwriter_options *options, rendercache *cache)
+{
+    int status = 1;
+    dat2reader **readers = calloc(path_count + 1, sizeof(dat2reader *));
+    if (!readers)
+        return 1;
+
+    readers[0] = reader;
+    int reader_count = 1;
+    for (; reader_count <= path_count; reader_count++)
+    {
+        readers[reader_count] = dat2reader_open(paths[reader_count - 1]);
+        if (!readers[reader_count])
+            goto open_error;
+    }
+
+    unsigned long port_number = port ? strtoul(port, NULL, 10) : 8080;
+    if (port_number == 0 || port_number > UINT16_MAX)
+    {
+        fprintf(stderr, "Invalid port %s\n", port);
+        goto open_error;
+    }
+
+    if (assetserver_run(readers, reader_count, port_number, threads, options, cache) == 0)
+        status = 0;
+
+open_error:
+    for (int i = 1; i < reader_count; i++)
+        dat2reader_close(readers[i]);
+    free(readers);
+    return status;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-l level] [-f png|gif] [-v] [-o output] [-t trace] [-c cache] [-i index] [archive.dat] [command [arguments]]\n", name);
+    fprintf(stderr, "  -l sets the png compression level, from 0 (fastest) to 9 (smallest)\n");
+    fprintf(stderr, "  -f sets the animation format, png (APNG, the default) or gif\n");
+    fprintf(stderr, "  -c reuses images rendered by artwork, animate and serve from a cache directory\n");
+    fprintf(stderr, "  -t records the files found and extracted by the command to a trace\n");
+    fprintf(stderr, "  -i seeks within large compressed files from the checkpoints in an index\n");
+    fprintf(stderr, "Commands:\n");
+    fprintf(stderr, "  list                            Print the archive directory\n");
+    fprintf(stderr, "  extract <entry> <file>          Extract a single entry\n");
+    fprintf(stderr, "  extract <entry> <file> <start> <end>\n");
+    fprintf(stderr, "                                  Extract bytes [start, end) of an entry\n");
+    fprintf(stderr, "  frm <entry> <palette> <png>     Export the first frame of an frm\n");
+    fprintf(stderr, "  artwork                         Export every frm as png (default)\n");
+    fprintf(stderr, "  artwork masks [radius [dx dy]]  Also write the mask, outline (default radius 1) and shadow\n");
+    fprintf(stderr, "                                  (default offset 3 2) of every frame as 1-bit planes to .msk,\n");
+    fprintf(stderr, "                                  and make palette index 0 transparent in the png\n");
+    fprintf(stderr, "                                  (write -- before the arguments if dx or dy is negative)\n");
+    fprintf(stderr, "  animate [pattern]               Export each direction of matching frms as an animation\n");
+    fprintf(stderr, "  cycle [pattern]                 Export frms using cycling palette colours as looping APNG\n");
+    fprintf(stderr, "  catalog <out> [binary|json]     Write the size, timing and offsets of every frm and frame\n");
+    fprintf(stderr, "  thumbnails [size ...]           Export downscaled frms as rgba png (default 128 64 32)\n");
+    fprintf(stderr, "  acm <entry> <file>              Decode an acm entry to wav (or raw pcm for .raw)\n");
+    fprintf(stderr, "  sounds [pattern]                Decode matching acm entries to wav\n");
+    fprintf(stderr, "  maps [pattern]                  Render floors and roofs of matching maps as png tiles\n");
+    fprintf(stderr, "  convert <out.dat> [standard|extended]\n");
+    fprintf(stderr, "                                  Copy the archive, choosing the directory format\n");
+    fprintf(stderr, "  pack <out.d2b>                  Copy the archive into a block archive, which opens like a .dat\n");
+    fprintf(stderr, "                                  and decompresses faster (convert turns it back into a .dat)\n");
+    fprintf(stderr, "  optimize <out.dat> [budget%%]    Recompress or store each file, grouped by directory;\n");
+    fprintf(stderr, "                                  files are stored if at most budget%% larger (default 0)\n");
+    fprintf(stderr, "  checkpoints <out.idx> [span]    Index large compressed files every span KB (default 1024)\n");
+    fprintf(stderr, "                                  so reads from any position inflate at most span KB\n");
+    fprintf(stderr, "  prefetch <trace>                Read the files in a trace into the page cache\n");
+    fprintf(stderr, "  repack <trace> <out.dat>        Copy the archive with traced files first, in access order\n");
+    fprintf(stderr, "  diff <new.dat> [patch.dat]      List added (A), removed (R) and changed (M) files,\n");
+    fprintf(stderr, "                                  optionally writing the added and changed files to a patch\n");
+    fprintf(stderr, "  serve [port [archive.dat ...]]  Serve entries over http on 127.0.0.1 (default port 8080)\n");
+    fprintf(stderr, "                                  GET /list, /file/<entry>, /frm/<entry>,\n");
+    fprintf(stderr, "                                  /png/<entry>?direction=<d>&frame=<f>\n");
+    fprintf(stderr, "  stats [json|csv]                Summarise sizes and compression by extension and directory\n");
+    fprintf(stderr, "                                  (-o writes to a file)\n");
+    fprintf(stderr, "  verify                          Check every entry (-v lists checksums)\n");
+    fprintf(stderr, "  dedupe [archive.dat ...]        Report identical entries (-o exports unique files)\n");
 }
 
 int main(int argc, char **argv)
 {
-    dat2reader *reader = dat2reader_open("master.dat");
+    unsigned threads = 0;
+    bool verbose = false;
+    const char *output = NULL;
+    const char *trace = NULL;
+    const char *cache_path = NULL;
+    const char *index_path = NULL;
+    pngwriter_options png_options = pngwriter_preset(DEFLATE_LEVEL_FAST);
+    animwriter_format anim_format = ANIMWRITER_APNG;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:l:f:vo:t:c:i:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'l':
+                png_options = pngwriter_preset(atoi(optarg));
+                break;
+            case 'f':
+                if (strcmp(optarg, "gif") == 0)
+                    anim_format = ANIMWRITER_GIF;
+                else if (strcmp(optarg, "png") == 0 || strcmp(optarg, "apng") == 0)
+                    anim_format = ANIMWRITER_APNG;
+                else
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 't':
+                trace = optarg;
+                break;
+            case 'c':
+                cache_path = optarg;
+                break;
+            case 'i':
+                index_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    const char *path = optind < argc ? argv[optind++] : "master.dat";
+    const char *command = optind < argc ? argv[optind++] : "artwork";
+    int argn = argc - optind;
+    char **args = &argv[optind];
+
+    dat2reader *reader = dat2reader_open((char *)path);
     if (!reader)
         return 1;
 
-    //print_entry_table(reader);
-    //extract_file(reader, "art\\scenery\\verti01.frm", "verti01.frm");
-    //dump_frm(reader, "art\\scenery\\verti01.frm", "color.pal", "0.png");
-    dump_artwork(reader);
+    if ((index_path && dat2checkpoints_load(reader, index_path)) ||
+        (trace && dat2reader_start_trace(reader, trace)))
+    {
+        dat2reader_close(reader);
+        return 1;
+    }
 
+    rendercache *cache = NULL;
+    if (cache_path && !(cache = rendercache_open(cache_path)))
+    {
+        dat2reader_stop_trace(reader);
+        dat2reader_close(reader);
+        return 1;
+    }
+
+    int status = 0;
+    if (strcmp(command, "list") == 0)
+        print_entry_table(reader);
+    else if (strcmp(command, "extract") == 0 && argn == 2)
+        extract_file(reader, args[0], args[1]);
+    else if (strcmp(command, "extract") == 0 && argn == 4)
+        extract_range(reader, args[0], args[1], strtoul(args[2], NULL, 0), strtoul(args[3], NULL, 0));
+    else if (strcmp(command, "frm") == 0 && argn == 3)
+    {
+        // A single image can use every thread for striped compression,
+        // while bulk exports already run one entry per thread
+        pngwriter_options frm_options = png_options;
+        frm_options.threads = threads;
+        dump_frm(reader, args[0], args[1], args[2], &frm_options);
+    }
+    else if (strcmp(command, "artwork") == 0 && argn == 0)
+        dump_artwork(reader, NULL, threads, &png_options, cache);
+    else if (strcmp(command, "artwork") == 0 && strcmp(args[0], "masks") == 0)
+    {
+        spritemask_options masks;
+        if (parse_mask_options(args, argn, &masks) == 0)
+            dump_artwork(reader, &masks, threads, &png_options, cache);
+        else
+            status = 1;
+    }
+    else if (strcmp(command, "animate") == 0 && argn <= 1)
+        animate_artwork(reader, argn ? args[0] : NULL, anim_format, threads, &png_options, cache);
+    else if (strcmp(command, "cycle") == 0 && argn <= 1)
+        cycle_artwork(reader, argn ? args[0] : NULL, threads, &png_options);
+    else if (strcmp(command, "catalog") == 0 && (argn == 1 || argn == 2))
+        status = catalog_artwork(reader, args[0], argn == 2 ? args[1] : NULL, threads);
+    else if (strcmp(command, "thumbnails") == 0)
+        dump_thumbnails(reader, args, argn, threads, &png_options);
+    else if (strcmp(command, "acm") == 0 && argn == 2)
+        status = decode_sound(reader, args[0], args[1]);
+    else if (strcmp(command, "sounds") == 0 && argn <= 1)
+        dump_sounds(reader, argn ? args[0] : NULL, threads);
+    else if (strcmp(command, "maps") == 0 && argn <= 1)
+        status = render_maps(reader, argn ? args[0] : NULL, threads, &png_options);
+    else if (strcmp(command, "convert") == 0 && (argn == 1 || argn == 2))
+        status = convert_archive(reader, args[0], argn == 2 ? args[1] : NULL);
+    else if (strcmp(command, "pack") == 0 && argn == 1)
+        status = pack_archive(reader, args[0], threads);
+    else if (strcmp(command, "optimize") == 0 && (argn == 1 || argn == 2))
+        status = optimize_archive(reader, args[0], argn == 2 ? args[1] : NULL, threads);
+    else if (strcmp(command, "checkpoints") == 0 && (argn == 1 || argn == 2))
+        status = index_checkpoints(reader, args[0], argn == 2 ? args[1] : NULL, threads);
+    else if (strcmp(command, "prefetch") == 0 && argn == 1)
+        status = prefetch_archive(reader, args[0]);
+    else if (strcmp(command, "repack") == 0 && argn == 2)
+        status = repack_archive(reader, args[0], args[1]);
+    else if (strcmp(command, "diff") == 0 && (argn == 1 || argn == 2))
+        status = diff_archives(reader, args[0], argn == 2 ? args[1] : NULL, threads);
+    else if (strcmp(command, "serve") == 0)
+        status = serve_archives(reader, argn ? args[0] : NULL, args + 1, argn ? argn - 1 : 0, threads, &png_options, cache);
+    else if (strcmp(command, "stats") == 0 && argn <= 1)
+        status = print_statistics(reader, argn ? args[0] : NULL, output, threads);
+    else if (strcmp(command, "verify") == 0)
+        status = verify_archive(reader, threads, verbose);
+    else if (strcmp(command, "dedupe") == 0)
+        status = dedupe_archives(reader, args, argn, output, threads);
+    else
+    {
+        usage(argv[0]);
+        status = 1;
+    }
+
+    if (cache)
+    {
+        fprintf(stderr, "Render cache: %llu hits, %llu misses\n", (unsigned long long)cache->hits,
+            (unsigned long long)cache->misses);
+        rendercache_close(cache);
+    }
+
+    if (dat2reader_stop_trace(reader))
+        status = 1;
     dat2reader_close(reader);
-    return 0;
+    return status;
 }
@@ -0,0 +1,124 @@
+/*
+ * mapreader.c
+ * Reads Fallout 2 .map files
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "mapreader.h"
+
+// Map data is big-endian
+static uint32_t read_u32(uint8_t **data)
+{
+    uint32_t ret = 0;
+    for (int8_t i = 3; i >= 0; i--)
+        ret |= (uint32_t)*(*data)++ << 8*i;
+    return ret;
+}
+
+static int32_t read_s32(uint8_t **data)
+{
+    return (int32_t)read_u32(data);
+}
+
+//
+// Parse the header and square tiles of a map. Scripts and objects
+// follow the tiles and are not read
+// Returns NULL if the data is truncated or inconsistent
+//
+mapreader *mapreader_from_data(uint8_t *data, size_t length)
+{
+    if (length < MAP_HEADER_SIZE)
+        return NULL;
+
+    mapreader *reader = calloc(1, sizeof(mapreader));
+    if (!reader)
+        return NULL;
+
+    uint8_t *dp = data;
+    reader->version = read_u32(&dp);
+    memcpy(reader->name, dp, 16);
+    reader->name[16] = '\0';
+    dp += 16;
+    reader->player_position = read_s32(&dp);
+    reader->player_elevation = read_s32(&dp);
+    reader->player_orientation = read_s32(&dp);
+    reader->local_count = read_s32(&dp);
+    reader->script_index = read_s32(&dp);
+    reader->flags = read_s32(&dp);
+    reader->darkness = read_s32(&dp);
+    reader->global_count = read_s32(&dp);
+    reader->map_id = read_s32(&dp);
+    reader->timestamp = read_u32(&dp);
+    dp = data + MAP_HEADER_SIZE;
+
+    // Global then local variables precede the tiles
+    if (reader->global_count < 0 || reader->local_count < 0)
+        goto format_error;
+
+    size_t offset = MAP_HEADER_SIZE + 4*((size_t)reader->global_count + reader->local_count);
+    for (uint8_t e = 0; e < MAP_ELEVATIONS; e++)
+    {
+        // A set flag bit (2, 4, 8) marks the elevation as absent
+        if (reader->flags & (2 << e))
+            continue;
+
+        if (offset > length || length - offset < 4*MAP_SQUARES)
+            goto format_error;
+
+        reader->squares[e] = malloc(MAP_SQUARES*sizeof(uint32_t));
+        if (!reader->squares[e])
+            goto format_error;
+
+        dp = data + offset;
+        for (size_t i = 0; i < MAP_SQUARES; i++)
+            reader->squares[e][i] = read_u32(&dp);
+        offset += 4*MAP_SQUARES;
+    }
+
+    return reader;
+
+format_error:
+    mapreader_free(reader);
+    return NULL;
+}
+
+void mapreader_free(mapreader *reader)
+{
+    for (uint8_t e = 0; e < MAP_ELEVATIONS; e++)
+        free(reader->squares[e]);
+    free(reader);
+}
+
+uint16_t map_get_floor(mapreader *reader, uint8_t elevation, uint16_t square)
+{
+    return reader->squares[elevation][square] & MAP_TILE_MASK;
+}
+
+uint16_t map_get_roof(mapreader *reader, uint8_t elevation, uint16_t square)
+{
+    return (reader->squares[elevation][square] >> 16) & MAP_TILE_MASK;
+}
@@ -0,0 +1,70 @@
+/*
+ * mapreader.h
+ * Reads Fallout 2 .map files
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _mapreader_h
+#define _mapreader_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAP_HEADER_SIZE 236
+#define MAP_WIDTH 100
+#define MAP_SQUARES (MAP_WIDTH*MAP_WIDTH)
+#define MAP_ELEVATIONS 3
+
+// Tile ids index art\tiles\tiles.lst; id 1 is the blank tile
+#define MAP_TILE_MASK 0x0FFF
+#define MAP_TILE_BLANK 1
+
+typedef struct
+{
+    uint32_t version;
+    char name[17];
+    int32_t player_position;
+    int32_t player_elevation;
+    int32_t player_orientation;
+    int32_t local_count;
+    int32_t script_index;
+    int32_t flags;
+    int32_t darkness;
+    int32_t global_count;
+    int32_t map_id;
+    uint32_t timestamp;
+
+    // Floor tile ids in the low 16 bits of each square, roof ids in the
+    // high 16 bits. NULL for elevations the map does not have
+    uint32_t *squares[MAP_ELEVATIONS];
+} mapreader;
+
+mapreader *mapreader_from_data(uint8_t *data, size_t length);
+void mapreader_free(mapreader *reader);
+uint16_t map_get_floor(mapreader *reader, uint8_t elevation, uint16_t square);
+uint16_t map_get_roof(mapreader *reader, uint8_t elevation, uint16_t square);
+
+#endif
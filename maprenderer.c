@@ -0,0 +1,418 @@
+/*
+ * maprenderer.c
+ * Renders map floors and roofs as tiled images
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "maprenderer.h"
+#include "dat2pool.h"
+#include "dat2scheduler.h"
+#include "frmreader.h"
+
+#define TILE_LIST "art\\tiles\\tiles.lst"
+#define TILE_PREFIX "art\\tiles\\"
+
+// Square tile frames are 80x36, and roofs sit 96 pixels above their floor
+#define SQUARE_WIDTH 80
+#define SQUARE_HEIGHT 36
+#define ROOF_OFFSET 96
+
+// Extent of a map's squares in screen space, with room above for roofs
+#define IMAGE_WIDTH (48*MAP_WIDTH + 32*MAP_WIDTH)
+#define IMAGE_HEIGHT (36*MAP_WIDTH + ROOF_OFFSET)
+
+enum
+{
+    FRAME_UNLOADED = 0,
+    FRAME_LOADED = 1,
+    FRAME_MISSING = -1,
+};
+
+//
+// Screen position of a square's top left corner. x runs right to left
+//
+static void square_to_screen(uint16_t square, int32_t *sx, int32_t *sy)
+{
+    int32_t x = MAP_WIDTH - 1 - square % MAP_WIDTH;
+    int32_t y = square / MAP_WIDTH;
+    *sx = 48*MAP_WIDTH - 48 + 32*y - 48*x;
+    *sy = 24*y + 12*x + ROOF_OFFSET;
+}
+
+//
+// Look up a tile frm, falling back to a lower case name since
+// tiles.lst entries do not always match the archive's case
+//
+static dat2entry *find_tile(dat2reader *reader, char *line)
+{
+    char name[256];
+    if (snprintf(name, sizeof(name), TILE_PREFIX "%s", line) >= (int)sizeof(name))
+        return NULL;
+
+    dat2entry *entry = dat2reader_find_entry(reader, name);
+    if (entry)
+        return entry;
+
+    for (char *c = name; *c; c++)
+        *c = tolower((unsigned char)*c);
+    return dat2reader_find_entry(reader, name);
+}
+
+//
+// Map tile ids to archive entries. Each line of tiles.lst names the
+// frm for the id matching its line number
+// Returns 0 on success, or -1 on error
+//
+static int load_tile_list(maprenderer *renderer)
+{
+    dat2entry *list = dat2reader_find_entry(renderer->reader, TILE_LIST);
+    if (!list)
+    {
+        fprintf(stderr, "Unable to find %s\n", TILE_LIST);
+        return -1;
+    }
+
+    uint8_t *data = dat2entry_extract_data(list);
+    if (!data)
+        return -1;
+
+    uint32_t line_count = 1;
+    for (uint32_t i = 0; i < list->uncompressed_size; i++)
+        if (data[i] == '\n')
+            line_count++;
+
+    renderer->tiles = calloc(line_count, sizeof(dat2entry *));
+    if (!renderer->tiles)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(data);
+        return -1;
+    }
+
+    char *text = (char *)data;
+    uint32_t start = 0;
+    for (uint32_t i = 0; i <= list->uncompressed_size; i++)
+    {
+        if (i < list->uncompressed_size && data[i] != '\n')
+            continue;
+
+        // Names end at the first whitespace or comment
+        uint32_t end = start;
+        while (end < i && !isspace((unsigned char)text[end]) && text[end] != ';')
+            end++;
+
+        if (end > start)
+        {
+            char line[128];
+            uint32_t length = end - start < sizeof(line) - 1 ? end - start : sizeof(line) - 1;
+            memcpy(line, &text[start], length);
+            line[length] = '\0';
+            renderer->tiles[renderer->tile_count] = find_tile(renderer->reader, line);
+        }
+
+        renderer->tile_count++;
+        start = i + 1;
+    }
+
+    free(data);
+    return 0;
+}
+
+//
+// Create a renderer for maps using the tiles in reader
+// Returns NULL on error
+//
+maprenderer *maprenderer_create(dat2reader *reader, const uint8_t *rgb, const pngwriter_options *options)
+{
+    maprenderer *renderer = calloc(1, sizeof(maprenderer));
+    if (!renderer)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    renderer->reader = reader;
+    renderer->rgb = rgb;
+    renderer->options = options;
+    renderer->tile_size = MAPRENDERER_TILE_SIZE;
+    renderer->frames = calloc(reader->entry_count, sizeof(maprenderer_frame));
+    if (!renderer->frames)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        free(renderer);
+        return NULL;
+    }
+
+    if (load_tile_list(renderer))
+    {
+        maprenderer_free(renderer);
+        return NULL;
+    }
+    return renderer;
+}
+
+void maprenderer_free(maprenderer *renderer)
+{
+    for (uint32_t i = 0; i < renderer->reader->entry_count; i++)
+        free(renderer->frames[i].pixels);
+    free(renderer->frames);
+    free(renderer->tiles);
+    free(renderer);
+}
+
+static maprenderer_frame *tile_frame(maprenderer *renderer, uint16_t id)
+{
+    if (id == MAP_TILE_BLANK || id >= renderer->tile_count || !renderer->tiles[id])
+        return NULL;
+
+    maprenderer_frame *frame = &renderer->frames[renderer->tiles[id] - renderer->reader->entries];
+    return frame->state == FRAME_LOADED ? frame : NULL;
+}
+
+//
+// Decode the first frame of a tile frm into the cache. Each entry is
+// loaded by exactly one task, so the cache needs no locking
+//
+static int load_frame(dat2entry *entry, void *user)
+{
+    maprenderer *renderer = user;
+    maprenderer_frame *cached = &renderer->frames[entry - renderer->reader->entries];
+    cached->state = FRAME_MISSING;
+
+    dat2pool *pool = dat2pool_thread();
+    uint8_t *data = pool ? dat2pool_acquire(pool, entry->uncompressed_size) : NULL;
+    frmreader *frm = NULL;
+    if (data && dat2entry_extract_into(entry, data, entry->uncompressed_size) == 0)
+        frm = frmreader_from_data(data, entry->uncompressed_size);
+    if (pool)
+        dat2pool_release(pool, data);
+
+    if (!frm)
+    {
+        fprintf(stderr, "%s: invalid frm data\n", entry->filename);
+        return 1;
+    }
+
+    frmframe *frame = frm_get_frame(frm, 0, 0);
+    cached->pixels = malloc((size_t)frame->width*frame->height);
+    if (cached->pixels)
+    {
+        memcpy(cached->pixels, frame->data, (size_t)frame->width*frame->height);
+        cached->width = frame->width;
+        cached->height = frame->height;
+        cached->state = FRAME_LOADED;
+    }
+
+    frmreader_free(frm);
+    return cached->state != FRAME_LOADED;
+}
+
+//
+// Decode every tile frm used by a map that is not already cached
+// Returns 0 on success, or -1 on error
+//
+static int load_frames(maprenderer *renderer, mapreader *map, unsigned threads)
+{
+    dat2reader *reader = renderer->reader;
+    dat2entry **pending = malloc(reader->entry_count*sizeof(dat2entry *));
+    if (!pending)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    size_t count = 0;
+    for (uint8_t e = 0; e < MAP_ELEVATIONS; e++)
+    {
+        if (!map->squares[e])
+            continue;
+
+        for (uint16_t i = 0; i < MAP_SQUARES; i++)
+        {
+            uint16_t ids[2] = { map_get_floor(map, e, i), map_get_roof(map, e, i) };
+            for (int j = 0; j < 2; j++)
+            {
+                if (ids[j] == MAP_TILE_BLANK || ids[j] >= renderer->tile_count || !renderer->tiles[ids[j]])
+                    continue;
+
+                dat2entry *entry = renderer->tiles[ids[j]];
+                maprenderer_frame *frame = &renderer->frames[entry - reader->entries];
+                if (frame->state == FRAME_UNLOADED)
+                {
+                    // Mark as queued so the entry is only added once
+                    frame->state = FRAME_MISSING;
+                    pending[count++] = entry;
+                }
+            }
+        }
+    }
+
+    dat2scheduler_run(pending, count, load_frame, renderer, threads);
+    free(pending);
+    return 0;
+}
+
+typedef struct
+{
+    maprenderer *renderer;
+    mapreader *map;
+    const char *name;
+    uint8_t elevations[MAP_ELEVATIONS];
+    uint32_t columns;
+    uint32_t rows;
+} render_job;
+
+//
+// Copy the opaque pixels of a frame at (sx, sy) into an output tile
+// covering [x0, x0 + width) x [y0, y0 + height)
+// Returns true if any part of the frame overlapped the tile
+//
+static bool blit(uint8_t *out, int32_t x0, int32_t y0, uint32_t width, uint32_t height,
+    const maprenderer_frame *frame, int32_t sx, int32_t sy)
+{
+    int32_t left = sx > x0 ? sx : x0;
+    int32_t top = sy > y0 ? sy : y0;
+    int32_t right = sx + frame->width < x0 + (int32_t)width ? sx + frame->width : x0 + (int32_t)width;
+    int32_t bottom = sy + frame->height < y0 + (int32_t)height ? sy + frame->height : y0 + (int32_t)height;
+    if (left >= right || top >= bottom)
+        return false;
+
+    for (int32_t y = top; y < bottom; y++)
+    {
+        const uint8_t *src = &frame->pixels[(size_t)(y - sy)*frame->width + (left - sx)];
+        uint8_t *dest = &out[(size_t)(y - y0)*width + (left - x0)];
+        for (int32_t x = 0; x < right - left; x++)
+            if (src[x])
+                dest[x] = src[x];
+    }
+    return true;
+}
+
+//
+// Composite one output tile: every floor in draw order, then every
+// roof. Only the tile's own buffer is allocated
+//
+static int render_tile(size_t index, void *user)
+{
+    render_job *job = user;
+    maprenderer *renderer = job->renderer;
+    uint32_t per_elevation = job->columns*job->rows;
+    uint8_t elevation = job->elevations[index/per_elevation];
+    uint32_t row = index % per_elevation / job->columns;
+    uint32_t column = index % job->columns;
+
+    int32_t x0 = column*renderer->tile_size;
+    int32_t y0 = row*renderer->tile_size;
+    uint32_t width = IMAGE_WIDTH - x0 < renderer->tile_size ? IMAGE_WIDTH - x0 : renderer->tile_size;
+    uint32_t height = IMAGE_HEIGHT - y0 < renderer->tile_size ? IMAGE_HEIGHT - y0 : renderer->tile_size;
+
+    uint8_t *pixels = calloc((size_t)width*height, sizeof(uint8_t));
+    if (!pixels)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // Squares are drawn back to front: rows top to bottom, and within
+    // a row from the rightmost square on screen to the leftmost
+    bool drawn = false;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int32_t y = 0; y < MAP_WIDTH; y++)
+        {
+            for (int32_t x = MAP_WIDTH - 1; x >= 0; x--)
+            {
+                uint16_t square = y*MAP_WIDTH + x;
+                uint16_t id = pass ? map_get_roof(job->map, elevation, square) : map_get_floor(job->map, elevation, square);
+                maprenderer_frame *frame = tile_frame(renderer, id);
+                if (!frame)
+                    continue;
+
+                int32_t sx, sy;
+                square_to_screen(square, &sx, &sy);
+                if (pass)
+                    sy -= ROOF_OFFSET;
+
+                drawn |= blit(pixels, x0, y0, width, height, frame, sx, sy);
+            }
+        }
+    }
+
+    int status = 0;
+    if (drawn)
+    {
+        char path[FILENAME_MAX];
+        snprintf(path, sizeof(path), "%s_%u_%02u_%02u.png", job->name, elevation, row, column);
+        printf("%s\n", path);
+
+        pngwriter_image image;
+        image.width = width;
+        image.height = height;
+        image.color = PNGWRITER_COLOR_INDEXED;
+        image.pixels = pixels;
+        image.stride = width;
+        image.palette = renderer->rgb;
+        image.palette_size = 256;
+        image.transparent_index = 0;
+
+        pngbuffer buffer = { NULL, 0, 0 };
+        status = pngwriter_encode(&buffer, &image, renderer->options) || pngbuffer_write_file(&buffer, path);
+        pngbuffer_free(&buffer);
+    }
+
+    free(pixels);
+    return status;
+}
+
+//
+// Render every elevation of a map as tiles named
+// <name>_<elevation>_<row>_<column>.png, skipping empty tiles
+// Returns 0 on success, or -1 if any tile failed
+//
+int maprenderer_render(maprenderer *renderer, mapreader *map, const char *name, unsigned threads)
+{
+    if (load_frames(renderer, map, threads))
+        return -1;
+
+    render_job job;
+    job.renderer = renderer;
+    job.map = map;
+    job.name = name;
+    job.columns = (IMAGE_WIDTH + renderer->tile_size - 1)/renderer->tile_size;
+    job.rows = (IMAGE_HEIGHT + renderer->tile_size - 1)/renderer->tile_size;
+
+    size_t elevation_count = 0;
+    for (uint8_t e = 0; e < MAP_ELEVATIONS; e++)
+        if (map->squares[e])
+            job.elevations[elevation_count++] = e;
+
+    size_t failed = dat2scheduler_run_tasks(elevation_count*job.columns*job.rows, NULL, render_tile, &job, threads);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * maprenderer.h
+ * Renders map floors and roofs as tiled images
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _maprenderer_h
+#define _maprenderer_h
+
+#include <stdint.h>
+#include "dat2reader.h"
+#include "mapreader.h"
+#include "pngwriter.h"
+
+#define MAPRENDERER_TILE_SIZE 1024
+
+typedef struct
+{
+    int8_t state;
+    uint16_t width;
+    uint16_t height;
+    uint8_t *pixels;
+} maprenderer_frame;
+
+typedef struct
+{
+    dat2reader *reader;
+    const uint8_t *rgb;
+    const pngwriter_options *options;
+    uint32_t tile_size;
+
+    // Tile id to entry, from art\tiles\tiles.lst
+    uint32_t tile_count;
+    dat2entry **tiles;
+
+    // Decoded first frames, indexed by entry so that tiles sharing
+    // an frm share the cached frame, and kept across maps
+    maprenderer_frame *frames;
+} maprenderer;
+
+maprenderer *maprenderer_create(dat2reader *reader, const uint8_t *rgb, const pngwriter_options *options);
+void maprenderer_free(maprenderer *renderer);
+int maprenderer_render(maprenderer *renderer, mapreader *map, const char *name, unsigned threads);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * palcycle.c
+ * Animates the cycling palette ranges used for water, fire and lights
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "palcycle.h"
+
+// Index 0 is the transparent entry in the Fallout palettes
+#define TRANSPARENT_INDEX 0
+
+// The alarm's red level climbs to ALARM_MAX in steps of ALARM_STEP (in
+// the palette's 6 bit units) and falls back again
+#define ALARM_INDEX 254
+#define ALARM_STEP 4
+#define ALARM_MAX 60
+#define ALARM_STEPS (2*ALARM_MAX/ALARM_STEP)
+
+typedef struct
+{
+    uint8_t first;
+    uint8_t count;
+    uint16_t steps;
+    uint16_t period;    // Milliseconds per step
+} palcycle_timing;
+
+static const palcycle_timing timings[PALCYCLE_RANGE_COUNT] =
+{
+    [PALCYCLE_SLIME] = { 229, 4, 4, 200 },
+    [PALCYCLE_SHORELINE] = { 248, 6, 6, 200 },
+    [PALCYCLE_FIRE_SLOW] = { 238, 5, 5, 200 },
+    [PALCYCLE_FIRE_FAST] = { 243, 5, 5, 142 },
+    [PALCYCLE_MONITORS] = { 233, 5, 5, 100 },
+    [PALCYCLE_ALARM] = { ALARM_INDEX, 1, ALARM_STEPS, 33 },
+};
+
+//
+// Find which cycling ranges appear in a frame's pixels
+// Returns a mask with bit r set for each range r
+//
+uint32_t palcycle_ranges_used(const uint8_t *pixels, size_t count)
+{
+    uint8_t range_of[256];
+    memset(range_of, PALCYCLE_RANGE_COUNT, sizeof(range_of));
+    for (uint8_t r = 0; r < PALCYCLE_RANGE_COUNT; r++)
+        memset(&range_of[timings[r].first], r, timings[r].count);
+
+    uint32_t ranges = 0;
+    for (size_t i = 0; i < count; i++)
+        if (range_of[pixels[i]] < PALCYCLE_RANGE_COUNT)
+            ranges |= 1U << range_of[pixels[i]];
+    return ranges;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+    while (b)
+    {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+//
+// Time in milliseconds after which every range in the mask is back
+// at its starting colours, saturating at UINT32_MAX
+//
+uint32_t palcycle_loop_length(uint32_t ranges)
+{
+    uint64_t length = 1;
+    for (uint8_t r = 0; r < PALCYCLE_RANGE_COUNT; r++)
+    {
+        if (!(ranges & (1U << r)))
+            continue;
+
+        uint32_t loop = timings[r].steps*timings[r].period;
+        length = length/gcd(length, loop)*loop;
+        if (length > UINT32_MAX)
+            return UINT32_MAX;
+    }
+    return length;
+}
+
+//
+// Produce the 8 bit palette as it appears a given number of milliseconds
+// into the cycle, changing only the ranges in the mask
+//
+void palcycle_apply(const uint8_t *rgb, uint32_t ranges, uint32_t time, uint8_t *out)
+{
+    memcpy(out, rgb, 768);
+    for (uint8_t r = 0; r < PALCYCLE_RANGE_COUNT; r++)
+    {
+        if (!(ranges & (1U << r)))
+            continue;
+
+        const palcycle_timing *timing = &timings[r];
+        uint32_t step = time/timing->period % timing->steps;
+        if (r == PALCYCLE_ALARM)
+        {
+            uint32_t level = step <= ALARM_STEPS/2 ? step : ALARM_STEPS - step;
+            out[3*ALARM_INDEX] = 4*ALARM_STEP*level;
+            out[3*ALARM_INDEX + 1] = 0;
+            out[3*ALARM_INDEX + 2] = 0;
+            continue;
+        }
+
+        for (uint8_t i = 0; i < timing->count; i++)
+        {
+            uint8_t source = timing->first + (i + timing->count - step % timing->count) % timing->count;
+            memcpy(&out[3*(timing->first + i)], &rgb[3*source], 3);
+        }
+    }
+}
+
+//
+// Time of the first step of any range in the mask after a given time
+//
+static uint32_t next_step(uint32_t ranges, uint32_t time)
+{
+    uint32_t next = UINT32_MAX;
+    for (uint8_t r = 0; r < PALCYCLE_RANGE_COUNT; r++)
+    {
+        if (!(ranges & (1U << r)))
+            continue;
+
+        uint32_t period = timings[r].period;
+        uint32_t step = (time/period + 1)*period;
+        if (step < next)
+            next = step;
+    }
+    return next;
+}
+
+static void expand_rgba(const uint8_t *pixels, size_t stride, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+    const uint8_t *rgb, uint8_t *out)
+{
+    uint8_t lut[256][4];
+    for (size_t i = 0; i < 256; i++)
+    {
+        memcpy(lut[i], &rgb[3*i], 3);
+        lut[i][3] = i == TRANSPARENT_INDEX ? 0 : 255;
+    }
+
+    for (uint32_t row = 0; row < height; row++)
+    {
+        const uint8_t *in = &pixels[(y + row)*stride + x];
+        for (uint32_t column = 0; column < width; column++)
+            memcpy(out + 4*(row*width + column), lut[in[column]], 4);
+    }
+}
+
+//
+// Encode a frame as a looping APNG of its palette cycle. APNG has one
+// palette per file, so every step is expanded to RGBA through the
+// cycled palette. The pixels are only looked up, never decoded again,
+// and steps after the first only store the rectangle around the
+// cycling pixels
+// Returns 0 on success, 1 if the frame has no cycling pixels, or -1 on error
+//
+int palcycle_encode_apng(const uint8_t *pixels, uint16_t width, uint16_t height, const uint8_t *rgb,
+    const pngwriter_options *options, pngbuffer *out)
+{
+    uint32_t ranges = palcycle_ranges_used(pixels, (size_t)width*height);
+    if (!ranges)
+        return 1;
+
+    // Bound the pixels that change
+    uint32_t min_x = width, min_y = height, max_x = 0, max_y = 0;
+    uint8_t changes[256];
+    memset(changes, 0, sizeof(changes));
+    for (uint8_t r = 0; r < PALCYCLE_RANGE_COUNT; r++)
+        if (ranges & (1U << r))
+            memset(&changes[timings[r].first], 1, timings[r].count);
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            if (!changes[pixels[y*width + x]])
+                continue;
+
+            if (x < min_x)
+                min_x = x;
+            if (x > max_x)
+                max_x = x;
+            if (y < min_y)
+                min_y = y;
+            if (y > max_y)
+                max_y = y;
+        }
+    }
+
+    // Collect step times until every range is back at its start
+    uint32_t loop = palcycle_loop_length(ranges);
+    uint32_t times[PALCYCLE_MAX_FRAMES + 1];
+    uint32_t frame_count = 0;
+    for (uint32_t time = 0; time < loop && frame_count < PALCYCLE_MAX_FRAMES; time = next_step(ranges, time))
+        times[frame_count++] = time;
+    times[frame_count] = frame_count < PALCYCLE_MAX_FRAMES ? loop : next_step(ranges, times[frame_count - 1]);
+
+    pngwriter_image image;
+    image.width = width;
+    image.height = height;
+    image.color = PNGWRITER_COLOR_RGBA;
+    image.palette = NULL;
+    image.palette_size = 0;
+    image.transparent_index = -1;
+
+    uint8_t *rgba = malloc(4*(size_t)width*height);
+    if (!rgba)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int status = -1;
+    if (pngwriter_begin(out, &image) || pngwriter_write_animation(out, frame_count, 0))
+        goto error;
+
+    pngwriter_frame frame;
+    frame.delay_denominator = 1000;
+    frame.dispose = PNGWRITER_DISPOSE_NONE;
+    frame.blend = PNGWRITER_BLEND_SOURCE;
+
+    uint32_t sequence = 0;
+    for (uint32_t i = 0; i < frame_count; i++)
+    {
+        uint8_t cycled[768];
+        palcycle_apply(rgb, ranges, times[i], cycled);
+
+        // The first frame is also the still image, so covers everything
+        uint32_t x = i ? min_x : 0;
+        uint32_t y = i ? min_y : 0;
+        image.width = i ? max_x - min_x + 1 : width;
+        image.height = i ? max_y - min_y + 1 : height;
+        image.stride = 4*image.width;
+        image.pixels = rgba;
+        expand_rgba(pixels, width, x, y, image.width, image.height, cycled, rgba);
+
+        frame.x = x;
+        frame.y = y;
+        frame.delay_numerator = times[i + 1] - times[i];
+        if (pngwriter_write_frame(out, &image, &frame, options, &sequence))
+            goto error;
+    }
+
+    status = pngwriter_end(out);
+
+error:
+    free(rgba);
+    return status;
+}
@@ -0,0 +1,59 @@
+/*
+ * palcycle.h
+ * Animates the cycling palette ranges used for water, fire and lights
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _palcycle_h
+#define _palcycle_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "pngwriter.h"
+
+// The engine cycles these palette ranges on fixed timers. Each step of a
+// rotating range moves every colour one entry along. The alarm range is a
+// single entry whose red level pulses up and down instead
+typedef enum
+{
+    PALCYCLE_SLIME,
+    PALCYCLE_SHORELINE,
+    PALCYCLE_FIRE_SLOW,
+    PALCYCLE_FIRE_FAST,
+    PALCYCLE_MONITORS,
+    PALCYCLE_ALARM,
+    PALCYCLE_RANGE_COUNT
+} palcycle_range;
+
+// Longer combined cycles are cut short, so their loop jumps once
+#define PALCYCLE_MAX_FRAMES 240
+
+uint32_t palcycle_ranges_used(const uint8_t *pixels, size_t count);
+uint32_t palcycle_loop_length(uint32_t ranges);
+void palcycle_apply(const uint8_t *rgb, uint32_t ranges, uint32_t time, uint8_t *out);
+int palcycle_encode_apng(const uint8_t *pixels, uint16_t width, uint16_t height, const uint8_t *rgb,
+    const pngwriter_options *options, pngbuffer *out);
+
+#endif
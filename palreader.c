@@ -26,8 +26,9 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
-#include <png.h>
+#include <string.h>
 
 #include "palreader.h"
 
@@ -54,62 +55,68 @@ void palreader_free(palreader *reader)
     free(reader);
 }
 
-// Based on code from http://www.lemoda.net/c/write-png/
-int palreader_export_png(palreader *reader, uint8_t *data, uint16_t width, uint16_t height, const char *path)
+//
+// Expand the palette to 8 bit (r,g,b) triplets at the current brightness
+//
+void palreader_get_rgb(palreader *reader, uint8_t *rgb)
 {
-    int status = -1;
-    FILE *fp = fopen(path, "wb");
-    if (!fp)
-        goto fopen_failed;
-
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png_ptr == NULL)
-        goto png_create_write_struct_failed;
-
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (info_ptr == NULL)
-        goto png_create_info_struct_failed;
-
-    // Set up error handling
-    if (setjmp(png_jmpbuf(png_ptr)))
-        goto png_failure;
-
-    // Set image attributes.
-    png_set_IHDR(png_ptr, info_ptr, width, height, 8,
-                 PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-    // Initialize rows of PNG
-    png_byte **row_pointers = png_malloc(png_ptr, height*sizeof(png_byte *));
-    for (size_t y = 0; y < height; y++)
+    for (size_t i = 0; i < 768; i++)
     {
-        png_byte *row = png_malloc(png_ptr, 3*width*sizeof(uint8_t));
-        row_pointers[y] = row;
-        for (size_t x = 0; x < width; x++)
-        {
-            uint8_t index = data[y*width + x];
-            for (size_t i = 0; i < 3; i++)
-                *row++ = reader->data[3*index + i]*reader->brightness;
-        }
+        unsigned value = reader->data[i]*reader->brightness;
+        rgb[i] = value > 255 ? 255 : value;
     }
+}
+
+static int encode_indexed(palreader *reader, uint8_t *data, uint16_t width, uint16_t height, int16_t transparent_index,
+    const pngwriter_options *options, pngbuffer *out)
+{
+    uint8_t rgb[768];
+    palreader_get_rgb(reader, rgb);
+
+    pngwriter_image image;
+    image.width = width;
+    image.height = height;
+    image.color = PNGWRITER_COLOR_INDEXED;
+    image.pixels = data;
+    image.stride = width;
+    image.palette = rgb;
+    image.palette_size = 256;
+    image.transparent_index = transparent_index;
+    return pngwriter_encode(out, &image, options);
+}
 
-    // Write to file
-    png_init_io(png_ptr, fp);
-    png_set_rows(png_ptr, info_ptr, row_pointers);
-    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+//
+// Encode frame data as an indexed PNG into memory using the built-in encoder
+// Pixels keep their palette indices, so no per-pixel RGB expansion is needed
+// Returns 0 on success, or -1 on error
+//
+int palreader_encode_png(palreader *reader, uint8_t *data, uint16_t width, uint16_t height, const pngwriter_options *options, pngbuffer *out)
+{
+    return encode_indexed(reader, data, width, height, -1, options, out);
+}
 
-    // Cleanup
-    status = 0;
-    for (size_t y = 0; y < height; y++)
-        png_free(png_ptr, row_pointers[y]);
+//
+// Encode frame data as an indexed PNG with palette index 0 transparent,
+// so the alpha channel carries the sprite's mask
+// Returns 0 on success, or -1 on error
+//
+int palreader_encode_transparent_png(palreader *reader, uint8_t *data, uint16_t width, uint16_t height,
+    const pngwriter_options *options, pngbuffer *out)
+{
+    return encode_indexed(reader, data, width, height, 0, options, out);
+}
 
-    png_free(png_ptr, row_pointers);
+//
+// Encode frame data with the built-in encoder and write it to a file
+// Returns 0 on success, or -1 on error
+//
+int palreader_write_png(palreader *reader, uint8_t *data, uint16_t width, uint16_t height, const pngwriter_options *options, const char *path)
+{
+    pngbuffer buffer = { NULL, 0, 0 };
+    int status = palreader_encode_png(reader, data, width, height, options, &buffer);
+    if (status == 0)
+        status = pngbuffer_write_file(&buffer, path);
 
-png_failure:
-png_create_info_struct_failed:
-    png_destroy_write_struct (&png_ptr, &info_ptr);
-png_create_write_struct_failed:
-    fclose (fp);
-fopen_failed:
+    pngbuffer_free(&buffer);
     return status;
 }
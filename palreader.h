@@ -30,6 +30,7 @@
 #define _palreader_h
 
 #include <stdint.h>
+#include "pngwriter.h"
 
 typedef enum
 {
@@ -47,6 +48,10 @@ typedef struct
 
 palreader *palreader_from_data(uint8_t *data);
 void palreader_free(palreader *reader);
-int palreader_export_png(palreader *reader, uint8_t *data, uint16_t width, uint16_t height, const char *path);
+void palreader_get_rgb(palreader *reader, uint8_t *rgb);
+int palreader_encode_png(palreader *reader, uint8_t *data, uint16_t width, uint16_t height, const pngwriter_options *options, pngbuffer *out);
+int palreader_encode_transparent_png(palreader *reader, uint8_t *data, uint16_t width, uint16_t height,
+    const pngwriter_options *options, pngbuffer *out);
+int palreader_write_png(palreader *reader, uint8_t *data, uint16_t width, uint16_t height, const pngwriter_options *options, const char *path);
 
 #endif
@@ -0,0 +1,506 @@
+/*
+ * pngwriter.c
+ * Writes PNG images into memory buffers
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "pngwriter.h"
+#include "deflate.h"
+#include "checksum.h"
+#include "dat2scheduler.h"
+
+// Images are only split into stripes when each stripe gets at least this
+// much filtered data, so sprites keep the single threaded path
+#define PNGWRITER_STRIPE_MIN_SIZE (256*1024)
+
+static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+//
+// Ensure a buffer has room for length more bytes
+// Returns 0 on success, or -1 on error
+//
+int pngbuffer_reserve(pngbuffer *buffer, size_t length)
+{
+    if (buffer->capacity - buffer->length >= length)
+        return 0;
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity - buffer->length < length)
+        capacity *= 2;
+
+    uint8_t *data = realloc(buffer->data, capacity);
+    if (!data)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+int pngbuffer_append(pngbuffer *buffer, const uint8_t *data, size_t length)
+{
+    if (pngbuffer_reserve(buffer, length))
+        return -1;
+
+    if (length)
+        memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return 0;
+}
+
+int pngbuffer_write_file(pngbuffer *buffer, const char *path)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int status = fwrite(buffer->data, 1, buffer->length, fp) == buffer->length ? 0 : -1;
+    if (fclose(fp))
+        status = -1;
+    return status;
+}
+
+void pngbuffer_free(pngbuffer *buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = buffer->capacity = 0;
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+//
+// Append a chunk whose data is already in place after an 8 byte gap
+// reserved for the length and type, computing and appending the CRC
+//
+static int finish_chunk(pngbuffer *out, size_t start, const char *type)
+{
+    uint8_t *chunk = out->data + start;
+    size_t length = out->length - start - 8;
+    put_u32(chunk, length);
+    memcpy(chunk + 4, type, 4);
+
+    uint8_t crc[4];
+    put_u32(crc, crc32_update(CRC32_INIT, chunk + 4, length + 4));
+    return pngbuffer_append(out, crc, 4);
+}
+
+static int write_chunk(pngbuffer *out, const char *type, const uint8_t *data, size_t length)
+{
+    size_t start = out->length;
+    uint8_t header[8] = { 0 };
+    if (pngbuffer_append(out, header, 8) || pngbuffer_append(out, data, length))
+        return -1;
+    return finish_chunk(out, start, type);
+}
+
+//
+// Settings for a speed/size tradeoff level between 0 (fastest, uncompressed)
+// and 9 (smallest). Indexed sprites compress best unfiltered, so row filters
+// are only tried at the slowest levels
+//
+pngwriter_options pngwriter_preset(int level)
+{
+    pngwriter_options options;
+    options.level = level < 0 ? DEFLATE_LEVEL_FAST : level > DEFLATE_LEVEL_BEST ? DEFLATE_LEVEL_BEST : level;
+    options.filter = options.level >= 8 ? PNGWRITER_FILTER_ADAPTIVE : PNGWRITER_FILTER_NONE;
+    options.threads = 1;
+    return options;
+}
+
+static inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+//
+// Apply a PNG filter type to one row of bpp-byte pixels
+// Returns the sum of absolute values of the filtered bytes
+// (as signed), the usual heuristic for choosing a filter
+//
+static uint32_t filter_row(uint8_t type, const uint8_t *row, const uint8_t *prior, size_t length, size_t bpp, uint8_t *out)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        uint8_t a = i >= bpp ? row[i - bpp] : 0;
+        uint8_t b = prior ? prior[i] : 0;
+        uint8_t c = i >= bpp && prior ? prior[i - bpp] : 0;
+        uint8_t value;
+        switch (type)
+        {
+            case 1: value = row[i] - a; break;
+            case 2: value = row[i] - b; break;
+            case 3: value = row[i] - ((a + b) >> 1); break;
+            case 4: value = row[i] - paeth(a, b, c); break;
+            default: value = row[i]; break;
+        }
+        out[i] = value;
+        sum += value < 128 ? value : 256 - value;
+    }
+    return sum;
+}
+
+//
+// Build the filtered scanlines for rows [first, last) of the IDAT data.
+// Each row only depends on itself and the unfiltered row above it, so
+// any range of rows can be filtered independently
+//
+static void filter_image(const pngwriter_image *image, pngwriter_filter filter, size_t bpp, uint32_t first, uint32_t last,
+    uint8_t *out, uint8_t *scratch)
+{
+    size_t row_length = image->width*bpp;
+    for (uint32_t y = first; y < last; y++)
+    {
+        const uint8_t *row = image->pixels + y*image->stride;
+        const uint8_t *prior = y ? row - image->stride : NULL;
+        uint8_t *line = out + (y - first)*(row_length + 1);
+
+        if (filter == PNGWRITER_FILTER_NONE)
+        {
+            line[0] = 0;
+            memcpy(line + 1, row, row_length);
+            continue;
+        }
+
+        uint8_t best_type = 0;
+        uint32_t best_sum = filter_row(0, row, prior, row_length, bpp, line + 1);
+        for (uint8_t type = 1; type <= 4 && best_sum; type++)
+        {
+            uint32_t sum = filter_row(type, row, prior, row_length, bpp, scratch);
+            if (sum < best_sum)
+            {
+                best_sum = sum;
+                best_type = type;
+                memcpy(line + 1, scratch, row_length);
+            }
+        }
+        line[0] = best_type;
+    }
+}
+
+//
+// Write the signature and the header chunks (IHDR, and for indexed
+// images PLTE and tRNS) describing an image or animation canvas
+// Returns 0 on success, or -1 on error
+//
+int pngwriter_begin(pngbuffer *out, const pngwriter_image *image)
+{
+    if (pngbuffer_append(out, png_signature, sizeof(png_signature)))
+        return -1;
+
+    uint8_t header[13];
+    put_u32(header, image->width);
+    put_u32(header + 4, image->height);
+    header[8] = 8;
+    header[9] = image->color;
+    header[10] = 0;
+    header[11] = 0;
+    header[12] = 0;
+    if (write_chunk(out, "IHDR", header, sizeof(header)))
+        return -1;
+
+    if (image->color != PNGWRITER_COLOR_INDEXED)
+        return 0;
+
+    if (write_chunk(out, "PLTE", image->palette, 3*image->palette_size))
+        return -1;
+
+    // tRNS only needs to extend up to the transparent entry
+    if (image->transparent_index >= 0)
+    {
+        uint8_t alpha[256];
+        memset(alpha, 0xFF, sizeof(alpha));
+        alpha[image->transparent_index] = 0;
+        if (write_chunk(out, "tRNS", alpha, image->transparent_index + 1))
+            return -1;
+    }
+    return 0;
+}
+
+typedef struct
+{
+    const pngwriter_image *image;
+    const pngwriter_options *options;
+    size_t bpp;
+    uint32_t stripe_count;
+    uint8_t **output;
+    size_t *output_length;
+    uint32_t *adler32;
+} stripe_job;
+
+//
+// Filter and compress one stripe of rows into raw deflate blocks ending
+// in a sync flush (except the last stripe, which ends the stream).
+// The rows just above the stripe are filtered again to prime the match
+// finder, so stripes compress nearly as well as one pass
+//
+static int compress_stripe(size_t index, void *user)
+{
+    stripe_job *job = user;
+    const pngwriter_image *image = job->image;
+    size_t line_length = image->width*job->bpp + 1;
+    uint32_t first = (uint64_t)image->height*index/job->stripe_count;
+    uint32_t last = (uint64_t)image->height*(index + 1)/job->stripe_count;
+
+    uint32_t history = (DEFLATE_WINDOW_SIZE + line_length - 1)/line_length;
+    uint32_t start = first > history ? first - history : 0;
+    size_t dictionary = (first - start)*line_length;
+    size_t length = (last - first)*line_length;
+
+    int status = 1;
+    uint8_t *raw = malloc(dictionary + length + line_length);
+    size_t bound = deflate_bound(length);
+    uint8_t *output = malloc(bound);
+    if (!raw || !output)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto error;
+    }
+
+    filter_image(image, job->options->filter, job->bpp, start, last, raw, raw + dictionary + length);
+    job->output_length[index] = deflate_raw_stripe(output, bound, raw, dictionary, length, job->options->level,
+        index + 1 == job->stripe_count);
+    if (!job->output_length[index])
+        goto error;
+
+    job->adler32[index] = adler32_update(ADLER32_INIT, raw + dictionary, length);
+    job->output[index] = output;
+    output = NULL;
+    status = 0;
+
+error:
+    free(output);
+    free(raw);
+    return status;
+}
+
+//
+// Compress an image as independent stripes on separate threads and join
+// them into one zlib stream at out, using the combined Adler-32 of the
+// stripes. out must have room for zlib_bound of the filtered data
+// Returns the compressed length, or 0 on error
+//
+static size_t compress_striped(const pngwriter_image *image, const pngwriter_options *options, size_t bpp,
+    uint32_t stripe_count, uint8_t *out, size_t capacity)
+{
+    size_t written = 0;
+    stripe_job job;
+    job.image = image;
+    job.options = options;
+    job.bpp = bpp;
+    job.stripe_count = stripe_count;
+    job.output = calloc(stripe_count, sizeof(uint8_t *));
+    job.output_length = calloc(stripe_count, sizeof(size_t));
+    job.adler32 = calloc(stripe_count, sizeof(uint32_t));
+    if (!job.output || !job.output_length || !job.adler32)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto error;
+    }
+
+    if (dat2scheduler_run_tasks(stripe_count, NULL, compress_stripe, &job, options->threads))
+        goto error;
+
+    size_t total = 6;
+    for (uint32_t i = 0; i < stripe_count; i++)
+        total += job.output_length[i];
+    if (total > capacity)
+        goto error;
+
+    zlib_header(out, options->level);
+    size_t position = 2;
+    size_t line_length = image->width*bpp + 1;
+    uint32_t adler = ADLER32_INIT;
+    for (uint32_t i = 0; i < stripe_count; i++)
+    {
+        memcpy(out + position, job.output[i], job.output_length[i]);
+        position += job.output_length[i];
+
+        uint32_t rows = (uint64_t)image->height*(i + 1)/stripe_count - (uint64_t)image->height*i/stripe_count;
+        adler = adler32_combine(adler, job.adler32[i], (uint64_t)rows*line_length);
+    }
+    put_u32(out + position, adler);
+    written = position + 4;
+
+error:
+    if (job.output)
+        for (uint32_t i = 0; i < stripe_count; i++)
+            free(job.output[i]);
+    free(job.output);
+    free(job.output_length);
+    free(job.adler32);
+    return written;
+}
+
+//
+// Filter and compress an image into an IDAT chunk, or into an fdAT
+// chunk carrying the given sequence number if sequence >= 0
+//
+static int write_image_data(pngbuffer *out, const pngwriter_image *image, const pngwriter_options *options, int64_t sequence)
+{
+    size_t bpp = image->color == PNGWRITER_COLOR_RGBA ? 4 : image->color == PNGWRITER_COLOR_RGB ? 3 : 1;
+    size_t row_length = image->width*bpp;
+    size_t raw_length = (row_length + 1)*image->height;
+
+    unsigned threads = options->threads ? options->threads : dat2scheduler_default_threads();
+    size_t stripe_count = raw_length/PNGWRITER_STRIPE_MIN_SIZE;
+    if (stripe_count > threads)
+        stripe_count = threads;
+    if (stripe_count > image->height)
+        stripe_count = image->height;
+
+    // Compress directly into the output buffer after the chunk header
+    size_t start = out->length;
+    size_t prefix = sequence >= 0 ? 4 : 0;
+    size_t bound = zlib_bound(raw_length);
+    if (stripe_count > 1)
+        bound += stripe_count*deflate_bound(0);
+    if (pngbuffer_reserve(out, 8 + prefix + bound + 4))
+        return -1;
+
+    if (sequence >= 0)
+        put_u32(out->data + start + 8, sequence);
+
+    size_t compressed = 0;
+    if (stripe_count > 1)
+        compressed = compress_striped(image, options, bpp, stripe_count, out->data + start + 8 + prefix, bound);
+    else
+    {
+        uint8_t *raw = malloc(raw_length + row_length);
+        if (!raw)
+        {
+            fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+            return -1;
+        }
+
+        filter_image(image, options->filter, bpp, 0, image->height, raw, raw + raw_length);
+        compressed = zlib_compress(out->data + start + 8 + prefix, bound, raw, raw_length, options->level);
+        free(raw);
+    }
+
+    if (!compressed)
+        return -1;
+
+    out->length = start + 8 + prefix + compressed;
+    return finish_chunk(out, start, sequence >= 0 ? "fdAT" : "IDAT");
+}
+
+//
+// Write the image data for a still image
+// Returns 0 on success, or -1 on error
+//
+int pngwriter_write_image(pngbuffer *out, const pngwriter_image *image, const pngwriter_options *options)
+{
+    return write_image_data(out, image, options, -1);
+}
+
+//
+// Mark the image as an animation (APNG acTL chunk). Must follow
+// pngwriter_begin and precede the first frame. plays = 0 loops forever
+// Returns 0 on success, or -1 on error
+//
+int pngwriter_write_animation(pngbuffer *out, uint32_t frame_count, uint32_t plays)
+{
+    uint8_t control[8];
+    put_u32(control, frame_count);
+    put_u32(control + 4, plays);
+    return write_chunk(out, "acTL", control, sizeof(control));
+}
+
+//
+// Write one animation frame (APNG fcTL followed by frame data). The image
+// describes the frame's sub-rectangle and must share the canvas format;
+// the first frame must cover the whole canvas and is also the still image
+// shown by decoders without APNG support. sequence starts at 0 and is
+// advanced past the chunks written
+// Returns 0 on success, or -1 on error
+//
+int pngwriter_write_frame(pngbuffer *out, const pngwriter_image *image, const pngwriter_frame *frame,
+    const pngwriter_options *options, uint32_t *sequence)
+{
+    uint8_t control[26];
+    put_u32(control, (*sequence)++);
+    put_u32(control + 4, image->width);
+    put_u32(control + 8, image->height);
+    put_u32(control + 12, frame->x);
+    put_u32(control + 16, frame->y);
+    control[20] = frame->delay_numerator >> 8;
+    control[21] = frame->delay_numerator;
+    control[22] = frame->delay_denominator >> 8;
+    control[23] = frame->delay_denominator;
+    control[24] = frame->dispose;
+    control[25] = frame->blend;
+    if (write_chunk(out, "fcTL", control, sizeof(control)))
+        return -1;
+
+    // The first frame's data is the regular IDAT
+    if (*sequence == 1)
+        return write_image_data(out, image, options, -1);
+
+    return write_image_data(out, image, options, (*sequence)++);
+}
+
+//
+// Write the closing IEND chunk
+// Returns 0 on success, or -1 on error
+//
+int pngwriter_end(pngbuffer *out)
+{
+    return write_chunk(out, "IEND", NULL, 0);
+}
+
+//
+// Encode an 8 bit per channel image as PNG, appending it to out
+// Returns 0 on success, or -1 on error
+//
+int pngwriter_encode(pngbuffer *out, const pngwriter_image *image, const pngwriter_options *options)
+{
+    if (pngwriter_begin(out, image) || pngwriter_write_image(out, image, options))
+        return -1;
+    return pngwriter_end(out);
+}
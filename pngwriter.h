@@ -0,0 +1,117 @@
+/*
+ * pngwriter.h
+ * Writes PNG images into memory buffers
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _pngwriter_h
+#define _pngwriter_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum
+{
+    PNGWRITER_COLOR_RGB = 2,
+    PNGWRITER_COLOR_INDEXED = 3,
+    PNGWRITER_COLOR_RGBA = 6,
+} pngwriter_color;
+
+typedef enum
+{
+    PNGWRITER_FILTER_NONE,
+    PNGWRITER_FILTER_ADAPTIVE,
+} pngwriter_filter;
+
+typedef struct
+{
+    int level;
+    pngwriter_filter filter;
+
+    // Large images are split into horizontal stripes that are filtered
+    // and compressed on up to this many threads (0 selects one per CPU)
+    unsigned threads;
+} pngwriter_options;
+
+typedef struct
+{
+    uint32_t width;
+    uint32_t height;
+    pngwriter_color color;
+    const uint8_t *pixels;
+    size_t stride;
+    const uint8_t *palette;
+    uint16_t palette_size;
+    int16_t transparent_index;
+} pngwriter_image;
+
+// APNG frame disposal and blending (fcTL dispose_op and blend_op)
+typedef enum
+{
+    PNGWRITER_DISPOSE_NONE = 0,
+    PNGWRITER_DISPOSE_BACKGROUND = 1,
+    PNGWRITER_DISPOSE_PREVIOUS = 2,
+} pngwriter_dispose;
+
+typedef enum
+{
+    PNGWRITER_BLEND_SOURCE = 0,
+    PNGWRITER_BLEND_OVER = 1,
+} pngwriter_blend;
+
+typedef struct
+{
+    uint32_t x;
+    uint32_t y;
+    uint16_t delay_numerator;
+    uint16_t delay_denominator;
+    pngwriter_dispose dispose;
+    pngwriter_blend blend;
+} pngwriter_frame;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} pngbuffer;
+
+pngwriter_options pngwriter_preset(int level);
+int pngwriter_encode(pngbuffer *out, const pngwriter_image *image, const pngwriter_options *options);
+
+int pngwriter_begin(pngbuffer *out, const pngwriter_image *image);
+int pngwriter_write_image(pngbuffer *out, const pngwriter_image *image, const pngwriter_options *options);
+int pngwriter_write_animation(pngbuffer *out, uint32_t frame_count, uint32_t plays);
+int pngwriter_write_frame(pngbuffer *out, const pngwriter_image *image, const pngwriter_frame *frame,
+    const pngwriter_options *options, uint32_t *sequence);
+int pngwriter_end(pngbuffer *out);
+
+int pngbuffer_reserve(pngbuffer *buffer, size_t length);
+int pngbuffer_append(pngbuffer *buffer, const uint8_t *data, size_t length);
+int pngbuffer_write_file(pngbuffer *buffer, const char *path);
+void pngbuffer_free(pngbuffer *buffer);
+
+#endif
@@ -0,0 +1,383 @@
+/*
+ * rendercache.c
+ * Persistent cache of rendered images keyed by entry, palette and options
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rendercache.h"
+#include "checksum.h"
+
+static size_t index_size(uint32_t capacity)
+{
+    return sizeof(rendercache_header) + (size_t)capacity*sizeof(rendercache_slot);
+}
+
+static uint32_t key_slot(const rendercache_key *key, uint32_t capacity)
+{
+    return hash64((const uint8_t *)key, sizeof(rendercache_key), 0) & (capacity - 1);
+}
+
+static char *cache_path(const char *directory, const char *name)
+{
+    size_t length = strlen(directory) + strlen(name) + 2;
+    char *path = malloc(length);
+    if (path)
+        snprintf(path, length, "%s/%s", directory, name);
+    return path;
+}
+
+//
+// Map an index file, creating an empty index if the file is new or
+// was written by an incompatible version
+// Returns 0 on success, or -1 on error
+//
+static int map_index(rendercache *cache, int fd, uint32_t capacity, bool reset)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+        return -1;
+
+    rendercache_header header;
+    bool valid = !reset && (size_t)st.st_size >= sizeof(header) && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, RENDERCACHE_MAGIC, RENDERCACHE_MAGIC_SIZE) == 0 && header.version == RENDERCACHE_VERSION &&
+        header.capacity && !(header.capacity & (header.capacity - 1)) && (size_t)st.st_size >= index_size(header.capacity);
+
+    if (!valid)
+    {
+        if (!cache->writable)
+            return -1;
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, RENDERCACHE_MAGIC, RENDERCACHE_MAGIC_SIZE);
+        header.version = RENDERCACHE_VERSION;
+        header.capacity = capacity;
+        if (ftruncate(fd, 0) || ftruncate(fd, index_size(capacity)) ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+            return -1;
+    }
+
+    size_t size = index_size(header.capacity);
+    void *map = mmap(NULL, size, cache->writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    cache->header = map;
+    cache->slots = (rendercache_slot *)((uint8_t *)map + sizeof(rendercache_header));
+    cache->mapped_size = size;
+    return 0;
+}
+
+//
+// Open or create a render cache in a directory. The first process to
+// open a cache may add to it; caches already in use by another process
+// are opened for lookups only
+// Returns NULL on error
+//
+rendercache *rendercache_open(const char *directory)
+{
+    rendercache *cache = calloc(1, sizeof(rendercache));
+    if (!cache)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    cache->lock_fd = cache->index_fd = cache->data_fd = -1;
+    cache->directory = strdup(directory);
+    char *lock_path = cache_path(directory, "lock");
+    char *index_path = cache_path(directory, "index");
+    char *data_path = cache_path(directory, "data");
+    if (!cache->directory || !lock_path || !index_path || !data_path)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto error;
+    }
+
+    if (mkdir(directory, 0777) && errno != EEXIST)
+    {
+        fprintf(stderr, "Unable to create %s: %s\n", directory, strerror(errno));
+        goto error;
+    }
+
+    cache->lock_fd = open(lock_path, O_RDWR | O_CREAT, 0666);
+    cache->writable = cache->lock_fd >= 0 && flock(cache->lock_fd, LOCK_EX | LOCK_NB) == 0;
+    int flags = cache->writable ? O_RDWR | O_CREAT : O_RDONLY;
+    cache->index_fd = open(index_path, flags, 0666);
+    cache->data_fd = open(data_path, flags, 0666);
+    if (cache->index_fd < 0 || cache->data_fd < 0)
+    {
+        fprintf(stderr, "Unable to open render cache %s: %s\n", directory, strerror(errno));
+        goto error;
+    }
+
+    if (map_index(cache, cache->index_fd, RENDERCACHE_INITIAL_CAPACITY, false))
+    {
+        fprintf(stderr, "Unable to map render cache index %s\n", index_path);
+        goto error;
+    }
+
+    // Images written after the index was last updated are unreferenced
+    if (cache->writable && ftruncate(cache->data_fd, cache->header->data_size))
+        goto error;
+
+    pthread_rwlock_init(&cache->lock, NULL);
+    free(lock_path);
+    free(index_path);
+    free(data_path);
+    return cache;
+
+error:
+    if (cache->header)
+        munmap(cache->header, cache->mapped_size);
+    if (cache->data_fd >= 0)
+        close(cache->data_fd);
+    if (cache->index_fd >= 0)
+        close(cache->index_fd);
+    if (cache->lock_fd >= 0)
+        close(cache->lock_fd);
+    free(cache->directory);
+    free(cache);
+    free(lock_path);
+    free(index_path);
+    free(data_path);
+    return NULL;
+}
+
+void rendercache_close(rendercache *cache)
+{
+    if (cache->writable)
+        msync(cache->header, cache->mapped_size, MS_SYNC);
+    munmap(cache->header, cache->mapped_size);
+    close(cache->data_fd);
+    close(cache->index_fd);
+    close(cache->lock_fd);
+    pthread_rwlock_destroy(&cache->lock);
+    free(cache->directory);
+    free(cache);
+}
+
+//
+// Identify an archive by its location, size and modification time, so
+// that cached images are not reused after the archive is replaced
+//
+uint64_t rendercache_archive_id(dat2reader *reader)
+{
+    struct stat st;
+    uint64_t stamp[3] = { 0, reader->filesize, 0 };
+    if (fstat(fileno(reader->file), &st) == 0)
+    {
+        stamp[0] = st.st_ino;
+        stamp[2] = (uint64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    char *path = realpath(reader->path, NULL);
+    const char *name = path ? path : reader->path;
+    uint64_t id = hash64((const uint8_t *)name, strlen(name), hash64((const uint8_t *)stamp, sizeof(stamp), 0));
+    free(path);
+    return id;
+}
+
+//
+// Build the key for an image rendered from an entry
+//
+rendercache_key rendercache_entry_key(dat2entry *entry, uint64_t archive, const uint8_t *rgb,
+    const pngwriter_options *options, rendercache_kind kind, uint32_t variant)
+{
+    rendercache_key key;
+    memset(&key, 0, sizeof(key));
+    key.archive = archive;
+    key.offset = entry->offset;
+    key.uncompressed_size = entry->uncompressed_size;
+    key.compressed_size = entry->compressed_size;
+    key.palette = hash64(rgb, 768, 0);
+    key.options = (uint32_t)kind << 16 | (uint32_t)options->filter << 8 | (uint8_t)options->level;
+    key.variant = variant;
+    return key;
+}
+
+//
+// Find a cached image and read a copy of it
+// Returns the image (to be freed by the caller), or NULL if it is not
+// cached or failed its checksum
+//
+uint8_t *rendercache_lookup(rendercache *cache, const rendercache_key *key, size_t *length)
+{
+    rendercache_slot found;
+    found.used = 0;
+
+    // Processes that only look up images do not hold the writer's lock,
+    // so a slot is only trusted if it is published before and after it
+    // is copied (see rendercache_store)
+    pthread_rwlock_rdlock(&cache->lock);
+    uint32_t capacity = cache->header->capacity;
+    for (uint32_t slot = key_slot(key, capacity); __atomic_load_n(&cache->slots[slot].used, __ATOMIC_ACQUIRE);
+        slot = (slot + 1) & (capacity - 1))
+    {
+        if (memcmp(&cache->slots[slot].key, key, sizeof(rendercache_key)) == 0)
+        {
+            found = cache->slots[slot];
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (!__atomic_load_n(&cache->slots[slot].used, __ATOMIC_RELAXED) ||
+                memcmp(&found.key, key, sizeof(rendercache_key)) != 0)
+                found.used = 0;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&cache->lock);
+
+    uint8_t *data = found.used ? malloc(found.length ? found.length : 1) : NULL;
+    if (data && (pread(cache->data_fd, data, found.length, found.offset) != (ssize_t)found.length ||
+        crc32_update(CRC32_INIT, data, found.length) != found.crc32))
+    {
+        free(data);
+        data = NULL;
+    }
+
+    __atomic_add_fetch(data ? &cache->hits : &cache->misses, 1, __ATOMIC_RELAXED);
+    *length = data ? found.length : 0;
+    return data;
+}
+
+//
+// Double the index capacity, rewriting it to a new file that then
+// replaces the old one
+// Returns 0 on success, or -1 on error
+//
+static int grow_index(rendercache *cache)
+{
+    char *path = cache_path(cache->directory, "index");
+    char *temp_path = cache_path(cache->directory, "index.new");
+    if (!path || !temp_path)
+    {
+        free(path);
+        free(temp_path);
+        return -1;
+    }
+
+    int status = -1;
+    int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    rendercache_header *old_header = cache->header;
+    rendercache_slot *old_slots = cache->slots;
+    size_t old_size = cache->mapped_size;
+    if (fd < 0 || map_index(cache, fd, 2*old_header->capacity, true))
+        goto error;
+
+    uint32_t capacity = cache->header->capacity;
+    for (uint32_t i = 0; i < old_header->capacity; i++)
+    {
+        if (!old_slots[i].used)
+            continue;
+
+        uint32_t slot = key_slot(&old_slots[i].key, capacity);
+        while (cache->slots[slot].used)
+            slot = (slot + 1) & (capacity - 1);
+        cache->slots[slot] = old_slots[i];
+    }
+    cache->header->count = old_header->count;
+    cache->header->data_size = old_header->data_size;
+
+    if (msync(cache->header, cache->mapped_size, MS_SYNC) || rename(temp_path, path))
+    {
+        munmap(cache->header, cache->mapped_size);
+        cache->header = old_header;
+        cache->slots = old_slots;
+        cache->mapped_size = old_size;
+        goto error;
+    }
+
+    munmap(old_header, old_size);
+    close(cache->index_fd);
+    cache->index_fd = fd;
+    fd = -1;
+    status = 0;
+
+error:
+    if (fd >= 0)
+    {
+        close(fd);
+        unlink(temp_path);
+    }
+    free(path);
+    free(temp_path);
+    return status;
+}
+
+//
+// Add an image to the cache. The image is written before the slot that
+// references it, so an interrupted store leaves the cache consistent.
+// The slot is withdrawn while it is rewritten and then published with a
+// release store, so lookups in other processes never see it half written
+// Returns 0 on success, or -1 if the image could not be stored
+//
+int rendercache_store(rendercache *cache, const rendercache_key *key, const uint8_t *data, size_t length)
+{
+    if (!cache->writable || length > UINT32_MAX)
+        return -1;
+
+    int status = -1;
+    pthread_rwlock_wrlock(&cache->lock);
+
+    // Keep the index at most three quarters full
+    if (4*((uint64_t)cache->header->count + 1) > 3*(uint64_t)cache->header->capacity && grow_index(cache))
+        goto error;
+
+    uint32_t capacity = cache->header->capacity;
+    uint32_t slot = key_slot(key, capacity);
+    for (; cache->slots[slot].used; slot = (slot + 1) & (capacity - 1))
+        if (memcmp(&cache->slots[slot].key, key, sizeof(rendercache_key)) == 0)
+            break;
+
+    uint64_t offset = cache->header->data_size;
+    if (pwrite(cache->data_fd, data, length, offset) != (ssize_t)length)
+        goto error;
+
+    rendercache_slot *entry = &cache->slots[slot];
+    bool added = !entry->used;
+    __atomic_store_n(&entry->used, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    entry->key = *key;
+    entry->offset = offset;
+    entry->length = length;
+    entry->crc32 = crc32_update(CRC32_INIT, data, length);
+    __atomic_store_n(&entry->used, 1, __ATOMIC_RELEASE);
+
+    cache->header->data_size = offset + length;
+    if (added)
+        cache->header->count++;
+    status = 0;
+
+error:
+    pthread_rwlock_unlock(&cache->lock);
+    return status;
+}
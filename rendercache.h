@@ -0,0 +1,115 @@
+/*
+ * rendercache.h
+ * Persistent cache of rendered images keyed by entry, palette and options
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _rendercache_h
+#define _rendercache_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "dat2reader.h"
+#include "pngwriter.h"
+
+// The cache is a directory holding an index of fixed-size slots, which
+// is mapped into memory, and an append-only file of rendered images.
+// Both use native byte order, as the cache is local to one machine.
+// Images that are replaced are never reclaimed, so the data file only
+// grows; delete the directory to start a fresh cache
+#define RENDERCACHE_MAGIC "D2RCACHE"
+#define RENDERCACHE_MAGIC_SIZE 8
+#define RENDERCACHE_VERSION 1
+#define RENDERCACHE_INITIAL_CAPACITY 1024
+
+typedef enum
+{
+    RENDERCACHE_ARTWORK = 1,    // First frame, opaque index 0
+    RENDERCACHE_FRAME = 2,      // One frame, transparent index 0
+    RENDERCACHE_APNG = 3,       // One direction as an animated PNG
+    RENDERCACHE_GIF = 4,        // One direction as a GIF
+} rendercache_kind;
+
+typedef struct
+{
+    uint64_t archive;
+    uint64_t offset;
+    uint32_t uncompressed_size;
+    uint32_t compressed_size;
+    uint64_t palette;
+    uint32_t options;
+    uint32_t variant;
+} rendercache_key;
+
+typedef struct
+{
+    rendercache_key key;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t crc32;
+    uint32_t used;
+    uint32_t reserved;
+} rendercache_slot;
+
+typedef struct
+{
+    char magic[RENDERCACHE_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t data_size;
+} rendercache_header;
+
+typedef struct
+{
+    char *directory;
+    int lock_fd;
+    int index_fd;
+    int data_fd;
+    bool writable;
+
+    // Lookups share the lock, stores and index growth take it exclusively
+    pthread_rwlock_t lock;
+    rendercache_header *header;
+    rendercache_slot *slots;
+    size_t mapped_size;
+
+    uint64_t hits;
+    uint64_t misses;
+} rendercache;
+
+rendercache *rendercache_open(const char *directory);
+void rendercache_close(rendercache *cache);
+
+uint64_t rendercache_archive_id(dat2reader *reader);
+rendercache_key rendercache_entry_key(dat2entry *entry, uint64_t archive, const uint8_t *rgb,
+    const pngwriter_options *options, rendercache_kind kind, uint32_t variant);
+uint8_t *rendercache_lookup(rendercache *cache, const rendercache_key *key, size_t *length);
+int rendercache_store(rendercache *cache, const rendercache_key *key, const uint8_t *data, size_t length);
+
+#endif
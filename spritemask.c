@@ -0,0 +1,248 @@
+/*
+ * spritemask.c
+ * Masks, outlines and drop shadows of sprite frames
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "spritemask.h"
+#include "byteorder.h"
+
+//
+// Default outline radius and shadow offset
+//
+spritemask_options spritemask_defaults(void)
+{
+    spritemask_options options = { SPRITEMASK_DEFAULT_OUTLINE, SPRITEMASK_DEFAULT_SHADOW_X, SPRITEMASK_DEFAULT_SHADOW_Y };
+    return options;
+}
+
+//
+// Pack the opacity of eight palette indices into one byte. The high bit
+// of each index byte is set if the byte is nonzero, then a multiply
+// gathers the eight high bits with the first pixel in the top bit
+//
+static uint8_t pack_opaque(const uint8_t *indices)
+{
+    uint64_t v;
+    memcpy(&v, indices, sizeof(v));
+    uint64_t low = 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t flags = (((v & low) + low) | v) & ~low;
+    return ((flags >> 7)*0x8040201008040201ULL) >> 56;
+}
+
+static uint8_t last_byte_mask(uint16_t width)
+{
+    return width % 8 ? (uint8_t)(0xff << (8 - width % 8)) : 0xff;
+}
+
+static void build_mask(const uint8_t *indices, spritemask *out)
+{
+    for (uint16_t y = 0; y < out->height; y++)
+    {
+        const uint8_t *row = indices + (size_t)y*out->width;
+        uint8_t *bits = out->mask + y*out->stride;
+        uint16_t x = 0;
+        for (; x + 8 <= out->width; x += 8)
+            *bits++ = pack_opaque(row + x);
+
+        if (x < out->width)
+        {
+            uint8_t byte = 0;
+            for (uint8_t i = 0; x + i < out->width; i++)
+                byte |= (row[x + i] != 0) << (7 - i);
+            *bits = byte;
+        }
+    }
+}
+
+//
+// Grow a plane by one pixel in every direction, including diagonals.
+// Rows are first spread sideways into scratch, carrying the edge bits
+// between bytes, then each row is combined with its neighbours
+//
+static void dilate(uint8_t *plane, uint8_t *scratch, uint16_t width, uint16_t height, size_t stride)
+{
+    uint8_t last = last_byte_mask(width);
+    for (uint16_t y = 0; y < height; y++)
+    {
+        const uint8_t *in = plane + y*stride;
+        uint8_t *out = scratch + y*stride;
+        for (size_t i = 0; i < stride; i++)
+        {
+            uint8_t left = i ? (uint8_t)(in[i - 1] << 7) : 0;
+            uint8_t right = i + 1 < stride ? in[i + 1] >> 7 : 0;
+            out[i] = in[i] | in[i] >> 1 | (uint8_t)(in[i] << 1) | left | right;
+        }
+        out[stride - 1] &= last;
+    }
+
+    for (uint16_t y = 0; y < height; y++)
+    {
+        uint8_t *out = plane + y*stride;
+        const uint8_t *above = y ? scratch + (y - 1)*stride : NULL;
+        const uint8_t *row = scratch + y*stride;
+        const uint8_t *below = y + 1 < height ? scratch + (y + 1)*stride : NULL;
+        for (size_t i = 0; i < stride; i++)
+            out[i] = row[i] | (above ? above[i] : 0) | (below ? below[i] : 0);
+    }
+}
+
+//
+// Read eight pixels of a row starting at pixel start, which may lie
+// outside the row. Pixels outside the row are clear
+//
+static uint8_t read_bits(const uint8_t *row, size_t stride, long start)
+{
+    long first = start < 0 ? -((7 - start)/8) : start/8;
+    int bit = start - first*8;
+    uint8_t high = first >= 0 && (size_t)first < stride ? row[first] : 0;
+    uint8_t low = first + 1 >= 0 && (size_t)(first + 1) < stride ? row[first + 1] : 0;
+    return bit ? (uint8_t)(high << bit | low >> (8 - bit)) : high;
+}
+
+//
+// Shift the mask by the shadow offset a byte of the row at a time,
+// keeping only the pixels that the mask itself does not cover
+//
+static void build_shadow(spritemask *out, int8_t shadow_x, int8_t shadow_y)
+{
+    uint8_t last = last_byte_mask(out->width);
+    for (long y = 0; y < out->height; y++)
+    {
+        uint8_t *row = out->shadow + y*out->stride;
+        long source = y - shadow_y;
+        if (source < 0 || source >= out->height)
+            continue;
+
+        const uint8_t *bits = out->mask + source*out->stride;
+        const uint8_t *covered = out->mask + y*out->stride;
+        for (size_t i = 0; i < out->stride; i++)
+            row[i] = read_bits(bits, out->stride, 8*(long)i - shadow_x) & ~covered[i];
+        row[out->stride - 1] &= last;
+    }
+}
+
+//
+// Build the mask, outline and shadow planes of a frame of palette indices
+// Returns 0 on success, or -1 on error
+//
+int spritemask_build(const uint8_t *indices, uint16_t width, uint16_t height, const spritemask_options *options,
+    spritemask *out)
+{
+    out->width = width;
+    out->height = height;
+    out->stride = (width + 7)/8;
+
+    size_t plane_size = out->stride*height;
+    out->mask = calloc(4*plane_size + 1, 1);
+    if (!out->mask)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+    out->outline = out->mask + plane_size;
+    out->shadow = out->outline + plane_size;
+    if (!plane_size)
+        return 0;
+
+    build_mask(indices, out);
+    build_shadow(out, options->shadow_x, options->shadow_y);
+
+    // Dilate a copy of the mask, then remove the mask itself
+    uint8_t *scratch = out->shadow + plane_size;
+    memcpy(out->outline, out->mask, plane_size);
+    for (uint8_t i = 0; i < options->outline_radius; i++)
+        dilate(out->outline, scratch, width, height, out->stride);
+    for (size_t i = 0; i < plane_size; i++)
+        out->outline[i] &= ~out->mask[i];
+    return 0;
+}
+
+//
+// Release the planes of a frame
+//
+void spritemask_free(spritemask *masks)
+{
+    free(masks->mask);
+    masks->mask = masks->outline = masks->shadow = NULL;
+}
+
+//
+// Write the planes of every frame of an frm to a mask file
+// Returns 0 on success, or -1 on error
+//
+int spritemask_write_frm(frmreader *frm, const spritemask_options *options, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    uint8_t header[SPRITEMASK_HEADER_SIZE] = { 0 };
+    memcpy(header, SPRITEMASK_MAGIC, SPRITEMASK_MAGIC_SIZE);
+    header[8] = SPRITEMASK_VERSION;
+    header[9] = frm->direction_count;
+    put_le16(header + 10, frm->animation_length);
+    header[12] = options->outline_radius;
+    header[13] = (uint8_t)options->shadow_x;
+    header[14] = (uint8_t)options->shadow_y;
+    fwrite(header, sizeof(header), 1, file);
+
+    int status = 0;
+    for (uint8_t d = 0; d < frm->direction_count && status == 0; d++)
+    {
+        for (uint16_t i = 0; i < frm->animation_length && status == 0; i++)
+        {
+            frmframe *frame = frm_get_frame(frm, d, i);
+            spritemask masks;
+            if (!frame || spritemask_build(frame->data, frame->width, frame->height, options, &masks))
+            {
+                status = -1;
+                break;
+            }
+
+            uint8_t size[SPRITEMASK_FRAME_HEADER_SIZE];
+            put_le16(size, frame->width);
+            put_le16(size + 2, frame->height);
+            fwrite(size, sizeof(size), 1, file);
+            fwrite(masks.mask, 1, 3*masks.stride*masks.height, file);
+            spritemask_free(&masks);
+        }
+    }
+
+    if (ferror(file))
+        status = -1;
+    if (fclose(file))
+        status = -1;
+    if (status)
+        fprintf(stderr, "Error writing %s\n", path);
+    return status;
+}
@@ -0,0 +1,83 @@
+/*
+ * spritemask.h
+ * Masks, outlines and drop shadows of sprite frames
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _spritemask_h
+#define _spritemask_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "frmreader.h"
+
+// Planes are 1-bit bitmaps with rows of (width + 7)/8 bytes and the
+// leftmost pixel in the most significant bit, as in a 1-bit PNG. Bits
+// past the width are always clear.
+//
+// A mask file starts with the magic, version, direction count, frames
+// per direction, outline radius and shadow offset. Each frame follows
+// in direction order as its 16-bit width and height and then its mask,
+// outline and shadow planes. All values are little-endian
+#define SPRITEMASK_MAGIC "FRMMASK\x1A"
+#define SPRITEMASK_MAGIC_SIZE 8
+#define SPRITEMASK_VERSION 1
+#define SPRITEMASK_HEADER_SIZE 16
+#define SPRITEMASK_FRAME_HEADER_SIZE 4
+
+#define SPRITEMASK_DEFAULT_OUTLINE 1
+#define SPRITEMASK_DEFAULT_SHADOW_X 3
+#define SPRITEMASK_DEFAULT_SHADOW_Y 2
+#define SPRITEMASK_MAX_OUTLINE 32
+
+typedef struct
+{
+    uint8_t outline_radius;
+    int8_t shadow_x;
+    int8_t shadow_y;
+} spritemask_options;
+
+typedef struct
+{
+    uint16_t width;
+    uint16_t height;
+    size_t stride;
+
+    // Pixels with a nonzero palette index, pixels within outline_radius
+    // of the mask but outside it, and pixels of the mask moved by the
+    // shadow offset that lie outside it. The outline and shadow are
+    // clipped to the frame
+    uint8_t *mask;
+    uint8_t *outline;
+    uint8_t *shadow;
+} spritemask;
+
+spritemask_options spritemask_defaults(void);
+int spritemask_build(const uint8_t *indices, uint16_t width, uint16_t height, const spritemask_options *options,
+    spritemask *out);
+void spritemask_free(spritemask *masks);
+int spritemask_write_frm(frmreader *frm, const spritemask_options *options, const char *path);
+
+#endif
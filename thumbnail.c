@@ -0,0 +1,351 @@
+/*
+ * thumbnail.c
+ * Downscales palettized sprites into thumbnails
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "thumbnail.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Index 0 is the transparent entry in the Fallout palettes
+#define TRANSPARENT_INDEX 0
+
+//
+// Average one output row from a pair of input rows. Odd widths
+// average the final column with itself
+//
+static void halve_row_scalar(uint8_t *out, const uint8_t *r0, const uint8_t *r1, uint32_t x, uint32_t width)
+{
+    for (; 2*x < width; x++)
+    {
+        uint32_t a = 2*x, b = 2*x + 1 < width ? 2*x + 1 : 2*x;
+        for (int c = 0; c < 4; c++)
+            out[4*x + c] = (r0[4*a + c] + r0[4*b + c] + r1[4*a + c] + r1[4*b + c] + 2) >> 2;
+    }
+}
+
+#ifdef __SSE2__
+//
+// Reduce four input pixels from each row to two output pixels per iteration,
+// widening to 16 bits so the rounding matches the scalar path
+//
+static uint32_t halve_row_sse2(uint8_t *out, const uint8_t *r0, const uint8_t *r1, uint32_t width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    uint32_t x = 0;
+    for (; 2*x + 4 <= width; x += 2)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)&r0[8*x]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&r1[8*x]);
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+        __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+        __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        _mm_storel_epi64((__m128i *)&out[4*x], _mm_packus_epi16(sum, sum));
+    }
+    return x;
+}
+#endif
+
+static int halve_image(thumbnail_image *out, const thumbnail_image *in)
+{
+    out->width = (in->width + 1)/2;
+    out->height = (in->height + 1)/2;
+    out->pixels = malloc(4*out->width*out->height);
+    if (!out->pixels)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    size_t stride = 4*in->width;
+    for (uint32_t y = 0; y < out->height; y++)
+    {
+        const uint8_t *r0 = &in->pixels[2*y*stride];
+        const uint8_t *r1 = 2*y + 1 < in->height ? r0 + stride : r0;
+        uint8_t *row = &out->pixels[4*y*out->width];
+
+        uint32_t x = 0;
+#ifdef __SSE2__
+        x = halve_row_sse2(row, r0, r1, in->width);
+#endif
+        halve_row_scalar(row, r0, r1, x, in->width);
+    }
+    return 0;
+}
+
+//
+// Expand a sprite to premultiplied RGBA and reduce it by halves until
+// the next level would be smaller than min_size on its longest side
+// Returns NULL on error
+//
+thumbnail_chain *thumbnail_chain_build(const uint8_t *indices, uint32_t width, uint32_t height,
+    const uint8_t *rgb, uint32_t min_size)
+{
+    if (width == 0 || height == 0)
+        return NULL;
+
+    size_t level_count = 1;
+    for (uint32_t w = width, h = height; (w > h ? w : h)/2 >= min_size && (w > 1 || h > 1); level_count++)
+    {
+        w = (w + 1)/2;
+        h = (h + 1)/2;
+    }
+
+    thumbnail_chain *chain = malloc(sizeof(thumbnail_chain));
+    if (!chain)
+        goto chain_error;
+
+    chain->level_count = 0;
+    chain->levels = calloc(level_count, sizeof(thumbnail_image));
+    if (!chain->levels)
+        goto levels_error;
+
+    // Transparent pixels become zero in every channel, so they add
+    // no color when averaged with their opaque neighbours
+    uint8_t colors[256][4];
+    for (size_t i = 0; i < 256; i++)
+    {
+        memcpy(colors[i], &rgb[3*i], 3);
+        colors[i][3] = 0xFF;
+    }
+    memset(colors[TRANSPARENT_INDEX], 0, 4);
+
+    thumbnail_image *base = &chain->levels[0];
+    base->width = width;
+    base->height = height;
+    base->pixels = malloc(4*(size_t)width*height);
+    if (!base->pixels)
+        goto pixel_error;
+
+    for (size_t i = 0; i < (size_t)width*height; i++)
+        memcpy(&base->pixels[4*i], colors[indices[i]], 4);
+    chain->level_count = 1;
+
+    for (; chain->level_count < level_count; chain->level_count++)
+        if (halve_image(&chain->levels[chain->level_count], &chain->levels[chain->level_count - 1]))
+            goto pixel_error;
+
+    return chain;
+
+pixel_error:
+    thumbnail_chain_free(chain);
+    return NULL;
+levels_error:
+    free(chain);
+chain_error:
+    fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+    return NULL;
+}
+
+void thumbnail_chain_free(thumbnail_chain *chain)
+{
+    for (size_t i = 0; i < chain->level_count; i++)
+        free(chain->levels[i].pixels);
+    free(chain->levels);
+    free(chain);
+}
+
+// Box filter taps mapping each output sample to the input samples it covers
+typedef struct
+{
+    uint32_t *start;
+    uint32_t *count;
+    float *weights;
+    uint32_t taps;
+} box_filter;
+
+static int box_filter_init(box_filter *filter, uint32_t in, uint32_t out)
+{
+    double scale = (double)in/out;
+    filter->taps = (uint32_t)ceil(scale) + 1;
+    filter->start = malloc(out*sizeof(uint32_t));
+    filter->count = malloc(out*sizeof(uint32_t));
+    filter->weights = malloc((size_t)out*filter->taps*sizeof(float));
+    if (!filter->start || !filter->count || !filter->weights)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < out; i++)
+    {
+        double f0 = i*scale, f1 = (i + 1)*scale;
+        uint32_t start = (uint32_t)f0;
+        uint32_t end = (uint32_t)ceil(f1);
+        if (end > in)
+            end = in;
+
+        filter->start[i] = start;
+        filter->count[i] = end - start;
+        for (uint32_t j = start; j < end; j++)
+        {
+            double overlap = (j + 1 < f1 ? j + 1 : f1) - (j > f0 ? j : f0);
+            filter->weights[i*filter->taps + j - start] = overlap/scale;
+        }
+    }
+    return 0;
+}
+
+static void box_filter_free(box_filter *filter)
+{
+    free(filter->start);
+    free(filter->count);
+    free(filter->weights);
+}
+
+//
+// Produce a thumbnail fitting within size x size, keeping the aspect ratio.
+// Sprites that already fit are returned at full size. The smallest chain
+// level that is at least as large as the result is area-averaged down to it
+// Returns 0 on success, or -1 on error
+//
+int thumbnail_chain_resize(thumbnail_chain *chain, uint32_t size, thumbnail_image *out)
+{
+    thumbnail_image *base = &chain->levels[0];
+    uint32_t width = base->width, height = base->height;
+    if (width > size || height > size)
+    {
+        if (width >= height)
+        {
+            height = ((uint64_t)height*size + width/2)/width;
+            width = size;
+        }
+        else
+        {
+            width = ((uint64_t)width*size + height/2)/height;
+            height = size;
+        }
+        if (width == 0)
+            width = 1;
+        if (height == 0)
+            height = 1;
+    }
+
+    thumbnail_image *source = base;
+    for (size_t i = 1; i < chain->level_count; i++)
+        if (chain->levels[i].width >= width && chain->levels[i].height >= height)
+            source = &chain->levels[i];
+
+    out->width = width;
+    out->height = height;
+    out->pixels = malloc(4*(size_t)width*height);
+    float *rows = malloc(4*(size_t)width*source->height*sizeof(float));
+
+    int status = -1;
+    box_filter horizontal = { NULL }, vertical = { NULL };
+    if (!out->pixels || !rows)
+    {
+        fprintf(stderr, "Malloc error: %s\n", strerror(errno));
+        goto error;
+    }
+
+    if (box_filter_init(&horizontal, source->width, width) || box_filter_init(&vertical, source->height, height))
+        goto error;
+
+    for (uint32_t y = 0; y < source->height; y++)
+    {
+        const uint8_t *in = &source->pixels[4*(size_t)y*source->width];
+        float *row = &rows[4*(size_t)y*width];
+        for (uint32_t x = 0; x < width; x++)
+        {
+            float sum[4] = { 0, 0, 0, 0 };
+            const float *weights = &horizontal.weights[x*horizontal.taps];
+            const uint8_t *p = &in[4*horizontal.start[x]];
+            for (uint32_t j = 0; j < horizontal.count[x]; j++)
+                for (int c = 0; c < 4; c++)
+                    sum[c] += weights[j]*p[4*j + c];
+            memcpy(&row[4*x], sum, sizeof(sum));
+        }
+    }
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+        const float *weights = &vertical.weights[y*vertical.taps];
+        const float *first = &rows[4*(size_t)vertical.start[y]*width];
+        uint8_t *dest = &out->pixels[4*(size_t)y*width];
+        for (uint32_t x = 0; x < width; x++)
+        {
+            float sum[4] = { 0, 0, 0, 0 };
+            for (uint32_t j = 0; j < vertical.count[y]; j++)
+                for (int c = 0; c < 4; c++)
+                    sum[c] += weights[j]*first[4*((size_t)j*width + x) + c];
+
+            // Convert back to straight alpha for output
+            float alpha = sum[3];
+            if (alpha < 0.5f)
+            {
+                memset(&dest[4*x], 0, 4);
+                continue;
+            }
+
+            for (int c = 0; c < 3; c++)
+            {
+                float value = sum[c]*255.0f/alpha + 0.5f;
+                dest[4*x + c] = value > 255.0f ? 255 : (uint8_t)value;
+            }
+            dest[4*x + 3] = alpha > 254.5f ? 255 : (uint8_t)(alpha + 0.5f);
+        }
+    }
+    status = 0;
+
+error:
+    box_filter_free(&horizontal);
+    box_filter_free(&vertical);
+    free(rows);
+    if (status)
+    {
+        free(out->pixels);
+        out->pixels = NULL;
+    }
+    return status;
+}
+
+//
+// Encode a thumbnail as an RGBA PNG, appending it to out
+// Returns 0 on success, or -1 on error
+//
+int thumbnail_encode_png(const thumbnail_image *image, const pngwriter_options *options, pngbuffer *out)
+{
+    pngwriter_image png;
+    png.width = image->width;
+    png.height = image->height;
+    png.color = PNGWRITER_COLOR_RGBA;
+    png.pixels = image->pixels;
+    png.stride = 4*image->width;
+    png.palette = NULL;
+    png.palette_size = 0;
+    png.transparent_index = -1;
+    return pngwriter_encode(out, &png, options);
+}
@@ -0,0 +1,58 @@
+/*
+ * thumbnail.h
+ * Downscales palettized sprites into thumbnails
+ *
+ * Copyright (c) 2012, Paul Chote
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _thumbnail_h
+#define _thumbnail_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "pngwriter.h"
+
+// An RGBA image. Chain levels hold premultiplied color, while
+// images returned by thumbnail_chain_resize are straight alpha
+typedef struct
+{
+    uint32_t width;
+    uint32_t height;
+    uint8_t *pixels;
+} thumbnail_image;
+
+// Successive 2x2 box reductions of a sprite, starting at full size
+typedef struct
+{
+    size_t level_count;
+    thumbnail_image *levels;
+} thumbnail_chain;
+
+thumbnail_chain *thumbnail_chain_build(const uint8_t *indices, uint32_t width, uint32_t height,
+    const uint8_t *rgb, uint32_t min_size);
+void thumbnail_chain_free(thumbnail_chain *chain);
+int thumbnail_chain_resize(thumbnail_chain *chain, uint32_t size, thumbnail_image *out);
+int thumbnail_encode_png(const thumbnail_image *image, const pngwriter_options *options, pngbuffer *out);
+
+#endif
@@ -30,8 +30,8 @@ typedef unsigned long long mz_uint64;
 #define MINIZ_HAS_64BIT_REGISTERS 1
 #endif
 
-// Works around MSVC's spammy "warning C4127: conditional expression is constant" message.
-#define MZ_MACRO_END while (0, 0)
+// Plain while (0): the MSVC C4127 workaround of while (0, 0) trips -Wunused-value in gcc
+#define MZ_MACRO_END while (0)
 
 // Decompression flags used by tinfl_decompress().
 // TINFL_FLAG_PARSE_ZLIB_HEADER: If set, the input has a valid zlib header and ends with an adler32 checksum (it's a valid zlib stream). Otherwise, the input is a raw deflate stream.
@@ -103,6 +103,8 @@ typedef struct
     mz_int16 m_look_up[TINFL_FAST_LOOKUP_SIZE], m_tree[TINFL_MAX_HUFF_SYMBOLS_0 * 2];
 } tinfl_huff_table;
 
+int tinfl_build_huff_table(tinfl_huff_table *pTable, mz_uint table_size);
+
 #if MINIZ_HAS_64BIT_REGISTERS
 #define TINFL_USE_64BIT_BITBUF 1
 #endif